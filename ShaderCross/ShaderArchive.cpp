@@ -0,0 +1,351 @@
+//
+//  ShaderArchive.cpp
+//  ShaderCross
+//
+//  Layout, integers in host byte order (little-endian on every supported platform):
+//
+//      header    magic "SXARCHIV", version, entry count, index offset
+//      payloads  each aligned to s_alignment, stored once however many entries use them
+//      index     one fixed-size record per entry, sorted by key
+//
+//  An index record holds the key, the stage count and for each of two stages the
+//  stage and the offset and length of its output, SPIR-V and reflection data.
+//
+
+#include "ShaderArchive.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ShaderCross
+{
+    static const char s_magic[8] = { 'S', 'X', 'A', 'R', 'C', 'H', 'I', 'V' };
+    static const uint32_t s_version = 1;
+    static const size_t s_alignment = 16;
+
+    struct ArchiveHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t entryCount;
+        uint64_t indexOffset;
+        uint64_t reserved;
+    };
+
+    struct ArchiveBlob
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    struct ArchiveStage
+    {
+        uint32_t stage;
+        uint32_t reserved;
+        ArchiveBlob output;
+        ArchiveBlob spirv;
+        ArchiveBlob json;
+    };
+
+    struct ArchiveEntry
+    {
+        uint64_t keyLow;
+        uint64_t keyHigh;
+        uint32_t stageCount;
+        uint32_t reserved;
+        ArchiveStage stages[2];
+    };
+
+    static_assert(sizeof(ArchiveHeader) == 32, "archive header must not be padded");
+    static_assert(sizeof(ArchiveEntry) == 24 + 2 * 56, "archive entries must not be padded");
+
+    static size_t AlignedSize(size_t size)
+    {
+        return (size + s_alignment - 1) / s_alignment * s_alignment;
+    }
+
+    size_t ShaderArchiveWriter::addBlob(const void* data, size_t length)
+    {
+        Hash128 hash = HashBytes(data, length);
+        auto it = m_blobIndex.find(hash);
+        if (it != m_blobIndex.end())
+        {
+            return it->second;
+        }
+
+        m_blobs.push_back(std::string((const char*)data, length));
+        m_blobIndex[hash] = m_blobs.size() - 1;
+        return m_blobs.size() - 1;
+    }
+
+    bool ShaderArchiveWriter::add(const Hash128& key, const Result& result)
+    {
+        if (!result.success)
+        {
+            return false;
+        }
+
+        std::vector<StageData> stages;
+        for (int i = 0; i < result.resultCount && i < 2; i++)
+        {
+            StageData stage;
+            stage.stage = result.stage[i];
+            stage.output = addBlob(result.output[i].data(), result.output[i].size());
+            stage.spirv = addBlob(result.spirv[i].data(), result.spirv[i].size() * sizeof(unsigned));
+            stage.json = addBlob(result.json[i].data(), result.json[i].size());
+            stages.push_back(stage);
+        }
+        m_entries[key] = stages;
+        return true;
+    }
+
+    bool ShaderArchiveWriter::write(const std::string& path) const
+    {
+        // blobs that no entry uses any more, after entries were replaced, are left out
+        std::vector<bool> used(m_blobs.size(), false);
+        for (const auto& entry : m_entries)
+        {
+            for (const StageData& stage : entry.second)
+            {
+                used[stage.output] = used[stage.spirv] = used[stage.json] = true;
+            }
+        }
+
+        std::vector<ArchiveBlob> blobs(m_blobs.size());
+        uint64_t offset = AlignedSize(sizeof(ArchiveHeader));
+        for (size_t i = 0; i < m_blobs.size(); i++)
+        {
+            if (used[i])
+            {
+                blobs[i].offset = offset;
+                blobs[i].length = m_blobs[i].size();
+                offset += AlignedSize(m_blobs[i].size());
+            }
+        }
+
+        ArchiveHeader header = {};
+        memcpy(header.magic, s_magic, sizeof(s_magic));
+        header.version = s_version;
+        header.entryCount = (uint32_t)m_entries.size();
+        header.indexOffset = offset;
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+        {
+            return false;
+        }
+
+        static const char padding[s_alignment] = {};
+        file.write((const char*)&header, sizeof(header));
+        file.write(padding, AlignedSize(sizeof(header)) - sizeof(header));
+        for (size_t i = 0; i < m_blobs.size(); i++)
+        {
+            if (used[i])
+            {
+                file.write(m_blobs[i].data(), m_blobs[i].size());
+                file.write(padding, AlignedSize(m_blobs[i].size()) - m_blobs[i].size());
+            }
+        }
+
+        // std::map keeps the entries sorted by key, which is the order find() expects
+        for (const auto& entry : m_entries)
+        {
+            ArchiveEntry record = {};
+            record.keyLow = entry.first.low;
+            record.keyHigh = entry.first.high;
+            record.stageCount = (uint32_t)entry.second.size();
+            for (size_t i = 0; i < entry.second.size(); i++)
+            {
+                const StageData& stage = entry.second[i];
+                record.stages[i].stage = (uint32_t)stage.stage;
+                record.stages[i].output = blobs[stage.output];
+                record.stages[i].spirv = blobs[stage.spirv];
+                record.stages[i].json = blobs[stage.json];
+            }
+            file.write((const char*)&record, sizeof(record));
+        }
+
+        return (bool)file;
+    }
+
+    ShaderArchive::ShaderArchive() : m_data(nullptr), m_length(0), m_mapped(false), m_index(nullptr), m_count(0)
+    {
+
+    }
+
+    ShaderArchive::~ShaderArchive()
+    {
+        close();
+    }
+
+    bool ShaderArchive::open(const std::string& path)
+    {
+        close();
+
+#if defined(_WIN32)
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open())
+        {
+            return false;
+        }
+        m_buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        m_data = m_buffer.data();
+        m_length = m_buffer.size();
+#else
+        int descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0)
+        {
+            return false;
+        }
+
+        struct stat status;
+        if (fstat(descriptor, &status) != 0 || status.st_size < (off_t)sizeof(ArchiveHeader))
+        {
+            ::close(descriptor);
+            return false;
+        }
+
+        void* mapping = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        ::close(descriptor);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        m_data = (const char*)mapping;
+        m_length = (size_t)status.st_size;
+        m_mapped = true;
+#endif
+
+        if (!validate())
+        {
+            close();
+            return false;
+        }
+
+        ArchiveHeader header;
+        memcpy(&header, m_data, sizeof(header));
+        m_index = m_data + header.indexOffset;
+        m_count = header.entryCount;
+        return true;
+    }
+
+    void ShaderArchive::close()
+    {
+#if !defined(_WIN32)
+        if (m_mapped)
+        {
+            munmap((void*)m_data, m_length);
+        }
+#endif
+        m_buffer.clear();
+        m_data = nullptr;
+        m_length = 0;
+        m_mapped = false;
+        m_index = nullptr;
+        m_count = 0;
+    }
+
+    // Checks the header and that every record points inside the file, so find() can
+    // hand out pointers without checking them again
+    bool ShaderArchive::validate() const
+    {
+        if (m_length < sizeof(ArchiveHeader))
+        {
+            return false;
+        }
+
+        ArchiveHeader header;
+        memcpy(&header, m_data, sizeof(header));
+        if (memcmp(header.magic, s_magic, sizeof(s_magic)) != 0 || header.version != s_version)
+        {
+            return false;
+        }
+        if (header.indexOffset % s_alignment != 0 || header.indexOffset > m_length ||
+            (m_length - header.indexOffset) / sizeof(ArchiveEntry) < header.entryCount)
+        {
+            return false;
+        }
+
+        auto inside = [&](const ArchiveBlob& blob)
+        {
+            return blob.offset <= header.indexOffset && blob.length <= header.indexOffset - blob.offset;
+        };
+
+        const ArchiveEntry* entries = (const ArchiveEntry*)(m_data + header.indexOffset);
+        for (uint32_t i = 0; i < header.entryCount; i++)
+        {
+            const ArchiveEntry& entry = entries[i];
+            if (entry.stageCount > 2)
+            {
+                return false;
+            }
+            for (uint32_t stage = 0; stage < entry.stageCount; stage++)
+            {
+                const ArchiveStage& record = entry.stages[stage];
+                if (record.stage >= StageCount || !inside(record.output) || !inside(record.spirv) || !inside(record.json) ||
+                    record.spirv.offset % sizeof(uint32_t) != 0)
+                {
+                    return false;
+                }
+            }
+            if (i > 0)
+            {
+                const ArchiveEntry& previous = entries[i - 1];
+                if (previous.keyHigh > entry.keyHigh || (previous.keyHigh == entry.keyHigh && previous.keyLow >= entry.keyLow))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool ShaderArchive::find(const Hash128& key, ShaderArchiveEntry& entry) const
+    {
+        const ArchiveEntry* entries = (const ArchiveEntry*)m_index;
+        size_t low = 0;
+        size_t high = m_count;
+        while (low < high)
+        {
+            size_t middle = low + (high - low) / 2;
+            const ArchiveEntry& record = entries[middle];
+            if (record.keyHigh < key.high || (record.keyHigh == key.high && record.keyLow < key.low))
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+
+        if (low == m_count || entries[low].keyHigh != key.high || entries[low].keyLow != key.low)
+        {
+            return false;
+        }
+
+        const ArchiveEntry& record = entries[low];
+        entry.stageCount = record.stageCount;
+        for (uint32_t i = 0; i < record.stageCount; i++)
+        {
+            const ArchiveStage& stage = record.stages[i];
+            ShaderArchiveStage& view = entry.stages[i];
+            view.stage = (ShaderStage)stage.stage;
+            view.output = m_data + stage.output.offset;
+            view.outputLength = (size_t)stage.output.length;
+            view.spirv = (const uint32_t*)(m_data + stage.spirv.offset);
+            view.spirvWords = (size_t)(stage.spirv.length / sizeof(uint32_t));
+            view.json = m_data + stage.json.offset;
+            view.jsonLength = (size_t)stage.json.length;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,101 @@
+//
+//  ShaderArchive.hpp
+//  ShaderCross
+//
+//  Single-file archive of compiled shaders, read through a memory mapping
+//
+
+#ifndef ShaderArchive_hpp
+#define ShaderArchive_hpp
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ShaderCross.hpp"
+
+namespace ShaderCross
+{
+    // Collects compile results and writes them to an archive. Identical payloads,
+    // e.g. the same output shared by several variants, are stored once.
+    class ShaderArchiveWriter
+    {
+    public:
+        // Stores the outputs, SPIR-V and reflection data of a successful result under
+        // key, replacing anything added under the same key before. Returns false for
+        // failed results.
+        bool add(const Hash128& key, const Result& result);
+
+        // Writes the archive, replacing path
+        bool write(const std::string& path) const;
+
+        size_t size() const { return m_entries.size(); }
+
+    private:
+        struct StageData
+        {
+            ShaderStage stage;
+            size_t output;
+            size_t spirv;
+            size_t json;
+        };
+
+        size_t addBlob(const void* data, size_t length);
+
+        std::map<Hash128, std::vector<StageData>> m_entries;
+        std::vector<std::string> m_blobs;
+        std::map<Hash128, size_t> m_blobIndex;
+    };
+
+    // A stage of an archived shader. The pointers point into the archive's mapping and
+    // stay valid until the archive is closed.
+    struct ShaderArchiveStage
+    {
+        ShaderStage stage;
+        const char* output;
+        size_t outputLength;
+        const uint32_t* spirv;
+        size_t spirvWords;
+        const char* json;
+        size_t jsonLength;
+    };
+
+    struct ShaderArchiveEntry
+    {
+        uint32_t stageCount;
+        ShaderArchiveStage stages[2];
+    };
+
+    class ShaderArchive
+    {
+    public:
+        ShaderArchive();
+        ~ShaderArchive();
+
+        // Maps an archive written by ShaderArchiveWriter. Returns false if it can't be
+        // read or isn't a valid archive.
+        bool open(const std::string& path);
+        void close();
+
+        // Looks key up with a binary search of the index
+        bool find(const Hash128& key, ShaderArchiveEntry& entry) const;
+
+        size_t size() const { return m_count; }
+
+    private:
+        ShaderArchive(const ShaderArchive&) = delete;
+        ShaderArchive& operator=(const ShaderArchive&) = delete;
+
+        bool validate() const;
+
+        const char* m_data;
+        size_t m_length;
+        bool m_mapped;
+        std::vector<char> m_buffer;
+        const char* m_index;
+        uint32_t m_count;
+    };
+}
+
+#endif /* ShaderArchive_hpp */
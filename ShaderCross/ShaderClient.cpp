@@ -0,0 +1,243 @@
+//
+//  ShaderClient.cpp
+//  ShaderCross
+//
+
+#include "ShaderClient.hpp"
+#include "ShaderProtocol.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace ShaderCross
+{
+#if !defined(_WIN32)
+    static std::string DefaultDaemonSocketDirectory()
+    {
+        // the runtime directory is already private to the user
+        const char* runtime = getenv("XDG_RUNTIME_DIR");
+        std::string path;
+        if (runtime && *runtime)
+        {
+            path = runtime;
+        }
+        else
+        {
+            const char* directory = getenv("TMPDIR");
+            path = directory && *directory ? directory : "/tmp";
+            if (path.back() != '/')
+            {
+                path += '/';
+            }
+            path += "shadercross-" + std::to_string((unsigned long)getuid());
+        }
+        while (path.size() > 1 && path.back() == '/')
+        {
+            path.pop_back();
+        }
+        return path;
+    }
+#endif
+
+    std::string DefaultDaemonSocketPath()
+    {
+#if defined(_WIN32)
+        return std::string();
+#else
+        return DefaultDaemonSocketDirectory() + "/shadercross.sock";
+#endif
+    }
+
+    bool CheckDaemonSocketDirectory(const std::string& socketPath, bool create, std::string& error)
+    {
+#if defined(_WIN32)
+        return true;
+#else
+        std::string directory = DefaultDaemonSocketDirectory();
+        size_t slash = socketPath.rfind('/');
+        if (slash == std::string::npos || socketPath.substr(0, slash) != directory)
+        {
+            return true;
+        }
+
+        // whoever could have created the directory first could replace the socket
+        struct stat status;
+        if (lstat(directory.c_str(), &status) != 0 && errno == ENOENT && create && mkdir(directory.c_str(), S_IRWXU) != 0 && errno != EEXIST)
+        {
+            error = "Can't create " + directory + ": " + strerror(errno) + "\n";
+            return false;
+        }
+        if (lstat(directory.c_str(), &status) != 0)
+        {
+            error = "Can't use " + directory + ": " + strerror(errno) + "\n";
+            return false;
+        }
+        if (!S_ISDIR(status.st_mode) || status.st_uid != getuid() || (status.st_mode & (S_IRWXG | S_IRWXO)) != 0)
+        {
+            error = directory + " has to be a directory owned by the user that only they can access\n";
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    bool PeerIsCurrentUser(int socket)
+    {
+#if defined(_WIN32)
+        return false;
+#elif defined(SO_PEERCRED)
+        ucred credentials;
+        socklen_t size = sizeof(credentials);
+        return getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &size) == 0 && credentials.uid == getuid();
+#else
+        uid_t user;
+        gid_t group;
+        return getpeereid(socket, &user, &group) == 0 && user == getuid();
+#endif
+    }
+
+    CompileClient::CompileClient() : m_socket(-1)
+    {
+
+    }
+
+    CompileClient::~CompileClient()
+    {
+        close();
+    }
+
+    bool CompileClient::connect(const std::string& socketPath)
+    {
+        close();
+#if defined(_WIN32)
+        return false;
+#else
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path))
+        {
+            return false;
+        }
+        memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+        std::string error;
+        if (!CheckDaemonSocketDirectory(socketPath, false, error))
+        {
+            return false;
+        }
+
+        m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_socket < 0)
+        {
+            return false;
+        }
+#if defined(SO_NOSIGPIPE)
+        int noSignal = 1;
+        setsockopt(m_socket, SOL_SOCKET, SO_NOSIGPIPE, &noSignal, sizeof(noSignal));
+#endif
+        // a daemon of another user could answer with anything
+        if (::connect(m_socket, (const sockaddr*)&address, sizeof(address)) != 0 || !PeerIsCurrentUser(m_socket))
+        {
+            close();
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    void CompileClient::close()
+    {
+#if !defined(_WIN32)
+        if (m_socket >= 0)
+        {
+            ::close(m_socket);
+        }
+#endif
+        m_socket = -1;
+    }
+
+    bool CompileClient::request(uint32_t type, const std::string& payload, std::string& response, std::string& error)
+    {
+#if defined(_WIN32)
+        error = "shadercross-daemon is not supported on Windows\n";
+        return false;
+#else
+        uint32_t responseType;
+        if (!connected() || !WriteFrame(m_socket, type, payload) || !ReadFrame(m_socket, responseType, response))
+        {
+            // the connection can't be trusted to be in step with the daemon any more
+            close();
+            error = "Lost the connection to shadercross-daemon\n";
+            return false;
+        }
+        if (responseType != type)
+        {
+            error = responseType == MessageError ? response : "Unexpected response from shadercross-daemon\n";
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    bool CompileClient::compile(const Config& config, Result& result)
+    {
+        result = Result();
+        result.success = false;
+        result.resultCount = 0;
+
+        if (config.includeCallback || config.sharedIncludeCallback)
+        {
+            result.errors = "Include callbacks can't be used with shadercross-daemon\n";
+            return false;
+        }
+
+        Config sent = config;
+#if !defined(_WIN32)
+        char absolute[PATH_MAX];
+        if (!sent.includePath.empty() && sent.includePath[0] != '/' && realpath(sent.includePath.c_str(), absolute))
+        {
+            // KrafixIncluder appends header names to the path as it is
+            bool separator = sent.includePath.back() == '/';
+            sent.includePath = std::string(absolute) + (separator ? "/" : "");
+        }
+#endif
+
+        std::string payload;
+        WriteConfig(sent, payload);
+        std::string response;
+        if (!request(MessageCompile, payload, response, result.errors))
+        {
+            return false;
+        }
+        if (!ReadResult(response.data(), response.size(), result))
+        {
+            result = Result();
+            result.success = false;
+            result.resultCount = 0;
+            result.errors = "Invalid response from shadercross-daemon\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool CompileClient::clearCache()
+    {
+        std::string response, error;
+        return request(MessageClearCache, std::string(), response, error);
+    }
+
+    bool CompileClient::shutdown()
+    {
+        std::string response, error;
+        return request(MessageShutdown, std::string(), response, error);
+    }
+}
@@ -0,0 +1,67 @@
+//
+//  ShaderClient.hpp
+//  ShaderCross
+//
+//  Client of shadercross-daemon, which compiles with warm caches in a long-running
+//  process instead of every tool paying for compiler startup
+//
+
+#ifndef ShaderClient_hpp
+#define ShaderClient_hpp
+
+#include <string>
+
+#include "ShaderCross.hpp"
+
+namespace ShaderCross
+{
+    // Socket the daemon listens on when it isn't given one, in $XDG_RUNTIME_DIR or
+    // else in a directory of the user's own under $TMPDIR
+    std::string DefaultDaemonSocketPath();
+
+    // Checks that the directory of the default socket belongs to the user and that
+    // nobody else can get into it, after creating it if create is set. Sockets
+    // anywhere else pass, their directories are up to whoever chose them. Returns
+    // false with the reason in error.
+    bool CheckDaemonSocketDirectory(const std::string& socketPath, bool create, std::string& error);
+
+    // Whether the other end of a connected Unix domain socket runs as the same user
+    bool PeerIsCurrentUser(int socket);
+
+    // A connection to the daemon. Requests on one connection are answered in order,
+    // use a connection per thread to compile concurrently.
+    class CompileClient
+    {
+    public:
+        CompileClient();
+        ~CompileClient();
+
+        // Fails if the socket's directory isn't private or the daemon runs as
+        // another user
+        bool connect(const std::string& socketPath = DefaultDaemonSocketPath());
+        void close();
+        bool connected() const { return m_socket >= 0; }
+
+        // Compiles config in the daemon. Returns false, with the reason in
+        // result.errors, if the request couldn't be made, e.g. because the daemon
+        // isn't running or config uses include callbacks, which can't be sent. Headers
+        // are read by the daemon, so includePath is made absolute before sending.
+        bool compile(const Config& config, Result& result);
+
+        // Drops the daemon's compile caches
+        bool clearCache();
+
+        // Asks the daemon to exit once the requests in flight are answered
+        bool shutdown();
+
+    private:
+        CompileClient(const CompileClient&) = delete;
+        CompileClient& operator=(const CompileClient&) = delete;
+
+        bool request(uint32_t type, const std::string& payload, std::string& response, std::string& error);
+
+        int m_socket;
+    };
+}
+
+#endif /* ShaderClient_hpp */
@@ -28,14 +28,44 @@
 #include <SPIRV-Cross/spirv_reflect.hpp>
 #include <SPIRV-Cross/spirv_common.hpp>
 
+#include <cerrno>
 #include <cstring>
 #include <cstdlib>
+#include <ctime>
 #include <cctype>
 #include <cmath>
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <sstream>
 #include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#if defined(_WIN32)
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "SpirVCompact.h"
+#include "SpirVLinker.h"
 #include "SpirVTranslator.h"
 #include "GlslTranslator2.h"
 #include "HlslTranslator2.h"
@@ -193,15 +223,30 @@ namespace ShaderCross
         CustomIncluder(IncludeCallback callback) : m_callback(callback)
         {
             
+        }
+
+        CustomIncluder(SharedIncludeCallback callback) : m_sharedCallback(callback)
+        {
+
         }
         
         IncludeResult* include(const char* headerName, const char* includerName, size_t inclusionDepth, bool local) {
             
-            auto content = m_callback(headerName, local);
-            std::string filecontent = content.second;
-            char* heapcontent = new char[filecontent.size() + 1];
-            strcpy(heapcontent, filecontent.c_str());
-            return new IncludeResult(content.first, heapcontent, content.second.size(), heapcontent);
+            // glslang reads the callback's buffer in place, userData keeps it alive until release
+            if (m_sharedCallback)
+            {
+                IncludeBuffer buffer;
+                if (!m_sharedCallback(headerName, local, buffer))
+                {
+                    return nullptr;
+                }
+                auto owner = new std::shared_ptr<const void>(std::move(buffer.owner));
+                return new IncludeResult(buffer.headerName, buffer.data, buffer.length, owner);
+            }
+
+            auto content = std::make_shared<const IncludeCallbackResult>(m_callback(headerName, local));
+            auto owner = new std::shared_ptr<const void>(content);
+            return new IncludeResult(content->first, content->second.data(), content->second.size(), owner);
         }
         
         IncludeResult* includeSystem(const char* headerName, const char* includerName, size_t inclusionDepth) override {
@@ -215,13 +260,265 @@ namespace ShaderCross
         void releaseInclude(IncludeResult* result) override {
             if (result)
             {
-                delete (char*)result->userData;
+                delete (std::shared_ptr<const void>*)result->userData;
                 delete result;
             }
         }
         
     private:
         IncludeCallback m_callback;
+        SharedIncludeCallback m_sharedCallback;
+    };
+
+    // A map that holds at most capacity entries, making room for a new one by
+    // dropping the least recently used. Not synchronized, callers lock around it.
+    template <typename Key, typename Value>
+    class LruCache
+    {
+    public:
+        explicit LruCache(size_t capacity) : m_capacity(capacity) {}
+
+        // Returns the entry, now the most recently used, or nullptr
+        Value* find(const Key& key)
+        {
+            auto it = m_entries.find(key);
+            if (it == m_entries.end())
+            {
+                return nullptr;
+            }
+            m_order.splice(m_order.begin(), m_order, it->second.second);
+            return &it->second.first;
+        }
+
+        void insert(const Key& key, const Value& value)
+        {
+            auto it = m_entries.find(key);
+            if (it != m_entries.end())
+            {
+                it->second.first = value;
+                m_order.splice(m_order.begin(), m_order, it->second.second);
+                return;
+            }
+            if (m_entries.size() >= m_capacity && !m_order.empty())
+            {
+                m_entries.erase(m_order.back());
+                m_order.pop_back();
+            }
+            m_order.push_front(key);
+            m_entries.insert(std::make_pair(key, std::make_pair(value, m_order.begin())));
+        }
+
+        void erase(const Key& key)
+        {
+            auto it = m_entries.find(key);
+            if (it != m_entries.end())
+            {
+                m_order.erase(it->second.second);
+                m_entries.erase(it);
+            }
+        }
+
+        void clear()
+        {
+            m_entries.clear();
+            m_order.clear();
+        }
+
+    private:
+        size_t m_capacity;
+        std::list<Key> m_order; /* most recently used first */
+        std::map<Key, std::pair<Value, typename std::list<Key>::iterator>> m_entries;
+    };
+
+    // Contents of an include file, loaded once and shared by every compile that
+    // includes it until the file's modification time or size changes
+    class IncludeFile
+    {
+    public:
+        IncludeFile(const std::string& path) : m_data(nullptr), m_size(0), m_mapped(false), m_modified(0), m_valid(false)
+        {
+#if defined(_WIN32)
+            struct _stat64 status;
+            std::ifstream file(path, std::ios::binary);
+            if (_stat64(path.c_str(), &status) == 0 && file.is_open())
+            {
+                m_modified = (int64_t)status.st_mtime;
+                m_buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+                m_data = m_buffer.data();
+                m_size = m_buffer.size();
+                m_valid = true;
+            }
+#else
+            int descriptor = open(path.c_str(), O_RDONLY);
+            if (descriptor < 0)
+            {
+                return;
+            }
+
+            struct stat status;
+            if (fstat(descriptor, &status) == 0)
+            {
+                m_size = (size_t)status.st_size;
+                m_modified = ModificationTime(status);
+                m_valid = true;
+
+                // reading a mapping faults if the file is truncated in the meantime, e.g. by an
+                // editor saving over it, so only large files that haven't changed lately are mapped
+                if (m_size >= s_mapThreshold && time(nullptr) - status.st_mtime > s_settleSeconds)
+                {
+                    void* mapping = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+                    if (mapping != MAP_FAILED)
+                    {
+                        m_data = (const char*)mapping;
+                        m_mapped = true;
+                    }
+                }
+                if (!m_mapped && m_size > 0)
+                {
+                    // a file that shrinks while it is read keeps what was read, the size
+                    // no longer matches so the next load reads it again
+                    m_buffer.resize(m_size);
+                    size_t total = 0;
+                    while (total < m_size)
+                    {
+                        ssize_t count = read(descriptor, m_buffer.data() + total, m_size - total);
+                        if (count < 0 && errno == EINTR)
+                        {
+                            continue;
+                        }
+                        if (count <= 0)
+                        {
+                            break;
+                        }
+                        total += (size_t)count;
+                    }
+                    m_buffer.resize(total);
+                    m_data = m_buffer.data();
+                    m_size = total;
+                }
+            }
+            close(descriptor);
+#endif
+        }
+
+        ~IncludeFile()
+        {
+#if !defined(_WIN32)
+            if (m_mapped)
+            {
+                munmap((void*)m_data, m_size);
+            }
+#endif
+        }
+
+        const char* data() const { return m_data; }
+        size_t size() const { return m_size; }
+        bool valid() const { return m_valid; }
+
+        // Faults every page of the mapping in, so later reads don't wait on storage
+        void touch() const
+        {
+#if !defined(_WIN32)
+            if (m_mapped)
+            {
+                madvise((void*)m_data, m_size, MADV_WILLNEED);
+                volatile char sink = 0;
+                for (size_t offset = 0; offset < m_size; offset += 4096)
+                {
+                    sink += m_data[offset];
+                }
+                (void)sink;
+            }
+#endif
+        }
+
+        // Whether the file on disk still matches what was loaded
+        bool current(const std::string& path) const
+        {
+#if defined(_WIN32)
+            struct _stat64 status;
+            if (_stat64(path.c_str(), &status) != 0)
+            {
+                return !m_valid;
+            }
+            return m_valid && (size_t)status.st_size == m_size && (int64_t)status.st_mtime == m_modified;
+#else
+            struct stat status;
+            if (stat(path.c_str(), &status) != 0)
+            {
+                return !m_valid;
+            }
+            return m_valid && (size_t)status.st_size == m_size && ModificationTime(status) == m_modified;
+#endif
+        }
+
+    private:
+        IncludeFile(const IncludeFile&) = delete;
+        IncludeFile& operator=(const IncludeFile&) = delete;
+
+#if !defined(_WIN32)
+        static int64_t ModificationTime(const struct stat& status)
+        {
+#if defined(__APPLE__)
+            return (int64_t)status.st_mtimespec.tv_sec * 1000000000 + status.st_mtimespec.tv_nsec;
+#else
+            return (int64_t)status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+#endif
+        }
+#endif
+
+        static const size_t s_mapThreshold = 64 * 1024;
+        static const time_t s_settleSeconds = 10;
+
+        const char* m_data;
+        size_t m_size;
+        bool m_mapped;
+        int64_t m_modified;
+        bool m_valid;
+        std::vector<char> m_buffer;
+    };
+
+    // Process-wide cache of the most recently used include files, safe to use from
+    // concurrent compiles
+    class IncludeFileCache
+    {
+    public:
+        static IncludeFileCache& shared()
+        {
+            static IncludeFileCache cache;
+            return cache;
+        }
+
+        std::shared_ptr<const IncludeFile> load(const std::string& path)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                std::shared_ptr<const IncludeFile>* cached = m_files.find(path);
+                if (cached && (*cached)->current(path))
+                {
+                    return *cached;
+                }
+            }
+
+            // map outside the lock so slow storage doesn't serialise other compiles
+            std::shared_ptr<const IncludeFile> file = std::make_shared<IncludeFile>(path);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_files.insert(path, file);
+            return file;
+        }
+
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_files.clear();
+        }
+
+    private:
+        IncludeFileCache() : m_files(1024) {}
+
+        std::mutex m_mutex;
+        LruCache<std::string, std::shared_ptr<const IncludeFile>> m_files; /* evicted files stay alive while a compile uses them */
     };
 
     class KrafixIncluder : public glslang::TShader::Includer
@@ -237,30 +534,34 @@ namespace ShaderCross
 
         IncludeResult* includeLocal(const char* headerName, const char* includerName, size_t inclusionDepth) override {
             std::string realfilename = dir + headerName;
-            std::stringstream content;
-            std::string line;
-            std::ifstream file(realfilename);
-            if (file.is_open()) {
-                while (getline(file, line)) {
-                    content << line << '\n';
-                }
-                file.close();
+            // glslang reads straight from the shared file data, the result just keeps it alive
+            auto prefetched = m_prefetched.find(realfilename);
+            auto file = new std::shared_ptr<const IncludeFile>(prefetched != m_prefetched.end() ? prefetched->second : IncludeFileCache::shared().load(realfilename));
+            if (!(*file)->valid())
+            {
+                // reported by glslang as a missing header rather than compiled as an empty one
+                delete file;
+                return nullptr;
             }
-            std::string filecontent = content.str();
-            char* heapcontent = new char[filecontent.size() + 1];
-            strcpy(heapcontent, filecontent.c_str());
-            return new IncludeResult(realfilename, heapcontent, content.str().size(), heapcontent);
+            return new IncludeResult(realfilename, (*file)->data(), (*file)->size(), file);
         }
 
         void releaseInclude(IncludeResult* result) override {
             if (result)
             {
-                delete (char*)result->userData;
+                delete (std::shared_ptr<const IncludeFile>*)result->userData;
                 delete result;
             }
         }
+
+        // Loads every header reachable from the sources on a pool of I/O threads, a level
+        // of the include graph at a time, so that the compile is served from memory rather
+        // than blocking on storage for each include in turn
+        void prefetch(const std::vector<std::string>& sources);
+
     private:
         std::string dir;
+        std::map<std::string, std::shared_ptr<const IncludeFile>> m_prefetched;
     };
 
     class NullIncluder : public glslang::TShader::Includer {
@@ -282,333 +583,3413 @@ namespace ShaderCross
         }
     };
 
-    // Simple bundling of what makes a compilation unit for ease in passing around,
-    // and separation of handling file IO versus API (programmatic) compilation.
-    struct ShaderCompUnit
+    // Hands glslang the stub of a header that is linked in as a precompiled module
+    // instead of the header itself
+    class ModuleIncluder : public glslang::TShader::Includer
     {
-        EShLanguage stage;
-        std::string fileName;
-        char** text;             // memory owned/managed externally
-        const char* fileNameList[1];
-
-        // Need to have a special constructors to adjust the fileNameList, since back end needs a list of ptrs
-        ShaderCompUnit(EShLanguage istage, std::string& ifileName, char** itext)
+    public:
+        ModuleIncluder(glslang::TShader::Includer* includer, const std::vector<std::shared_ptr<const ShaderModule>>& modules) : m_includer(includer), m_modules(modules)
         {
-            stage = istage;
-            fileName = ifileName;
-            text = itext;
-            fileNameList[0] = fileName.c_str();
+
         }
 
-        ShaderCompUnit(const ShaderCompUnit& rhs)
+        ~ModuleIncluder()
         {
-            stage = rhs.stage;
-            fileName = rhs.fileName;
-            text = rhs.text;
-            fileNameList[0] = fileName.c_str();
+            delete m_includer;
         }
 
-    };
-
-    static char s_compilerOutputBuffer[1024*1024];
-
-    ShaderStage shLanguageToShaderStage(EShLanguage lang)
-    {
-        switch (lang) {
-        case EShLangVertex: return StageVertex;
-        case EShLangTessControl: return StageTessControl;
-        case EShLangTessEvaluation: return StageTessEvaluation;
-        case EShLangGeometry: return StageGeometry;
-        case EShLangFragment: return StageFragment;
-        case EShLangCompute: return StageCompute;
-        case EShLangCount:
-        default:
-            return StageCompute;
+        IncludeResult* includeSystem(const char* headerName, const char* includerName, size_t inclusionDepth) override {
+            IncludeResult* stub = findStub(headerName);
+            return stub ? stub : m_includer->includeSystem(headerName, includerName, inclusionDepth);
         }
-    }
-
-    void CompileAndLinkShaderUnits(const Config& config,
-                                   Result& result,
-                                   std::vector<ShaderCompUnit> compUnits,
-                                   Target target,
-                                   const char* sourcefilename,
-                                   const char* filename,
-                                   glslang::TShader::Includer& includer,
-                                   const char* defines)
-    {
-        // keep track of what to free
-        std::list<glslang::TShader*> shaders;
-
-        EShMessages messages = EShMsgDefault;
-
-        //
-        // Per-shader processing...
-        //
-        
-        bool linkFailed = false;
-        bool compileFailed = false;
 
-        glslang::TProgram& program = *new glslang::TProgram;
-        for (auto it = compUnits.cbegin(); it != compUnits.cend(); ++it) {
-            const auto& compUnit = *it;
-            glslang::TShader* shader = new glslang::TShader(compUnit.stage);
-            shader->setStringsWithLengthsAndNames(compUnit.text, NULL, compUnit.fileNameList, 1);
-            shader->setPreamble(defines);
-            shader->setAutoMapBindings(true);
+        IncludeResult* includeLocal(const char* headerName, const char* includerName, size_t inclusionDepth) override {
+            IncludeResult* stub = findStub(headerName);
+            return stub ? stub : m_includer->includeLocal(headerName, includerName, inclusionDepth);
+        }
 
-            shaders.push_back(shader);
+        void releaseInclude(IncludeResult* result) override {
+            if (m_stubs.erase(result))
+            {
+                delete result;
+            }
+            else
+            {
+                m_includer->releaseInclude(result);
+            }
+        }
 
-            const int defaultVersion = 100; // Options & EOptionDefaultDesktop ? 110 : 100;
+        glslang::TShader::Includer& base()
+        {
+            return *m_includer;
+        }
 
-            shader->setEnvTarget(glslang::EShTargetSpv, glslang::EShTargetSpv_1_0);
-            
-            static TBuiltInResource defaultBuiltInResources = InitResources();
-            
-            if (!shader->parse(&defaultBuiltInResources, defaultVersion, EEsProfile, false, false, messages, includer))
+    private:
+        IncludeResult* findStub(const char* headerName)
+        {
+            for (const auto& module : m_modules)
             {
-                compileFailed = true;
-                result.errors += shader->getInfoLog();
+                if (module->headerName == headerName)
+                {
+                    IncludeResult* result = new IncludeResult(module->headerName, module->stub.data(), module->stub.size(), nullptr);
+                    m_stubs.insert(result);
+                    return result;
+                }
             }
+            return nullptr;
+        }
 
-            program.addShader(shader);
+        glslang::TShader::Includer* m_includer;
+        std::vector<std::shared_ptr<const ShaderModule>> m_modules;
+        std::set<IncludeResult*> m_stubs;
+    };
+
+    static glslang::TShader::Includer* CreateSourceIncluder(const Config& config)
+    {
+        if (config.sharedIncludeCallback)
+        {
+            return new CustomIncluder(*config.sharedIncludeCallback);
+        }
+        else if (config.includeCallback)
+        {
+            return new CustomIncluder(*config.includeCallback);
+        }
+        else if (config.includePath.length() > 0)
+        {
+            return new KrafixIncluder(config.includePath);
         }
+        return new NullIncluder();
+    }
 
-        //
-        // Program-level processing...
-        //
+    static glslang::TShader::Includer* CreateIncluder(const Config& config)
+    {
+        glslang::TShader::Includer* includer = CreateSourceIncluder(config);
+        return config.modules.empty() ? includer : new ModuleIncluder(includer, config.modules);
+    }
 
-        // Link
-        if (!program.link(messages))
+    // Finds the next '#' or '/' at or after p, 16 bytes at a time where SIMD is available.
+    // Those are the only characters that can start a directive or hide one in a comment.
+    static const char* FindDirectiveOrComment(const char* p, const char* end)
+    {
+#if defined(__SSE2__) || defined(_M_X64)
+        const __m128i hash = _mm_set1_epi8('#');
+        const __m128i slash = _mm_set1_epi8('/');
+        while (end - p >= 16)
         {
-            linkFailed = true;
-            result.errors += program.getInfoLog();
+            __m128i block = _mm_loadu_si128((const __m128i*)p);
+            unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, hash), _mm_cmpeq_epi8(block, slash)));
+            if (mask)
+            {
+#if defined(_MSC_VER)
+                unsigned long index;
+                _BitScanForward(&index, mask);
+                return p + index;
+#else
+                return p + __builtin_ctz(mask);
+#endif
+            }
+            p += 16;
         }
-            
-        if (!program.mapIO())
+#elif defined(__aarch64__)
+        const uint8x16_t hash = vdupq_n_u8('#');
+        const uint8x16_t slash = vdupq_n_u8('/');
+        while (end - p >= 16)
         {
-            linkFailed = true;
+            uint8x16_t block = vld1q_u8((const uint8_t*)p);
+            if (vmaxvq_u8(vorrq_u8(vceqq_u8(block, hash), vceqq_u8(block, slash))))
+            {
+                break;
+            }
+            p += 16;
         }
-        
-        // Dump SPIR-V
-        if (compileFailed || linkFailed)
+#endif
+        while (p < end && *p != '#' && *p != '/')
         {
-            result.success = false;
-            result.errors += "SPIR-V is not generated for failed compile or link\n";
+            p++;
         }
-        else
+        return p;
+    }
+
+    // Splits the rest of a directive line into tokens, following line continuations
+    // and dropping comments. Returns the position after the line.
+    static const char* DirectiveTokens(const char* p, const char* end, std::vector<std::string>& tokens)
+    {
+        while (p < end)
         {
-            int outputIndex = 0;
-            for (int stage = 0; stage < EShLangCount; ++stage)
+            char c = *p;
+            if (c == '\n')
             {
-                if (program.getIntermediate((EShLanguage)stage))
-                {
-                    std::vector<unsigned int> spirv;
-                    std::string warningsErrors;
-                    spv::SpvBuildLogger logger;
-                    glslang::GlslangToSpv(*program.getIntermediate((EShLanguage)stage), spirv, &logger);
+                return p + 1;
+            }
+            if (c == '\\' && p + 1 < end && (p[1] == '\n' || p[1] == '\r'))
+            {
+                p += (p[1] == '\r' && p + 2 < end && p[2] == '\n') ? 3 : 2;
+                continue;
+            }
+            if (isspace((unsigned char)c))
+            {
+                p++;
+                continue;
+            }
+            if (c == '/' && p + 1 < end && p[1] == '/')
+            {
+                const char* newline = (const char*)memchr(p, '\n', end - p);
+                return newline ? newline + 1 : end;
+            }
+            if (c == '/' && p + 1 < end && p[1] == '*')
+            {
+                p += 2;
+                while (p < end && !(*p == '*' && p + 1 < end && p[1] == '/')) p++;
+                p = std::min(p + 2, end);
+                continue;
+            }
 
-                    Translator* translator = NULL;
-                    ShaderStage shaderStage = shLanguageToShaderStage((EShLanguage)stage);
-                    std::map<std::string, int> attributes;
-                    
-                    switch (target.lang)
-                    {
-                    case SpirV:
-                        translator = new SpirVTranslator(spirv, shaderStage);
-                        break;
-                    case GLSL:
-                        translator = new GlslTranslator2(spirv, shaderStage, false);
-                        break;
-                    case HLSL:
-                        translator = new HlslTranslator2(spirv, shaderStage);
-                        break;
-                    case Metal:
-                        translator = new MetalTranslator2(spirv, shaderStage);
-                        break;
-                    case AGAL:
-                        translator = new AgalTranslator(spirv, shaderStage);
-                        break;
-                    case VarList:
-                        translator = new VarListTranslator(spirv, shaderStage);
-                        break;
-                    case JavaScript:
-                        break;
-                    }
+            const char* start = p;
+            if (isalnum((unsigned char)c) || c == '_')
+            {
+                while (p < end && (isalnum((unsigned char)*p) || *p == '_')) p++;
+            }
+            else if (c == '"' || (c == '<' && tokens.size() == 1 && tokens[0] == "include"))
+            {
+                char terminator = c == '"' ? '"' : '>';
+                p++;
+                while (p < end && *p != terminator && *p != '\n') p++;
+                if (p < end && *p == terminator) p++;
+            }
+            else
+            {
+                p++;
+            }
+            tokens.push_back(std::string(start, p - start));
+        }
+        return p;
+    }
 
-                    try
+    // Walks a source and the headers it includes looking only at preprocessor directives
+    class DependencyScanner
+    {
+    public:
+        DependencyScanner(glslang::TShader::Includer& includer, DependencyScan& scan) : m_includer(includer), m_scan(scan)
+        {
+
+        }
+
+        // Called with the full text of the defines, each source and each header scanned
+        void setTextVisitor(const std::function<void(const char* text, size_t length)>& visitor)
+        {
+            m_textVisitor = visitor;
+        }
+
+        void scan(const char* text, size_t length, const std::string& name, size_t depth)
+        {
+            if (m_textVisitor)
+            {
+                m_textVisitor(text, length);
+            }
+
+            const char* p = text;
+            const char* end = text + length;
+
+            while (p < end)
+            {
+                p = FindDirectiveOrComment(p, end);
+                if (p >= end)
+                {
+                    break;
+                }
+
+                if (*p == '/')
+                {
+                    if (p + 1 < end && p[1] == '/')
                     {
-                        translator->outputCode(target, sourcefilename, filename, s_compilerOutputBuffer, attributes);
-                        result.output[outputIndex] = s_compilerOutputBuffer;
-                        result.success = true;
-                        result.resultCount = 1;
+                        const char* newline = (const char*)memchr(p, '\n', end - p);
+                        p = newline ? newline : end;
                     }
-                    catch (spirv_cross::CompilerError& error) {
-                        printf("Error compiling to %s: %s\n", target.string().c_str(), error.what());
-                        compileFailed = true;
-                        result.success = false;
-                        result.errors += error.what();
+                    else if (p + 1 < end && p[1] == '*')
+                    {
+                        p += 2;
+                        while (p < end)
+                        {
+                            const char* star = (const char*)memchr(p, '*', end - p);
+                            if (!star || star + 1 >= end)
+                            {
+                                p = end;
+                                break;
+                            }
+                            p = star + 1;
+                            if (*p == '/')
+                            {
+                                p++;
+                                break;
+                            }
+                        }
                     }
-                    
+                    else
                     {
-                        spirv_cross::Parser spirv_parser(spirv);
-                        spirv_parser.parse();
+                        p++;
+                    }
+                    continue;
+                }
 
-                        spirv_cross::CompilerReflection compiler(std::move(spirv_parser.get_parsed_ir()));
-                        compiler.set_format("json");
-                        
-                        result.json[outputIndex] = compiler.compile();
+                // a directive's '#' can only be preceded by whitespace on its line
+                const char* lineStart = p;
+                while (lineStart > text && (lineStart[-1] == ' ' || lineStart[-1] == '\t' || lineStart[-1] == '\r'))
+                {
+                    lineStart--;
+                }
+                if (lineStart > text && lineStart[-1] != '\n')
+                {
+                    p++;
+                    continue;
+                }
+
+                std::vector<std::string> tokens;
+                p = DirectiveTokens(p + 1, end, tokens);
+                directive(tokens, name, depth);
+            }
+        }
+
+    private:
+        void directive(const std::vector<std::string>& tokens, const std::string& name, size_t depth)
+        {
+            if (tokens.empty())
+            {
+                return;
+            }
+
+            const std::string& directive = tokens[0];
+            if (directive == "include" && tokens.size() >= 2 && tokens[1].size() >= 2)
+            {
+                bool local = tokens[1][0] == '"';
+                include(tokens[1].substr(1, tokens[1].size() - 2), name, local, depth + 1);
+            }
+            else if (directive == "define" && tokens.size() >= 2)
+            {
+                m_scan.defines.insert(tokens[1]);
+            }
+            else if (directive == "pragma" && tokens.size() >= 3 && tokens[1] == "variant")
+            {
+                VariantAxis axis;
+                axis.name = tokens[2];
+                axis.values.assign(tokens.begin() + 3, tokens.end());
+                m_scan.variantAxes.push_back(axis);
+            }
+            else if ((directive == "ifdef" || directive == "ifndef") && tokens.size() >= 2)
+            {
+                m_scan.conditions.insert(tokens[1]);
+            }
+            else if (directive == "if" || directive == "elif")
+            {
+                for (size_t i = 1; i < tokens.size(); i++)
+                {
+                    const std::string& token = tokens[i];
+                    if ((isalpha((unsigned char)token[0]) || token[0] == '_') && token != "defined")
+                    {
+                        m_scan.conditions.insert(token);
                     }
+                }
+            }
+        }
 
-                    outputIndex++;
-                    
-                    delete translator;
+        void include(const std::string& headerName, const std::string& includerName, bool local, size_t depth)
+        {
+            if (depth > s_maxIncludeDepth)
+            {
+                return;
+            }
+
+            glslang::TShader::Includer::IncludeResult* result = local
+                ? m_includer.includeLocal(headerName.c_str(), includerName.c_str(), depth)
+                : m_includer.includeSystem(headerName.c_str(), includerName.c_str(), depth);
+            if (!result)
+            {
+                if (std::find(m_scan.missing.begin(), m_scan.missing.end(), headerName) == m_scan.missing.end())
+                {
+                    m_scan.missing.push_back(headerName);
                 }
+                return;
             }
+
+            // headers are scanned once, guarded or not, as their directives don't change
+            if (m_visited.insert(result->headerName).second)
+            {
+                m_scan.includes.push_back(result->headerName);
+                scan(result->headerData, result->headerLength, result->headerName, depth);
+            }
+            m_includer.releaseInclude(result);
         }
-        
-        // Free everything up, program has to go before the shaders
-        // because it might have merged stuff from the shaders, and
-        // the stuff from the shaders has to have its destructors called
-        // before the pools holding the memory in the shaders is freed.
-        delete& program;
-        while (shaders.size() > 0)
+
+        static const size_t s_maxIncludeDepth = 64;
+
+        glslang::TShader::Includer& m_includer;
+        DependencyScan& m_scan;
+        std::set<std::string> m_visited;
+        std::function<void(const char* text, size_t length)> m_textVisitor;
+    };
+
+    static void ScanDependencies(const Config& config, DependencyScan& scan, const std::function<void(const char* text, size_t length)>& textVisitor)
+    {
+        glslang::TShader::Includer* includer = CreateIncluder(config);
+        DependencyScanner scanner(*includer, scan);
+        scanner.setTextVisitor(textVisitor);
+
+        scanner.scan(config.defines.data(), config.defines.size(), "", 0);
+        for (int i = 0; i < config.stageCount; i++)
         {
-            delete shaders.back();
-            shaders.pop_back();
+            scanner.scan(config.source[i].data(), config.source[i].size(), config.sourceName[i], 0);
         }
+
+        delete includer;
     }
 
-    void CompileAndLinkShaderFiles(const Config& config,
-                                   Result& result,
-                                   Target target,
-                                   glslang::TShader::Includer& includer,
-                                   const char* defines)
+    void ScanDependencies(const Config& config, DependencyScan& scan)
     {
-        std::vector<ShaderCompUnit> compUnits;
+        ScanDependencies(config, scan, nullptr);
+    }
 
-        char* sources[] = { nullptr, nullptr, nullptr, nullptr, nullptr };
+    static const unsigned s_prefetchThreads = 8;
 
-        for (int i = 0; i < config.stageCount; i++)
-        {
-            sources[i] = (char*)config.source[i].c_str();
-            
-            const char* to;
-            EShLanguage lang = EShLangCount;
-            
-            switch(config.stage[i])
+    // Names of the headers a text includes directly
+    static std::vector<std::string> DirectIncludes(const char* text, size_t length)
+    {
+        // with nothing resolvable, every #include ends up in missing
+        NullIncluder includer;
+        DependencyScan scan;
+        DependencyScanner scanner(includer, scan);
+        scanner.scan(text, length, "", 0);
+        return scan.missing;
+    }
+
+    void KrafixIncluder::prefetch(const std::vector<std::string>& sources)
+    {
+        std::vector<std::string> level;
+        std::set<std::string> requested;
+
+        auto request = [&](const char* text, size_t length) {
+            for (const auto& headerName : DirectIncludes(text, length))
             {
-                case StageVertex:
-                    to = "vert";
-                    lang = EShLangVertex;
-                    break;
-                case StageTessControl:
-                    to = "tesc";
-                    lang = EShLangTessControl;
-                    break;
-                case StageTessEvaluation:
-                    to = "tese";
-                    lang = EShLangTessEvaluation;
-                    break;
-                case StageGeometry:
-                    to = "geom";
-                    lang = EShLangGeometry;
-                    break;
-                case StageFragment:
-                    to = "frag";
-                    lang = EShLangFragment;
-                    break;
-                case StageCompute:
-                    to = "comp";
-                    lang = EShLangCompute;
-                    break;
-                default:
-                    break;
+                std::string path = dir + headerName;
+                if (requested.insert(path).second)
+                {
+                    level.push_back(path);
+                }
             }
-            
-            std::string name = (config.sourceName[i].length() > 0) ? config.sourceName[i] : std::string("source.") + to;
-                        
-            ShaderCompUnit compUnit(lang, name, sources+i);
-            compUnits.push_back(compUnit);
+        };
+
+        for (const auto& source : sources)
+        {
+            request(source.data(), source.size());
         }
-    
-        result.success = true;
-        
-        CompileAndLinkShaderUnits(config,
-                                  result,
-                                  compUnits,
-                                  target,
-                                  config.sourceName[0].c_str(),
-                                  config.sourceName[0].c_str(),
-                                  includer,
-                                  defines);
 
+        while (!level.empty())
+        {
+            std::vector<std::shared_ptr<const IncludeFile>> files(level.size());
+            std::atomic<size_t> next(0);
+
+            auto load = [&]() {
+                for (size_t i = next++; i < level.size(); i = next++)
+                {
+                    files[i] = IncludeFileCache::shared().load(level[i]);
+                    files[i]->touch();
+                }
+            };
+
+            std::vector<std::thread> threads;
+            for (unsigned i = 1; i < std::min<size_t>(s_prefetchThreads, level.size()); i++)
+            {
+                threads.push_back(std::thread(load));
+            }
+            load();
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+
+            std::vector<std::string> loaded;
+            loaded.swap(level);
+            for (size_t i = 0; i < loaded.size(); i++)
+            {
+                m_prefetched[loaded[i]] = files[i];
+                request(files[i]->data(), files[i]->size());
+            }
+        }
     }
 
-    void Compile(const Config& config, Result& result)
+    // A header handed to glslang during a compile, identified by how it was requested
+    // so that it can be resolved again later to check whether it changed
+    struct IncludeDependency
     {
-        glslang::TShader::Includer* includer = nullptr;
-        
-        if (config.includeCallback)
+        std::string headerName;
+        std::string includerName;
+        bool local;
+        bool found;
+        Hash128 contentHash;
+    };
+
+    // Forwards to another includer and records every header it resolves
+    class RecordingIncluder : public glslang::TShader::Includer
+    {
+    public:
+        RecordingIncluder(glslang::TShader::Includer& includer) : m_includer(includer)
         {
-            includer = new CustomIncluder(*config.includeCallback);
+
         }
-        else if (config.includePath.length() > 0)
-        {
-            includer = new KrafixIncluder(config.includePath);
+
+        IncludeResult* includeSystem(const char* headerName, const char* includerName, size_t inclusionDepth) override {
+            return record(m_includer.includeSystem(headerName, includerName, inclusionDepth), headerName, includerName, false);
         }
-        else
-        {
-            includer = new NullIncluder();
+
+        IncludeResult* includeLocal(const char* headerName, const char* includerName, size_t inclusionDepth) override {
+            return record(m_includer.includeLocal(headerName, includerName, inclusionDepth), headerName, includerName, true);
         }
-                    
-        glslang::InitializeProcess();
 
-        int version = -1;
+        void releaseInclude(IncludeResult* result) override {
+            m_includer.releaseInclude(result);
+        }
 
-        Target target = config.target;
-        std::string defines = config.defines;
+        const std::vector<IncludeDependency>& dependencies() const
+        {
+            return m_dependencies;
+        }
 
-        switch(config.target.lang)
+        size_t mark() const
         {
-            case SpirV:
-                target.version = version > 0 ? version : 1;
-                defines += "#define SPIRV " + std::to_string(config.target.version) + "\n";
-                break;
-            case GLSL:
-                defines += "#define GLSL " + std::to_string(target.version) + "\n";
-                break;
-            case HLSL:
-                target.version = version > 0 ? version : 11;
-                defines += "#define HLSL " + std::to_string(target.version) + "\n";
-                break;
-            case Metal:
-                target.version = version > 0 ? version : 1;
-                defines += "#define METAL " + std::to_string(target.version) + "\n";
-                break;
-            case AGAL:
-                target.version = version > 0 ? version : 100;
-                target.es = true;
-                defines += "#define AGAL " + std::to_string(target.version) + "\n";
-                break;
-            case VarList:
-                target.version = version > 0 ? version : 1;
-                break;
-            case JavaScript:
-                result.success = false;
-                result.errors = "JavaScript not supported";
-                return;
+            return m_dependencies.size();
         }
-        
-        CompileAndLinkShaderFiles(config,
-                                  result,
-                                  target,
-                                  *includer,
-                                  defines.c_str());
 
-        //glslang::FinalizeProcess();
+    private:
+        IncludeResult* record(IncludeResult* result, const char* headerName, const char* includerName, bool local)
+        {
+            IncludeDependency dependency;
+            dependency.headerName = headerName;
+            dependency.includerName = includerName ? includerName : "";
+            dependency.local = local;
+            dependency.found = result != nullptr;
+            if (result)
+            {
+                dependency.contentHash = HashBytes(result->headerData, result->headerLength);
+            }
+            m_dependencies.push_back(dependency);
+            return result;
+        }
 
-        if (includer) delete includer;
-    }
-}
+        glslang::TShader::Includer& m_includer;
+        std::vector<IncludeDependency> m_dependencies;
+    };
+
+    // A non-empty line of shader source after comments are stripped. Only the tokens
+    // of preprocessor directives are kept.
+    struct SourceLine
+    {
+        bool directive;
+        std::vector<std::string> tokens;
+    };
+
+    static std::vector<SourceLine> SignificantLines(const char* text, size_t length)
+    {
+        std::vector<SourceLine> lines;
+        bool lineStart = true;
+        bool lineAdded = false;
 
+        for (size_t i = 0; i < length;)
+        {
+            char c = text[i];
+
+            if (c == '\\' && i + 1 < length && (text[i + 1] == '\n' || text[i + 1] == '\r'))
+            {
+                i += (text[i + 1] == '\r' && i + 2 < length && text[i + 2] == '\n') ? 3 : 2;
+                continue;
+            }
+            if (c == '\n')
+            {
+                lineStart = true;
+                lineAdded = false;
+                i++;
+                continue;
+            }
+            if (isspace((unsigned char)c))
+            {
+                i++;
+                continue;
+            }
+            if (c == '/' && i + 1 < length && text[i + 1] == '/')
+            {
+                while (i < length && text[i] != '\n') i++;
+                continue;
+            }
+            if (c == '/' && i + 1 < length && text[i + 1] == '*')
+            {
+                i += 2;
+                while (i < length && !(text[i] == '*' && i + 1 < length && text[i + 1] == '/')) i++;
+                i += 2;
+                continue;
+            }
 
+            if (!lineAdded)
+            {
+                SourceLine line;
+                line.directive = lineStart && c == '#';
+                lines.push_back(line);
+                lineAdded = true;
+                lineStart = false;
+                if (c == '#')
+                {
+                    i++;
+                    continue;
+                }
+            }
+
+            size_t start = i;
+            if (isalnum((unsigned char)c) || c == '_')
+            {
+                while (i < length && (isalnum((unsigned char)text[i]) || text[i] == '_')) i++;
+            }
+            else
+            {
+                i++;
+            }
+            if (lines.back().directive)
+            {
+                lines.back().tokens.push_back(std::string(text + start, i - start));
+            }
+        }
+
+        return lines;
+    }
+
+    // How a header protects itself from being included more than once
+    struct IncludeGuard
+    {
+        bool pragmaOnce = false;
+        std::string macro; // the whole header is wrapped in #ifndef macro / #define macro / #endif
+        std::set<std::string> undefined; // macros the header #undefs
+    };
+
+    static IncludeGuard FindIncludeGuard(const char* text, size_t length)
+    {
+        IncludeGuard guard;
+        std::vector<SourceLine> lines = SignificantLines(text, length);
+
+        for (const auto& line : lines)
+        {
+            if (line.directive && line.tokens.size() >= 2 && line.tokens[0] == "pragma" && line.tokens[1] == "once")
+            {
+                guard.pragmaOnce = true;
+            }
+            if (line.directive && line.tokens.size() >= 2 && line.tokens[0] == "undef")
+            {
+                guard.undefined.insert(line.tokens[1]);
+            }
+        }
+
+        if (lines.size() < 3 || !lines[0].directive || !lines[1].directive)
+        {
+            return guard;
+        }
+
+        // #ifndef X, #if !defined(X) or #if !defined X
+        const std::vector<std::string>& opening = lines[0].tokens;
+        std::string macro;
+        if (opening.size() == 2 && opening[0] == "ifndef")
+        {
+            macro = opening[1];
+        }
+        else if (opening.size() >= 4 && opening[0] == "if" && opening[1] == "!" && opening[2] == "defined")
+        {
+            macro = opening[3] == "(" && opening.size() == 6 && opening[5] == ")" ? opening[4] : opening.size() == 4 ? opening[3] : "";
+        }
+
+        const std::vector<std::string>& definition = lines[1].tokens;
+        if (macro.empty() || definition.size() < 2 || definition[0] != "define" || definition[1] != macro)
+        {
+            return guard;
+        }
+
+        int depth = 1;
+        for (size_t i = 2; i < lines.size(); i++)
+        {
+            if (!lines[i].directive || lines[i].tokens.empty())
+            {
+                continue;
+            }
+
+            const std::string& directive = lines[i].tokens[0];
+            if (directive == "if" || directive == "ifdef" || directive == "ifndef")
+            {
+                depth++;
+            }
+            else if ((directive == "else" || directive == "elif") && depth == 1)
+            {
+                return guard;
+            }
+            else if (directive == "endif" && --depth == 0)
+            {
+                if (i == lines.size() - 1)
+                {
+                    guard.macro = macro;
+                }
+                return guard;
+            }
+        }
+        return guard;
+    }
+
+    // Hands glslang an empty body when a header guarded by #pragma once or an include
+    // guard is included again in the same translation unit, so the preprocessor doesn't
+    // have to tokenize and skip the whole header
+    class GuardedIncluder : public glslang::TShader::Includer
+    {
+    public:
+        GuardedIncluder(glslang::TShader::Includer& includer) : m_includer(includer)
+        {
+
+        }
+
+        // Starts a new translation unit, scanning its own text for #undefs of guard macros
+        void beginTranslationUnit(const char* preamble, const char* source)
+        {
+            m_included.clear();
+            m_undefined.clear();
+            for (const char* text : { preamble, source })
+            {
+                if (text)
+                {
+                    IncludeGuard guard = FindIncludeGuard(text, strlen(text));
+                    m_undefined.insert(guard.undefined.begin(), guard.undefined.end());
+                }
+            }
+        }
+
+        IncludeResult* includeSystem(const char* headerName, const char* includerName, size_t inclusionDepth) override {
+            return filter(m_includer.includeSystem(headerName, includerName, inclusionDepth));
+        }
+
+        IncludeResult* includeLocal(const char* headerName, const char* includerName, size_t inclusionDepth) override {
+            return filter(m_includer.includeLocal(headerName, includerName, inclusionDepth));
+        }
+
+        void releaseInclude(IncludeResult* result) override {
+            if (m_skipped.erase(result))
+            {
+                delete result;
+            }
+            else
+            {
+                m_includer.releaseInclude(result);
+            }
+        }
+
+    private:
+        IncludeResult* filter(IncludeResult* result)
+        {
+            if (!result)
+            {
+                return result;
+            }
+
+            auto included = m_included.find(result->headerName);
+            if (included == m_included.end())
+            {
+                IncludeGuard guard = FindIncludeGuard(result->headerData, result->headerLength);
+                m_undefined.insert(guard.undefined.begin(), guard.undefined.end());
+                m_included[result->headerName] = guard;
+                return result;
+            }
+
+            const IncludeGuard& guard = included->second;
+            if (guard.pragmaOnce || (!guard.macro.empty() && !m_undefined.count(guard.macro)))
+            {
+                IncludeResult* skipped = new IncludeResult(result->headerName, "", 0, nullptr);
+                m_includer.releaseInclude(result);
+                m_skipped.insert(skipped);
+                return skipped;
+            }
+            return result;
+        }
+
+        glslang::TShader::Includer& m_includer;
+        std::map<std::string, IncludeGuard> m_included;
+        std::set<std::string> m_undefined;
+        std::set<IncludeResult*> m_skipped;
+    };
+
+    // Resolves each recorded header again and checks it still has the same contents
+    static bool DependenciesUnchanged(const std::vector<IncludeDependency>& dependencies, glslang::TShader::Includer& includer)
+    {
+        for (const auto& dependency : dependencies)
+        {
+            glslang::TShader::Includer::IncludeResult* include = dependency.local
+                ? includer.includeLocal(dependency.headerName.c_str(), dependency.includerName.c_str(), 1)
+                : includer.includeSystem(dependency.headerName.c_str(), dependency.includerName.c_str(), 1);
+
+            bool unchanged = (include != nullptr) == dependency.found;
+            if (include)
+            {
+                unchanged = unchanged && HashBytes(include->headerData, include->headerLength) == dependency.contentHash;
+                includer.releaseInclude(include);
+            }
+
+            if (!unchanged)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static Hash128 HashAttributeLocations(const Config& config)
+    {
+        Hasher hasher;
+        for (const auto& attribute : config.attributeLocations)
+        {
+            hasher.update(attribute.first);
+            hasher.update((uint64_t)attribute.second);
+        }
+        hasher.update((uint64_t)config.attributeSizes.size());
+        for (const auto& attribute : config.attributeSizes)
+        {
+            hasher.update(attribute.first);
+            hasher.update((uint64_t)attribute.second);
+        }
+        return hasher.finish();
+    }
+
+    static Hash128 HashUniformBlocks(const Config& config)
+    {
+        Hasher hasher;
+        for (const UniformBlock& block : config.uniformBlocks)
+        {
+            hasher.update(block.name);
+            hasher.update((uint64_t)block.binding);
+            hasher.update((uint64_t)block.members.size());
+            for (const UniformBlockMember& member : block.members)
+            {
+                hasher.update(member.type);
+                hasher.update(member.name);
+            }
+        }
+        return hasher.finish();
+    }
+
+    // Identifies a compile by everything in the config that affects its output,
+    // except for the contents of included headers which are tracked separately
+    static Hash128 HashConfig(const Config& config)
+    {
+        Hasher hasher;
+        hasher.update((uint64_t)config.target.lang);
+        hasher.update((uint64_t)config.target.version);
+        hasher.update((uint64_t)config.target.es);
+        hasher.update((uint64_t)config.target.system);
+        hasher.update((uint64_t)config.stageCount);
+        for (int i = 0; i < config.stageCount; i++)
+        {
+            hasher.update((uint64_t)config.stage[i]);
+            hasher.update(config.source[i]);
+            hasher.update(config.sourceName[i]);
+        }
+        hasher.update(config.defines);
+        hasher.update(config.includePath);
+        hasher.update((uint64_t)(config.includeCallback != nullptr));
+        hasher.update((uint64_t)(config.sharedIncludeCallback != nullptr));
+        for (const auto& module : config.modules)
+        {
+            hasher.update(module->hash);
+        }
+        hasher.update(HashAttributeLocations(config));
+        hasher.update(HashUniformBlocks(config));
+        return hasher.finish();
+    }
+
+    // Failed compiles are remembered along with their diagnostics so that
+    // a known-bad shader doesn't pay for a full compile every time it is requested
+    struct FailureCacheEntry
+    {
+        std::string errors;
+        std::vector<IncludeDependency> dependencies;
+    };
+
+    static const size_t s_failureCacheCapacity = 256;
+    static std::mutex s_failureCacheMutex;
+    static LruCache<Hash128, FailureCacheEntry> s_failureCache(s_failureCacheCapacity);
+
+    static bool FindCachedFailure(const Hash128& key, glslang::TShader::Includer& includer, std::string& errors)
+    {
+        FailureCacheEntry entry;
+        {
+            std::lock_guard<std::mutex> lock(s_failureCacheMutex);
+            FailureCacheEntry* cached = s_failureCache.find(key);
+            if (!cached)
+            {
+                return false;
+            }
+            entry = *cached;
+        }
+
+        if (!DependenciesUnchanged(entry.dependencies, includer))
+        {
+            std::lock_guard<std::mutex> lock(s_failureCacheMutex);
+            s_failureCache.erase(key);
+            return false;
+        }
+
+        errors = entry.errors;
+        return true;
+    }
+
+    static void StoreCachedFailure(const Hash128& key, const std::string& errors, const std::vector<IncludeDependency>& dependencies)
+    {
+        FailureCacheEntry entry;
+        entry.errors = errors;
+        entry.dependencies = dependencies;
+        std::lock_guard<std::mutex> lock(s_failureCacheMutex);
+        s_failureCache.insert(key, entry);
+    }
+
+    // Hashes the preprocessor token stream of a source and everything it includes.
+    // Whitespace and comments are dropped, except for the line breaks that end
+    // preprocessor directives. Line breaks are kept everywhere when line numbers can
+    // reach the output, i.e. with debug info or when a file uses __LINE__.
+    // The tokens of each header are also hashed on their own, see headers().
+    class TokenHasher
+    {
+    public:
+        TokenHasher(glslang::TShader::Includer& includer, bool debugInfo) : m_includer(includer), m_debugInfo(debugInfo)
+        {
+
+        }
+
+        // Returns the hash of the text and its headers. tokensOnly receives the hash of
+        // the text alone.
+        Hash128 hash(const char* text, size_t length, const std::string& name, size_t depth, Hash128* tokensOnly = nullptr)
+        {
+            Hasher hasher;
+            std::vector<Hash128> headerHashes;
+            static const char lineMacro[] = "__LINE__";
+            bool lineSensitive = m_debugInfo || std::search(text, text + length, lineMacro, lineMacro + sizeof(lineMacro) - 1) != text + length;
+            bool lineStart = true;
+            bool inDirective = false;
+            int directiveToken = 0;
+            std::string directive;
+
+            size_t i = 0;
+            while (i < length)
+            {
+                char c = text[i];
+
+                if (c == '\\' && i + 1 < length && (text[i + 1] == '\n' || (text[i + 1] == '\r' && i + 2 < length && text[i + 2] == '\n')))
+                {
+                    i += text[i + 1] == '\n' ? 2 : 3;
+                    continue;
+                }
+
+                if (c == '\n')
+                {
+                    if (inDirective || lineSensitive)
+                    {
+                        hasher.update("\n", 1);
+                    }
+                    inDirective = false;
+                    lineStart = true;
+                    i++;
+                    continue;
+                }
+
+                if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v')
+                {
+                    i++;
+                    continue;
+                }
+
+                if (c == '/' && i + 1 < length && text[i + 1] == '/')
+                {
+                    while (i < length && text[i] != '\n') i++;
+                    continue;
+                }
+
+                if (c == '/' && i + 1 < length && text[i + 1] == '*')
+                {
+                    i += 2;
+                    while (i < length && !(text[i] == '*' && i + 1 < length && text[i + 1] == '/'))
+                    {
+                        if (text[i] == '\n' && lineSensitive) hasher.update("\n", 1);
+                        i++;
+                    }
+                    i += 2;
+                    continue;
+                }
+
+                if (c == '#' && lineStart)
+                {
+                    hasher.update("#", 1);
+                    inDirective = true;
+                    directiveToken = 0;
+                    directive.clear();
+                    lineStart = false;
+                    i++;
+                    continue;
+                }
+
+                lineStart = false;
+                size_t start = i;
+
+                if (isalpha((unsigned char)c) || c == '_')
+                {
+                    while (i < length && (isalnum((unsigned char)text[i]) || text[i] == '_')) i++;
+                    hasher.update(text + start, i - start);
+
+                    if (inDirective)
+                    {
+                        if (directiveToken == 0)
+                        {
+                            directive.assign(text + start, i - start);
+                            if (directive == "include")
+                            {
+                                i = hashInclude(hasher, headerHashes, text, length, i, name, depth);
+                            }
+                        }
+                        else if (directiveToken == 1 && directive == "define" && i < length && text[i] == '(')
+                        {
+                            // function-like macros are only distinguished from object-like ones by spacing
+                            hasher.update("(fn", 3);
+                        }
+                        directiveToken++;
+                    }
+                    continue;
+                }
+
+                if (isdigit((unsigned char)c) || (c == '.' && i + 1 < length && isdigit((unsigned char)text[i + 1])))
+                {
+                    while (i < length)
+                    {
+                        char n = text[i];
+                        if ((n == '+' || n == '-') && (text[i - 1] == 'e' || text[i - 1] == 'E')) i++;
+                        else if (isalnum((unsigned char)n) || n == '.' || n == '_') i++;
+                        else break;
+                    }
+                    hasher.update(text + start, i - start);
+                    directiveToken++;
+                    continue;
+                }
+
+                if (c == '"')
+                {
+                    i++;
+                    while (i < length && text[i] != '"' && text[i] != '\n') i++;
+                    if (i < length && text[i] == '"') i++;
+                    hasher.update(text + start, i - start);
+                    directiveToken++;
+                    continue;
+                }
+
+                static const char* punctuators[] = {
+                    "<<=", ">>=", "++", "--", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "^^",
+                    "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "##"
+                };
+
+                size_t tokenLength = 1;
+                if (i + 1 < length && ispunct((unsigned char)text[i + 1]))
+                {
+                    for (const char* punctuator : punctuators)
+                    {
+                        size_t punctuatorLength = punctuator[2] ? 3 : 2;
+                        if (i + punctuatorLength <= length && strncmp(text + i, punctuator, punctuatorLength) == 0)
+                        {
+                            tokenLength = punctuatorLength;
+                            break;
+                        }
+                    }
+                }
+                i += tokenLength;
+                hasher.update(text + start, tokenLength);
+                directiveToken++;
+            }
+
+            Hash128 tokens = hasher.finish();
+            if (tokensOnly)
+            {
+                *tokensOnly = tokens;
+            }
+
+            Hasher combined;
+            combined.update(tokens);
+            for (const Hash128& headerHash : headerHashes)
+            {
+                combined.update(headerHash);
+            }
+            return combined.finish();
+        }
+
+        // Token hash of every header reached so far, by resolved name, not including
+        // the headers it includes itself
+        const std::map<std::string, Hash128>& headers() const
+        {
+            return m_headerTokens;
+        }
+
+    private:
+        // Hashes the name of an #include'd header and appends the hash of its contents
+        // to headerHashes, returning the position after the header name
+        size_t hashInclude(Hasher& hasher, std::vector<Hash128>& headerHashes, const char* text, size_t length, size_t i, const std::string& name, size_t depth)
+        {
+            while (i < length && (text[i] == ' ' || text[i] == '\t')) i++;
+            if (i >= length || (text[i] != '"' && text[i] != '<'))
+            {
+                return i;
+            }
+
+            bool local = text[i] == '"';
+            char terminator = local ? '"' : '>';
+            size_t start = ++i;
+            while (i < length && text[i] != terminator && text[i] != '\n') i++;
+            std::string headerName(text + start, i - start);
+            if (i < length && text[i] == terminator) i++;
+
+            hasher.update(local ? "\"" : "<", 1);
+            hasher.update(headerName);
+            headerHashes.push_back(headerHash(headerName, name, local, depth + 1));
+            return i;
+        }
+
+        Hash128 headerHash(const std::string& headerName, const std::string& includerName, bool local, size_t depth)
+        {
+            std::string memoKey = (local ? "\"" : "<") + headerName;
+            auto it = m_headers.find(memoKey);
+            if (it != m_headers.end())
+            {
+                return it->second;
+            }
+
+            // Recursive includes are an error for glslang, which is what the key needs to capture
+            Hash128 hash;
+            hash.low = depth;
+            if (depth <= s_maxIncludeDepth)
+            {
+                m_headers[memoKey] = hash;
+
+                glslang::TShader::Includer::IncludeResult* include = local
+                    ? m_includer.includeLocal(headerName.c_str(), includerName.c_str(), depth)
+                    : m_includer.includeSystem(headerName.c_str(), includerName.c_str(), depth);
+                if (include)
+                {
+                    Hash128 tokens;
+                    hash = this->hash(include->headerData, include->headerLength, include->headerName, depth, &tokens);
+                    m_headerTokens[include->headerName] = tokens;
+                    m_includer.releaseInclude(include);
+                }
+                m_headers[memoKey] = hash;
+            }
+            return hash;
+        }
+
+        static const size_t s_maxIncludeDepth = 64;
+
+        glslang::TShader::Includer& m_includer;
+        bool m_debugInfo;
+        std::map<std::string, Hash128> m_headers;
+        std::map<std::string, Hash128> m_headerTokens;
+    };
+
+    // Hashes the lines of the defines preamble separately and ignores their order
+    static Hash128 HashDefinitionSet(TokenHasher& tokenHasher, const std::string& defines)
+    {
+        std::vector<Hash128> lines;
+        size_t start = 0;
+        while (start < defines.size())
+        {
+            size_t end = defines.find('\n', start);
+            if (end == std::string::npos) end = defines.size();
+            if (defines.find_first_not_of(" \t\r", start) < end)
+            {
+                lines.push_back(tokenHasher.hash(defines.data() + start, end - start, "", 0));
+            }
+            start = end + 1;
+        }
+        std::sort(lines.begin(), lines.end());
+
+        Hasher hasher;
+        for (const Hash128& line : lines)
+        {
+            hasher.update(line);
+        }
+        return hasher.finish();
+    }
+
+    void ComputeCompileKey(const Config& config, CompileKey& key, bool debugInfo)
+    {
+        glslang::TShader::Includer* includer = CreateIncluder(config);
+        TokenHasher tokenHasher(*includer, debugInfo);
+
+        key = CompileKey();
+        key.shaderName = config.sourceName[0];
+        key.options["target.lang"] = Hasher().update((uint64_t)config.target.lang).finish();
+        key.options["target.version"] = Hasher().update((uint64_t)config.target.version).finish();
+        key.options["target.es"] = Hasher().update((uint64_t)config.target.es).finish();
+        key.options["target.system"] = Hasher().update((uint64_t)config.target.system).finish();
+        key.options["debugInfo"] = Hasher().update((uint64_t)debugInfo).finish();
+        key.options["stageCount"] = Hasher().update((uint64_t)config.stageCount).finish();
+        if (!config.modules.empty())
+        {
+            // the stubs only change with the declarations, the bodies are in the SPIR-V
+            Hasher modules;
+            for (const auto& module : config.modules)
+            {
+                modules.update(module->hash);
+            }
+            key.options["modules"] = modules.finish();
+        }
+        if (!config.attributeLocations.empty())
+        {
+            key.options["attributeLocations"] = HashAttributeLocations(config);
+        }
+        if (!config.uniformBlocks.empty())
+        {
+            key.options["uniformBlocks"] = HashUniformBlocks(config);
+        }
+
+        Hash128 definesWithHeaders = tokenHasher.hash(config.defines.data(), config.defines.size(), "", 0, &key.defines);
+        key.definitionSet = HashDefinitionSet(tokenHasher, config.defines);
+
+        Hasher hasher;
+        hasher.update("ShaderCross cache key 2");
+        for (const auto& option : key.options)
+        {
+            hasher.update(option.first);
+            hasher.update(option.second);
+        }
+        hasher.update(definesWithHeaders);
+        for (int i = 0; i < config.stageCount; i++)
+        {
+            key.stage[i] = config.stage[i];
+            key.sourceName[i] = config.sourceName[i];
+            Hash128 sourceWithHeaders = tokenHasher.hash(config.source[i].data(), config.source[i].size(), config.sourceName[i], 0, &key.source[i]);
+
+            hasher.update((uint64_t)config.stage[i]);
+            hasher.update(config.sourceName[i]);
+            hasher.update(sourceWithHeaders);
+        }
+        key.includes = tokenHasher.headers();
+        key.key = hasher.finish();
+
+        delete includer;
+    }
+
+    Hash128 ComputeCacheKey(const Config& config, bool debugInfo)
+    {
+        CompileKey key;
+        ComputeCompileKey(config, key, debugInfo);
+        return key.key;
+    }
+
+    std::vector<std::string> DiffCompileKeys(const CompileKey& before, const CompileKey& after)
+    {
+        std::vector<std::string> changes;
+        if (before.key == after.key)
+        {
+            return changes;
+        }
+
+        if (before.shaderName != after.shaderName)
+        {
+            changes.push_back("shader name changed from " + before.shaderName + " to " + after.shaderName);
+        }
+
+        // modules, attribute locations and uniform blocks are only recorded when a
+        // config has any, so they can come and go
+        for (const auto& option : after.options)
+        {
+            auto previous = before.options.find(option.first);
+            if (previous == before.options.end())
+            {
+                changes.push_back("option " + option.first + " added");
+            }
+            else if (previous->second != option.second)
+            {
+                changes.push_back("option " + option.first + " changed");
+            }
+        }
+        for (const auto& option : before.options)
+        {
+            if (after.options.find(option.first) == after.options.end())
+            {
+                changes.push_back("option " + option.first + " removed");
+            }
+        }
+
+        if (before.defines != after.defines)
+        {
+            changes.push_back(before.definitionSet == after.definitionSet ? "defines reordered" : "defines changed");
+        }
+
+        for (int i = 0; i < 2; i++)
+        {
+            if (before.sourceName[i] != after.sourceName[i] || before.stage[i] != after.stage[i])
+            {
+                if (!before.sourceName[i].empty() || !after.sourceName[i].empty())
+                {
+                    changes.push_back("stage " + std::to_string(i) + " source changed from " + before.sourceName[i] + " to " + after.sourceName[i]);
+                }
+            }
+            else if (before.source[i] != after.source[i])
+            {
+                changes.push_back("source " + after.sourceName[i] + " changed");
+            }
+        }
+
+        for (const auto& include : after.includes)
+        {
+            auto previous = before.includes.find(include.first);
+            if (previous == before.includes.end())
+            {
+                changes.push_back("include " + include.first + " added");
+            }
+            else if (previous->second != include.second)
+            {
+                changes.push_back("include " + include.first + " changed");
+            }
+        }
+        for (const auto& include : before.includes)
+        {
+            if (after.includes.find(include.first) == after.includes.end())
+            {
+                changes.push_back("include " + include.first + " removed");
+            }
+        }
+
+        if (changes.empty())
+        {
+            // Same files, but an #include resolved to a different one of them
+            changes.push_back("include resolution changed");
+        }
+        return changes;
+    }
+
+    // Simple bundling of what makes a compilation unit for ease in passing around,
+    // and separation of handling file IO versus API (programmatic) compilation.
+    struct ShaderCompUnit
+    {
+        EShLanguage stage;
+        std::string fileName;
+        char** text;             // memory owned/managed externally
+        const char* fileNameList[1];
+
+        // Need to have a special constructors to adjust the fileNameList, since back end needs a list of ptrs
+        ShaderCompUnit(EShLanguage istage, std::string& ifileName, char** itext)
+        {
+            stage = istage;
+            fileName = ifileName;
+            text = itext;
+            fileNameList[0] = fileName.c_str();
+        }
+
+        ShaderCompUnit(const ShaderCompUnit& rhs)
+        {
+            stage = rhs.stage;
+            fileName = rhs.fileName;
+            text = rhs.text;
+            fileNameList[0] = fileName.c_str();
+        }
+
+    };
+
+    static const size_t s_compilerOutputBufferSize = 1024*1024;
+
+    ShaderStage shLanguageToShaderStage(EShLanguage lang)
+    {
+        switch (lang) {
+        case EShLangVertex: return StageVertex;
+        case EShLangTessControl: return StageTessControl;
+        case EShLangTessEvaluation: return StageTessEvaluation;
+        case EShLangGeometry: return StageGeometry;
+        case EShLangFragment: return StageFragment;
+        case EShLangCompute: return StageCompute;
+        case EShLangCount:
+        default:
+            return StageCompute;
+        }
+    }
+
+    EShLanguage shaderStageToShLanguage(ShaderStage stage)
+    {
+        switch (stage) {
+        case StageVertex: return EShLangVertex;
+        case StageTessControl: return EShLangTessControl;
+        case StageTessEvaluation: return EShLangTessEvaluation;
+        case StageGeometry: return EShLangGeometry;
+        case StageFragment: return EShLangFragment;
+        case StageCompute: return EShLangCompute;
+        case StageCount:
+        default:
+            return EShLangCount;
+        }
+    }
+
+    // Output of a single pipeline stage, kept apart from Result so that
+    // stages can be cached and reused independently of each other
+    struct StageResult
+    {
+        EShLanguage stage;
+        std::vector<unsigned> spirv;
+        std::string output;
+        std::string json;
+        std::vector<IncludeDependency> dependencies;
+        std::map<std::string, int> attributes; /* vertex input locations the translator assigned */
+    };
+
+    // Translator from SPIR-V to target, null for targets that aren't translated from SPIR-V
+    static Translator* CreateTranslator(const Target& target, std::vector<unsigned>& spirv, ShaderStage stage, const std::vector<UniformBlock>& uniformBlocks = std::vector<UniformBlock>())
+    {
+        switch (target.lang)
+        {
+        case SpirV:
+            return new SpirVTranslator(spirv, stage, false, uniformBlocks);
+        case SpirVCompact:
+            return new SpirVTranslator(spirv, stage, true, uniformBlocks);
+        case GLSL:
+            return new GlslTranslator2(spirv, stage, false);
+        case HLSL:
+            return new HlslTranslator2(spirv, stage);
+        case Metal:
+            return new MetalTranslator2(spirv, stage);
+        case AGAL:
+            return new AgalTranslator(spirv, stage);
+        case VarList:
+            return new VarListTranslator(spirv, stage);
+        case JavaScript:
+            break;
+        }
+        return nullptr;
+    }
+
+    // Whether the translator for target places vertex inputs with assignAttributeLocations.
+    // AGAL numbers its attribute registers itself and VarList only lists variables.
+    static bool PlacesAttributes(const Target& target)
+    {
+        return target.lang != AGAL && target.lang != VarList;
+    }
+
+    // Gives the vertex inputs the locations the translator assigned, the SPIR-V the
+    // reflection data is made from still has glslang's
+    static void PinReflectedAttributes(spirv_cross::Compiler& compiler, const std::map<std::string, int>& attributes)
+    {
+        for (auto variable : compiler.get_active_interface_variables())
+        {
+            const std::string& name = compiler.get_name(variable);
+            auto attribute = attributes.find(name);
+            if (attribute == attributes.end())
+            {
+                // HLSL passes a matrix as an attribute per column, the first at the matrix's location
+                attribute = attributes.find(name + "_0");
+            }
+            if (compiler.get_storage_class(variable) == spv::StorageClassInput && attribute != attributes.end())
+            {
+                compiler.set_decoration(variable, spv::DecorationLocation, (uint32_t)attribute->second);
+            }
+        }
+    }
+
+    // Adds the vertex input locations to a stage's reflection data as "attribute_locations",
+    // an object from each input's name to its location
+    static void ReflectAttributeLocations(const std::map<std::string, int>& attributes, std::string& json)
+    {
+        size_t end = json.rfind('}');
+        if (attributes.empty() || end == std::string::npos)
+        {
+            return;
+        }
+
+        std::string locations;
+        for (const auto& attribute : attributes)
+        {
+            locations += std::string(locations.empty() ? "" : ",") + "\n        \"" + attribute.first + "\" : " + std::to_string(attribute.second);
+        }
+
+        size_t last = json.find_last_not_of(" \t\r\n", end - 1);
+        bool empty = last == std::string::npos || json[last] == '{';
+        json.insert(last == std::string::npos ? end : last + 1, std::string(empty ? "" : ",") + "\n    \"attribute_locations\" : {" + locations + "\n    }");
+    }
+
+    // Adds the shared blocks a stage's uniforms were routed into to its reflection data,
+    // as "uniform_blocks" listing each block's binding, size and the members the stage uses
+    static void ReflectUniformBlocks(const Config& config, const std::map<std::string, std::string>& routed, std::string& json)
+    {
+        size_t end = json.rfind('}');
+        if (routed.empty() || end == std::string::npos)
+        {
+            return;
+        }
+
+        std::string blocks;
+        for (const UniformBlock& block : config.uniformBlocks)
+        {
+            std::string members;
+            std::vector<unsigned> offsets;
+            unsigned size = uniformBlockLayout(block, offsets);
+            for (size_t i = 0; i < block.members.size(); i++)
+            {
+                const UniformBlockMember& member = block.members[i];
+                auto uniform = routed.find(member.name);
+                if (uniform != routed.end() && uniform->second == block.name)
+                {
+                    members += std::string(members.empty() ? "" : ",") + "\n                { \"name\" : \"" + member.name + "\", \"type\" : \"" +
+                        member.type + "\", \"offset\" : " + std::to_string(offsets[i]) + " }";
+                }
+            }
+            if (!members.empty())
+            {
+                blocks += std::string(blocks.empty() ? "" : ",") + "\n        {\n            \"name\" : \"" + block.name + "\",\n            \"binding\" : " +
+                    std::to_string(block.binding) + ",\n            \"size\" : " + std::to_string(size) + ",\n            \"members\" : [" + members + "\n            ]\n        }";
+            }
+        }
+
+        size_t last = json.find_last_not_of(" \t\r\n", end - 1);
+        bool empty = last == std::string::npos || json[last] == '{';
+        json.insert(last == std::string::npos ? end : last + 1, std::string(empty ? "" : ",") + "\n    \"uniform_blocks\" : [" + blocks + "\n    ]");
+    }
+
+    void CompileAndLinkShaderUnits(const Config& config,
+                                   Result& result,
+                                   std::vector<ShaderCompUnit> compUnits,
+                                   Target target,
+                                   const char* sourcefilename,
+                                   const char* filename,
+                                   RecordingIncluder& includer,
+                                   const char* defines,
+                                   std::vector<StageResult>& stageResults)
+    {
+        // keep track of what to free
+        std::list<glslang::TShader*> shaders;
+
+        // headers included by each stage, as a range of the includer's dependencies
+        std::map<EShLanguage, std::pair<size_t, size_t>> stageDependencies;
+
+        EShMessages messages = EShMsgDefault;
+
+        //
+        // Per-shader processing...
+        //
+        
+        bool linkFailed = false;
+        bool compileFailed = false;
+
+        GuardedIncluder guardedIncluder(includer);
+
+        glslang::TProgram& program = *new glslang::TProgram;
+        for (auto it = compUnits.cbegin(); it != compUnits.cend(); ++it) {
+            const auto& compUnit = *it;
+            glslang::TShader* shader = new glslang::TShader(compUnit.stage);
+            shader->setStringsWithLengthsAndNames(compUnit.text, NULL, compUnit.fileNameList, 1);
+            shader->setPreamble(defines);
+            shader->setAutoMapBindings(true);
+
+            shaders.push_back(shader);
+
+            const int defaultVersion = 100; // Options & EOptionDefaultDesktop ? 110 : 100;
+
+            shader->setEnvTarget(glslang::EShTargetSpv, glslang::EShTargetSpv_1_0);
+            
+            static TBuiltInResource defaultBuiltInResources = InitResources();
+            
+            size_t firstDependency = includer.mark();
+            guardedIncluder.beginTranslationUnit(defines, *compUnit.text);
+            if (!shader->parse(&defaultBuiltInResources, defaultVersion, EEsProfile, false, false, messages, guardedIncluder))
+            {
+                compileFailed = true;
+                result.errors += shader->getInfoLog();
+            }
+            stageDependencies[compUnit.stage] = std::make_pair(firstDependency, includer.mark());
+
+            program.addShader(shader);
+        }
+
+        //
+        // Program-level processing...
+        //
+
+        // Link
+        if (!program.link(messages))
+        {
+            linkFailed = true;
+            result.errors += program.getInfoLog();
+        }
+            
+        if (!program.mapIO())
+        {
+            linkFailed = true;
+        }
+        
+        // Dump SPIR-V
+        if (compileFailed || linkFailed)
+        {
+            result.success = false;
+            result.errors += "SPIR-V is not generated for failed compile or link\n";
+        }
+        else
+        {
+            for (int stage = 0; stage < EShLangCount; ++stage)
+            {
+                if (program.getIntermediate((EShLanguage)stage))
+                {
+                    std::vector<unsigned int> spirv;
+                    std::string warningsErrors;
+                    spv::SpvBuildLogger logger;
+                    glslang::GlslangToSpv(*program.getIntermediate((EShLanguage)stage), spirv, &logger);
+
+                    bool linked = true;
+                    for (const auto& module : config.modules)
+                    {
+                        linked = linked && LinkSpirV(spirv, module->spirv, result.errors);
+                    }
+                    if (!linked)
+                    {
+                        compileFailed = true;
+                        result.success = false;
+                        continue;
+                    }
+
+                    StageResult stageResult;
+                    stageResult.stage = (EShLanguage)stage;
+                    stageResult.spirv = spirv;
+
+                    auto range = stageDependencies[(EShLanguage)stage];
+                    stageResult.dependencies.assign(includer.dependencies().begin() + range.first, includer.dependencies().begin() + range.second);
+
+                    ShaderStage shaderStage = shLanguageToShaderStage((EShLanguage)stage);
+                    std::map<std::string, int> attributes = config.attributeLocations;
+                    Translator* translator = CreateTranslator(target, spirv, shaderStage, config.uniformBlocks);
+                    translator->setAttributeSizes(config.attributeSizes);
+
+                    try
+                    {
+                        // Each translation gets its own zeroed buffer so concurrent compiles
+                        // can't see each other's output and every byte of it is defined
+                        std::vector<char> outputBuffer(s_compilerOutputBufferSize);
+                        translator->outputCode(target, sourcefilename, filename, outputBuffer.data(), attributes);
+                        stageResult.output.assign(outputBuffer.data(), translator->outputLength(outputBuffer.data()));
+                        if (shaderStage == StageVertex && !config.attributeLocations.empty() && PlacesAttributes(target))
+                        {
+                            stageResult.attributes = attributes;
+                        }
+                    }
+                    catch (spirv_cross::CompilerError& error) {
+                        printf("Error compiling to %s: %s\n", target.string().c_str(), error.what());
+                        compileFailed = true;
+                        result.success = false;
+                        result.errors += error.what();
+                    }
+                    
+                    {
+                        spirv_cross::Parser spirv_parser(spirv);
+                        spirv_parser.parse();
+
+                        spirv_cross::CompilerReflection compiler(std::move(spirv_parser.get_parsed_ir()));
+                        compiler.set_format("json");
+                        PinReflectedAttributes(compiler, stageResult.attributes);
+                        
+                        stageResult.json = compiler.compile();
+                        ReflectAttributeLocations(stageResult.attributes, stageResult.json);
+                    }
+                    if (SpirVTranslator* spirvTranslator = dynamic_cast<SpirVTranslator*>(translator))
+                    {
+                        ReflectUniformBlocks(config, spirvTranslator->uniformBlocks(), stageResult.json);
+                    }
+
+                    stageResults.push_back(stageResult);
+                    
+                    delete translator;
+                }
+            }
+        }
+        
+        // Free everything up, program has to go before the shaders
+        // because it might have merged stuff from the shaders, and
+        // the stuff from the shaders has to have its destructors called
+        // before the pools holding the memory in the shaders is freed.
+        delete& program;
+        while (shaders.size() > 0)
+        {
+            delete shaders.back();
+            shaders.pop_back();
+        }
+    }
+
+    // Compiles the stages of the config selected by stageMask (bit i for config.stage[i])
+    void CompileAndLinkShaderFiles(const Config& config,
+                                   Result& result,
+                                   Target target,
+                                   RecordingIncluder& includer,
+                                   const char* defines,
+                                   unsigned stageMask,
+                                   std::vector<StageResult>& stageResults)
+    {
+        std::vector<ShaderCompUnit> compUnits;
+
+        char* sources[] = { nullptr, nullptr, nullptr, nullptr, nullptr };
+
+        for (int i = 0; i < config.stageCount; i++)
+        {
+            if (!(stageMask & (1u << i)))
+            {
+                continue;
+            }
+
+            sources[i] = (char*)config.source[i].c_str();
+            
+            const char* to;
+            EShLanguage lang = shaderStageToShLanguage(config.stage[i]);
+            
+            switch(config.stage[i])
+            {
+                case StageVertex:
+                    to = "vert";
+                    break;
+                case StageTessControl:
+                    to = "tesc";
+                    break;
+                case StageTessEvaluation:
+                    to = "tese";
+                    break;
+                case StageGeometry:
+                    to = "geom";
+                    break;
+                case StageFragment:
+                    to = "frag";
+                    break;
+                case StageCompute:
+                    to = "comp";
+                    break;
+                default:
+                    break;
+            }
+            
+            std::string name = (config.sourceName[i].length() > 0) ? config.sourceName[i] : std::string("source.") + to;
+                        
+            ShaderCompUnit compUnit(lang, name, sources+i);
+            compUnits.push_back(compUnit);
+        }
+    
+        result.success = true;
+        
+        CompileAndLinkShaderUnits(config,
+                                  result,
+                                  compUnits,
+                                  target,
+                                  config.sourceName[0].c_str(),
+                                  config.sourceName[0].c_str(),
+                                  includer,
+                                  defines,
+                                  stageResults);
+
+    }
+
+    // Variables a stage exchanges with its neighbours and the resources it binds,
+    // keyed by name with a structural signature of their type
+    struct StageInterface
+    {
+        std::map<std::string, std::string> inputs;
+        std::map<std::string, std::string> outputs;
+        std::map<std::string, std::pair<unsigned, unsigned>> resources; /* descriptor set and binding of resources decorated with one */
+        std::map<std::string, std::string> uniforms; /* loose uniforms, which have no binding until they are packed into the stage's uniform buffer */
+    };
+
+    static StageInterface ExtractInterface(const std::vector<unsigned>& spirv)
+    {
+        using namespace spv;
+
+        StageInterface stageInterface;
+        std::map<unsigned, std::string> names;
+        std::map<unsigned, std::string> types;
+        std::map<unsigned, unsigned> constants;
+        std::map<unsigned, unsigned> bindings;
+        std::map<unsigned, unsigned> sets;
+        std::set<unsigned> builtins;
+
+        auto type = [&types](unsigned id) {
+            auto it = types.find(id);
+            return it != types.end() ? it->second : std::string("?");
+        };
+
+        unsigned index = 5;
+        while (index < spirv.size())
+        {
+            unsigned wordCount = spirv[index] >> 16;
+            unsigned opcode = spirv[index] & 0xffff;
+            const unsigned* operands = &spirv[index + 1];
+            if (wordCount == 0 || index + wordCount > spirv.size())
+            {
+                break;
+            }
+
+            switch (opcode)
+            {
+            case OpName:
+                names[operands[0]] = (const char*)&operands[1];
+                break;
+            case OpDecorate:
+                if (operands[1] == DecorationBuiltIn) builtins.insert(operands[0]);
+                if (operands[1] == DecorationBinding) bindings[operands[0]] = operands[2];
+                if (operands[1] == DecorationDescriptorSet) sets[operands[0]] = operands[2];
+                break;
+            case OpConstant:
+                constants[operands[1]] = operands[2];
+                break;
+            case OpTypeVoid:
+            case OpTypeBool:
+            case OpTypeInt:
+            case OpTypeFloat:
+            case OpTypeSampler:
+            {
+                std::stringstream signature;
+                signature << "t" << opcode;
+                for (unsigned i = 1; i < wordCount - 1; i++) signature << "." << operands[i];
+                types[operands[0]] = signature.str();
+                break;
+            }
+            case OpTypeVector:
+            case OpTypeMatrix:
+                types[operands[0]] = "t" + std::to_string(opcode) + "." + std::to_string(operands[2]) + "(" + type(operands[1]) + ")";
+                break;
+            case OpTypeArray:
+                types[operands[0]] = "[" + std::to_string(constants[operands[2]]) + "]" + type(operands[1]);
+                break;
+            case OpTypeImage:
+            {
+                std::stringstream signature;
+                signature << "image(" << type(operands[1]) << ")";
+                for (unsigned i = 2; i < wordCount - 1; i++) signature << "." << operands[i];
+                types[operands[0]] = signature.str();
+                break;
+            }
+            case OpTypeSampledImage:
+                types[operands[0]] = "sampled(" + type(operands[1]) + ")";
+                break;
+            case OpTypeStruct:
+            {
+                std::string signature = "{";
+                for (unsigned i = 1; i < wordCount - 1; i++) signature += type(operands[i]) + ";";
+                types[operands[0]] = signature + "}";
+                break;
+            }
+            case OpTypePointer:
+                types[operands[0]] = type(operands[2]);
+                break;
+            case OpVariable:
+            {
+                unsigned id = operands[1];
+                StorageClass storage = (StorageClass)operands[2];
+                auto name = names.find(id);
+                if (name == names.end() || name->second.empty() || builtins.count(id))
+                {
+                    break;
+                }
+                if (storage == StorageClassInput) stageInterface.inputs[name->second] = type(operands[0]);
+                if (storage == StorageClassOutput) stageInterface.outputs[name->second] = type(operands[0]);
+                if ((storage == StorageClassUniform || storage == StorageClassUniformConstant) && bindings.count(id))
+                {
+                    stageInterface.resources[name->second] = std::make_pair(sets[id], bindings[id]);
+                }
+                else if (storage == StorageClassUniform || storage == StorageClassUniformConstant)
+                {
+                    stageInterface.uniforms[name->second] = type(operands[0]);
+                }
+                break;
+            }
+            default:
+                break;
+            }
+
+            index += wordCount;
+        }
+
+        return stageInterface;
+    }
+
+    // Checks that stages compiled separately could have been linked together: every
+    // input of a stage is written by the previous stage with the same type, no two
+    // resources ended up with the same binding, and a loose uniform declared by several
+    // stages has the same type in each. Each stage packs its loose uniforms into a
+    // buffer of its own, so their offsets don't have to agree.
+    static bool InterfacesCompatible(const std::vector<StageResult>& stageResults)
+    {
+        std::vector<StageInterface> interfaces;
+        for (const auto& stageResult : stageResults)
+        {
+            interfaces.push_back(ExtractInterface(stageResult.spirv));
+        }
+
+        std::map<std::pair<unsigned, unsigned>, std::string> boundResources;
+        std::map<std::string, std::string> uniforms;
+        for (size_t i = 0; i < interfaces.size(); i++)
+        {
+            if (i > 0)
+            {
+                for (const auto& input : interfaces[i].inputs)
+                {
+                    auto output = interfaces[i - 1].outputs.find(input.first);
+                    if (output == interfaces[i - 1].outputs.end() || output->second != input.second)
+                    {
+                        return false;
+                    }
+                }
+            }
+
+            for (const auto& resource : interfaces[i].resources)
+            {
+                auto bound = boundResources.insert(std::make_pair(resource.second, resource.first));
+                if (!bound.second && bound.first->second != resource.first)
+                {
+                    return false;
+                }
+            }
+
+            for (const auto& uniform : interfaces[i].uniforms)
+            {
+                auto declared = uniforms.insert(uniform);
+                if (!declared.second && declared.first->second != uniform.second)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Identifies one stage of a config, except for the contents of its included headers
+    static Hash128 HashStage(const Config& config, int index, const std::string& defines)
+    {
+        Hasher hasher;
+        hasher.update((uint64_t)config.target.lang);
+        hasher.update((uint64_t)config.target.version);
+        hasher.update((uint64_t)config.target.es);
+        hasher.update((uint64_t)config.target.system);
+        hasher.update((uint64_t)config.stage[index]);
+        hasher.update(config.source[index]);
+        hasher.update(config.sourceName[index]);
+        hasher.update(config.sourceName[0]);
+        hasher.update(defines);
+        hasher.update(config.includePath);
+        hasher.update((uint64_t)(config.includeCallback != nullptr));
+        hasher.update((uint64_t)(config.sharedIncludeCallback != nullptr));
+        for (const auto& module : config.modules)
+        {
+            hasher.update(module->hash);
+        }
+        hasher.update(HashAttributeLocations(config));
+        hasher.update(HashUniformBlocks(config));
+        return hasher.finish();
+    }
+
+    // Successfully compiled stages, reused when the same stage shows up again
+    // next to an edited one
+    static const size_t s_stageCacheCapacity = 256;
+    static std::mutex s_stageCacheMutex;
+    static LruCache<Hash128, StageResult> s_stageCache(s_stageCacheCapacity);
+
+    static bool FindCachedStage(const Hash128& key, glslang::TShader::Includer& includer, StageResult& stageResult)
+    {
+        {
+            std::lock_guard<std::mutex> lock(s_stageCacheMutex);
+            StageResult* cached = s_stageCache.find(key);
+            if (!cached)
+            {
+                return false;
+            }
+            stageResult = *cached;
+        }
+
+        if (!DependenciesUnchanged(stageResult.dependencies, includer))
+        {
+            std::lock_guard<std::mutex> lock(s_stageCacheMutex);
+            s_stageCache.erase(key);
+            return false;
+        }
+        return true;
+    }
+
+    static void StoreCachedStage(const Hash128& key, const StageResult& stageResult)
+    {
+        std::lock_guard<std::mutex> lock(s_stageCacheMutex);
+        s_stageCache.insert(key, stageResult);
+    }
+
+    // Compiles every stage of the config, reusing the previous output of stages whose
+    // source and includes are unchanged when the edited stages still fit their interface
+    static void CompilePipeline(const Config& config,
+                                Result& result,
+                                Target target,
+                                glslang::TShader::Includer& includer,
+                                RecordingIncluder& recordingIncluder,
+                                const std::string& defines,
+                                std::vector<StageResult>& stageResults)
+    {
+        unsigned allStages = (1u << config.stageCount) - 1;
+        Hash128 keys[2];
+        unsigned changedStages = allStages;
+        std::vector<StageResult> reusedStages;
+
+        if (config.reuseStages)
+        {
+            for (int i = 0; i < config.stageCount; i++)
+            {
+                keys[i] = HashStage(config, i, defines);
+
+                StageResult stageResult;
+                if (FindCachedStage(keys[i], includer, stageResult) && stageResult.stage == shaderStageToShLanguage(config.stage[i]))
+                {
+                    reusedStages.push_back(stageResult);
+                    changedStages &= ~(1u << i);
+                }
+            }
+        }
+
+        auto byStage = [](const StageResult& a, const StageResult& b) { return a.stage < b.stage; };
+
+        if (changedStages == 0)
+        {
+            result.success = true;
+            result.cached = true;
+            stageResults = reusedStages;
+            std::sort(stageResults.begin(), stageResults.end(), byStage);
+            return;
+        }
+
+        if (changedStages != allStages)
+        {
+            Result changedResult;
+            std::vector<StageResult> changedStageResults;
+            CompileAndLinkShaderFiles(config, changedResult, target, recordingIncluder, defines.c_str(), changedStages, changedStageResults);
+
+            std::vector<StageResult> combined = reusedStages;
+            combined.insert(combined.end(), changedStageResults.begin(), changedStageResults.end());
+            std::sort(combined.begin(), combined.end(), byStage);
+
+            // the unchanged stages compiled before, so errors can only come from the edited ones
+            if (!changedResult.success)
+            {
+                result.success = false;
+                result.errors += changedResult.errors;
+                return;
+            }
+
+            if (InterfacesCompatible(combined))
+            {
+                result.success = true;
+                result.errors += changedResult.errors;
+                stageResults = combined;
+                for (int i = 0; i < config.stageCount; i++)
+                {
+                    for (const auto& stageResult : changedStageResults)
+                    {
+                        if ((changedStages & (1u << i)) && stageResult.stage == shaderStageToShLanguage(config.stage[i]))
+                        {
+                            StoreCachedStage(keys[i], stageResult);
+                        }
+                    }
+                }
+                return;
+            }
+        }
+
+        CompileAndLinkShaderFiles(config, result, target, recordingIncluder, defines.c_str(), allStages, stageResults);
+
+        if (config.reuseStages && result.success)
+        {
+            for (int i = 0; i < config.stageCount; i++)
+            {
+                for (const auto& stageResult : stageResults)
+                {
+                    if (stageResult.stage == shaderStageToShLanguage(config.stage[i]))
+                    {
+                        StoreCachedStage(keys[i], stageResult);
+                    }
+                }
+            }
+        }
+    }
+
+    // Sets the default version of the target language and adds the macro that
+    // identifies it to the defines. Returns false for unsupported targets.
+    static bool ApplyTargetDefines(const Config& config, Target& target, std::string& defines)
+    {
+        int version = -1;
+
+        switch(config.target.lang)
+        {
+            case SpirV:
+            case SpirVCompact:
+                target.version = version > 0 ? version : 1;
+                defines += "#define SPIRV " + std::to_string(config.target.version) + "\n";
+                break;
+            case GLSL:
+                defines += "#define GLSL " + std::to_string(target.version) + "\n";
+                break;
+            case HLSL:
+                target.version = version > 0 ? version : 11;
+                defines += "#define HLSL " + std::to_string(target.version) + "\n";
+                break;
+            case Metal:
+                target.version = version > 0 ? version : 1;
+                defines += "#define METAL " + std::to_string(target.version) + "\n";
+                break;
+            case AGAL:
+                target.version = version > 0 ? version : 100;
+                target.es = true;
+                defines += "#define AGAL " + std::to_string(target.version) + "\n";
+                break;
+            case VarList:
+                target.version = version > 0 ? version : 1;
+                break;
+            case JavaScript:
+                return false;
+        }
+        return true;
+    }
+
+    // Every shader has to see the same layout of the shared uniform blocks
+    static bool CheckUniformBlocks(const Config& config, std::string& errors)
+    {
+        bool valid = true;
+        std::set<std::string> members;
+        std::map<unsigned, std::string> bindings;
+        for (const UniformBlock& block : config.uniformBlocks)
+        {
+            if (block.binding < 2)
+            {
+                errors += "Uniform block " + block.name + ": binding " + std::to_string(block.binding) + " is taken by the shader's own uniform buffer\n";
+                valid = false;
+            }
+            else if (!bindings.insert(std::make_pair(block.binding, block.name)).second)
+            {
+                errors += "Uniform block " + block.name + ": binding " + std::to_string(block.binding) + " is taken by " + bindings[block.binding] + "\n";
+                valid = false;
+            }
+            for (const UniformBlockMember& member : block.members)
+            {
+                if (uniformTypeSize(member.type) == 0)
+                {
+                    errors += "Uniform block " + block.name + ": " + member.name + " has type " + member.type + ", which can't be in a shared block\n";
+                    valid = false;
+                }
+                if (!members.insert(member.name).second)
+                {
+                    errors += "Uniform block " + block.name + ": " + member.name + " is declared more than once\n";
+                    valid = false;
+                }
+            }
+        }
+        return valid;
+    }
+
+    void Compile(const Config& config, Result& result)
+    {
+        glslang::TShader::Includer* includer = CreateIncluder(config);
+
+        if (config.prefetchIncludes)
+        {
+            ModuleIncluder* moduleIncluder = dynamic_cast<ModuleIncluder*>(includer);
+            if (KrafixIncluder* krafixIncluder = dynamic_cast<KrafixIncluder*>(moduleIncluder ? &moduleIncluder->base() : includer))
+            {
+                krafixIncluder->prefetch(std::vector<std::string>(config.source, config.source + config.stageCount));
+            }
+        }
+
+        Hash128 cacheKey;
+        if (config.cacheFailures)
+        {
+            cacheKey = HashConfig(config);
+            if (FindCachedFailure(cacheKey, *includer, result.errors))
+            {
+                result.success = false;
+                result.resultCount = 0;
+                result.cached = true;
+                delete includer;
+                return;
+            }
+        }
+
+        RecordingIncluder recordingIncluder(*includer);
+                    
+        glslang::InitializeProcess();
+
+        Target target = config.target;
+        std::string defines = config.defines;
+        if (!ApplyTargetDefines(config, target, defines))
+        {
+            result.success = false;
+            result.resultCount = 0;
+            result.errors = "JavaScript not supported";
+            delete includer;
+            return;
+        }
+        if (!CheckUniformBlocks(config, result.errors))
+        {
+            result.success = false;
+            result.resultCount = 0;
+            delete includer;
+            return;
+        }
+        
+        std::vector<StageResult> stageResults;
+        CompilePipeline(config,
+                        result,
+                        target,
+                        *includer,
+                        recordingIncluder,
+                        defines,
+                        stageResults);
+
+        result.resultCount = (uint8_t)stageResults.size();
+        for (size_t i = 0; i < stageResults.size() && i < 2; i++)
+        {
+            result.stage[i] = shLanguageToShaderStage(stageResults[i].stage);
+            result.output[i] = stageResults[i].output;
+            result.json[i] = stageResults[i].json;
+            result.spirv[i] = stageResults[i].spirv;
+            result.outputHash[i] = Hasher().update((uint64_t)stageResults[i].stage).update(result.output[i]).update(result.json[i]).finish();
+            result.unchanged[i] = result.success && result.outputHash[i] == config.previousOutputHash[i];
+            if (stageResults[i].stage == EShLangVertex)
+            {
+                result.attributeLocations = stageResults[i].attributes;
+            }
+        }
+
+        //glslang::FinalizeProcess();
+
+        if (config.cacheFailures && !result.success)
+        {
+            StoreCachedFailure(cacheKey, result.errors, recordingIncluder.dependencies());
+        }
+
+        if (includer) delete includer;
+    }
+
+    bool Translate(const Target& target, ShaderStage stage, const void* data, size_t length, std::string& output, std::string& errors)
+    {
+        const uint8_t* bytes = (const uint8_t*)data;
+        std::vector<unsigned> spirv;
+        if (IsCompactSpirV(bytes, length))
+        {
+            if (!DecodeCompactSpirV(bytes, length, spirv))
+            {
+                errors += "Invalid compact SPIR-V\n";
+                return false;
+            }
+        }
+        else
+        {
+            if (length < 5 * sizeof(unsigned) || length % sizeof(unsigned) != 0)
+            {
+                errors += "Invalid SPIR-V\n";
+                return false;
+            }
+            spirv.resize(length / sizeof(unsigned));
+            memcpy(spirv.data(), bytes, length);
+        }
+
+        Config config;
+        config.target = target;
+        Target resolved = target;
+        std::string defines;
+        std::unique_ptr<Translator> translator(ApplyTargetDefines(config, resolved, defines) ? CreateTranslator(resolved, spirv, stage) : nullptr);
+        if (!translator)
+        {
+            errors += "Can not translate to " + resolved.string() + "\n";
+            return false;
+        }
+
+        try
+        {
+            std::vector<char> outputBuffer(s_compilerOutputBufferSize);
+            std::map<std::string, int> attributes;
+            translator->outputCode(resolved, "", "", outputBuffer.data(), attributes);
+            output.assign(outputBuffer.data(), translator->outputLength(outputBuffer.data()));
+        }
+        catch (spirv_cross::CompilerError& error)
+        {
+            errors += error.what();
+            return false;
+        }
+        return true;
+    }
+
+    // Copies a header with the body of every function definition replaced by one that
+    // only returns, keeping its line breaks so that line numbers still match the header.
+    // Declarations, structs, uniforms and preprocessor directives are kept as they are.
+    static std::string StubFunctionBodies(const char* text, size_t length)
+    {
+        std::string stub;
+        stub.reserve(length);
+
+        const char* end = text + length;
+        const char* p = text;
+        std::vector<std::string> declaration; // tokens of the current top-level declaration before its parameters
+        bool parameters = false;
+        int parentheses = 0;
+        char last = 0;
+        bool lineStart = true;
+
+        // the end of a comment starting at p, or p if there is none
+        auto skipComment = [&](const char* p) -> const char*
+        {
+            if (p + 1 < end && p[0] == '/' && p[1] == '/')
+            {
+                const char* newline = (const char*)memchr(p, '\n', end - p);
+                return newline ? newline : end;
+            }
+            if (p + 1 < end && p[0] == '/' && p[1] == '*')
+            {
+                const char* q = p + 2;
+                while (q + 1 < end && !(q[0] == '*' && q[1] == '/')) q++;
+                return std::min(q + 2, end);
+            }
+            return p;
+        };
+
+        while (p < end)
+        {
+            char c = *p;
+            const char* comment = skipComment(p);
+            if (comment != p)
+            {
+                stub.append(p, comment - p);
+                p = comment;
+                continue;
+            }
+            if (c == '\n')
+            {
+                lineStart = true;
+            }
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+            {
+                stub += c;
+                p++;
+                continue;
+            }
+
+            if (c == '#' && lineStart)
+            {
+                const char* q = p;
+                while (q < end && *q != '\n')
+                {
+                    q += (*q == '\\' && q + 1 < end) ? 2 : 1;
+                }
+                stub.append(p, q - p);
+                p = q;
+                declaration.clear();
+                parameters = false;
+                last = 0;
+                continue;
+            }
+            lineStart = false;
+
+            if (isalnum((unsigned char)c) || c == '_')
+            {
+                const char* start = p;
+                while (p < end && (isalnum((unsigned char)*p) || *p == '_' || *p == '.')) p++;
+                if (!parameters)
+                {
+                    declaration.push_back(std::string(start, p - start));
+                }
+                stub.append(start, p - start);
+                last = 'a';
+                continue;
+            }
+
+            if (c == '{' && last == ')' && parentheses == 0 && declaration.size() >= 2)
+            {
+                int depth = 1;
+                size_t lines = 0;
+                const char* q = p + 1;
+                while (q < end && depth > 0)
+                {
+                    const char* afterComment = skipComment(q);
+                    if (afterComment != q)
+                    {
+                        lines += std::count(q, afterComment, '\n');
+                        q = afterComment;
+                        continue;
+                    }
+                    if (*q == '{') depth++;
+                    else if (*q == '}') depth--;
+                    else if (*q == '\n') lines++;
+                    q++;
+                }
+
+                std::string returnType;
+                for (size_t i = 0; i + 1 < declaration.size(); i++)
+                {
+                    returnType += (i > 0 ? " " : "") + declaration[i];
+                }
+                stub += returnType == "void" ? "{" : "{ " + returnType + " shadercross_stub; return shadercross_stub;";
+                stub.append(lines, '\n');
+                stub += lines > 0 ? "}" : " }";
+
+                p = q;
+                declaration.clear();
+                parameters = false;
+                last = '}';
+                continue;
+            }
+
+            switch (c)
+            {
+            case '(':
+                parentheses++;
+                parameters = true;
+                break;
+            case ')':
+                parentheses--;
+                break;
+            case '[':
+            case ']':
+                if (!parameters)
+                {
+                    declaration.push_back(std::string(1, c));
+                }
+                break;
+            case ';':
+            case '{':
+            case '}':
+                declaration.clear();
+                parameters = false;
+                break;
+            default:
+                break;
+            }
+            stub += c;
+            last = c;
+            p++;
+        }
+        return stub;
+    }
+
+    static void FindIdentifierUses(const char* text, size_t length, std::set<std::string>& names);
+
+    // Directives that fail the compile of a shader which defines a macro the header or the
+    // headers it includes use before including it, as the module's functions were compiled
+    // without it. Macros the module was compiled with, the header's own and the reserved
+    // ones are left out.
+    static std::string MacroGuards(const std::string& headerName, const char* text, size_t length, const std::string& preamble, glslang::TShader::Includer& includer)
+    {
+        std::set<std::string> used;
+        DependencyScan scan;
+        DependencyScanner scanner(includer, scan);
+        scanner.scan(preamble.data(), preamble.size(), "", 0);
+        scanner.setTextVisitor([&used](const char* text, size_t length) { FindIdentifierUses(text, length, used); });
+        scanner.scan(text, length, headerName, 0);
+
+        static const std::set<std::string> directives = {
+            "define", "defined", "elif", "else", "endif", "error", "extension", "if", "ifdef", "ifndef", "include", "line", "pragma", "undef", "version"
+        };
+
+        std::string guards;
+        for (const std::string& name : used)
+        {
+            if (scan.defines.count(name) || directives.count(name) || name.compare(0, 3, "GL_") == 0 || name.compare(0, 2, "__") == 0)
+            {
+                continue;
+            }
+            guards += "#ifdef " + name + "\n#error " + name + " is defined before including the precompiled module " + headerName + ", which was compiled without it\n#endif\n";
+        }
+        return guards;
+    }
+
+    bool CompileModule(const Config& config, const std::string& headerName, ShaderModule& module, std::string& errors)
+    {
+        Config moduleConfig = config;
+        moduleConfig.modules.clear();
+        std::unique_ptr<glslang::TShader::Includer> includer(CreateIncluder(moduleConfig));
+
+        Target target = config.target;
+        std::string defines = config.defines;
+        if (!ApplyTargetDefines(config, target, defines))
+        {
+            errors += "Can not compile modules for " + target.string() + "\n";
+            return false;
+        }
+
+        glslang::TShader::Includer::IncludeResult* header = includer->includeLocal(headerName.c_str(), config.sourceName[0].c_str(), 1);
+        if (!header)
+        {
+            errors += "Header " + headerName + " not found\n";
+            return false;
+        }
+        std::string source = config.source[0] + "\n" + std::string(header->headerData, header->headerLength) + "\nvoid main() {}\n";
+        module.headerName = headerName;
+        // the guards go last so that line numbers in the stub still match the header
+        module.stub = StubFunctionBodies(header->headerData, header->headerLength) + "\n" +
+            MacroGuards(headerName, header->headerData, header->headerLength, defines + "\n" + config.source[0], *includer);
+        includer->releaseInclude(header);
+
+        glslang::InitializeProcess();
+        static const TBuiltInResource resources = InitResources();
+
+        // functions nothing calls have to be kept, they are what the module is for
+        EShMessages messages = (EShMessages)(EShMsgDefault | EShMsgKeepUncalled);
+
+        glslang::TShader shader(shaderStageToShLanguage(config.stage[0]));
+        const char* text = source.c_str();
+        const char* name = headerName.c_str();
+        shader.setStringsWithLengthsAndNames(&text, NULL, &name, 1);
+        shader.setPreamble(defines.c_str());
+        shader.setAutoMapBindings(true);
+        shader.setEnvTarget(glslang::EShTargetSpv, glslang::EShTargetSpv_1_0);
+        if (!shader.parse(&resources, 100, EEsProfile, false, false, messages, *includer))
+        {
+            errors += shader.getInfoLog();
+            return false;
+        }
+
+        glslang::TProgram program;
+        program.addShader(&shader);
+        if (!program.link(messages) || !program.mapIO())
+        {
+            errors += program.getInfoLog();
+            return false;
+        }
+
+        module.spirv.clear();
+        spv::SpvBuildLogger logger;
+        glslang::GlslangToSpv(*program.getIntermediate(shaderStageToShLanguage(config.stage[0])), module.spirv, &logger);
+        module.hash = Hasher().update(HashBytes(module.spirv.data(), module.spirv.size() * sizeof(unsigned))).update(module.stub).finish();
+        return true;
+    }
+
+    static const size_t s_maxVariants = 4096;
+
+    // Adds every identifier used in a text to names, except in #pragma variant
+    // declarations, which name a macro without using it
+    static void FindIdentifierUses(const char* text, size_t length, std::set<std::string>& names)
+    {
+        static const char pragma[] = "pragma";
+        static const char variant[] = "variant";
+        const char* end = text + length;
+        const char* p = text;
+        bool lineStart = true;
+        while (p < end)
+        {
+            char c = *p;
+            if (c == '\n')
+            {
+                lineStart = true;
+                p++;
+                continue;
+            }
+            if (c == ' ' || c == '\t' || c == '\r')
+            {
+                p++;
+                continue;
+            }
+
+            if (c == '#' && lineStart)
+            {
+                const char* q = p + 1;
+                while (q < end && (*q == ' ' || *q == '\t')) q++;
+                if (end - q > 6 && std::equal(pragma, pragma + 6, q))
+                {
+                    q += 6;
+                    while (q < end && (*q == ' ' || *q == '\t')) q++;
+                    if (end - q >= 7 && std::equal(variant, variant + 7, q) && (end - q == 7 || !(isalnum((unsigned char)q[7]) || q[7] == '_')))
+                    {
+                        const char* newline = (const char*)memchr(q, '\n', end - q);
+                        p = newline ? newline : end;
+                        continue;
+                    }
+                }
+            }
+            lineStart = false;
+
+            if (isalpha((unsigned char)c) || c == '_')
+            {
+                const char* start = p;
+                while (p < end && (isalnum((unsigned char)*p) || *p == '_')) p++;
+                names.insert(std::string(start, p - start));
+            }
+            else if (isdigit((unsigned char)c))
+            {
+                // skip suffixes and exponents so that they aren't taken for identifiers
+                while (p < end && (isalnum((unsigned char)*p) || *p == '_' || *p == '.')) p++;
+            }
+            else
+            {
+                p++;
+            }
+        }
+    }
+
+    // Runs body(i) for every i below count on up to threadCount threads
+    static void ParallelFor(size_t count, unsigned threadCount, const std::function<void(size_t)>& body)
+    {
+        std::atomic<size_t> next(0);
+        auto worker = [&]()
+        {
+            for (size_t i = next++; i < count; i = next++)
+            {
+                body(i);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < threadCount && i < count; i++)
+        {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    // Hashes what the compiler sees of each stage after preprocessing, so variants
+    // whose defines make no difference can share a compile. Stages that fail to
+    // preprocess hash to something unique to the preamble, so their errors get reported.
+    static Hash128 HashPreprocessed(const Config& config, const std::string& preamble)
+    {
+        static const TBuiltInResource resources = InitResources();
+        glslang::TShader::Includer* includer = CreateIncluder(config);
+
+        Hasher hasher;
+        for (int i = 0; i < config.stageCount; i++)
+        {
+            glslang::TShader shader(shaderStageToShLanguage(config.stage[i]));
+            const char* text = config.source[i].c_str();
+            const char* name = config.sourceName[i].c_str();
+            shader.setStringsWithLengthsAndNames(&text, NULL, &name, 1);
+            shader.setPreamble(preamble.c_str());
+            shader.setEnvTarget(glslang::EShTargetSpv, glslang::EShTargetSpv_1_0);
+
+            std::string output;
+            if (shader.preprocess(&resources, 100, EEsProfile, false, false, EShMsgDefault, &output, *includer))
+            {
+                hasher.update(output);
+            }
+            else
+            {
+                hasher.update("failed");
+                hasher.update(preamble);
+            }
+        }
+
+        delete includer;
+        return hasher.finish();
+    }
+
+    void CompileVariants(const Config& config, VariantSet& set, unsigned threadCount)
+    {
+        set = VariantSet();
+        set.axes = config.variantAxes;
+
+        std::set<std::string> referenced;
+        DependencyScan scan;
+        ScanDependencies(config, scan, [&](const char* text, size_t length)
+        {
+            FindIdentifierUses(text, length, referenced);
+        });
+        for (const VariantAxis& axis : scan.variantAxes)
+        {
+            auto sameName = [&](const VariantAxis& other) { return other.name == axis.name; };
+            if (std::find_if(set.axes.begin(), set.axes.end(), sameName) == set.axes.end())
+            {
+                set.axes.push_back(axis);
+            }
+        }
+
+        size_t count = 1;
+        for (VariantAxis& axis : set.axes)
+        {
+            if (axis.values.empty())
+            {
+                axis.values = { "", "1" };
+            }
+            count *= axis.values.size();
+            if (count > s_maxVariants)
+            {
+                set.errors = "more than " + std::to_string(s_maxVariants) + " variants";
+                return;
+            }
+
+            // a macro that is never tested or expanded can't change the output
+            set.axisUsed.push_back(scan.conditions.count(axis.name) > 0 || referenced.count(axis.name) > 0);
+        }
+
+        set.variants.resize(count);
+        std::vector<size_t> canonicalVariants;
+        for (size_t index = 0; index < count; index++)
+        {
+            Variant& variant = set.variants[index];
+            variant.values.resize(set.axes.size());
+            size_t remainder = index;
+            size_t canonical = 0;
+            size_t stride = 1;
+            for (size_t axis = set.axes.size(); axis-- > 0; )
+            {
+                const VariantAxis& variantAxis = set.axes[axis];
+                size_t value = remainder % variantAxis.values.size();
+                variant.values[axis] = variantAxis.values[value];
+                remainder /= variantAxis.values.size();
+
+                // unused axes take their first value in the canonical variant
+                if (set.axisUsed[axis]) canonical += value * stride;
+                stride *= variantAxis.values.size();
+            }
+            for (size_t axis = 0; axis < set.axes.size(); axis++)
+            {
+                if (!variant.values[axis].empty())
+                {
+                    variant.defines += "#define " + set.axes[axis].name + " " + variant.values[axis] + "\n";
+                }
+            }
+
+            variant.canonical = canonical;
+            if (canonical == index)
+            {
+                canonicalVariants.push_back(index);
+            }
+        }
+
+        Target target = config.target;
+        std::string targetDefines;
+        if (!ApplyTargetDefines(config, target, targetDefines))
+        {
+            set.errors = "JavaScript not supported";
+            set.variants.clear();
+            return;
+        }
+
+        if (threadCount == 0)
+        {
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        glslang::InitializeProcess();
+
+        std::vector<Hash128> preprocessed(canonicalVariants.size());
+        ParallelFor(canonicalVariants.size(), threadCount, [&](size_t i)
+        {
+            preprocessed[i] = HashPreprocessed(config, config.defines + set.variants[canonicalVariants[i]].defines + targetDefines);
+        });
+
+        // the first variant of each group with the same preprocessed sources gets compiled
+        std::map<Hash128, size_t> groups;
+        std::vector<size_t> compileIndex(count);
+        std::vector<size_t> representatives;
+        for (size_t i = 0; i < canonicalVariants.size(); i++)
+        {
+            auto group = groups.insert(std::make_pair(preprocessed[i], representatives.size()));
+            if (group.second)
+            {
+                representatives.push_back(canonicalVariants[i]);
+            }
+            compileIndex[canonicalVariants[i]] = group.first->second;
+        }
+        set.compiles = representatives.size();
+
+        std::vector<Result> compiled(representatives.size());
+        ParallelFor(representatives.size(), threadCount, [&](size_t i)
+        {
+            Config variantConfig = config;
+            variantConfig.defines += set.variants[representatives[i]].defines;
+            Compile(variantConfig, compiled[i]);
+        });
+
+        // different sources can still compile to the same output
+        std::map<Hash128, size_t> distinct;
+        std::vector<size_t> resultIndex(compiled.size());
+        for (size_t i = 0; i < compiled.size(); i++)
+        {
+            Hasher hasher;
+            hasher.update((uint64_t)compiled[i].success);
+            hasher.update((uint64_t)compiled[i].resultCount);
+            for (int stage = 0; stage < compiled[i].resultCount && stage < 2; stage++)
+            {
+                hasher.update(compiled[i].outputHash[stage]);
+            }
+            hasher.update(compiled[i].errors);
+
+            auto result = distinct.insert(std::make_pair(hasher.finish(), set.results.size()));
+            if (result.second)
+            {
+                set.results.push_back(std::move(compiled[i]));
+            }
+            resultIndex[i] = result.first->second;
+        }
+
+        for (size_t index = 0; index < count; index++)
+        {
+            set.variants[index].result = resultIndex[compileIndex[set.variants[index].canonical]];
+        }
+    }
+
+    // Reads an integer the way the preprocessor does, e.g. 4, 0x10 or 010
+    static bool ParseAxisValue(const std::string& text, long long& value)
+    {
+        if (text.empty() || !isdigit((unsigned char)text[0]))
+        {
+            return false;
+        }
+        char* end = nullptr;
+        value = strtoll(text.c_str(), &end, 0);
+        while (*end == 'u' || *end == 'U' || *end == 'l' || *end == 'L') end++;
+        return *end == 0;
+    }
+
+    // Writes the #if conditions of an ubershader's axes as GLSL. The preprocessor only
+    // has ints, so operands are converted wherever GLSL wants a bool and the reverse.
+    class AxisCondition
+    {
+    public:
+        AxisCondition(const std::map<std::string, const UbershaderControl*>& controls) : m_controls(controls)
+        {
+
+        }
+
+        // Sets glsl to a bool expression, or returns false with error set
+        bool write(const std::string& condition, std::string& glsl, std::string& error)
+        {
+            m_tokens.clear();
+            m_next = 0;
+            m_error.clear();
+            tokenize(condition);
+
+            Operand operand = ternary();
+            if (m_error.empty() && m_next < m_tokens.size())
+            {
+                fail("unexpected " + m_tokens[m_next]);
+            }
+            if (!m_error.empty())
+            {
+                error = m_error;
+                return false;
+            }
+            glsl = asBool(operand);
+            return true;
+        }
+
+    private:
+        struct Operand
+        {
+            std::string text;
+            bool boolean;
+        };
+
+        void tokenize(const std::string& condition)
+        {
+            static const char* const pairs[] = { "&&", "||", "==", "!=", "<=", ">=", "<<", ">>" };
+            const char* p = condition.c_str();
+            const char* end = p + condition.size();
+            while (p < end)
+            {
+                if (isspace((unsigned char)*p) || *p == '\\')
+                {
+                    p++;
+                }
+                else if (p + 1 < end && p[0] == '/' && p[1] == '/')
+                {
+                    break;
+                }
+                else if (p + 1 < end && p[0] == '/' && p[1] == '*')
+                {
+                    p += 2;
+                    while (p < end && !(*p == '*' && p + 1 < end && p[1] == '/')) p++;
+                    p = std::min(p + 2, end);
+                }
+                else if (isalnum((unsigned char)*p) || *p == '_')
+                {
+                    const char* start = p;
+                    while (p < end && (isalnum((unsigned char)*p) || *p == '_')) p++;
+                    m_tokens.push_back(std::string(start, p - start));
+                }
+                else
+                {
+                    size_t length = 1;
+                    for (const char* pair : pairs)
+                    {
+                        if (p + 1 < end && p[0] == pair[0] && p[1] == pair[1]) length = 2;
+                    }
+                    m_tokens.push_back(std::string(p, length));
+                    p += length;
+                }
+            }
+        }
+
+        static std::string asBool(const Operand& operand)
+        {
+            return operand.boolean ? operand.text : "(" + operand.text + " != 0)";
+        }
+
+        static std::string asInt(const Operand& operand)
+        {
+            return operand.boolean ? "int(" + operand.text + ")" : operand.text;
+        }
+
+        // Binary operators from the loosest binding, -1 for anything else
+        static int precedence(const std::string& token)
+        {
+            static const char* const levels[][4] =
+            {
+                { "||" }, { "&&" }, { "|" }, { "^" }, { "&" }, { "==", "!=" },
+                { "<", ">", "<=", ">=" }, { "<<", ">>" }, { "+", "-" }, { "*", "/", "%" }
+            };
+            for (int level = 0; level < s_levels; level++)
+            {
+                for (const char* op : levels[level])
+                {
+                    if (op && token == op) return level;
+                }
+            }
+            return -1;
+        }
+
+        bool accept(const char* token)
+        {
+            if (m_next < m_tokens.size() && m_tokens[m_next] == token)
+            {
+                m_next++;
+                return true;
+            }
+            return false;
+        }
+
+        Operand fail(const std::string& message)
+        {
+            if (m_error.empty())
+            {
+                m_error = message;
+            }
+            return { "0", false };
+        }
+
+        Operand ternary()
+        {
+            Operand condition = binary(0);
+            if (!accept("?"))
+            {
+                return condition;
+            }
+            Operand first = ternary();
+            if (!accept(":"))
+            {
+                return fail("expected : after ?");
+            }
+            Operand second = ternary();
+            return { "(" + asBool(condition) + " ? " + asInt(first) + " : " + asInt(second) + ")", false };
+        }
+
+        Operand binary(int level)
+        {
+            if (level == s_levels)
+            {
+                return unary();
+            }
+            Operand left = binary(level + 1);
+            while (m_error.empty() && m_next < m_tokens.size() && precedence(m_tokens[m_next]) == level)
+            {
+                std::string op = m_tokens[m_next++];
+                Operand right = binary(level + 1);
+                if (level <= 1)
+                {
+                    left = { "(" + asBool(left) + " " + op + " " + asBool(right) + ")", true };
+                }
+                else
+                {
+                    // equality and relational operators are the rest that give a bool
+                    left = { "(" + asInt(left) + " " + op + " " + asInt(right) + ")", level == 5 || level == 6 };
+                }
+            }
+            return left;
+        }
+
+        Operand unary()
+        {
+            if (accept("!"))
+            {
+                return { "!" + asBool(unary()), true };
+            }
+            for (const char* op : { "-", "+", "~" })
+            {
+                if (accept(op))
+                {
+                    return { "(" + std::string(op) + asInt(unary()) + ")", false };
+                }
+            }
+            return primary();
+        }
+
+        Operand primary()
+        {
+            if (m_next >= m_tokens.size())
+            {
+                return fail("expression ends early");
+            }
+            std::string token = m_tokens[m_next++];
+            if (token == "(")
+            {
+                Operand operand = ternary();
+                return accept(")") ? operand : fail("expected )");
+            }
+            if (token == "defined")
+            {
+                bool parenthesized = accept("(");
+                std::string name = m_next < m_tokens.size() ? m_tokens[m_next++] : "";
+                if (parenthesized && !accept(")"))
+                {
+                    return fail("expected ) after defined(" + name);
+                }
+                auto control = m_controls.find(name);
+                if (control == m_controls.end())
+                {
+                    return fail("tests " + name + ", which is not an ubershader axis");
+                }
+                // axes without an empty value are always defined
+                const std::vector<std::string>& values = control->second->values;
+                if (std::find(values.begin(), values.end(), "") == values.end())
+                {
+                    return { "true", true };
+                }
+                return { "(" + control->second->uniform + " != 0)", true };
+            }
+            if (isdigit((unsigned char)token[0]))
+            {
+                long long value;
+                return ParseAxisValue(token, value) ? Operand{ std::to_string(value), false } : fail("invalid number " + token);
+            }
+            auto control = m_controls.find(token);
+            if (control != m_controls.end())
+            {
+                return { control->second->uniform, false };
+            }
+            if (isalpha((unsigned char)token[0]) || token[0] == '_')
+            {
+                return fail("tests " + token + ", which is not an ubershader axis");
+            }
+            return fail("unexpected " + token);
+        }
+
+        static const int s_levels = 10;
+
+        const std::map<std::string, const UbershaderControl*>& m_controls;
+        std::vector<std::string> m_tokens;
+        size_t m_next = 0;
+        std::string m_error;
+    };
+
+    // Rewrites a source for CompileUbershader without moving any of its lines, so
+    // that errors still point at the right place
+    static bool RewriteUbershaderSource(const std::string& source, const std::string& sourceName,
+                                        const std::map<std::string, const UbershaderControl*>& controls,
+                                        std::string& output, std::string& errors)
+    {
+        struct Group
+        {
+            bool converted; /* the group tests axes and is being turned into code */
+            bool declarations; /* the #if is outside of any function */
+            std::vector<bool> braces; /* braces open at the #if */
+            std::vector<bool> firstBranchBraces; /* braces open at the end of the first branch of a group that isn't converted */
+            bool firstBranch;
+        };
+
+        bool success = true;
+        auto error = [&](size_t line, const std::string& message)
+        {
+            errors += (sourceName.empty() ? std::string("source") : sourceName) + ":" + std::to_string(line) + ": " + message + "\n";
+            success = false;
+        };
+
+        // copies text with the axes replaced by their uniforms
+        auto replaceAxes = [&](const char* p, const char* end)
+        {
+            while (p < end)
+            {
+                const char* start = p;
+                if (isalpha((unsigned char)*p) || *p == '_')
+                {
+                    while (p < end && (isalnum((unsigned char)*p) || *p == '_')) p++;
+                    auto control = controls.find(std::string(start, p - start));
+                    if (control != controls.end())
+                    {
+                        output += control->second->uniform;
+                        continue;
+                    }
+                }
+                else if (isdigit((unsigned char)*p))
+                {
+                    while (p < end && (isalnum((unsigned char)*p) || *p == '_' || *p == '.')) p++;
+                }
+                else
+                {
+                    p++;
+                }
+                output.append(start, p - start);
+            }
+        };
+
+        AxisCondition condition(controls);
+        std::vector<Group> groups;
+        std::vector<bool> braces; /* whether each open brace is in a function */
+        bool comment = false;
+        char last = 0;
+        size_t line = 1;
+        output.clear();
+        output.reserve(source.size() + source.size() / 8);
+
+        const char* p = source.data();
+        const char* end = p + source.size();
+        while (p < end)
+        {
+            const char* lineStart = p;
+            const char* first = p;
+            while (first < end && (*first == ' ' || *first == '\t' || *first == '\r')) first++;
+
+            if (!comment && first < end && *first == '#')
+            {
+                std::vector<std::string> tokens;
+                const char* next = DirectiveTokens(first + 1, end, tokens);
+                const char* body = first + 1;
+                while (body < next && (*body == ' ' || *body == '\t')) body++;
+                while (body < next && (isalnum((unsigned char)*body) || *body == '_')) body++;
+                std::string directive = tokens.empty() ? std::string() : tokens[0];
+
+                bool testsAxis = false;
+                for (size_t i = 1; i < tokens.size(); i++)
+                {
+                    testsAxis = testsAxis || controls.count(tokens[i]) > 0;
+                }
+
+                bool replaced = true;
+                std::string replacement;
+                auto branch = [&](const std::string& text) -> std::string
+                {
+                    std::string glsl, message;
+                    if (!condition.write(text, glsl, message))
+                    {
+                        error(line, "#" + directive + " " + message);
+                    }
+                    return glsl;
+                };
+                bool inFunction = !braces.empty() && braces.back();
+                // the contents of a converted group are compiled into every variant, so a
+                // directive there would no longer depend on the axis
+                bool inConverted = std::any_of(groups.begin(), groups.end(), [](const Group& group) { return group.converted; });
+
+                if (directive == "if" || directive == "ifdef" || directive == "ifndef")
+                {
+                    Group group = { testsAxis, !inFunction, braces, std::vector<bool>(), true };
+                    if (inConverted && !testsAxis)
+                    {
+                        error(line, "#" + directive + " inside a group on an ubershader axis has to test an axis too");
+                    }
+                    if (testsAxis)
+                    {
+                        std::string glsl = branch(directive == "if" ? std::string(body, next - body) : (directive == "ifndef" ? "!" : "") + std::string("defined ") + tokens[1]);
+                        replacement = group.declarations ? "" : "if (" + glsl + ") {";
+                    }
+                    else
+                    {
+                        replaced = false;
+                    }
+                    groups.push_back(group);
+                }
+                else if ((directive == "elif" || directive == "else") && !groups.empty())
+                {
+                    Group& group = groups.back();
+                    if (group.converted)
+                    {
+                        if (group.declarations)
+                        {
+                            error(line, "#" + directive + " on an ubershader axis outside of a function, only an #if guarding declarations can be kept");
+                        }
+                        else if (braces.size() != group.braces.size())
+                        {
+                            error(line, "the branch before doesn't close the braces it opens");
+                        }
+                        replacement = directive == "elif" ? "} else if (" + branch(std::string(body, next - body)) + ") {" : "} else {";
+                    }
+                    else
+                    {
+                        if (testsAxis)
+                        {
+                            error(line, "#elif tests an ubershader axis in a group whose #if doesn't");
+                        }
+                        if (group.firstBranch)
+                        {
+                            group.firstBranchBraces = braces;
+                            group.firstBranch = false;
+                        }
+                        replaced = false;
+                    }
+                    braces = group.braces;
+                }
+                else if (directive == "endif" && !groups.empty())
+                {
+                    Group group = groups.back();
+                    groups.pop_back();
+                    if (group.converted)
+                    {
+                        if (braces.size() != group.braces.size())
+                        {
+                            error(line, "the branch before doesn't close the braces it opens");
+                        }
+                        replacement = group.declarations ? "" : "}";
+                        braces = group.braces;
+                    }
+                    else
+                    {
+                        // other branches are assumed to leave the same braces open as the first
+                        if (!group.firstBranch)
+                        {
+                            braces = group.firstBranchBraces;
+                        }
+                        replaced = false;
+                    }
+                }
+                else if ((directive == "define" || directive == "undef") && tokens.size() >= 2 && controls.count(tokens[1]))
+                {
+                    error(line, "#" + directive + " of ubershader axis " + tokens[1]);
+                    replaced = false;
+                }
+                else
+                {
+                    if (inConverted && !directive.empty())
+                    {
+                        error(line, "#" + directive + " inside a group on an ubershader axis would apply to every variant");
+                    }
+                    replaced = false;
+                }
+
+                if (replaced)
+                {
+                    output.append(lineStart, first - lineStart);
+                    output += replacement;
+                    output.append(std::count(first, next, '\n'), '\n');
+                }
+                else if (directive == "define" && testsAxis)
+                {
+                    replaceAxes(lineStart, next);
+                }
+                else
+                {
+                    output.append(lineStart, next - lineStart);
+                }
+                line += std::count(first, next, '\n');
+                p = next;
+                continue;
+            }
+
+            const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+            lineEnd = lineEnd ? lineEnd + 1 : end;
+            while (p < lineEnd)
+            {
+                const char* start = p;
+                if (comment)
+                {
+                    while (p < lineEnd && !(*p == '*' && p + 1 < lineEnd && p[1] == '/')) p++;
+                    if (p < lineEnd)
+                    {
+                        p += 2;
+                        comment = false;
+                    }
+                    output.append(start, p - start);
+                    continue;
+                }
+                char c = *p;
+                if (c == '/' && p + 1 < lineEnd && p[1] == '/')
+                {
+                    output.append(p, lineEnd - p);
+                    p = lineEnd;
+                    continue;
+                }
+                if (c == '/' && p + 1 < lineEnd && p[1] == '*')
+                {
+                    comment = true;
+                    output.append(p, 2);
+                    p += 2;
+                    continue;
+                }
+                if (isalnum((unsigned char)c) || c == '_')
+                {
+                    while (p < lineEnd && (isalnum((unsigned char)*p) || *p == '_' || (isdigit((unsigned char)*start) && *p == '.'))) p++;
+                    replaceAxes(start, p);
+                    last = 'a';
+                    continue;
+                }
+                if (c == '{')
+                {
+                    // a function's body follows its parameters, anything else in a function is code too
+                    braces.push_back((!braces.empty() && braces.back()) || last == ')');
+                }
+                else if (c == '}')
+                {
+                    for (auto group = groups.rbegin(); group != groups.rend(); ++group)
+                    {
+                        if (group->converted)
+                        {
+                            if (braces.size() <= group->braces.size())
+                            {
+                                error(line, "} closes a brace opened outside of the ubershader branch");
+                            }
+                            break;
+                        }
+                    }
+                    if (!braces.empty()) braces.pop_back();
+                }
+                if (!isspace((unsigned char)c))
+                {
+                    last = c;
+                }
+                output += c;
+                p++;
+            }
+            line++;
+        }
+        return success;
+    }
+
+    void CompileUbershader(const Config& config, Ubershader& ubershader, const std::vector<std::string>& axes)
+    {
+        ubershader = Ubershader();
+        ubershader.result.success = false;
+        ubershader.result.resultCount = 0;
+        std::string& errors = ubershader.result.errors;
+
+        // identifiers of the defines and headers, which aren't rewritten
+        std::set<std::string> fixed;
+        DependencyScan scan;
+        ScanDependencies(config, scan, [&](const char* text, size_t length)
+        {
+            for (int i = 0; i < config.stageCount; i++)
+            {
+                if (text == config.source[i].data())
+                {
+                    return;
+                }
+            }
+            FindIdentifierUses(text, length, fixed);
+        });
+
+        std::vector<VariantAxis> candidates = config.variantAxes;
+        for (const VariantAxis& axis : scan.variantAxes)
+        {
+            auto sameName = [&](const VariantAxis& other) { return other.name == axis.name; };
+            if (std::find_if(candidates.begin(), candidates.end(), sameName) == candidates.end())
+            {
+                candidates.push_back(axis);
+            }
+        }
+
+        // an axis can be a uniform when its values are integers, with an empty
+        // value standing for 0 unless 0 is one of them
+        auto integral = [](const VariantAxis& axis)
+        {
+            bool undefined = false;
+            bool zero = false;
+            for (const std::string& value : axis.values)
+            {
+                long long number = 0;
+                if (value.empty())
+                {
+                    undefined = true;
+                }
+                else if (!ParseAxisValue(value, number))
+                {
+                    return false;
+                }
+                zero = zero || (!value.empty() && number == 0);
+            }
+            return !(undefined && zero);
+        };
+
+        for (VariantAxis& axis : candidates)
+        {
+            if (axis.values.empty())
+            {
+                axis.values = { "", "1" };
+            }
+            bool selected = axes.empty() ? integral(axis) : std::find(axes.begin(), axes.end(), axis.name) != axes.end();
+            if (!selected)
+            {
+                continue;
+            }
+            if (!integral(axis))
+            {
+                errors += "Variant axis " + axis.name + " can't be an ubershader uniform, its values aren't distinct integers\n";
+            }
+            if (fixed.count(axis.name))
+            {
+                errors += "Variant axis " + axis.name + " is used in the defines or a header, which ubershaders can't rewrite\n";
+            }
+
+            UbershaderControl control;
+            control.axis = axis.name;
+            control.uniform = "shadercross_" + axis.name;
+            control.values = axis.values;
+            ubershader.controls.push_back(control);
+        }
+        for (const std::string& name : axes)
+        {
+            auto sameName = [&](const VariantAxis& axis) { return axis.name == name; };
+            if (std::find_if(candidates.begin(), candidates.end(), sameName) == candidates.end())
+            {
+                errors += name + " is not a variant axis of the shader\n";
+            }
+        }
+        if (!errors.empty())
+        {
+            return;
+        }
+
+        std::map<std::string, const UbershaderControl*> controls;
+        Config ubershaderConfig = config;
+        for (const UbershaderControl& control : ubershader.controls)
+        {
+            controls[control.axis] = &control;
+
+            // the defines are compiled as the preamble, which comes after #version.
+            // ES uniforms used by both stages need the same precision.
+            ubershaderConfig.defines += "#ifdef GL_ES\nuniform mediump int " + control.uniform + ";\n#else\nuniform int " + control.uniform + ";\n#endif\n";
+        }
+
+        bool rewritten = true;
+        for (int i = 0; i < config.stageCount; i++)
+        {
+            rewritten = RewriteUbershaderSource(config.source[i], config.sourceName[i], controls, ubershaderConfig.source[i], errors) && rewritten;
+        }
+        if (!rewritten)
+        {
+            return;
+        }
+
+        Compile(ubershaderConfig, ubershader.result);
+    }
+
+    std::vector<int> UbershaderControlValues(const Ubershader& ubershader, const VariantSet& set, const Variant& variant)
+    {
+        std::vector<int> values;
+        for (const UbershaderControl& control : ubershader.controls)
+        {
+            long long value = 0;
+            for (size_t axis = 0; axis < set.axes.size() && axis < variant.values.size(); axis++)
+            {
+                if (set.axes[axis].name == control.axis)
+                {
+                    // an empty value leaves the axis undefined
+                    if (!ParseAxisValue(variant.values[axis], value)) value = 0;
+                }
+            }
+            values.push_back((int)value);
+        }
+        return values;
+    }
+
+    void ClearCompileCache()
+    {
+        {
+            std::lock_guard<std::mutex> lock(s_failureCacheMutex);
+            s_failureCache.clear();
+        }
+        {
+            std::lock_guard<std::mutex> lock(s_stageCacheMutex);
+            s_stageCache.clear();
+        }
+        IncludeFileCache::shared().clear();
+    }
+}
@@ -9,16 +9,46 @@
 #ifndef ShaderCross_hpp
 #define ShaderCross_hpp
 
+#include <cstdint>
+#include <functional>
 #include <map>
+#include <memory>
+#include <set>
 #include <string>
 #include <sstream>
 #include <vector>
 
+#include "ShaderHash.hpp"
+
 namespace ShaderCross
 {
     typedef std::pair<std::string, std::string> IncludeCallbackResult;
     typedef std::function<IncludeCallbackResult(const char* headerName, bool local)> IncludeCallback;
 
+    // Header contents handed to the compiler without being copied. The data must stay
+    // valid and unchanged for as long as owner is alive; the compiler holds a reference
+    // to owner until it has finished with the header.
+    struct IncludeBuffer
+    {
+        std::string headerName;
+        const char* data = nullptr;
+        size_t length = 0;
+        std::shared_ptr<const void> owner;
+
+        static IncludeBuffer fromString(const std::string& headerName, const std::shared_ptr<const std::string>& contents)
+        {
+            IncludeBuffer buffer;
+            buffer.headerName = headerName;
+            buffer.data = contents->data();
+            buffer.length = contents->size();
+            buffer.owner = contents;
+            return buffer;
+        }
+    };
+
+    // Fills buffer and returns true if the header was found
+    typedef std::function<bool(const char* headerName, bool local, IncludeBuffer& buffer)> SharedIncludeCallback;
+
     enum TargetLanguage {
         SpirV,
         GLSL,
@@ -26,7 +56,8 @@ namespace ShaderCross
         Metal,
         AGAL,
         VarList,
-        JavaScript
+        JavaScript,
+        SpirVCompact /* SPIR-V in the compact encoding of SpirVCompact.h */
     };
 
     enum ShaderStage {
@@ -84,11 +115,45 @@ namespace ShaderCross
                 return "VarList";
             case JavaScript:
                 return "JavaScript";
+            case SpirVCompact:
+                return "SPIR-V (compact)";
             }
             return "Unknown";
         }
     };
 
+    // A macro that selects between variants of a shader, and the values it takes.
+    // An empty value leaves the macro undefined.
+    struct VariantAxis
+    {
+        std::string name;
+        std::vector<std::string> values;
+    };
+
+    // A header of shared functions compiled once to SPIR-V, see CompileModule
+    struct ShaderModule
+    {
+        std::string headerName; /* the name shaders include the header by */
+        std::string stub; /* the header with its function bodies stubbed out, compiled in its place */
+        std::vector<unsigned> spirv; /* the header's functions */
+        Hash128 hash; /* identifies the module in cache keys */
+    };
+
+    struct UniformBlockMember
+    {
+        std::string type; /* bool, int, float, vec2, vec3, vec4, mat2, mat3 or mat4 */
+        std::string name;
+    };
+
+    // A uniform block shared by every shader, e.g. PerFrame for the camera and time, so
+    // that the host uploads it once rather than for each shader using the uniforms
+    struct UniformBlock
+    {
+        std::string name; /* name of the block in the output and the reflection data */
+        unsigned binding = 2; /* 2 or above, clear of the shader's own uniform buffers at 0 and 1 and of the other blocks; textures skip it */
+        std::vector<UniformBlockMember> members; /* in layout order, at std140 offsets with matrices in 16 byte columns */
+    };
+
     struct Config
     {
         Target target;
@@ -99,18 +164,144 @@ namespace ShaderCross
         std::string defines;
         std::string includePath;
         IncludeCallback* includeCallback;
+        SharedIncludeCallback* sharedIncludeCallback = nullptr; /* used instead of includeCallback when set */
+        bool cacheFailures = true; /* remember failed compiles until their source or includes change */
+        bool reuseStages = true; /* only recompile the stages whose source or includes changed */
+        bool prefetchIncludes = false; /* load the headers under includePath concurrently before compiling */
+        Hash128 previousOutputHash[2]; /* outputHash from an earlier Result, to detect stages whose output didn't change */
+        std::vector<VariantAxis> variantAxes; /* axes CompileVariants expands in addition to #pragma variant */
+        std::vector<std::shared_ptr<const ShaderModule>> modules; /* headers linked in from precompiled SPIR-V instead of being compiled with each shader */
+        std::map<std::string, int> attributeLocations; /* vertex attributes pinned to the same location in every shader and target but AGAL, other attributes take locations none of these use */
+        std::map<std::string, unsigned> attributeSizes; /* locations taken by pinned attributes that need more than one, e.g. 4 for a mat4, kept free in shaders without the attribute too */
+        std::vector<UniformBlock> uniformBlocks; /* SPIR-V targets pack uniforms with the name and type of a member into its block instead of the shader's own buffer */
     };
 
     struct Result
     {
-        bool success; /* success/failure result of compilation */
-        uint8_t resultCount; /* the number of build results */
+        bool success = false; /* success/failure result of compilation */
+        uint8_t resultCount = 0; /* the number of build results */
+        ShaderStage stage[2] = { StageCount, StageCount }; /* stage of each output, in pipeline order */
         std::string output[2]; /* cross-compiled source code */
         std::string errors; /* compiler and linker errors */
         std::string json[2]; /* reflection data */
+        std::vector<unsigned> spirv[2]; /* SPIR-V the output was translated from */
+        bool cached = false; /* result was served from the compile cache */
+        Hash128 outputHash[2]; /* stable hash of each stage's output and reflection data */
+        bool unchanged[2] = { false, false }; /* output is identical to the one previousOutputHash was taken from */
+        std::map<std::string, int> attributeLocations; /* location of every vertex input when Config::attributeLocations pins any and the target places inputs by location */
     };
 
     void Compile(const Config& config, Result& result);
+
+    // Translates an already compiled stage, given as raw SPIR-V words or in the compact
+    // encoding of SpirVCompact.h, to target
+    bool Translate(const Target& target, ShaderStage stage, const void* spirv, size_t length, std::string& output, std::string& errors);
+
+    // Compiles the functions of a header once, so that shaders listing the module in
+    // Config::modules only parse its declarations and get the functions they call
+    // linked in at the SPIR-V level. The header is compiled as a config.stage[0]
+    // shader made of config.source[0], e.g. just a #version line, followed by the
+    // header, with config's target and defines. Shaders using the module have to be
+    // compiled with the same target and defines, and fail to compile if they define
+    // a macro the header uses before including it.
+    bool CompileModule(const Config& config, const std::string& headerName, ShaderModule& module, std::string& errors);
+
+    // Drops every cached compile result
+    void ClearCompileCache();
+
+    // Preprocessor dependencies of a shader, found without running the compiler
+    struct DependencyScan
+    {
+        std::vector<std::string> includes; /* resolved names of every header reached through #include */
+        std::vector<std::string> missing; /* headers that could not be resolved */
+        std::set<std::string> defines; /* macros #defined by the defines, sources or headers */
+        std::set<std::string> conditions; /* macros tested by #if, #ifdef, #ifndef and #elif */
+        std::vector<VariantAxis> variantAxes; /* declared by #pragma variant NAME [values], without values for defined/undefined */
+    };
+
+    // Scans the sources and defines of a config and every header they include, resolved
+    // the same way Compile resolves them. Headers inside disabled #if blocks are included
+    // too, so the result is a superset of what a compile would read.
+    void ScanDependencies(const Config& config, DependencyScan& scan);
+
+    struct Variant
+    {
+        std::vector<std::string> values; /* value of each axis of the set */
+        std::string defines; /* what the values add to Config::defines */
+        size_t result; /* index of the variant's result in VariantSet::results */
+        size_t canonical; /* index of the variant compiled for this one, which differs only in unused axes */
+    };
+
+    struct VariantSet
+    {
+        std::vector<VariantAxis> axes; /* Config::variantAxes followed by the #pragma variant axes */
+        std::vector<bool> axisUsed; /* whether each axis is tested or expanded anywhere in the sources or headers */
+        std::vector<Variant> variants; /* every combination of axis values, the last axis changing fastest */
+        std::vector<Result> results; /* distinct results, shared by variants with identical output */
+        size_t compiles = 0; /* compiles that were needed after merging variants with identical preprocessed sources */
+        std::string errors; /* set when the variants couldn't be expanded */
+    };
+
+    // Compiles every variant of a shader, on threadCount threads or one per core.
+    // Axes the sources never refer to are collapsed onto their first value, and
+    // variants whose sources preprocess to the same text are only compiled once.
+    void CompileVariants(const Config& config, VariantSet& set, unsigned threadCount = 0);
+
+    // A variant axis that an ubershader selects at runtime through a uniform
+    struct UbershaderControl
+    {
+        std::string axis; /* the macro the uniform stands in for */
+        std::string uniform; /* name of the int uniform, shadercross_ followed by the axis */
+        std::vector<std::string> values; /* values of the axis, an empty value sets the uniform to 0 */
+    };
+
+    struct Ubershader
+    {
+        std::vector<UbershaderControl> controls; /* uniforms to set, in the order the axes were found */
+        Result result; /* the compiled ubershader, whose reflection data lists the control uniforms */
+    };
+
+    // Compiles one shader covering every variant of the axes, or of all the axes whose
+    // values are integers when axes is empty. Conditionals on those axes become branches
+    // on int uniforms: inside functions each #if, #elif and #else turns into an if/else
+    // whose blocks have to open and close their own braces, at global scope an #if may
+    // only guard declarations and has its contents always compiled. Inside such a
+    // group only conditionals on the axes may appear, other directives would apply to
+    // every variant. The axes are replaced by their uniforms everywhere else in the
+    // sources. Only the config's
+    // sources are rewritten, so the axes must not be tested or defined in headers or
+    // in the defines.
+    void CompileUbershader(const Config& config, Ubershader& ubershader, const std::vector<std::string>& axes = std::vector<std::string>());
+
+    // Values of the control uniforms that make the ubershader behave like the variant
+    std::vector<int> UbershaderControlValues(const Ubershader& ubershader, const VariantSet& set, const Variant& variant);
+
+    // Key for host-side caches of compiled shaders. Computed from the preprocessor
+    // tokens of the sources, defines and every included header, so reformatting and
+    // comment edits don't change it. Pass debugInfo when line numbers reach the output.
+    Hash128 ComputeCacheKey(const Config& config, bool debugInfo = false);
+
+    // The parts ComputeCacheKey is made from, hashed separately so that a key which
+    // changed unexpectedly can be explained. Source and header hashes cover their own
+    // tokens only, not the headers they include.
+    struct CompileKey
+    {
+        Hash128 key; /* the value ComputeCacheKey returns */
+        std::string shaderName; /* sourceName of the first stage */
+        std::map<std::string, Hash128> options; /* target language, version, es, system, debug info, stage count, modules, attribute locations and uniform blocks */
+        Hash128 defines; /* defines preamble */
+        Hash128 definitionSet; /* lines of the defines preamble, regardless of their order */
+        ShaderStage stage[2] = { StageCount, StageCount };
+        std::string sourceName[2];
+        Hash128 source[2];
+        std::map<std::string, Hash128> includes; /* every header reached, by resolved name */
+    };
+
+    void ComputeCompileKey(const Config& config, CompileKey& key, bool debugInfo = false);
+
+    // Describes each component that differs between two keys, e.g. "include common.glsl
+    // changed" or "defines reordered". Empty when the keys are equal.
+    std::vector<std::string> DiffCompileKeys(const CompileKey& before, const CompileKey& after);
 }
 
 #endif /* ShaderCross_hpp */
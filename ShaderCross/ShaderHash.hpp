@@ -0,0 +1,115 @@
+//
+//  ShaderHash.hpp
+//  ShaderCross
+//
+//  Stable 128-bit hashing used for compile cache keys
+//
+
+#ifndef ShaderHash_hpp
+#define ShaderHash_hpp
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace ShaderCross
+{
+    struct Hash128
+    {
+        uint64_t low = 0;
+        uint64_t high = 0;
+
+        bool empty() const { return low == 0 && high == 0; }
+
+        bool operator==(const Hash128& rhs) const { return low == rhs.low && high == rhs.high; }
+        bool operator!=(const Hash128& rhs) const { return !(*this == rhs); }
+        bool operator<(const Hash128& rhs) const { return high < rhs.high || (high == rhs.high && low < rhs.low); }
+
+        std::string string() const
+        {
+            static const char digits[] = "0123456789abcdef";
+            std::string result(32, '0');
+            for (int i = 0; i < 16; i++)
+            {
+                result[15 - i] = digits[(high >> (i * 4)) & 0xf];
+                result[31 - i] = digits[(low >> (i * 4)) & 0xf];
+            }
+            return result;
+        }
+    };
+
+    // Incremental hasher. The result only depends on the sequence of update calls,
+    // never on the platform or process, so hashes can be persisted between runs.
+    // Each update is length-delimited, so update("ab") + update("c") and
+    // update("a") + update("bc") produce different hashes.
+    class Hasher
+    {
+    public:
+        Hasher() : m_a(0x9e3779b97f4a7c15ull), m_b(0xc2b2ae3d27d4eb4full) {}
+
+        Hasher& update(const void* data, size_t length)
+        {
+            const unsigned char* bytes = (const unsigned char*)data;
+            size_t i = 0;
+            for (; i + 8 <= length; i += 8)
+            {
+                uint64_t word;
+                memcpy(&word, bytes + i, 8);
+                mix(word);
+            }
+
+            uint64_t tail = 0;
+            for (size_t shift = 0; i < length; i++, shift += 8)
+            {
+                tail |= (uint64_t)bytes[i] << shift;
+            }
+            mix(tail);
+            mix((uint64_t)length);
+            return *this;
+        }
+
+        Hasher& update(const std::string& string) { return update(string.data(), string.size()); }
+        Hasher& update(const char* string) { return update(string, string ? strlen(string) : 0); }
+        Hasher& update(const Hash128& hash) { mix(hash.low); mix(hash.high); return *this; }
+        Hasher& update(uint64_t value) { mix(value); return *this; }
+
+        Hash128 finish() const
+        {
+            Hash128 hash;
+            uint64_t a = m_a + m_b;
+            uint64_t b = m_b ^ rotl(m_a, 23);
+            hash.low = avalanche(a);
+            hash.high = avalanche(b + hash.low);
+            return hash;
+        }
+
+    private:
+        static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+        static uint64_t avalanche(uint64_t x)
+        {
+            x ^= x >> 33;
+            x *= 0xff51afd7ed558ccdull;
+            x ^= x >> 33;
+            x *= 0xc4ceb9fe1a85ec53ull;
+            x ^= x >> 33;
+            return x;
+        }
+
+        void mix(uint64_t word)
+        {
+            m_a = rotl(m_a ^ (word * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+            m_b = rotl(m_b + (word ^ m_a), 27) * 0x52dce729ull + 0x38495ab5ull;
+        }
+
+        uint64_t m_a;
+        uint64_t m_b;
+    };
+
+    inline Hash128 HashBytes(const void* data, size_t length)
+    {
+        return Hasher().update(data, length).finish();
+    }
+}
+
+#endif /* ShaderHash_hpp */
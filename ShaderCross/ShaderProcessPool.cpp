@@ -0,0 +1,366 @@
+//
+//  ShaderProcessPool.cpp
+//  ShaderCross
+//
+//  The pool talks to its workers with the framing of ShaderProtocol over socket
+//  pairs. Forking a worker straight from the pool's process could copy a lock that
+//  another thread holds, e.g. the compile cache's, so workers are forked by a
+//  single-threaded helper instead, which hands their sockets back over SCM_RIGHTS.
+//
+
+#include "ShaderProcessPool.hpp"
+#include "ShaderProtocol.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#if !defined(_WIN32)
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace ShaderCross
+{
+#if !defined(_WIN32)
+    // Sends the worker's process id, with descriptor attached unless it is negative
+    static bool SendDescriptor(int connection, int descriptor, int process)
+    {
+        iovec data = { &process, sizeof(process) };
+        union
+        {
+            cmsghdr header;
+            char buffer[CMSG_SPACE(sizeof(int))];
+        } control;
+        memset(&control, 0, sizeof(control));
+
+        msghdr message = {};
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        if (descriptor >= 0)
+        {
+            message.msg_control = control.buffer;
+            message.msg_controllen = sizeof(control.buffer);
+            cmsghdr* header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(header), &descriptor, sizeof(int));
+        }
+
+        ssize_t sent;
+        do
+        {
+            sent = sendmsg(connection, &message, 0);
+        } while (sent < 0 && errno == EINTR);
+        return sent == sizeof(process);
+    }
+
+    static int ReceiveDescriptor(int connection, int& process)
+    {
+        iovec data = { &process, sizeof(process) };
+        union
+        {
+            cmsghdr header;
+            char buffer[CMSG_SPACE(sizeof(int))];
+        } control;
+
+        msghdr message = {};
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+
+        ssize_t received;
+        do
+        {
+            received = recvmsg(connection, &message, 0);
+        } while (received < 0 && errno == EINTR);
+        if (received != sizeof(process))
+        {
+            return -1;
+        }
+
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        if (!header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+        {
+            return -1;
+        }
+        int descriptor;
+        memcpy(&descriptor, CMSG_DATA(header), sizeof(int));
+        return descriptor;
+    }
+
+    static void RunWorker(int connection)
+    {
+        uint32_t type;
+        std::string request;
+        while (ReadFrame(connection, type, request))
+        {
+            Config config;
+            if (type != MessageCompile || !ReadConfig(request.data(), request.size(), config))
+            {
+                if (!WriteFrame(connection, MessageError, "Invalid compile request\n"))
+                {
+                    break;
+                }
+                continue;
+            }
+
+            Result result;
+            Compile(config, result);
+            std::string response;
+            WriteResult(result, response);
+            if (!WriteFrame(connection, MessageCompile, response))
+            {
+                break;
+            }
+        }
+    }
+
+    // Forks a worker for every byte read from control until the pool closes it
+    static void RunSpawner(int control)
+    {
+        // workers are reaped as they exit, the pool notices them going away on
+        // their sockets
+        signal(SIGCHLD, SIG_IGN);
+
+        char byte;
+        while (true)
+        {
+            ssize_t count = read(control, &byte, 1);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count != 1)
+            {
+                break;
+            }
+
+            int sockets[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+            {
+                SendDescriptor(control, -1, 0);
+                continue;
+            }
+#if defined(SO_NOSIGPIPE)
+            int noSignal = 1;
+            setsockopt(sockets[0], SOL_SOCKET, SO_NOSIGPIPE, &noSignal, sizeof(noSignal));
+#endif
+
+            pid_t worker = fork();
+            if (worker == 0)
+            {
+                close(control);
+                close(sockets[0]);
+                signal(SIGCHLD, SIG_DFL);
+                RunWorker(sockets[1]);
+                _exit(0);
+            }
+            close(sockets[1]);
+            SendDescriptor(control, worker > 0 ? sockets[0] : -1, (int)worker);
+            close(sockets[0]);
+        }
+        _exit(0);
+    }
+
+    // Waits until descriptor has data to read or seconds pass, 0 waits forever
+    static bool WaitReadable(int descriptor, unsigned seconds)
+    {
+        if (seconds == 0)
+        {
+            return true;
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+        while (true)
+        {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            pollfd readable = { descriptor, POLLIN, 0 };
+            int ready = poll(&readable, 1, (int)std::max<decltype(remaining)>(remaining, 0));
+            if (ready < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            // hangups and errors are seen by the read
+            return ready != 0;
+        }
+    }
+#endif
+
+    CompileProcessPool::CompileProcessPool(unsigned processCount, unsigned timeoutSeconds)
+        : m_processCount(processCount > 0 ? processCount : std::max(1u, std::thread::hardware_concurrency())),
+          m_timeoutSeconds(timeoutSeconds), m_spawner(-1), m_spawnerProcess(-1), m_workers(0)
+    {
+#if !defined(_WIN32)
+        int control[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, control) != 0)
+        {
+            return;
+        }
+
+        pid_t spawner = fork();
+        if (spawner == 0)
+        {
+            close(control[0]);
+            RunSpawner(control[1]);
+        }
+        close(control[1]);
+        if (spawner < 0)
+        {
+            close(control[0]);
+            return;
+        }
+#if defined(SO_NOSIGPIPE)
+        int noSignal = 1;
+        setsockopt(control[0], SOL_SOCKET, SO_NOSIGPIPE, &noSignal, sizeof(noSignal));
+#endif
+        m_spawner = control[0];
+        m_spawnerProcess = (int)spawner;
+#endif
+    }
+
+    CompileProcessPool::~CompileProcessPool()
+    {
+#if !defined(_WIN32)
+        // workers exit when their socket closes, the helper when its socket does
+        for (const Worker& worker : m_idle)
+        {
+            close(worker.socket);
+        }
+        if (m_spawner >= 0)
+        {
+            close(m_spawner);
+            while (waitpid((pid_t)m_spawnerProcess, nullptr, 0) < 0 && errno == EINTR)
+            {
+
+            }
+        }
+#endif
+    }
+
+    bool CompileProcessPool::spawnWorker(Worker& worker)
+    {
+#if defined(_WIN32)
+        return false;
+#else
+        std::lock_guard<std::mutex> lock(m_spawnMutex);
+        char byte = 1;
+#if defined(MSG_NOSIGNAL)
+        // a helper that went away is reported as an error rather than with SIGPIPE
+        int flags = MSG_NOSIGNAL;
+#else
+        int flags = 0;
+#endif
+        ssize_t sent;
+        do
+        {
+            sent = m_spawner >= 0 ? send(m_spawner, &byte, 1, flags) : -1;
+        } while (sent < 0 && errno == EINTR);
+        if (sent != 1)
+        {
+            return false;
+        }
+        worker.socket = ReceiveDescriptor(m_spawner, worker.process);
+        return worker.socket >= 0;
+#endif
+    }
+
+    void CompileProcessPool::compile(const Config& config, Result& result)
+    {
+        result = Result();
+        result.success = false;
+        result.resultCount = 0;
+
+        if (config.includeCallback || config.sharedIncludeCallback)
+        {
+            result.errors = "Include callbacks can't be used with worker processes\n";
+            return;
+        }
+
+#if defined(_WIN32)
+        Compile(config, result);
+#else
+        std::string payload;
+        WriteConfig(config, payload);
+
+        Worker worker = { -1, 0 };
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_available.wait(lock, [this]() { return !m_idle.empty() || m_workers < m_processCount; });
+            if (!m_idle.empty())
+            {
+                worker = m_idle.back();
+                m_idle.pop_back();
+            }
+            else
+            {
+                m_workers++;
+            }
+        }
+        if (worker.socket < 0)
+        {
+            if (!spawnWorker(worker))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_workers--;
+                }
+                m_available.notify_one();
+                result.errors = "Can't start a compiler process\n";
+                return;
+            }
+        }
+
+        uint32_t type;
+        std::string response;
+        bool sent = WriteFrame(worker.socket, MessageCompile, payload);
+        bool timedOut = sent && !WaitReadable(worker.socket, m_timeoutSeconds);
+        bool answered = sent && !timedOut && ReadFrame(worker.socket, type, response);
+        if (timedOut)
+        {
+            // the worker is stuck, the helper reaps it once it is gone
+            kill((pid_t)worker.process, SIGKILL);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (answered)
+            {
+                m_idle.push_back(worker);
+            }
+            else
+            {
+                // the worker died, the next compile that needs one forks a new one
+                close(worker.socket);
+                m_workers--;
+            }
+        }
+        m_available.notify_one();
+
+        if (timedOut)
+        {
+            result.errors = "The compiler process took longer than " + std::to_string(m_timeoutSeconds) + " seconds compiling " + (config.sourceName[0].empty() ? std::string("the shader") : config.sourceName[0]) + " and was stopped\n";
+        }
+        else if (!answered)
+        {
+            result.errors = "The compiler process crashed while compiling " + (config.sourceName[0].empty() ? std::string("the shader") : config.sourceName[0]) + "\n";
+        }
+        else if (type != MessageCompile)
+        {
+            result.errors = type == MessageError ? response : "Unexpected response from a compiler process\n";
+        }
+        else if (!ReadResult(response.data(), response.size(), result))
+        {
+            result = Result();
+            result.success = false;
+            result.resultCount = 0;
+            result.errors = "Invalid response from a compiler process\n";
+        }
+#endif
+    }
+}
@@ -0,0 +1,63 @@
+//
+//  ShaderProcessPool.hpp
+//  ShaderCross
+//
+//  Compiles in worker processes, so that a crash in the compiler or a translator
+//  fails one shader instead of the whole build
+//
+
+#ifndef ShaderProcessPool_hpp
+#define ShaderProcessPool_hpp
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ShaderCross.hpp"
+
+namespace ShaderCross
+{
+    // Up to processCount workers, or one per core, started as they are needed.
+    // Workers are forked from a helper process that is forked when the pool is
+    // created, so create the pool before starting any threads. A worker that
+    // crashes is replaced by the next compile that needs one, as is one that takes
+    // longer than timeoutSeconds (0 for no limit) to answer, which is killed.
+    //
+    // Every worker keeps its own compile cache. On Windows compiles run in-process.
+    class CompileProcessPool
+    {
+    public:
+        CompileProcessPool(unsigned processCount = 0, unsigned timeoutSeconds = 120);
+        ~CompileProcessPool();
+
+        // Compiles config in a worker, waiting for one to be free. Can be called from
+        // several threads at once. Include callbacks can't be used.
+        void compile(const Config& config, Result& result);
+
+    private:
+        CompileProcessPool(const CompileProcessPool&) = delete;
+        CompileProcessPool& operator=(const CompileProcessPool&) = delete;
+
+        struct Worker
+        {
+            int socket;
+            int process;
+        };
+
+        bool spawnWorker(Worker& worker);
+
+        unsigned m_processCount;
+        unsigned m_timeoutSeconds;
+        int m_spawner; /* socket to the helper process that forks workers */
+        int m_spawnerProcess;
+        std::mutex m_spawnMutex;
+
+        std::mutex m_mutex;
+        std::condition_variable m_available;
+        std::vector<Worker> m_idle; /* workers waiting for a request */
+        unsigned m_workers; /* workers alive, idle or busy */
+    };
+}
+
+#endif /* ShaderProcessPool_hpp */
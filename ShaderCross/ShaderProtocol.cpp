@@ -0,0 +1,463 @@
+//
+//  ShaderProtocol.cpp
+//  ShaderCross
+//
+//  Integers are written little-endian, strings and arrays as their length followed
+//  by their contents. Messages start with a format version so that a stale client
+//  or server is rejected rather than misread.
+//
+
+#include "ShaderProtocol.hpp"
+
+#include <cerrno>
+
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace ShaderCross
+{
+    static const uint32_t s_formatVersion = 5;
+    static const uint32_t s_maximumFrameLength = 1u << 30;
+
+    class MessageWriter
+    {
+    public:
+        MessageWriter(std::string& buffer) : m_buffer(buffer)
+        {
+
+        }
+
+        void write(uint64_t value)
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                m_buffer += (char)(value >> (i * 8));
+            }
+        }
+
+        void write(const std::string& string)
+        {
+            write((uint64_t)string.size());
+            m_buffer += string;
+        }
+
+        void write(const Hash128& hash)
+        {
+            write(hash.low);
+            write(hash.high);
+        }
+
+        void write(const std::vector<unsigned>& words)
+        {
+            write((uint64_t)words.size());
+            for (unsigned word : words)
+            {
+                for (int i = 0; i < 4; i++)
+                {
+                    m_buffer += (char)(word >> (i * 8));
+                }
+            }
+        }
+
+    private:
+        std::string& m_buffer;
+    };
+
+    class MessageReader
+    {
+    public:
+        MessageReader(const char* data, size_t length) : m_p((const unsigned char*)data), m_end((const unsigned char*)data + length), m_failed(false)
+        {
+
+        }
+
+        uint64_t readInteger()
+        {
+            if (m_end - m_p < 8)
+            {
+                m_failed = true;
+                return 0;
+            }
+            uint64_t value = 0;
+            for (int i = 0; i < 8; i++)
+            {
+                value |= (uint64_t)m_p[i] << (i * 8);
+            }
+            m_p += 8;
+            return value;
+        }
+
+        void read(std::string& string)
+        {
+            uint64_t length = readInteger();
+            if (m_failed || (uint64_t)(m_end - m_p) < length)
+            {
+                m_failed = true;
+                return;
+            }
+            string.assign((const char*)m_p, (size_t)length);
+            m_p += length;
+        }
+
+        void read(Hash128& hash)
+        {
+            hash.low = readInteger();
+            hash.high = readInteger();
+        }
+
+        void read(std::vector<unsigned>& words)
+        {
+            uint64_t count = readInteger();
+            if (m_failed || (uint64_t)(m_end - m_p) / 4 < count)
+            {
+                m_failed = true;
+                return;
+            }
+            words.resize((size_t)count);
+            for (unsigned& word : words)
+            {
+                word = (unsigned)m_p[0] | ((unsigned)m_p[1] << 8) | ((unsigned)m_p[2] << 16) | ((unsigned)m_p[3] << 24);
+                m_p += 4;
+            }
+        }
+
+        // A count of items that each take at least minimumSize bytes, so a corrupt
+        // count can't make the caller allocate more than the message holds
+        size_t readCount(size_t minimumSize)
+        {
+            uint64_t count = readInteger();
+            if (m_failed || (uint64_t)(m_end - m_p) / minimumSize < count)
+            {
+                m_failed = true;
+                return 0;
+            }
+            return (size_t)count;
+        }
+
+        bool succeeded() const
+        {
+            return !m_failed && m_p == m_end;
+        }
+
+    private:
+        const unsigned char* m_p;
+        const unsigned char* m_end;
+        bool m_failed;
+    };
+
+    void WriteConfig(const Config& config, std::string& buffer)
+    {
+        MessageWriter writer(buffer);
+        writer.write(s_formatVersion);
+        writer.write((uint64_t)config.target.lang);
+        writer.write((uint64_t)config.target.version);
+        writer.write((uint64_t)config.target.es);
+        writer.write((uint64_t)config.target.system);
+        writer.write((uint64_t)config.stageCount);
+        for (int i = 0; i < config.stageCount && i < 2; i++)
+        {
+            writer.write((uint64_t)config.stage[i]);
+            writer.write(config.source[i]);
+            writer.write(config.sourceName[i]);
+            writer.write(config.previousOutputHash[i]);
+        }
+        writer.write(config.defines);
+        writer.write(config.includePath);
+        writer.write((uint64_t)config.cacheFailures);
+        writer.write((uint64_t)config.reuseStages);
+        writer.write((uint64_t)config.prefetchIncludes);
+
+        writer.write((uint64_t)config.variantAxes.size());
+        for (const VariantAxis& axis : config.variantAxes)
+        {
+            writer.write(axis.name);
+            writer.write((uint64_t)axis.values.size());
+            for (const std::string& value : axis.values)
+            {
+                writer.write(value);
+            }
+        }
+
+        writer.write((uint64_t)config.modules.size());
+        for (const auto& module : config.modules)
+        {
+            writer.write(module->headerName);
+            writer.write(module->stub);
+            writer.write(module->spirv);
+            writer.write(module->hash);
+        }
+
+        writer.write((uint64_t)config.attributeLocations.size());
+        for (const auto& attribute : config.attributeLocations)
+        {
+            writer.write(attribute.first);
+            writer.write((uint64_t)(int64_t)attribute.second);
+        }
+        writer.write((uint64_t)config.attributeSizes.size());
+        for (const auto& attribute : config.attributeSizes)
+        {
+            writer.write(attribute.first);
+            writer.write((uint64_t)attribute.second);
+        }
+
+        writer.write((uint64_t)config.uniformBlocks.size());
+        for (const UniformBlock& block : config.uniformBlocks)
+        {
+            writer.write(block.name);
+            writer.write((uint64_t)block.binding);
+            writer.write((uint64_t)block.members.size());
+            for (const UniformBlockMember& member : block.members)
+            {
+                writer.write(member.type);
+                writer.write(member.name);
+            }
+        }
+    }
+
+    bool ReadConfig(const char* data, size_t length, Config& config)
+    {
+        MessageReader reader(data, length);
+        if (reader.readInteger() != s_formatVersion)
+        {
+            return false;
+        }
+
+        config = Config();
+        config.includeCallback = nullptr;
+        config.target.lang = (TargetLanguage)reader.readInteger();
+        config.target.version = (int)reader.readInteger();
+        config.target.es = reader.readInteger() != 0;
+        config.target.system = (TargetSystem)reader.readInteger();
+        uint64_t stageCount = reader.readInteger();
+        if (stageCount > 2)
+        {
+            return false;
+        }
+        config.stageCount = (uint8_t)stageCount;
+        for (int i = 0; i < config.stageCount; i++)
+        {
+            uint64_t stage = reader.readInteger();
+            if (stage >= StageCount)
+            {
+                return false;
+            }
+            config.stage[i] = (ShaderStage)stage;
+            reader.read(config.source[i]);
+            reader.read(config.sourceName[i]);
+            reader.read(config.previousOutputHash[i]);
+        }
+        reader.read(config.defines);
+        reader.read(config.includePath);
+        config.cacheFailures = reader.readInteger() != 0;
+        config.reuseStages = reader.readInteger() != 0;
+        config.prefetchIncludes = reader.readInteger() != 0;
+
+        config.variantAxes.resize(reader.readCount(16));
+        for (VariantAxis& axis : config.variantAxes)
+        {
+            reader.read(axis.name);
+            axis.values.resize(reader.readCount(8));
+            for (std::string& value : axis.values)
+            {
+                reader.read(value);
+            }
+        }
+
+        size_t moduleCount = reader.readCount(40);
+        for (size_t i = 0; i < moduleCount; i++)
+        {
+            auto module = std::make_shared<ShaderModule>();
+            reader.read(module->headerName);
+            reader.read(module->stub);
+            reader.read(module->spirv);
+            reader.read(module->hash);
+            config.modules.push_back(module);
+        }
+
+        size_t attributeCount = reader.readCount(16);
+        for (size_t i = 0; i < attributeCount; i++)
+        {
+            std::string name;
+            reader.read(name);
+            config.attributeLocations[name] = (int)(int64_t)reader.readInteger();
+        }
+        size_t sizeCount = reader.readCount(16);
+        for (size_t i = 0; i < sizeCount; i++)
+        {
+            std::string name;
+            reader.read(name);
+            config.attributeSizes[name] = (unsigned)reader.readInteger();
+        }
+
+        config.uniformBlocks.resize(reader.readCount(24));
+        for (UniformBlock& block : config.uniformBlocks)
+        {
+            reader.read(block.name);
+            block.binding = (unsigned)reader.readInteger();
+            block.members.resize(reader.readCount(16));
+            for (UniformBlockMember& member : block.members)
+            {
+                reader.read(member.type);
+                reader.read(member.name);
+            }
+        }
+
+        return reader.succeeded();
+    }
+
+    void WriteResult(const Result& result, std::string& buffer)
+    {
+        MessageWriter writer(buffer);
+        writer.write(s_formatVersion);
+        writer.write((uint64_t)result.success);
+        writer.write((uint64_t)result.resultCount);
+        writer.write(result.errors);
+        writer.write((uint64_t)result.cached);
+        for (int i = 0; i < result.resultCount && i < 2; i++)
+        {
+            writer.write((uint64_t)result.stage[i]);
+            writer.write(result.output[i]);
+            writer.write(result.json[i]);
+            writer.write(result.spirv[i]);
+            writer.write(result.outputHash[i]);
+            writer.write((uint64_t)result.unchanged[i]);
+        }
+
+        writer.write((uint64_t)result.attributeLocations.size());
+        for (const auto& attribute : result.attributeLocations)
+        {
+            writer.write(attribute.first);
+            writer.write((uint64_t)(int64_t)attribute.second);
+        }
+    }
+
+    bool ReadResult(const char* data, size_t length, Result& result)
+    {
+        MessageReader reader(data, length);
+        if (reader.readInteger() != s_formatVersion)
+        {
+            return false;
+        }
+
+        result = Result();
+        result.success = reader.readInteger() != 0;
+        uint64_t resultCount = reader.readInteger();
+        if (resultCount > 2)
+        {
+            return false;
+        }
+        result.resultCount = (uint8_t)resultCount;
+        reader.read(result.errors);
+        result.cached = reader.readInteger() != 0;
+        for (int i = 0; i < result.resultCount; i++)
+        {
+            uint64_t stage = reader.readInteger();
+            result.stage[i] = stage < StageCount ? (ShaderStage)stage : StageCount;
+            reader.read(result.output[i]);
+            reader.read(result.json[i]);
+            reader.read(result.spirv[i]);
+            reader.read(result.outputHash[i]);
+            result.unchanged[i] = reader.readInteger() != 0;
+        }
+
+        size_t attributeCount = reader.readCount(16);
+        for (size_t i = 0; i < attributeCount; i++)
+        {
+            std::string name;
+            reader.read(name);
+            result.attributeLocations[name] = (int)(int64_t)reader.readInteger();
+        }
+        return reader.succeeded();
+    }
+
+#if !defined(_WIN32)
+    static bool WriteAll(int descriptor, const char* data, size_t length)
+    {
+        while (length > 0)
+        {
+#if defined(MSG_NOSIGNAL)
+            // a peer that went away is reported as an error rather than with SIGPIPE
+            ssize_t written = send(descriptor, data, length, MSG_NOSIGNAL);
+            if (written < 0 && errno == ENOTSOCK)
+            {
+                written = ::write(descriptor, data, length);
+            }
+#else
+            ssize_t written = ::write(descriptor, data, length);
+#endif
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return false;
+            }
+            data += written;
+            length -= (size_t)written;
+        }
+        return true;
+    }
+
+    static bool ReadAll(int descriptor, char* data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t count = ::read(descriptor, data, length);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                return false;
+            }
+            data += count;
+            length -= (size_t)count;
+        }
+        return true;
+    }
+
+    bool WriteFrame(int descriptor, uint32_t type, const std::string& payload)
+    {
+        if (payload.size() > s_maximumFrameLength)
+        {
+            return false;
+        }
+
+        // one write for small messages, so the header doesn't go out in a packet of its own
+        std::string frame;
+        frame.reserve(8 + payload.size());
+        for (uint32_t value : { type, (uint32_t)payload.size() })
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                frame += (char)(value >> (i * 8));
+            }
+        }
+        frame += payload;
+        return WriteAll(descriptor, frame.data(), frame.size());
+    }
+
+    bool ReadFrame(int descriptor, uint32_t& type, std::string& payload)
+    {
+        unsigned char header[8];
+        if (!ReadAll(descriptor, (char*)header, sizeof(header)))
+        {
+            return false;
+        }
+
+        type = (uint32_t)header[0] | ((uint32_t)header[1] << 8) | ((uint32_t)header[2] << 16) | ((uint32_t)header[3] << 24);
+        uint32_t length = (uint32_t)header[4] | ((uint32_t)header[5] << 8) | ((uint32_t)header[6] << 16) | ((uint32_t)header[7] << 24);
+        if (length > s_maximumFrameLength)
+        {
+            return false;
+        }
+
+        payload.resize(length);
+        return length == 0 || ReadAll(descriptor, &payload[0], length);
+    }
+#endif
+}
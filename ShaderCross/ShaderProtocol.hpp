@@ -0,0 +1,43 @@
+//
+//  ShaderProtocol.hpp
+//  ShaderCross
+//
+//  Serialization of compile configs and results, and the framing used to send them
+//  between processes
+//
+
+#ifndef ShaderProtocol_hpp
+#define ShaderProtocol_hpp
+
+#include <cstdint>
+#include <string>
+
+#include "ShaderCross.hpp"
+
+namespace ShaderCross
+{
+    enum MessageType
+    {
+        MessageCompile = 1,     /* client: Config, server: Result */
+        MessageClearCache = 2,  /* no payload, answered with an empty message */
+        MessageShutdown = 3,    /* no payload, answered with an empty message before the server stops */
+        MessageError = 4        /* server: description of a request it couldn't handle */
+    };
+
+    // Include callbacks can't be sent to another process, configs are serialized
+    // without them
+    void WriteConfig(const Config& config, std::string& buffer);
+    bool ReadConfig(const char* data, size_t length, Config& config);
+
+    void WriteResult(const Result& result, std::string& buffer);
+    bool ReadResult(const char* data, size_t length, Result& result);
+
+#if !defined(_WIN32)
+    // A frame is the message type and payload length as little-endian 32-bit integers
+    // followed by the payload. Both return false when the descriptor fails or closes.
+    bool WriteFrame(int descriptor, uint32_t type, const std::string& payload);
+    bool ReadFrame(int descriptor, uint32_t& type, std::string& payload);
+#endif
+}
+
+#endif /* ShaderProtocol_hpp */
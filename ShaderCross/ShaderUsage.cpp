@@ -0,0 +1,249 @@
+//
+//  ShaderUsage.cpp
+//  ShaderCross
+//
+//  Layout, integers in host byte order like ShaderArchive:
+//
+//      header   magic "SXUSAGE1", version, record count, session count
+//      records  usage key, count, first use, first offset and sessions, sorted by key
+//
+
+#include "ShaderUsage.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+
+namespace ShaderCross
+{
+    static const char s_magic[8] = { 'S', 'X', 'U', 'S', 'A', 'G', 'E', '1' };
+    static const uint32_t s_version = 2;
+
+    // Milliseconds added to first offsets when ordering, so that how many sessions
+    // need a shader outweighs small differences in when they need it
+    static const double s_offsetSlack = 1000.0;
+
+    struct UsageHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t recordCount;
+        uint32_t sessionCount;
+        uint32_t reserved;
+    };
+
+    struct UsageEntry
+    {
+        uint64_t keyLow;
+        uint64_t keyHigh;
+        uint64_t count;
+        uint64_t firstUse;
+        uint32_t firstOffset;
+        uint32_t sessions;
+    };
+
+    static_assert(sizeof(UsageHeader) == 24, "usage header must not be padded");
+    static_assert(sizeof(UsageEntry) == 40, "usage entries must not be padded");
+
+    Hash128 ComputeUsageKey(const Config& config)
+    {
+        Hasher hasher;
+        hasher.update("usage");
+        hasher.update((uint64_t)config.target.lang);
+        hasher.update((uint64_t)config.target.version);
+        hasher.update((uint64_t)config.target.es);
+        hasher.update((uint64_t)config.target.system);
+        hasher.update((uint64_t)config.stageCount);
+        for (int i = 0; i < config.stageCount && i < 2; i++)
+        {
+            hasher.update((uint64_t)config.stage[i]);
+            hasher.update(config.sourceName[i].empty() ? config.source[i] : config.sourceName[i]);
+        }
+        hasher.update(config.defines);
+        return hasher.finish();
+    }
+
+    // The first offset of this session weighs as much as all the earlier ones
+    // together, so a shader that moved keeps its history for a few sessions only
+    static uint32_t RecentOffset(uint32_t previous, uint32_t offset)
+    {
+        return (uint32_t)(((uint64_t)previous + offset) / 2);
+    }
+
+    UsageLog::UsageLog() : m_loadedSessions(0), m_start(std::chrono::steady_clock::now())
+    {
+
+    }
+
+    void UsageLog::record(const Config& config)
+    {
+        record(ComputeUsageKey(config));
+    }
+
+    void UsageLog::record(const Hash128& usageKey)
+    {
+        auto offset = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_start).count();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        UsageRecord& record = m_records[usageKey];
+        if (record.count == 0)
+        {
+            record.firstUse = (uint64_t)time(nullptr);
+        }
+        if (m_session.insert(usageKey).second)
+        {
+            uint32_t firstOffset = (uint32_t)std::min<long long>(offset, UINT32_MAX);
+            record.firstOffset = record.sessions == 0 ? firstOffset : RecentOffset(record.firstOffset, firstOffset);
+            record.sessions++;
+        }
+        record.count++;
+    }
+
+    bool UsageLog::find(const Hash128& usageKey, UsageRecord& record) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_records.find(usageKey);
+        if (it == m_records.end())
+        {
+            return false;
+        }
+        record = it->second;
+        return true;
+    }
+
+    size_t UsageLog::size() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_records.size();
+    }
+
+    uint32_t UsageLog::sessionCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_loadedSessions + (m_session.empty() ? 0 : 1);
+    }
+
+    bool UsageLog::load(const std::string& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open())
+        {
+            return false;
+        }
+        std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+        UsageHeader header;
+        if (data.size() < sizeof(header))
+        {
+            return false;
+        }
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.magic, s_magic, sizeof(s_magic)) != 0 || header.version != s_version ||
+            (data.size() - sizeof(header)) / sizeof(UsageEntry) != header.recordCount ||
+            (data.size() - sizeof(header)) % sizeof(UsageEntry) != 0)
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const char* p = data.data() + sizeof(header);
+        for (uint32_t i = 0; i < header.recordCount; i++, p += sizeof(UsageEntry))
+        {
+            UsageEntry entry;
+            memcpy(&entry, p, sizeof(entry));
+            Hash128 key;
+            key.low = entry.keyLow;
+            key.high = entry.keyHigh;
+
+            UsageRecord& record = m_records[key];
+            if (record.count == 0)
+            {
+                record.firstUse = entry.firstUse;
+                record.firstOffset = entry.firstOffset;
+            }
+            else
+            {
+                record.firstUse = std::min(record.firstUse, entry.firstUse);
+                uint64_t sessions = (uint64_t)record.sessions + entry.sessions;
+                if (sessions > 0)
+                {
+                    record.firstOffset = (uint32_t)(((uint64_t)record.firstOffset * record.sessions + (uint64_t)entry.firstOffset * entry.sessions) / sessions);
+                }
+            }
+            record.count += entry.count;
+            record.sessions += entry.sessions;
+        }
+        m_loadedSessions += header.sessionCount;
+        return true;
+    }
+
+    bool UsageLog::save(const std::string& path) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        UsageHeader header = {};
+        memcpy(header.magic, s_magic, sizeof(s_magic));
+        header.version = s_version;
+        header.recordCount = (uint32_t)m_records.size();
+        header.sessionCount = m_loadedSessions + (m_session.empty() ? 0 : 1);
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+        {
+            return false;
+        }
+        file.write((const char*)&header, sizeof(header));
+        for (const auto& record : m_records)
+        {
+            UsageEntry entry = {};
+            entry.keyLow = record.first.low;
+            entry.keyHigh = record.first.high;
+            entry.count = record.second.count;
+            entry.firstUse = record.second.firstUse;
+            entry.firstOffset = record.second.firstOffset;
+            entry.sessions = record.second.sessions;
+            file.write((const char*)&entry, sizeof(entry));
+        }
+        return (bool)file;
+    }
+
+    std::vector<size_t> OrderByUsage(const std::vector<Config>& configs, const UsageLog& log)
+    {
+        struct Use
+        {
+            size_t index;
+            double expected; /* first offset divided by the fraction of sessions needing it */
+            uint64_t count;
+        };
+
+        double sessionCount = std::max(1u, log.sessionCount());
+        std::vector<Use> used;
+        for (size_t i = 0; i < configs.size(); i++)
+        {
+            UsageRecord record;
+            if (log.find(ComputeUsageKey(configs[i]), record))
+            {
+                double fraction = std::max(1u, record.sessions) / sessionCount;
+                used.push_back({ i, (record.firstOffset + s_offsetSlack) / fraction, record.count });
+            }
+        }
+
+        std::stable_sort(used.begin(), used.end(), [](const Use& a, const Use& b)
+        {
+            if (a.expected != b.expected)
+            {
+                return a.expected < b.expected;
+            }
+            return a.count > b.count;
+        });
+
+        std::vector<size_t> order;
+        for (const Use& use : used)
+        {
+            order.push_back(use.index);
+        }
+        return order;
+    }
+}
@@ -0,0 +1,82 @@
+//
+//  ShaderUsage.hpp
+//  ShaderCross
+//
+//  Records which shaders are requested at runtime, so that builds can precompile the
+//  ones needed first before the rest and skip the ones that are never used
+//
+
+#ifndef ShaderUsage_hpp
+#define ShaderUsage_hpp
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ShaderCross.hpp"
+
+namespace ShaderCross
+{
+    // Identifies a config across runs and builds by its target, stages, source names
+    // and defines, including variant defines. Sources are identified by sourceName, or
+    // by their text when it is empty, so editing a named shader keeps its history.
+    Hash128 ComputeUsageKey(const Config& config);
+
+    struct UsageRecord
+    {
+        uint64_t count = 0; /* requests recorded */
+        uint64_t firstUse = 0; /* seconds since the Unix epoch of the first request */
+        uint32_t firstOffset = 0; /* milliseconds into a session of the first request, averaged over sessions with the recent ones weighing most */
+        uint32_t sessions = 0; /* sessions that requested it */
+    };
+
+    // Counts the configs requested at runtime. A session starts when the log is
+    // created, load() merges in the sessions saved before, call it before recording
+    // so this session counts as the most recent one. Can be used from several
+    // threads at once.
+    class UsageLog
+    {
+    public:
+        UsageLog();
+
+        void record(const Config& config);
+        void record(const Hash128& usageKey);
+
+        bool find(const Hash128& usageKey, UsageRecord& record) const;
+        size_t size() const;
+
+        // Sessions loaded, and this one once it has recorded anything
+        uint32_t sessionCount() const;
+
+        // Adds the records of a saved log to this one, summing counts and sessions,
+        // keeping the earliest first use and averaging first offsets by sessions.
+        // Returns false if it can't be read or isn't a usage log.
+        bool load(const std::string& path);
+
+        // Writes every record, 40 bytes each, replacing path
+        bool save(const std::string& path) const;
+
+    private:
+        UsageLog(const UsageLog&) = delete;
+        UsageLog& operator=(const UsageLog&) = delete;
+
+        mutable std::mutex m_mutex;
+        std::map<Hash128, UsageRecord> m_records;
+        std::set<Hash128> m_session; /* keys recorded in this session */
+        uint32_t m_loadedSessions;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    // Indices of the configs the log has seen, in the order to precompile them: by
+    // when a session typically first needs them, pushed back the fewer sessions need
+    // them at all, so a shader one session in a hundred asks for early doesn't come
+    // before one every session needs soon after. Ties go to the most requested.
+    // Configs the log never saw are left out.
+    std::vector<size_t> OrderByUsage(const std::vector<Config>& configs, const UsageLog& log);
+}
+
+#endif /* ShaderUsage_hpp */
@@ -0,0 +1,245 @@
+//
+//  DeterminismTest.cpp
+//  ShaderCross
+//
+//  Compiles the same configs for every target in different orders, on several threads
+//  and in worker processes, and checks that each config always produces the same
+//  bytes. Interleaving different shaders catches translator state that leaks from one
+//  compile into the next.
+//
+
+#include "ShaderCross.hpp"
+#include "ShaderProcessPool.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace ShaderCross;
+
+namespace
+{
+    const char* s_spriteVertex =
+        "#version 450\n"
+        "layout(location = 0) in vec3 position;\n"
+        "layout(location = 1) in vec2 texCoord;\n"
+        "out vec2 vTexCoord;\n"
+        "uniform mat4 projectionMatrix;\n"
+        "uniform mat4 modelViewMatrix;\n"
+        "void main()\n"
+        "{\n"
+        "    vTexCoord = texCoord;\n"
+        "    gl_Position = projectionMatrix * modelViewMatrix * vec4(position, 1.0);\n"
+        "}\n";
+
+    const char* s_spriteFragment =
+        "#version 450\n"
+        "in vec2 vTexCoord;\n"
+        "out vec4 fragColor;\n"
+        "uniform sampler2D colorMap;\n"
+        "uniform float opacity;\n"
+        "void main()\n"
+        "{\n"
+        "    fragColor = texture(colorMap, vTexCoord) * opacity;\n"
+        "}\n";
+
+    const char* s_flatVertex =
+        "#version 450\n"
+        "layout(location = 0) in vec4 position;\n"
+        "uniform vec4 offset;\n"
+        "void main()\n"
+        "{\n"
+        "    gl_Position = position + offset;\n"
+        "}\n";
+
+    const char* s_flatFragment =
+        "#version 450\n"
+        "out vec4 fragColor;\n"
+        "uniform vec4 color;\n"
+        "uniform vec2 scale;\n"
+        "void main()\n"
+        "{\n"
+        "    fragColor = vec4(color.rgb * scale.x, color.a * scale.y);\n"
+        "}\n";
+
+    Config MakeConfig(const Target& target, const char* name, const char* vertex, const char* fragment)
+    {
+        Config config;
+        config.target = target;
+        config.stageCount = 2;
+        config.stage[0] = StageVertex;
+        config.stage[1] = StageFragment;
+        config.source[0] = vertex;
+        config.source[1] = fragment;
+        config.sourceName[0] = std::string(name) + ".vert";
+        config.sourceName[1] = std::string(name) + ".frag";
+        config.includeCallback = nullptr;
+        // every run has to compile for real, not be served from a cache
+        config.cacheFailures = false;
+        config.reuseStages = false;
+        return config;
+    }
+
+    std::vector<Config> MakeConfigs()
+    {
+        const Target targets[] = {
+            { SpirV, 1, false, Unknown },
+            { SpirVCompact, 1, false, Unknown },
+            { GLSL, 330, false, Linux },
+            { GLSL, 100, true, Android },
+            { HLSL, 11, false, Windows },
+            { Metal, 1, false, iOS },
+            { AGAL, 100, true, Flash },
+            { VarList, 1, false, Unknown },
+        };
+
+        std::vector<Config> configs;
+        for (const Target& target : targets)
+        {
+            configs.push_back(MakeConfig(target, "sprite", s_spriteVertex, s_spriteFragment));
+            configs.push_back(MakeConfig(target, "flat", s_flatVertex, s_flatFragment));
+        }
+        return configs;
+    }
+
+    // Everything of a result that has to be reproducible
+    std::string Fingerprint(const Result& result)
+    {
+        std::string fingerprint = result.success ? "success\n" : "failure\n";
+        fingerprint += result.errors + "\n";
+        for (int i = 0; i < result.resultCount && i < 2; i++)
+        {
+            fingerprint += std::to_string(result.output[i].size()) + ":" + result.output[i];
+            fingerprint += std::to_string(result.json[i].size()) + ":" + result.json[i];
+        }
+        return fingerprint;
+    }
+
+    std::string Describe(const Config& config)
+    {
+        Target target = config.target;
+        return config.sourceName[0] + " for " + target.string();
+    }
+
+    // Compiles the configs in order, a config may come up more than once, on threadCount
+    // threads each taking the next one. Returns the fingerprint of each compile in order.
+    std::vector<std::string> CompileAll(const std::vector<Config>& configs, const std::vector<size_t>& order, unsigned threadCount, CompileProcessPool* pool)
+    {
+        std::vector<std::string> fingerprints(order.size());
+        size_t next = 0;
+        std::mutex mutex;
+
+        auto work = [&]() {
+            while (true)
+            {
+                size_t position;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (next == order.size())
+                    {
+                        return;
+                    }
+                    position = next++;
+                }
+
+                Result result;
+                if (pool)
+                {
+                    pool->compile(configs[order[position]], result);
+                }
+                else
+                {
+                    Compile(configs[order[position]], result);
+                }
+                fingerprints[position] = Fingerprint(result);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < threadCount; i++)
+        {
+            threads.push_back(std::thread(work));
+        }
+        work();
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+        return fingerprints;
+    }
+
+    // Compiles the configs in order and compares each output with the first run's
+    bool Check(const char* run, const std::vector<Config>& configs, const std::vector<std::string>& expected, const std::vector<size_t>& order, unsigned threadCount,
+        CompileProcessPool* pool = nullptr)
+    {
+        std::vector<std::string> actual = CompileAll(configs, order, threadCount, pool);
+        bool same = true;
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            if (actual[i] != expected[order[i]])
+            {
+                fprintf(stderr, "%s: %s differs from the first run\n", run, Describe(configs[order[i]]).c_str());
+                same = false;
+            }
+        }
+        return same;
+    }
+}
+
+int main()
+{
+    // the pool forks its helper process, which has to happen before any thread starts
+    CompileProcessPool pool(4);
+
+    std::vector<Config> configs = MakeConfigs();
+    std::vector<size_t> order(configs.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+
+    std::vector<std::string> expected = CompileAll(configs, order, 1, nullptr);
+    bool passed = true;
+    for (size_t i = 0; i < configs.size(); i++)
+    {
+        if (expected[i].compare(0, 8, "success\n") != 0)
+        {
+            fprintf(stderr, "%s failed to compile:\n%s\n", Describe(configs[i]).c_str(), expected[i].c_str());
+            passed = false;
+        }
+    }
+
+    std::vector<size_t> reversed(order.rbegin(), order.rend());
+    passed = Check("reversed order", configs, expected, reversed, 1) && passed;
+
+    // the sprite shaders of every target, then the flat ones backwards, so leftover
+    // translator state would reach a different compile than in the first run
+    std::vector<size_t> interleaved;
+    for (size_t i = 0; i < order.size(); i += 2)
+    {
+        interleaved.push_back(order[i]);
+    }
+    for (size_t i = order.size(); i >= 2; i -= 2)
+    {
+        interleaved.push_back(order[i - 1]);
+    }
+    passed = Check("interleaved order", configs, expected, interleaved, 1) && passed;
+
+    passed = Check("8 threads", configs, expected, reversed, 8) && passed;
+
+    // the same config compiled on several threads at once
+    std::vector<size_t> repeated;
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        repeated.insert(repeated.end(), 4, order[i]);
+    }
+    passed = Check("concurrent repeats", configs, expected, repeated, 4) && passed;
+
+    passed = Check("worker processes", configs, expected, interleaved, 4, &pool) && passed;
+
+    printf("%s: %zu configs\n", passed ? "passed" : "FAILED", configs.size());
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+//
+//  IncludeGuardBenchmark.cpp
+//  ShaderCross
+//
+//  Times compiles of a shader that includes a diamond-shaped tree of headers, where
+//  every header includes both headers of the next level. Once with #ifndef guards the
+//  includers recognize, so repeated headers reach glslang empty, and once with the
+//  same guards followed by a #define, which glslang still honors but which makes the
+//  includers hand over the whole text on every include.
+//
+//  usage: shadercross-include-guard-benchmark [levels] [compiles]
+//
+
+#include "ShaderCross.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace ShaderCross;
+
+namespace
+{
+    const unsigned s_width = 2;
+    const unsigned s_functions = 40; /* about 2 KB of source per header */
+
+    std::string HeaderName(unsigned level, unsigned index)
+    {
+        return "l" + std::to_string(level) + "_" + std::to_string(index) + ".glsl";
+    }
+
+    std::string FunctionName(unsigned level, unsigned index, unsigned function)
+    {
+        return "f" + std::to_string(function) + "_l" + std::to_string(level) + "_" + std::to_string(index);
+    }
+
+    std::map<std::string, std::string> MakeHeaders(unsigned levels, bool recognizable)
+    {
+        std::map<std::string, std::string> headers;
+        for (unsigned level = 0; level < levels; level++)
+        {
+            for (unsigned index = 0; index < s_width; index++)
+            {
+                std::string guard = "L" + std::to_string(level) + "_" + std::to_string(index);
+                std::string text = "#ifndef " + guard + "\n#define " + guard + "\n";
+                for (unsigned next = 0; next < s_width && level + 1 < levels; next++)
+                {
+                    text += "#include \"" + HeaderName(level + 1, next) + "\"\n";
+                }
+                for (unsigned function = 0; function < s_functions; function++)
+                {
+                    text += "float " + FunctionName(level, index, function) + "(float x) { return x * " + std::to_string(function) + ".0 + sin(x); }\n";
+                }
+                text += "#endif\n";
+                if (!recognizable)
+                {
+                    text += "#define " + guard + "_DONE\n";
+                }
+                headers[HeaderName(level, index)] = text;
+            }
+        }
+        return headers;
+    }
+
+    std::string MakeShader()
+    {
+        std::string shader = "#version 450\n#extension GL_GOOGLE_include_directive : require\nout vec4 fragColor;\nuniform float time;\n";
+        for (unsigned index = 0; index < s_width; index++)
+        {
+            shader += "#include \"" + HeaderName(0, index) + "\"\n";
+        }
+        shader += "void main()\n{\n    fragColor = vec4(" + FunctionName(0, 0, 0) + "(time), " + FunctionName(0, 1, 0) + "(time), 0.0, 1.0);\n}\n";
+        return shader;
+    }
+
+    struct Measurement
+    {
+        bool success;
+        unsigned includes; /* headers requested from the include callback per compile */
+        double milliseconds; /* median compile time */
+    };
+
+    Measurement Measure(unsigned levels, unsigned compiles, bool recognizable)
+    {
+        std::map<std::string, std::string> headers = MakeHeaders(levels, recognizable);
+        unsigned includes = 0;
+        IncludeCallback callback = [&](const char* headerName, bool local) {
+            includes++;
+            auto header = headers.find(headerName);
+            return header == headers.end() ? IncludeCallbackResult() : IncludeCallbackResult(headerName, header->second);
+        };
+
+        Config config;
+        config.target = { SpirV, 1, false, Unknown };
+        config.stageCount = 1;
+        config.stage[0] = StageFragment;
+        config.source[0] = MakeShader();
+        config.sourceName[0] = "diamond.frag";
+        config.includeCallback = &callback;
+        // every compile has to preprocess the tree, not be served from a cache
+        config.cacheFailures = false;
+        config.reuseStages = false;
+
+        Measurement measurement = { true, 0, 0.0 };
+        std::vector<double> times;
+        for (unsigned i = 0; i < compiles; i++)
+        {
+            includes = 0;
+            Result result;
+            auto start = std::chrono::steady_clock::now();
+            Compile(config, result);
+            times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            if (!result.success)
+            {
+                fprintf(stderr, "diamond.frag failed to compile:\n%s", result.errors.c_str());
+                measurement.success = false;
+                return measurement;
+            }
+            measurement.includes = includes;
+        }
+        std::sort(times.begin(), times.end());
+        measurement.milliseconds = times[times.size() / 2];
+        return measurement;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    unsigned levels = argc > 1 ? (unsigned)atoi(argv[1]) : 8;
+    unsigned compiles = argc > 2 ? (unsigned)atoi(argv[2]) : 20;
+    if (levels == 0 || compiles == 0)
+    {
+        fprintf(stderr, "usage: %s [levels] [compiles]\n", argv[0]);
+        return 1;
+    }
+
+    printf("diamond of %u levels, %u headers per level, %u functions per header, median of %u compiles\n", levels, s_width, s_functions, compiles);
+
+    // one compile first, so that neither run pays for glslang's first-time setup
+    Measure(levels, 1, true);
+    Measurement skipped = Measure(levels, compiles, true);
+    Measurement full = Measure(levels, compiles, false);
+    if (!skipped.success || !full.success)
+    {
+        return 1;
+    }
+
+    printf("recognized guards:   %3u includes, %8.2f ms per compile\n", skipped.includes, skipped.milliseconds);
+    printf("unrecognized guards: %3u includes, %8.2f ms per compile\n", full.includes, full.milliseconds);
+    printf("speedup: %.2fx\n", full.milliseconds / skipped.milliseconds);
+    return 0;
+}
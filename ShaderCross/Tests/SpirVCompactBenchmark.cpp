@@ -0,0 +1,191 @@
+//
+//  SpirVCompactBenchmark.cpp
+//  ShaderCross
+//
+//  Encodes and decodes the SPIR-V the compiler produces for a few shaders, checks that
+//  every module comes back word for word and prints the size of the compact encoding
+//  and the encode and decode throughput.
+//
+//  usage: shadercross-compact-benchmark [passes]
+//
+
+#include "ShaderCross.hpp"
+#include "SpirVCompact.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace ShaderCross;
+
+namespace
+{
+    const char* s_spriteVertex =
+        "#version 450\n"
+        "layout(location = 0) in vec3 position;\n"
+        "layout(location = 1) in vec2 texCoord;\n"
+        "out vec2 vTexCoord;\n"
+        "uniform mat4 projectionMatrix;\n"
+        "uniform mat4 modelViewMatrix;\n"
+        "void main()\n"
+        "{\n"
+        "    vTexCoord = texCoord;\n"
+        "    gl_Position = projectionMatrix * modelViewMatrix * vec4(position, 1.0);\n"
+        "}\n";
+
+    const char* s_spriteFragment =
+        "#version 450\n"
+        "in vec2 vTexCoord;\n"
+        "out vec4 fragColor;\n"
+        "uniform sampler2D colorMap;\n"
+        "uniform float opacity;\n"
+        "void main()\n"
+        "{\n"
+        "    fragColor = texture(colorMap, vTexCoord) * opacity;\n"
+        "}\n";
+
+    const char* s_lightingVertex =
+        "#version 450\n"
+        "layout(location = 0) in vec3 position;\n"
+        "layout(location = 1) in vec3 normal;\n"
+        "layout(location = 2) in vec2 texCoord;\n"
+        "out vec3 vNormal;\n"
+        "out vec3 vPosition;\n"
+        "out vec2 vTexCoord;\n"
+        "uniform mat4 modelMatrix;\n"
+        "uniform mat4 viewProjectionMatrix;\n"
+        "uniform mat3 normalMatrix;\n"
+        "void main()\n"
+        "{\n"
+        "    vec4 world = modelMatrix * vec4(position, 1.0);\n"
+        "    vPosition = world.xyz;\n"
+        "    vNormal = normalize(normalMatrix * normal);\n"
+        "    vTexCoord = texCoord;\n"
+        "    gl_Position = viewProjectionMatrix * world;\n"
+        "}\n";
+
+    const char* s_lightingFragment =
+        "#version 450\n"
+        "in vec3 vNormal;\n"
+        "in vec3 vPosition;\n"
+        "in vec2 vTexCoord;\n"
+        "out vec4 fragColor;\n"
+        "uniform sampler2D colorMap;\n"
+        "uniform vec3 cameraPosition;\n"
+        "uniform vec3 lightPositions[4];\n"
+        "uniform vec3 lightColors[4];\n"
+        "uniform float shininess;\n"
+        "void main()\n"
+        "{\n"
+        "    vec3 n = normalize(vNormal);\n"
+        "    vec3 v = normalize(cameraPosition - vPosition);\n"
+        "    vec3 albedo = texture(colorMap, vTexCoord).rgb;\n"
+        "    vec3 color = vec3(0.0);\n"
+        "    for (int i = 0; i < 4; i++) {\n"
+        "        vec3 l = normalize(lightPositions[i] - vPosition);\n"
+        "        vec3 h = normalize(l + v);\n"
+        "        float diffuse = max(dot(n, l), 0.0);\n"
+        "        float specular = pow(max(dot(n, h), 0.0), shininess);\n"
+        "        color += lightColors[i] * (albedo * diffuse + specular);\n"
+        "    }\n"
+        "    fragColor = vec4(color, 1.0);\n"
+        "}\n";
+
+    bool CompileModules(const char* name, const char* vertex, const char* fragment, std::vector<std::vector<unsigned>>& modules)
+    {
+        Config config;
+        config.target = { SpirV, 1, false, Unknown };
+        config.stageCount = 2;
+        config.stage[0] = StageVertex;
+        config.stage[1] = StageFragment;
+        config.source[0] = vertex;
+        config.source[1] = fragment;
+        config.sourceName[0] = std::string(name) + ".vert";
+        config.sourceName[1] = std::string(name) + ".frag";
+        config.includeCallback = nullptr;
+
+        Result result;
+        Compile(config, result);
+        if (!result.success)
+        {
+            fprintf(stderr, "%s failed to compile:\n%s", name, result.errors.c_str());
+            return false;
+        }
+        for (int i = 0; i < result.resultCount && i < 2; i++)
+        {
+            // what glslang produced and what the SPIR-V translator made of it
+            modules.push_back(result.spirv[i]);
+            std::vector<unsigned> output(result.output[i].size() / 4);
+            memcpy(output.data(), result.output[i].data(), output.size() * 4);
+            modules.push_back(output);
+        }
+        return true;
+    }
+
+    double Seconds(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    unsigned passes = argc > 1 ? (unsigned)atoi(argv[1]) : 2000;
+    if (passes == 0)
+    {
+        fprintf(stderr, "usage: %s [passes]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::vector<unsigned>> modules;
+    if (!CompileModules("sprite", s_spriteVertex, s_spriteFragment, modules) || !CompileModules("lighting", s_lightingVertex, s_lightingFragment, modules))
+    {
+        return 1;
+    }
+
+    size_t rawBytes = 0;
+    size_t compactBytes = 0;
+    std::vector<std::vector<uint8_t>> encoded(modules.size());
+    for (size_t i = 0; i < modules.size(); i++)
+    {
+        std::vector<unsigned> decoded;
+        if (!EncodeCompactSpirV(modules[i], encoded[i]) || !DecodeCompactSpirV(encoded[i].data(), encoded[i].size(), decoded) || decoded != modules[i])
+        {
+            fprintf(stderr, "module %zu doesn't survive the round trip\n", i);
+            return 1;
+        }
+        rawBytes += modules[i].size() * 4;
+        compactBytes += encoded[i].size();
+    }
+
+    std::vector<uint8_t> scratch;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned pass = 0; pass < passes; pass++)
+    {
+        for (const std::vector<unsigned>& module : modules)
+        {
+            EncodeCompactSpirV(module, scratch);
+        }
+    }
+    double encodeSeconds = Seconds(start);
+
+    std::vector<unsigned> decoded;
+    start = std::chrono::steady_clock::now();
+    for (unsigned pass = 0; pass < passes; pass++)
+    {
+        for (const std::vector<uint8_t>& data : encoded)
+        {
+            DecodeCompactSpirV(data.data(), data.size(), decoded);
+        }
+    }
+    double decodeSeconds = Seconds(start);
+
+    double megabytes = (double)rawBytes * passes / 1e6;
+    printf("%zu modules, %zu bytes of SPIR-V, %zu bytes compact (%.1f%%), all lossless\n", modules.size(), rawBytes, compactBytes, 100.0 * compactBytes / rawBytes);
+    printf("encode: %.0f MB/s of SPIR-V\n", megabytes / encodeSeconds);
+    printf("decode: %.0f MB/s of SPIR-V\n", megabytes / decodeSeconds);
+    return 0;
+}
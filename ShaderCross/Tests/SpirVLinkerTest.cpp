@@ -0,0 +1,437 @@
+//
+//  SpirVLinkerTest.cpp
+//  ShaderCross
+//
+//  Links a hand assembled module into a stage compiled against its stub and checks
+//  that the result is well formed: every id is defined once and below the bound, every
+//  id operand refers to a definition, literals keep their values, and the stub's body
+//  was replaced along with the helpers it calls. Also checks that a module with an
+//  instruction the linker doesn't know is rejected rather than guessed at.
+//
+
+#include "SpirVLinker.h"
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace ShaderCross;
+
+namespace
+{
+    enum Opcode
+    {
+        OpName = 5,
+        OpMemberName = 6,
+        OpExtInstImport = 11,
+        OpExtInst = 12,
+        OpMemoryModel = 14,
+        OpEntryPoint = 15,
+        OpExecutionMode = 16,
+        OpCapability = 17,
+        OpTypeVoid = 19,
+        OpTypeInt = 21,
+        OpTypeFloat = 22,
+        OpTypeVector = 23,
+        OpTypeRuntimeArray = 29,
+        OpTypeStruct = 30,
+        OpTypePointer = 32,
+        OpTypeFunction = 33,
+        OpConstant = 43,
+        OpFunction = 54,
+        OpFunctionParameter = 55,
+        OpFunctionEnd = 56,
+        OpFunctionCall = 57,
+        OpVariable = 59,
+        OpLoad = 61,
+        OpStore = 62,
+        OpAccessChain = 65,
+        OpArrayLength = 68,
+        OpDecorate = 71,
+        OpMemberDecorate = 72,
+        OpVectorTimesScalar = 142,
+        OpLabel = 248,
+        OpReturn = 253,
+        OpReturnValue = 254
+    };
+
+    // The operands of each opcode the test uses, one letter per operand: r result id,
+    // i id, l literal, s string. A trailing * repeats the letter before it.
+    const std::map<unsigned, std::string> s_operands = {
+        { OpName, "is" }, { OpMemberName, "ils" }, { OpExtInstImport, "rs" }, { OpExtInst, "irili*" },
+        { OpMemoryModel, "ll" }, { OpEntryPoint, "lisi*" }, { OpExecutionMode, "il*" }, { OpCapability, "l" },
+        { OpTypeVoid, "r" }, { OpTypeInt, "rll" }, { OpTypeFloat, "rl" }, { OpTypeVector, "ril" },
+        { OpTypeRuntimeArray, "ri" }, { OpTypeStruct, "ri*" }, { OpTypePointer, "rli" }, { OpTypeFunction, "ri*" },
+        { OpConstant, "irl*" }, { OpFunction, "irli" }, { OpFunctionParameter, "ir" }, { OpFunctionEnd, "" },
+        { OpFunctionCall, "iri*" }, { OpVariable, "irli" }, { OpLoad, "iri" }, { OpStore, "ii" },
+        { OpAccessChain, "irii*" }, { OpArrayLength, "iril" }, { OpDecorate, "il*" }, { OpMemberDecorate, "ill*" },
+        { OpVectorTimesScalar, "irii" }, { OpLabel, "r" }, { OpReturn, "" }, { OpReturnValue, "i" }
+    };
+
+    struct Assembler
+    {
+        std::vector<unsigned> words;
+
+        Assembler(unsigned bound)
+        {
+            words = { 0x07230203, 0x10000, 0, bound, 0 };
+        }
+
+        void op(unsigned opcode, std::vector<unsigned> operands = {})
+        {
+            words.push_back(unsigned(operands.size() + 1) << 16 | opcode);
+            words.insert(words.end(), operands.begin(), operands.end());
+        }
+
+        // An instruction whose operands before and after a string are ids or literals
+        void op(unsigned opcode, std::vector<unsigned> before, const std::string& string, const std::vector<unsigned>& after = {})
+        {
+            std::vector<unsigned> packed(string.size() / 4 + 1, 0);
+            memcpy(packed.data(), string.data(), string.size());
+            before.insert(before.end(), packed.begin(), packed.end());
+            before.insert(before.end(), after.begin(), after.end());
+            op(opcode, before);
+        }
+    };
+
+    struct Instruction
+    {
+        unsigned opcode;
+        std::vector<unsigned> operands;
+        std::vector<char> kinds;
+    };
+
+    // Splits the module into instructions and works out the kind of every operand,
+    // returns false if an instruction is malformed or isn't one the test knows
+    bool Disassemble(const std::vector<unsigned>& spirv, std::vector<Instruction>& instructions, std::string& errors)
+    {
+        for (size_t offset = 5; offset < spirv.size();)
+        {
+            unsigned count = spirv[offset] >> 16;
+            Instruction instruction;
+            instruction.opcode = spirv[offset] & 0xffff;
+            if (count == 0 || offset + count > spirv.size())
+            {
+                errors += "truncated instruction at word " + std::to_string(offset) + "\n";
+                return false;
+            }
+            auto found = s_operands.find(instruction.opcode);
+            if (found == s_operands.end())
+            {
+                errors += "unexpected opcode " + std::to_string(instruction.opcode) + "\n";
+                return false;
+            }
+
+            instruction.operands.assign(spirv.begin() + offset + 1, spirv.begin() + offset + count);
+            const std::string& pattern = found->second;
+            size_t letter = 0;
+            for (size_t i = 0; i < instruction.operands.size(); i++)
+            {
+                if (letter < pattern.size() && pattern[letter] == '*')
+                {
+                    letter--;
+                }
+                if (letter >= pattern.size())
+                {
+                    errors += "too many operands for opcode " + std::to_string(instruction.opcode) + "\n";
+                    return false;
+                }
+                instruction.kinds.push_back(pattern[letter]);
+                // a string runs up to the word holding its terminator
+                unsigned word = instruction.operands[i];
+                bool terminated = (word & 0xff) == 0 || (word & 0xff00) == 0 || (word & 0xff0000) == 0 || (word & 0xff000000) == 0;
+                if (pattern[letter] != 's' || terminated)
+                {
+                    letter++;
+                }
+            }
+            instructions.push_back(instruction);
+            offset += count;
+        }
+        return true;
+    }
+
+    std::string String(const Instruction& instruction, size_t index)
+    {
+        std::string string;
+        for (; index < instruction.operands.size(); index++)
+        {
+            for (unsigned byte = 0; byte < 4; byte++)
+            {
+                char c = char(instruction.operands[index] >> (byte * 8));
+                if (c == 0)
+                {
+                    return string;
+                }
+                string += c;
+            }
+        }
+        return string;
+    }
+
+    // Checks that every id is defined once, below the bound, and that every id operand
+    // refers to one of them
+    bool Validate(const std::vector<unsigned>& spirv, std::vector<Instruction>& instructions, std::string& errors)
+    {
+        if (spirv.size() < 5 || spirv[0] != 0x07230203)
+        {
+            errors += "missing header\n";
+            return false;
+        }
+        if (!Disassemble(spirv, instructions, errors))
+        {
+            return false;
+        }
+
+        unsigned bound = spirv[3];
+        std::set<unsigned> defined;
+        for (const Instruction& instruction : instructions)
+        {
+            for (size_t i = 0; i < instruction.operands.size(); i++)
+            {
+                unsigned id = instruction.operands[i];
+                if (instruction.kinds[i] != 'r')
+                {
+                    continue;
+                }
+                if (id == 0 || id >= bound)
+                {
+                    errors += "id " + std::to_string(id) + " is outside the bound " + std::to_string(bound) + "\n";
+                }
+                if (!defined.insert(id).second)
+                {
+                    errors += "id " + std::to_string(id) + " is defined twice\n";
+                }
+            }
+        }
+        for (const Instruction& instruction : instructions)
+        {
+            for (size_t i = 0; i < instruction.operands.size(); i++)
+            {
+                if (instruction.kinds[i] == 'i' && !defined.count(instruction.operands[i]))
+                {
+                    errors += "opcode " + std::to_string(instruction.opcode) + " uses undefined id " + std::to_string(instruction.operands[i]) + "\n";
+                }
+            }
+        }
+        return errors.empty();
+    }
+
+    // A vertex shader whose main calls the stub of light(vec4), which returns a local
+    std::vector<unsigned> AssembleStage()
+    {
+        Assembler stage(30);
+        stage.op(OpCapability, { 1 });
+        stage.op(OpExtInstImport, { 1 }, "GLSL.std.450");
+        stage.op(OpMemoryModel, { 0, 1 });
+        stage.op(OpEntryPoint, { 0, 2 }, "main", { 20 });
+        stage.op(OpName, { 2 }, "main(");
+        stage.op(OpName, { 3 }, "light(vf4;");
+        stage.op(OpName, { 10 }, "p");
+        stage.op(OpName, { 11 }, "shadercross_stub");
+        stage.op(OpName, { 20 }, "color");
+        stage.op(OpDecorate, { 20, 30, 0 });
+        stage.op(OpTypeVoid, { 4 });
+        stage.op(OpTypeFunction, { 5, 4 });
+        stage.op(OpTypeFloat, { 6, 32 });
+        stage.op(OpTypeVector, { 7, 6, 4 });
+        stage.op(OpTypePointer, { 8, 7, 7 });
+        stage.op(OpTypeFunction, { 9, 7, 8 });
+        stage.op(OpTypePointer, { 19, 3, 7 });
+        stage.op(OpVariable, { 19, 20, 3 });
+        stage.op(OpConstant, { 6, 21, 0x3f800000 });
+
+        stage.op(OpFunction, { 4, 2, 0, 5 });
+        stage.op(OpLabel, { 12 });
+        stage.op(OpVariable, { 8, 13, 7 });
+        stage.op(OpFunctionCall, { 7, 14, 3, 13 });
+        stage.op(OpStore, { 20, 14 });
+        stage.op(OpReturn);
+        stage.op(OpFunctionEnd);
+
+        stage.op(OpFunction, { 7, 3, 0, 9 });
+        stage.op(OpFunctionParameter, { 8, 10 });
+        stage.op(OpLabel, { 15 });
+        stage.op(OpVariable, { 8, 11, 7 });
+        stage.op(OpLoad, { 7, 16, 11 });
+        stage.op(OpReturnValue, { 16 });
+        stage.op(OpFunctionEnd);
+        return stage.words;
+    }
+
+    // The module defining light(vec4), which reads a uniform block and the length of a
+    // buffer's runtime array, and calls a helper scale(vec4). unknownOpcode, if not 0,
+    // adds an instruction the linker can't know.
+    std::vector<unsigned> AssembleModule(unsigned unknownOpcode)
+    {
+        Assembler module(60);
+        module.op(OpCapability, { 1 });
+        module.op(OpExtInstImport, { 40 }, "GLSL.std.450");
+        module.op(OpMemoryModel, { 0, 1 });
+        module.op(OpEntryPoint, { 4, 41 }, "main");
+        module.op(OpExecutionMode, { 41, 7 });
+        module.op(OpName, { 41 }, "main(");
+        module.op(OpName, { 42 }, "light(vf4;");
+        module.op(OpName, { 43 }, "scale(vf4;");
+        module.op(OpName, { 44 }, "Light");
+        module.op(OpMemberName, { 44, 0 }, "intensity");
+        module.op(OpName, { 45 }, "");
+        module.op(OpName, { 48 }, "Counts");
+        module.op(OpDecorate, { 44, 2 });
+        module.op(OpMemberDecorate, { 44, 0, 35, 0 });
+        module.op(OpDecorate, { 45, 34, 0 });
+        module.op(OpDecorate, { 45, 33, 1 });
+        module.op(OpDecorate, { 48, 3 });
+        module.op(OpMemberDecorate, { 48, 0, 35, 0 });
+        module.op(OpMemberDecorate, { 48, 1, 35, 4 });
+        module.op(OpDecorate, { 50, 34, 0 });
+        module.op(OpDecorate, { 50, 33, 2 });
+        module.op(OpTypeVoid, { 1 });
+        module.op(OpTypeFunction, { 2, 1 });
+        module.op(OpTypeFloat, { 3, 32 });
+        module.op(OpTypeVector, { 4, 3, 4 });
+        module.op(OpTypePointer, { 5, 7, 4 });
+        module.op(OpTypeFunction, { 6, 4, 5 });
+        module.op(OpTypeStruct, { 44, 3 });
+        module.op(OpTypePointer, { 7, 2, 44 });
+        module.op(OpVariable, { 7, 45, 2 });
+        module.op(OpTypeInt, { 8, 32, 1 });
+        module.op(OpConstant, { 8, 9, 0 });
+        module.op(OpTypePointer, { 10, 2, 3 });
+        module.op(OpConstant, { 3, 11, 0x40000000 });
+        module.op(OpTypeInt, { 46, 32, 0 });
+        module.op(OpTypeRuntimeArray, { 47, 3 });
+        module.op(OpTypeStruct, { 48, 3, 47 });
+        module.op(OpTypePointer, { 49, 2, 48 });
+        module.op(OpVariable, { 49, 50, 2 });
+
+        module.op(OpFunction, { 1, 41, 0, 2 });
+        module.op(OpLabel, { 12 });
+        module.op(OpReturn);
+        module.op(OpFunctionEnd);
+
+        module.op(OpFunction, { 4, 42, 0, 6 });
+        module.op(OpFunctionParameter, { 5, 13 });
+        module.op(OpLabel, { 14 });
+        module.op(OpVariable, { 5, 15, 7 });
+        module.op(OpLoad, { 4, 16, 13 });
+        module.op(OpStore, { 15, 16 });
+        module.op(OpFunctionCall, { 4, 17, 43, 15 });
+        module.op(OpAccessChain, { 10, 18, 45, 9 });
+        module.op(OpLoad, { 3, 19, 18 });
+        // the member index is a literal that happens to equal the id of the void type
+        module.op(OpArrayLength, { 46, 26, 50, 1 });
+        if (unknownOpcode)
+        {
+            module.op(unknownOpcode, { 4, 27, 17 });
+        }
+        module.op(OpVectorTimesScalar, { 4, 20, 17, 19 });
+        module.op(OpExtInst, { 4, 21, 40, 69, 20 });
+        module.op(OpReturnValue, { 21 });
+        module.op(OpFunctionEnd);
+
+        module.op(OpFunction, { 4, 43, 0, 6 });
+        module.op(OpFunctionParameter, { 5, 22 });
+        module.op(OpLabel, { 23 });
+        module.op(OpLoad, { 4, 24, 22 });
+        module.op(OpVectorTimesScalar, { 4, 25, 24, 11 });
+        module.op(OpReturnValue, { 25 });
+        module.op(OpFunctionEnd);
+        return module.words;
+    }
+
+    bool TestLink()
+    {
+        std::vector<unsigned> spirv = AssembleStage();
+        std::string errors;
+        if (!LinkSpirV(spirv, AssembleModule(0), errors))
+        {
+            fprintf(stderr, "linking failed: %s\n", errors.c_str());
+            return false;
+        }
+
+        std::vector<Instruction> instructions;
+        if (!Validate(spirv, instructions, errors))
+        {
+            fprintf(stderr, "linked module is invalid:\n%s", errors.c_str());
+            return false;
+        }
+
+        std::map<unsigned, std::string> names;
+        for (const Instruction& instruction : instructions)
+        {
+            if (instruction.opcode == OpName)
+            {
+                names[instruction.operands[0]] = String(instruction, 1);
+            }
+        }
+
+        // the stub's body is gone, and light calls scale and reads the array length
+        unsigned function = 0;
+        bool callsScale = false;
+        bool arrayLength = false;
+        for (const Instruction& instruction : instructions)
+        {
+            if (instruction.opcode == OpFunction)
+            {
+                function = instruction.operands[1];
+            }
+            else if (names[function] != "light(vf4;")
+            {
+                continue;
+            }
+            else if (instruction.opcode == OpFunctionCall)
+            {
+                callsScale = callsScale || names[instruction.operands[2]] == "scale(vf4;";
+            }
+            else if (instruction.opcode == OpArrayLength)
+            {
+                if (instruction.operands[3] != 1)
+                {
+                    fprintf(stderr, "the member index of OpArrayLength was renumbered to %u\n", instruction.operands[3]);
+                    return false;
+                }
+                arrayLength = true;
+            }
+        }
+        bool stubLocal = false;
+        for (const auto& name : names)
+        {
+            stubLocal = stubLocal || name.second == "shadercross_stub";
+        }
+        if (stubLocal || !callsScale || !arrayLength)
+        {
+            fprintf(stderr, "light(vf4; was not replaced by the module's body\n");
+            return false;
+        }
+        return true;
+    }
+
+    bool TestUnknownInstruction()
+    {
+        std::vector<unsigned> spirv = AssembleStage();
+        std::string errors;
+        if (LinkSpirV(spirv, AssembleModule(4000), errors))
+        {
+            fprintf(stderr, "linking a module with an unknown instruction succeeded\n");
+            return false;
+        }
+        if (errors.find("unsupported instruction 4000") == std::string::npos)
+        {
+            fprintf(stderr, "unexpected error for an unknown instruction: %s\n", errors.c_str());
+            return false;
+        }
+        return true;
+    }
+}
+
+int main()
+{
+    bool passed = TestLink();
+    passed = TestUnknownInstruction() && passed;
+    printf("%s\n", passed ? "passed" : "FAILED");
+    return passed ? 0 : 1;
+}
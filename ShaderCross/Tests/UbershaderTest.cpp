@@ -0,0 +1,147 @@
+//
+//  UbershaderTest.cpp
+//  ShaderCross
+//
+//  Compiles ubershaders for several targets, with axis conditionals nested in
+//  functions and around declarations, and checks that directives which can't become
+//  runtime branches are rejected with the line they are on.
+//
+
+#include "ShaderCross.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace ShaderCross;
+
+namespace
+{
+    const char* s_vertex =
+        "#version 450\n"
+        "#pragma variant SKINNING\n"
+        "layout(location = 0) in vec4 position;\n"
+        "layout(location = 1) in vec4 weights;\n"
+        "uniform mat4 modelViewProjection;\n"
+        "#ifdef SKINNING\n"
+        "uniform mat4 bones[4];\n"
+        "#endif\n"
+        "void main()\n"
+        "{\n"
+        "    vec4 p = position;\n"
+        "#ifdef SKINNING\n"
+        "    p = bones[0] * p * weights.x + bones[1] * p * weights.y;\n"
+        "#endif\n"
+        "    gl_Position = modelViewProjection * p;\n"
+        "}\n";
+
+    const char* s_fragment =
+        "#version 450\n"
+        "#pragma variant LIGHTS 1 2 4\n"
+        "#pragma variant FOG\n"
+        "out vec4 fragColor;\n"
+        "uniform vec4 lightColors[4];\n"
+        "uniform vec4 fogColor;\n"
+        "void main()\n"
+        "{\n"
+        "    vec4 color = lightColors[0];\n"
+        "#if LIGHTS > 1\n"
+        "    color += lightColors[1];\n"
+        "#if LIGHTS == 4\n"
+        "    color += lightColors[2] + lightColors[3];\n"
+        "#endif\n"
+        "#elif defined(FOG)\n"
+        "    color = mix(color, fogColor, 0.5);\n"
+        "#else\n"
+        "    if (color.a < 0.5) {\n"
+        "        color.a = 0.5;\n"
+        "    }\n"
+        "#endif\n"
+        "    for (int i = 0; i < LIGHTS; i++) {\n"
+        "        color *= 0.9;\n"
+        "    }\n"
+        "    fragColor = color;\n"
+        "}\n";
+
+    Config MakeConfig(const Target& target, const std::string& fragment)
+    {
+        Config config;
+        config.target = target;
+        config.stageCount = 2;
+        config.stage[0] = StageVertex;
+        config.stage[1] = StageFragment;
+        config.source[0] = s_vertex;
+        config.source[1] = fragment;
+        config.sourceName[0] = "uber.vert";
+        config.sourceName[1] = "uber.frag";
+        config.includeCallback = nullptr;
+        return config;
+    }
+
+    bool TestCompile(const Target& target)
+    {
+        Target description = target;
+        Ubershader ubershader;
+        CompileUbershader(MakeConfig(target, s_fragment), ubershader);
+        if (!ubershader.result.success)
+        {
+            fprintf(stderr, "ubershader for %s failed to compile:\n%s", description.string().c_str(), ubershader.result.errors.c_str());
+            return false;
+        }
+        if (ubershader.controls.size() != 3)
+        {
+            fprintf(stderr, "ubershader for %s has %zu controls instead of 3\n", description.string().c_str(), ubershader.controls.size());
+            return false;
+        }
+        return true;
+    }
+
+    // Replaces the fragment shader's #else branch with lines and expects an error
+    // naming the first of them
+    bool TestRejected(const std::string& lines, const std::string& message)
+    {
+        std::string fragment = s_fragment;
+        size_t branch = fragment.find("    if (color.a < 0.5) {\n");
+        size_t branchEnd = fragment.find("#endif\n", branch);
+        fragment.replace(branch, branchEnd - branch, lines);
+        size_t line = std::count(fragment.begin(), fragment.begin() + branch, '\n') + 1;
+
+        Ubershader ubershader;
+        CompileUbershader(MakeConfig({ GLSL, 330, false, Linux }, fragment), ubershader);
+        std::string expected = "uber.frag:" + std::to_string(line) + ": " + message;
+        if (ubershader.result.success || ubershader.result.errors.find(expected) == std::string::npos)
+        {
+            fprintf(stderr, "expected \"%s\" for\n%s\ngot: %s\n", expected.c_str(), lines.c_str(), ubershader.result.errors.c_str());
+            return false;
+        }
+        return true;
+    }
+}
+
+int main()
+{
+    const Target targets[] = {
+        { SpirV, 1, false, Unknown },
+        { GLSL, 330, false, Linux },
+        { GLSL, 100, true, Android },
+        { HLSL, 11, false, Windows },
+        { Metal, 1, false, iOS },
+    };
+
+    bool passed = true;
+    for (const Target& target : targets)
+    {
+        passed = TestCompile(target) && passed;
+    }
+
+    passed = TestRejected("#define HALF 0.5\n    color *= HALF;\n", "#define inside a group on an ubershader axis") && passed;
+    passed = TestRejected("#undef LIGHT_SCALE\n", "#undef inside a group on an ubershader axis") && passed;
+    passed = TestRejected("#include \"fog.glsl\"\n", "#include inside a group on an ubershader axis") && passed;
+    passed = TestRejected("#extension GL_EXT_shader_texture_lod : enable\n", "#extension inside a group on an ubershader axis") && passed;
+    passed = TestRejected("#error no fog\n", "#error inside a group on an ubershader axis") && passed;
+    passed = TestRejected("#ifdef GL_ES\n    color.a = 1.0;\n#endif\n", "#ifdef inside a group on an ubershader axis has to test an axis too") && passed;
+
+    printf("%s\n", passed ? "passed" : "FAILED");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,221 @@
+//
+//  UniformBlockTest.cpp
+//  ShaderCross
+//
+//  Compiles textured shaders to SPIR-V with and without a shared uniform block and
+//  checks that the block and the textures never end up on the same binding, and that
+//  the block's members are at their std140 offsets.
+//
+
+#include "ShaderCross.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace ShaderCross;
+
+namespace
+{
+    const unsigned s_opTypeStruct = 30;
+    const unsigned s_opVariable = 59;
+    const unsigned s_opDecorate = 71;
+    const unsigned s_opMemberDecorate = 72;
+    const unsigned s_decorationOffset = 35;
+    const unsigned s_decorationBinding = 33;
+
+    const char* s_vertex =
+        "#version 450\n"
+        "layout(location = 0) in vec4 position;\n"
+        "layout(location = 1) in vec2 texCoord;\n"
+        "out vec2 vTexCoord;\n"
+        "void main()\n"
+        "{\n"
+        "    vTexCoord = texCoord;\n"
+        "    gl_Position = position;\n"
+        "}\n";
+
+    // no loose uniforms at all, only samplers
+    const char* s_samplerFragment =
+        "#version 450\n"
+        "in vec2 vTexCoord;\n"
+        "out vec4 fragColor;\n"
+        "uniform sampler2D colorMap;\n"
+        "uniform sampler2D detailMap;\n"
+        "void main()\n"
+        "{\n"
+        "    fragColor = texture(colorMap, vTexCoord) * texture(detailMap, vTexCoord);\n"
+        "}\n";
+
+    // samplers and a uniform that is routed into the shared block
+    const char* s_blockFragment =
+        "#version 450\n"
+        "in vec2 vTexCoord;\n"
+        "out vec4 fragColor;\n"
+        "uniform sampler2D colorMap;\n"
+        "uniform sampler2D detailMap;\n"
+        "uniform float time;\n"
+        "void main()\n"
+        "{\n"
+        "    fragColor = texture(colorMap, vTexCoord) * texture(detailMap, vTexCoord) * time;\n"
+        "}\n";
+
+    // a uniform of each size class, which std140 has to pad around
+    const char* s_layoutFragment =
+        "#version 450\n"
+        "in vec2 vTexCoord;\n"
+        "out vec4 fragColor;\n"
+        "uniform mat2 rotation;\n"
+        "uniform vec3 cameraPosition;\n"
+        "uniform vec4 tint;\n"
+        "uniform mat3 normalMatrix;\n"
+        "uniform float time;\n"
+        "void main()\n"
+        "{\n"
+        "    vec3 n = normalMatrix * cameraPosition;\n"
+        "    fragColor = vec4(rotation * vTexCoord, n.x, time) * tint;\n"
+        "}\n";
+
+    Config MakeConfig(const char* fragment)
+    {
+        Config config;
+        config.target = { SpirV, 1, false, Unknown };
+        config.stageCount = 2;
+        config.stage[0] = StageVertex;
+        config.stage[1] = StageFragment;
+        config.source[0] = s_vertex;
+        config.source[1] = fragment;
+        config.sourceName[0] = "textured.vert";
+        config.sourceName[1] = "textured.frag";
+        config.includeCallback = nullptr;
+        return config;
+    }
+
+    // The binding of every variable and block of a SPIR-V module, the last one
+    // where an id is decorated more than once, as SPIRV-Cross reads them
+    std::vector<unsigned> Bindings(const std::string& output)
+    {
+        std::vector<unsigned> words(output.size() / 4);
+        memcpy(words.data(), output.data(), words.size() * 4);
+        std::map<unsigned, unsigned> decorated;
+        std::set<unsigned> resources;
+        for (size_t i = 5; i < words.size() && (words[i] >> 16) > 0; i += words[i] >> 16)
+        {
+            unsigned opcode = words[i] & 0xffff;
+            unsigned length = words[i] >> 16;
+            if (opcode == s_opDecorate && length >= 4 && i + 3 < words.size() && words[i + 2] == s_decorationBinding)
+            {
+                decorated[words[i + 1]] = words[i + 3];
+            }
+            else if (opcode == s_opTypeStruct && length >= 2 && i + 1 < words.size())
+            {
+                resources.insert(words[i + 1]);
+            }
+            else if (opcode == s_opVariable && length >= 3 && i + 2 < words.size())
+            {
+                resources.insert(words[i + 2]);
+            }
+        }
+
+        std::vector<unsigned> bindings;
+        for (auto binding : decorated)
+        {
+            if (resources.count(binding.first))
+            {
+                bindings.push_back(binding.second);
+            }
+        }
+        return bindings;
+    }
+
+    // Offset decorations of the members of the struct decorated with binding, by member
+    std::map<unsigned, unsigned> Offsets(const std::string& output, unsigned binding)
+    {
+        std::vector<unsigned> words(output.size() / 4);
+        memcpy(words.data(), output.data(), words.size() * 4);
+        std::map<unsigned, std::map<unsigned, unsigned>> offsets;
+        unsigned block = 0;
+        for (size_t i = 5; i < words.size() && (words[i] >> 16) > 0; i += words[i] >> 16)
+        {
+            unsigned opcode = words[i] & 0xffff;
+            unsigned length = words[i] >> 16;
+            if (opcode == s_opMemberDecorate && length >= 5 && i + 4 < words.size() && words[i + 3] == s_decorationOffset)
+            {
+                offsets[words[i + 1]][words[i + 2]] = words[i + 4];
+            }
+            else if (opcode == s_opDecorate && length >= 4 && i + 3 < words.size() && words[i + 2] == s_decorationBinding && words[i + 3] == binding)
+            {
+                block = words[i + 1];
+            }
+        }
+        return offsets[block];
+    }
+
+    bool Check(const char* name, const Config& config, const std::vector<unsigned>& expected)
+    {
+        Result result;
+        Compile(config, result);
+        if (!result.success || result.resultCount != 2)
+        {
+            fprintf(stderr, "%s failed to compile:\n%s", name, result.errors.c_str());
+            return false;
+        }
+
+        std::vector<unsigned> bindings = Bindings(result.output[1]);
+        std::sort(bindings.begin(), bindings.end());
+        if (bindings != expected)
+        {
+            std::string found;
+            for (unsigned binding : bindings)
+            {
+                found += " " + std::to_string(binding);
+            }
+            fprintf(stderr, "%s: fragment shader bindings are%s\n", name, found.c_str());
+            return false;
+        }
+        return true;
+    }
+}
+
+int main()
+{
+    UniformBlock perFrame;
+    perFrame.name = "PerFrame";
+    perFrame.binding = 2;
+    perFrame.members.push_back({ "float", "time" });
+
+    bool passed = true;
+    passed = Check("sampler only", MakeConfig(s_samplerFragment), { 2, 3 }) && passed;
+
+    Config config = MakeConfig(s_samplerFragment);
+    config.uniformBlocks.push_back(perFrame);
+    passed = Check("sampler only with an unused block", config, { 3, 4 }) && passed;
+
+    // every loose uniform goes into the block, so the shader has no buffer of its own
+    config = MakeConfig(s_blockFragment);
+    config.uniformBlocks.push_back(perFrame);
+    passed = Check("samplers and a block", config, { 2, 3, 4 }) && passed;
+
+    // members the shader doesn't use keep their place in the block
+    UniformBlock layout;
+    layout.name = "Layout";
+    layout.binding = 2;
+    layout.members = { { "mat2", "rotation" }, { "float", "unused" }, { "vec3", "cameraPosition" }, { "vec4", "tint" }, { "mat3", "normalMatrix" }, { "float", "time" } };
+    config = MakeConfig(s_layoutFragment);
+    config.uniformBlocks.push_back(layout);
+    Result result;
+    Compile(config, result);
+    std::map<unsigned, unsigned> expected = { { 0, 0 }, { 1, 48 }, { 2, 64 }, { 3, 80 }, { 4, 128 } };
+    if (!result.success || result.resultCount != 2 || Offsets(result.output[1], 2) != expected)
+    {
+        fprintf(stderr, "block members aren't at their std140 offsets:\n%s", result.errors.c_str());
+        passed = false;
+    }
+
+    printf("%s\n", passed ? "passed" : "FAILED");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,367 @@
+//
+//  shadercross-daemon.cpp
+//  ShaderCross
+//
+//  Compile server. Keeps the compiler initialized and its caches warm for the life of
+//  the process and answers the requests of CompileClient (ShaderClient.hpp) on a Unix
+//  domain socket. Every connection is served by a thread of its own while the
+//  compiles themselves run on a fixed pool of workers.
+//
+
+#include "ShaderClient.hpp"
+#include "ShaderCross.hpp"
+#include "ShaderProtocol.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace ShaderCross;
+
+#ifndef _WIN32
+namespace
+{
+    // Runs submitted work on a fixed number of threads, so the number of compiles in
+    // flight doesn't grow with the number of clients
+    class WorkerPool
+    {
+    public:
+        WorkerPool(unsigned threadCount) : m_stopping(false)
+        {
+            for (unsigned i = 0; i < threadCount; i++)
+            {
+                m_threads.push_back(std::thread([this]() { work(); }));
+            }
+        }
+
+        ~WorkerPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping = true;
+            }
+            m_available.notify_all();
+            for (std::thread& thread : m_threads)
+            {
+                thread.join();
+            }
+        }
+
+        // Runs task on a worker and waits for it to finish
+        void run(const std::function<void()>& task)
+        {
+            std::mutex mutex;
+            std::condition_variable finished;
+            bool done = false;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_tasks.push_back([&]()
+                {
+                    task();
+                    std::lock_guard<std::mutex> doneLock(mutex);
+                    done = true;
+                    finished.notify_one();
+                });
+            }
+            m_available.notify_one();
+
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [&]() { return done; });
+        }
+
+    private:
+        void work()
+        {
+            while (true)
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_available.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+                    if (m_tasks.empty())
+                    {
+                        return;
+                    }
+                    task = std::move(m_tasks.front());
+                    m_tasks.pop_front();
+                }
+                task();
+            }
+        }
+
+        std::mutex m_mutex;
+        std::condition_variable m_available;
+        std::deque<std::function<void()>> m_tasks;
+        std::vector<std::thread> m_threads;
+        bool m_stopping;
+    };
+
+    class Daemon
+    {
+    public:
+        Daemon(unsigned threadCount) : m_pool(threadCount), m_listener(-1), m_connections(0)
+        {
+            m_wake[0] = m_wake[1] = -1;
+        }
+
+        bool listen(const std::string& path);
+        void run();
+        void stop();
+
+    private:
+        void serve(int connection);
+
+        WorkerPool m_pool;
+        std::string m_path;
+        int m_listener;
+        int m_wake[2];
+
+        std::mutex m_mutex;
+        std::condition_variable m_idle;
+        std::set<int> m_open;
+        unsigned m_connections;
+        std::atomic<bool> m_stopping{ false };
+    };
+
+    bool Daemon::listen(const std::string& path)
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+        {
+            fprintf(stderr, "Socket path too long: %s\n", path.c_str());
+            return false;
+        }
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        std::string error;
+        if (!CheckDaemonSocketDirectory(path, true, error))
+        {
+            fprintf(stderr, "%s", error.c_str());
+            return false;
+        }
+
+        // a socket file nobody answers on is left over from a daemon that died
+        CompileClient probe;
+        if (probe.connect(path))
+        {
+            fprintf(stderr, "A daemon is already listening on %s\n", path.c_str());
+            return false;
+        }
+        unlink(path.c_str());
+
+        m_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_listener < 0 || bind(m_listener, (const sockaddr*)&address, sizeof(address)) != 0)
+        {
+            fprintf(stderr, "Can't bind %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        chmod(path.c_str(), S_IRUSR | S_IWUSR);
+        if (::listen(m_listener, SOMAXCONN) != 0 || pipe(m_wake) != 0)
+        {
+            fprintf(stderr, "Can't listen on %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        m_path = path;
+        return true;
+    }
+
+    void Daemon::stop()
+    {
+        if (!m_stopping.exchange(true))
+        {
+            char byte = 0;
+            (void)!write(m_wake[1], &byte, 1);
+        }
+    }
+
+    void Daemon::run()
+    {
+        while (!m_stopping)
+        {
+            pollfd descriptors[2] = { { m_listener, POLLIN, 0 }, { m_wake[0], POLLIN, 0 } };
+            if (poll(descriptors, 2, -1) < 0)
+            {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (!(descriptors[0].revents & POLLIN))
+            {
+                continue;
+            }
+
+            int connection = accept(m_listener, nullptr, nullptr);
+            if (connection < 0)
+            {
+                continue;
+            }
+            // the socket file's permissions aren't honoured everywhere
+            if (!PeerIsCurrentUser(connection))
+            {
+                close(connection);
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_connections++;
+            m_open.insert(connection);
+            std::thread([this, connection]() { serve(connection); }).detach();
+        }
+
+        close(m_listener);
+        unlink(m_path.c_str());
+
+        // answer the requests in flight, connections waiting for their next request
+        // see the end of the stream
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (int connection : m_open)
+        {
+            ::shutdown(connection, SHUT_RD);
+        }
+        m_idle.wait(lock, [this]() { return m_connections == 0; });
+    }
+
+    void Daemon::serve(int connection)
+    {
+        uint32_t type;
+        std::string request;
+        while (!m_stopping && ReadFrame(connection, type, request))
+        {
+            std::string response;
+            bool sent = false;
+            switch (type)
+            {
+            case MessageCompile:
+            {
+                Config config;
+                if (!ReadConfig(request.data(), request.size(), config))
+                {
+                    sent = WriteFrame(connection, MessageError, "Invalid compile request\n");
+                    break;
+                }
+                Result result;
+                m_pool.run([&]() { Compile(config, result); });
+                WriteResult(result, response);
+                sent = WriteFrame(connection, MessageCompile, response);
+                break;
+            }
+            case MessageClearCache:
+                ClearCompileCache();
+                sent = WriteFrame(connection, MessageClearCache, response);
+                break;
+            case MessageShutdown:
+                sent = WriteFrame(connection, MessageShutdown, response);
+                stop();
+                break;
+            default:
+                sent = WriteFrame(connection, MessageError, "Unknown request\n");
+                break;
+            }
+            if (!sent)
+            {
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        close(connection);
+        m_open.erase(connection);
+        m_connections--;
+        m_idle.notify_all();
+    }
+
+    Daemon* s_daemon = nullptr;
+
+    void Stop(int)
+    {
+        if (s_daemon)
+        {
+            s_daemon->stop();
+        }
+    }
+
+    void PrintUsage()
+    {
+        fprintf(stderr,
+                "usage: shadercross-daemon [-j N] [socket]\n"
+                "  -j N    compile N shaders at a time (default: number of cores)\n"
+                "  socket  path of the Unix domain socket to listen on (default: %s)\n",
+                DefaultDaemonSocketPath().c_str());
+    }
+}
+#endif
+
+int main(int argc, char** argv)
+{
+#ifdef _WIN32
+    fprintf(stderr, "shadercross-daemon is not supported on Windows\n");
+    return 1;
+#else
+    unsigned jobCount = std::max(1u, std::thread::hardware_concurrency());
+    std::string socketPath;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc)
+        {
+            jobCount = (unsigned)std::max(1, atoi(argv[++i]));
+        }
+        else if (arg.compare(0, 2, "-j") == 0 && arg.size() > 2)
+        {
+            jobCount = (unsigned)std::max(1, atoi(arg.c_str() + 2));
+        }
+        else if (arg[0] != '-' && socketPath.empty())
+        {
+            socketPath = arg;
+        }
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+    if (socketPath.empty())
+    {
+        socketPath = DefaultDaemonSocketPath();
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    Daemon daemon(jobCount);
+    if (!daemon.listen(socketPath))
+    {
+        return 1;
+    }
+
+    s_daemon = &daemon;
+    signal(SIGINT, Stop);
+    signal(SIGTERM, Stop);
+
+    fprintf(stderr, "shadercross-daemon listening on %s\n", socketPath.c_str());
+    daemon.run();
+    s_daemon = nullptr;
+    return 0;
+#endif
+}
@@ -0,0 +1,1033 @@
+//
+//  shadercross.cpp
+//  ShaderCross
+//
+//  Batch command-line driver. Compiles every shader of a manifest for every target
+//  and define set, and writes the outputs with Make/Ninja style depfiles.
+//
+//  Manifest format, one directive per line, # starts a comment:
+//
+//      output build/shaders
+//      include shaders/include
+//      target gles glsl 300 es android
+//      target metal metal ios
+//      defines base
+//      defines skinned SKINNING BONES=64
+//      attributes position=0 normal=1 texCoord=2 mat4:instanceTransform=3
+//      block PerFrame 8 mat4:viewProjection vec3:cameraPosition float:time
+//      shader sprite vert=shaders/sprite.vert frag=shaders/sprite.frag
+//
+//  Paths are relative to the manifest. Each shader is compiled once per target and
+//  define set, to <output>/<target>/<shader>[.<defines>].<stage>.<extension>, with the
+//  reflection data next to it in a .json file and the dependencies of both in
+//  <output>/<target>/<shader>[.<defines>].d
+//
+//  attributes pins vertex attributes to the same location in every shader and target,
+//  so that one vertex layout can be used with all of them. An attribute that takes
+//  more than one location is given with its type, e.g. mat4 or vec4[4], so that shaders
+//  without it keep all of its locations free.
+//
+//  block declares a uniform block shared by every shader, with its binding and its
+//  members as <type>:<name> in layout order. SPIR-V targets move the uniforms of that
+//  name and type into the block. Bindings 0 and 1 are the shaders' own uniform
+//  buffers, and textures are numbered from 2 on, skipping the bindings of blocks.
+//
+
+#include "ShaderCross.hpp"
+#include "ShaderProcessPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+using namespace ShaderCross;
+
+namespace
+{
+    struct ShaderEntry
+    {
+        std::string name;
+        std::vector<std::pair<ShaderStage, std::string>> stages;
+    };
+
+    struct TargetEntry
+    {
+        std::string name;
+        Target target;
+    };
+
+    struct DefineSet
+    {
+        std::string name;
+        std::string defines;
+    };
+
+    struct Manifest
+    {
+        std::string path;
+        std::string outputPath;
+        std::string includePath;
+        std::vector<ShaderEntry> shaders;
+        std::vector<TargetEntry> targets;
+        std::vector<DefineSet> defineSets;
+        std::map<std::string, int> attributeLocations;
+        std::map<std::string, unsigned> attributeSizes;
+        std::vector<UniformBlock> uniformBlocks;
+    };
+
+    struct Job
+    {
+        const ShaderEntry* shader;
+        const TargetEntry* target;
+        const DefineSet* defineSet;
+    };
+
+    const char* s_stageNames[] = { "vert", "tesc", "tese", "geom", "frag", "comp" };
+
+    // Set by --processes, compiles then run in worker processes
+    CompileProcessPool* s_processPool = nullptr;
+
+    std::string DirectoryOf(const std::string& path)
+    {
+        size_t slash = path.find_last_of("/\\");
+        return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+    }
+
+    std::string ResolvePath(const std::string& base, const std::string& path)
+    {
+        if (path.empty() || path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'))
+        {
+            return path;
+        }
+        return base + path;
+    }
+
+    bool ReadFile(const std::string& path, std::string& contents)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            return false;
+        }
+        std::stringstream stream;
+        stream << file.rdbuf();
+        contents = stream.str();
+        return true;
+    }
+
+    // Leaves files whose contents didn't change untouched, so that build systems
+    // which check timestamps of outputs (e.g. Ninja's restat) can skip dependent steps
+    bool WriteFileIfChanged(const std::string& path, const std::string& contents)
+    {
+        std::string existing;
+        if (ReadFile(path, existing) && existing == contents)
+        {
+            return true;
+        }
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(contents.data(), contents.size());
+        return (bool)file;
+    }
+
+    bool MakeDirectories(const std::string& path)
+    {
+        for (size_t i = 1; i <= path.size(); i++)
+        {
+            if (i == path.size() || path[i] == '/' || path[i] == '\\')
+            {
+                std::string directory = path.substr(0, i);
+#ifdef _WIN32
+                int status = _mkdir(directory.c_str());
+#else
+                int status = mkdir(directory.c_str(), 0777);
+#endif
+                if (status != 0 && errno != EEXIST)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    std::vector<std::string> SplitWords(const std::string& line)
+    {
+        std::vector<std::string> words;
+        std::istringstream stream(line);
+        std::string word;
+        while (stream >> word)
+        {
+            words.push_back(word);
+        }
+        return words;
+    }
+
+    bool ParseStage(const std::string& name, ShaderStage& stage)
+    {
+        for (int i = 0; i < StageCount; i++)
+        {
+            if (name == s_stageNames[i])
+            {
+                stage = (ShaderStage)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool ParseLanguage(const std::string& name, TargetLanguage& lang)
+    {
+        static const std::pair<const char*, TargetLanguage> languages[] = {
+            { "spirv", SpirV }, { "spirvc", SpirVCompact }, { "glsl", GLSL }, { "hlsl", HLSL }, { "metal", Metal }, { "agal", AGAL }, { "varlist", VarList }
+        };
+        for (const auto& language : languages)
+        {
+            if (name == language.first)
+            {
+                lang = language.second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool ParseSystem(const std::string& name, TargetSystem& system)
+    {
+        static const std::pair<const char*, TargetSystem> systems[] = {
+            { "windows", Windows }, { "windowsapp", WindowsApp }, { "osx", OSX }, { "linux", Linux }, { "ios", iOS },
+            { "android", Android }, { "html5", HTML5 }, { "flash", Flash }, { "unity", Unity }
+        };
+        for (const auto& entry : systems)
+        {
+            if (name == entry.first)
+            {
+                system = entry.second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char* Extension(TargetLanguage lang)
+    {
+        switch (lang)
+        {
+        case SpirV:
+            return "spv";
+        case GLSL:
+            return "glsl";
+        case HLSL:
+            return "hlsl";
+        case Metal:
+            return "metal";
+        case AGAL:
+            return "agal";
+        case VarList:
+            return "varlist";
+        case JavaScript:
+            return "js";
+        case SpirVCompact:
+            return "spvc";
+        }
+        return "out";
+    }
+
+    // Number of vertex attribute locations a GLSL type takes, 0 if it isn't one: a
+    // location per matrix column of every array element, two for double vectors of
+    // more than two components
+    unsigned AttributeSize(const std::string& type)
+    {
+        size_t bracket = type.find('[');
+        if (bracket != std::string::npos)
+        {
+            unsigned elements = (unsigned)atoi(type.c_str() + bracket + 1);
+            if (bracket == 0 || type.back() != ']' || !isdigit((unsigned char)type[bracket + 1]) || elements == 0 ||
+                type.find_first_not_of("0123456789", bracket + 1) != type.size() - 1)
+            {
+                return 0;
+            }
+            return AttributeSize(type.substr(0, bracket)) * elements;
+        }
+        static const char* const vectors[] = { "float", "int", "uint", "bool", "double" };
+        for (const char* name : vectors)
+        {
+            if (type == name)
+            {
+                return 1;
+            }
+        }
+        bool wide = type[0] == 'd';
+        std::string base = type.substr(wide ? 1 : 0);
+        if (base.size() == 4 && base.compare(0, 3, "vec") == 0 && base[3] >= '2' && base[3] <= '4')
+        {
+            return wide && base[3] > '2' ? 2 : 1;
+        }
+        if ((type.size() == 5 && (type.compare(0, 4, "ivec") == 0 || type.compare(0, 4, "uvec") == 0 || type.compare(0, 4, "bvec") == 0)) && type[4] >= '2' && type[4] <= '4')
+        {
+            return 1;
+        }
+        // matC or matCxR
+        if (base.compare(0, 3, "mat") == 0 && base.size() >= 4 && base[3] >= '2' && base[3] <= '4' &&
+            (base.size() == 4 || (base.size() == 6 && base[4] == 'x' && base[5] >= '2' && base[5] <= '4')))
+        {
+            char rows = base.size() == 6 ? base[5] : base[3];
+            return (unsigned)(base[3] - '0') * (wide && rows > '2' ? 2 : 1);
+        }
+        return 0;
+    }
+
+    bool ParseManifest(const std::string& path, Manifest& manifest, std::string& error)
+    {
+        std::string contents;
+        if (!ReadFile(path, contents))
+        {
+            error = path + ": cannot read manifest";
+            return false;
+        }
+
+        manifest.path = path;
+        std::string base = DirectoryOf(path);
+        std::istringstream lines(contents);
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(lines, line))
+        {
+            lineNumber++;
+            std::string location = path + ":" + std::to_string(lineNumber) + ": ";
+            size_t comment = line.find('#');
+            if (comment != std::string::npos)
+            {
+                line.erase(comment);
+            }
+
+            std::vector<std::string> words = SplitWords(line);
+            if (words.empty())
+            {
+                continue;
+            }
+
+            const std::string& directive = words[0];
+            if (directive == "output" && words.size() == 2)
+            {
+                manifest.outputPath = ResolvePath(base, words[1]);
+            }
+            else if (directive == "include" && words.size() == 2)
+            {
+                if (!manifest.includePath.empty())
+                {
+                    error = location + "only one include directory is supported";
+                    return false;
+                }
+                manifest.includePath = ResolvePath(base, words[1]);
+                if (manifest.includePath.back() != '/' && manifest.includePath.back() != '\\')
+                {
+                    manifest.includePath += '/';
+                }
+            }
+            else if (directive == "target" && words.size() >= 3)
+            {
+                TargetEntry entry;
+                entry.name = words[1];
+                entry.target.version = 0;
+                entry.target.es = false;
+                entry.target.system = Unknown;
+                if (!ParseLanguage(words[2], entry.target.lang))
+                {
+                    error = location + "unknown language " + words[2];
+                    return false;
+                }
+                for (size_t i = 3; i < words.size(); i++)
+                {
+                    if (words[i] == "es")
+                    {
+                        entry.target.es = true;
+                    }
+                    else if (isdigit((unsigned char)words[i][0]))
+                    {
+                        entry.target.version = atoi(words[i].c_str());
+                    }
+                    else if (!ParseSystem(words[i], entry.target.system))
+                    {
+                        error = location + "unknown target option " + words[i];
+                        return false;
+                    }
+                }
+                manifest.targets.push_back(entry);
+            }
+            else if (directive == "defines" && words.size() >= 2)
+            {
+                DefineSet defineSet;
+                defineSet.name = words[1];
+                for (size_t i = 2; i < words.size(); i++)
+                {
+                    size_t equals = words[i].find('=');
+                    std::string name = words[i].substr(0, equals);
+                    std::string value = equals == std::string::npos ? std::string() : " " + words[i].substr(equals + 1);
+                    defineSet.defines += "#define " + name + value + "\n";
+                }
+                manifest.defineSets.push_back(defineSet);
+            }
+            else if (directive == "attributes" && words.size() >= 2)
+            {
+                for (size_t i = 1; i < words.size(); i++)
+                {
+                    size_t equals = words[i].find('=');
+                    size_t colon = words[i].find(':');
+                    if (equals == std::string::npos || equals + 1 == words[i].size() || !isdigit((unsigned char)words[i][equals + 1]) ||
+                        (colon != std::string::npos && colon > equals))
+                    {
+                        error = location + "expected [<type>:]<attribute>=<location>: " + words[i];
+                        return false;
+                    }
+                    size_t nameStart = colon == std::string::npos ? 0 : colon + 1;
+                    std::string name = words[i].substr(nameStart, equals - nameStart);
+                    manifest.attributeLocations[name] = atoi(words[i].c_str() + equals + 1);
+                    if (colon != std::string::npos)
+                    {
+                        std::string type = words[i].substr(0, colon);
+                        unsigned size = AttributeSize(type);
+                        if (size == 0)
+                        {
+                            error = location + "not a vertex attribute type: " + type;
+                            return false;
+                        }
+                        manifest.attributeSizes[name] = size;
+                    }
+                }
+            }
+            else if (directive == "block" && words.size() >= 4)
+            {
+                if (!isdigit((unsigned char)words[2][0]))
+                {
+                    error = location + "expected block <name> <binding> <type>:<member>...: " + words[2];
+                    return false;
+                }
+                UniformBlock block;
+                block.name = words[1];
+                block.binding = (unsigned)atoi(words[2].c_str());
+                for (size_t i = 3; i < words.size(); i++)
+                {
+                    size_t colon = words[i].find(':');
+                    if (colon == std::string::npos || colon == 0 || colon + 1 == words[i].size())
+                    {
+                        error = location + "expected <type>:<member>: " + words[i];
+                        return false;
+                    }
+                    UniformBlockMember member;
+                    member.type = words[i].substr(0, colon);
+                    member.name = words[i].substr(colon + 1);
+                    block.members.push_back(member);
+                }
+                manifest.uniformBlocks.push_back(block);
+            }
+            else if (directive == "shader" && words.size() >= 3)
+            {
+                ShaderEntry shader;
+                shader.name = words[1];
+                for (size_t i = 2; i < words.size(); i++)
+                {
+                    size_t equals = words[i].find('=');
+                    ShaderStage stage;
+                    if (equals == std::string::npos || !ParseStage(words[i].substr(0, equals), stage))
+                    {
+                        error = location + "expected <stage>=<file>, with stage one of vert, tesc, tese, geom, frag, comp: " + words[i];
+                        return false;
+                    }
+                    shader.stages.push_back(std::make_pair(stage, ResolvePath(base, words[i].substr(equals + 1))));
+                }
+                if (shader.stages.size() > 2)
+                {
+                    error = location + "a shader can have at most two stages";
+                    return false;
+                }
+                // Compile returns the stages in pipeline order
+                std::sort(shader.stages.begin(), shader.stages.end());
+                manifest.shaders.push_back(shader);
+            }
+            else
+            {
+                error = location + "cannot parse: " + line;
+                return false;
+            }
+        }
+
+        if (manifest.outputPath.empty())
+        {
+            manifest.outputPath = base.empty() ? "./" : base;
+        }
+        else if (manifest.outputPath.back() != '/' && manifest.outputPath.back() != '\\')
+        {
+            manifest.outputPath += '/';
+        }
+        if (manifest.defineSets.empty())
+        {
+            manifest.defineSets.push_back(DefineSet());
+        }
+        if (manifest.targets.empty())
+        {
+            error = path + ": no targets";
+            return false;
+        }
+        return true;
+    }
+
+    // Escapes a path for a Make style depfile, which Ninja reads too
+    std::string DepfileEscape(const std::string& path)
+    {
+        std::string escaped;
+        for (char c : path)
+        {
+            if (c == ' ' || c == '#')
+            {
+                escaped += '\\';
+            }
+            else if (c == '$')
+            {
+                escaped += '$';
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    std::string JobName(const Job& job)
+    {
+        return job.shader->name + " (" + job.target->name + (job.defineSet->name.empty() ? "" : ", " + job.defineSet->name) + ")";
+    }
+
+    // Compiles one job, appending anything to report to log. scan receives the headers
+    // the job depends on, even when it fails to compile.
+    bool RunJob(const Manifest& manifest, const Job& job, DependencyScan& scan, std::string& log)
+    {
+        const ShaderEntry& shader = *job.shader;
+        std::string basePath = manifest.outputPath + job.target->name + "/" + shader.name;
+        if (!job.defineSet->name.empty())
+        {
+            basePath += "." + job.defineSet->name;
+        }
+        std::string displayName = JobName(job);
+
+        Config config;
+        config.target = job.target->target;
+        config.stageCount = (uint8_t)shader.stages.size();
+        config.defines = job.defineSet->defines;
+        config.includePath = manifest.includePath;
+        config.includeCallback = nullptr;
+        config.attributeLocations = manifest.attributeLocations;
+        config.attributeSizes = manifest.attributeSizes;
+        config.uniformBlocks = manifest.uniformBlocks;
+        for (size_t i = 0; i < shader.stages.size(); i++)
+        {
+            config.stage[i] = shader.stages[i].first;
+            config.sourceName[i] = shader.stages[i].second;
+            if (!ReadFile(shader.stages[i].second, config.source[i]))
+            {
+                log += displayName + ": cannot read " + shader.stages[i].second + "\n";
+                return false;
+            }
+        }
+
+        // Every header the sources can reach, including ones in disabled #if blocks,
+        // so the build system errs on the side of rebuilding
+        ScanDependencies(config, scan);
+
+        Result result;
+        if (s_processPool)
+        {
+            s_processPool->compile(config, result);
+        }
+        else
+        {
+            Compile(config, result);
+        }
+        if (!result.success)
+        {
+            log += displayName + ": failed\n" + result.errors;
+            if (!result.errors.empty() && result.errors.back() != '\n')
+            {
+                log += "\n";
+            }
+            return false;
+        }
+
+        if (!MakeDirectories(DirectoryOf(basePath)))
+        {
+            log += displayName + ": cannot create " + DirectoryOf(basePath) + "\n";
+            return false;
+        }
+
+        std::vector<std::string> outputs;
+        for (size_t i = 0; i < result.resultCount && i < shader.stages.size(); i++)
+        {
+            std::string stagePath = basePath + "." + s_stageNames[shader.stages[i].first];
+            std::string outputPath = stagePath + "." + Extension(config.target.lang);
+            std::string jsonPath = stagePath + ".json";
+            if (!WriteFileIfChanged(outputPath, result.output[i]) || !WriteFileIfChanged(jsonPath, result.json[i]))
+            {
+                log += displayName + ": cannot write " + stagePath + "\n";
+                return false;
+            }
+            outputs.push_back(outputPath);
+            outputs.push_back(jsonPath);
+        }
+
+        std::string depfile;
+        for (const std::string& output : outputs)
+        {
+            depfile += (depfile.empty() ? "" : " ") + DepfileEscape(output);
+        }
+        depfile += ":";
+        depfile += " \\\n  " + DepfileEscape(manifest.path);
+        for (const auto& stage : shader.stages)
+        {
+            depfile += " \\\n  " + DepfileEscape(stage.second);
+        }
+        for (const std::string& include : scan.includes)
+        {
+            depfile += " \\\n  " + DepfileEscape(include);
+        }
+        depfile += "\n";
+
+        if (!WriteFileIfChanged(basePath + ".d", depfile))
+        {
+            log += displayName + ": cannot write " + basePath + ".d\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Runs the selected jobs on jobCount threads, printing what they report as they
+    // finish, and returns how many failed. scans[index] receives the dependencies of
+    // jobs[index].
+    size_t RunJobs(const Manifest& manifest, const std::vector<Job>& jobs, const std::vector<size_t>& selected, unsigned jobCount,
+                   bool reportSuccess, std::vector<DependencyScan>& scans)
+    {
+        std::atomic<size_t> nextJob(0);
+        std::atomic<size_t> failed(0);
+        std::mutex logMutex;
+        auto worker = [&]()
+        {
+            for (size_t next = nextJob++; next < selected.size(); next = nextJob++)
+            {
+                size_t index = selected[next];
+                auto start = std::chrono::steady_clock::now();
+                std::string log;
+                scans[index] = DependencyScan();
+                bool success = RunJob(manifest, jobs[index], scans[index], log);
+                if (!success)
+                {
+                    failed++;
+                }
+                else if (reportSuccess)
+                {
+                    auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+                    log += JobName(jobs[index]) + ": compiled in " + std::to_string(milliseconds) + " ms\n";
+                }
+                if (!log.empty())
+                {
+                    std::lock_guard<std::mutex> lock(logMutex);
+                    fputs(log.c_str(), stderr);
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < std::min<size_t>(jobCount, selected.size()); i++)
+        {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        return failed;
+    }
+
+    // Replaces manifest and jobs with the ones of the manifest at manifestPath, leaving
+    // them alone if it can't be parsed
+    bool LoadManifest(const std::string& manifestPath, const std::string& outputPath, Manifest& manifest, std::vector<Job>& jobs)
+    {
+        std::string error;
+        Manifest parsed;
+        if (!ParseManifest(manifestPath, parsed, error))
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            return false;
+        }
+        if (!outputPath.empty())
+        {
+            parsed.outputPath = outputPath;
+            if (parsed.outputPath.back() != '/' && parsed.outputPath.back() != '\\')
+            {
+                parsed.outputPath += '/';
+            }
+        }
+
+        manifest = std::move(parsed);
+        jobs.clear();
+        for (const auto& shader : manifest.shaders)
+        {
+            for (const auto& target : manifest.targets)
+            {
+                for (const auto& defineSet : manifest.defineSets)
+                {
+                    jobs.push_back({ &shader, &target, &defineSet });
+                }
+            }
+        }
+        return true;
+    }
+
+#ifdef __linux__
+    // Absolute path with symlinks resolved, also for files that don't exist (yet)
+    std::string CanonicalPath(const std::string& path)
+    {
+        std::string directory = DirectoryOf(path);
+        std::string name = path.substr(directory.size());
+        char resolved[PATH_MAX];
+        if (!realpath(directory.empty() ? "." : directory.c_str(), resolved))
+        {
+            return path;
+        }
+        return std::string(resolved) + "/" + name;
+    }
+
+    // Keeps the dependency graph of every job in memory and recompiles only the jobs
+    // whose sources or headers change. inotify watches the directories rather than the
+    // files, since editors often save by replacing a file.
+    class Watcher
+    {
+    public:
+        Watcher(const Manifest& manifest, const std::vector<Job>& jobs, unsigned jobCount)
+            : m_manifest(manifest), m_jobs(jobs), m_jobCount(jobCount), m_dependencies(jobs.size())
+        {
+            m_fd = inotify_init1(IN_CLOEXEC);
+        }
+
+        ~Watcher()
+        {
+            if (m_fd >= 0) close(m_fd);
+        }
+
+        // Returns when the manifest changes, or false if watching failed
+        bool run(std::vector<DependencyScan>& scans)
+        {
+            if (m_fd < 0)
+            {
+                perror("inotify_init1");
+                return false;
+            }
+
+            m_manifestPath = CanonicalPath(m_manifest.path);
+            watchDirectory(DirectoryOf(m_manifestPath));
+            for (size_t job = 0; job < m_jobs.size(); job++)
+            {
+                updateDependencies(job, scans[job]);
+            }
+            fprintf(stderr, "watching %zu files for %zu shaders\n", m_dependents.size(), m_jobs.size());
+
+            while (true)
+            {
+                std::set<std::string> changed;
+                bool overflow = false;
+                if (!readChanges(changed, overflow))
+                {
+                    return false;
+                }
+
+                if (changed.count(m_manifestPath))
+                {
+                    fprintf(stderr, "%s changed, reloading\n", m_manifest.path.c_str());
+                    return true;
+                }
+
+                std::set<size_t> affected;
+                for (const std::string& path : changed)
+                {
+                    auto dependents = m_dependents.find(path);
+                    if (dependents != m_dependents.end())
+                    {
+                        affected.insert(dependents->second.begin(), dependents->second.end());
+                    }
+                }
+                if (overflow)
+                {
+                    for (size_t job = 0; job < m_jobs.size(); job++) affected.insert(job);
+                }
+                if (affected.empty())
+                {
+                    continue;
+                }
+
+                std::vector<size_t> selected(affected.begin(), affected.end());
+                RunJobs(m_manifest, m_jobs, selected, m_jobCount, true, scans);
+                for (size_t job : selected)
+                {
+                    updateDependencies(job, scans[job]);
+                }
+            }
+        }
+
+    private:
+        void watchDirectory(const std::string& directory)
+        {
+            if (m_watches.count(directory))
+            {
+                return;
+            }
+            int wd = inotify_add_watch(m_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+            m_watches[directory] = wd;
+            if (wd >= 0)
+            {
+                m_directories[wd] = directory;
+            }
+        }
+
+        void updateDependencies(size_t job, const DependencyScan& scan)
+        {
+            for (const std::string& path : m_dependencies[job])
+            {
+                m_dependents[path].erase(job);
+            }
+
+            std::vector<std::string> paths;
+            for (const auto& stage : m_jobs[job].shader->stages)
+            {
+                paths.push_back(CanonicalPath(stage.second));
+            }
+            for (const std::string& include : scan.includes)
+            {
+                paths.push_back(CanonicalPath(include));
+            }
+            // Headers that don't exist yet are looked up below the include path,
+            // so creating one there triggers a rebuild too
+            for (const std::string& missing : scan.missing)
+            {
+                if (!m_manifest.includePath.empty())
+                {
+                    paths.push_back(CanonicalPath(m_manifest.includePath + missing));
+                }
+            }
+
+            for (const std::string& path : paths)
+            {
+                m_dependents[path].insert(job);
+                watchDirectory(DirectoryOf(path));
+            }
+            m_dependencies[job] = paths;
+        }
+
+        // Blocks until files change, then collects changes until things have been
+        // quiet for a moment, since saving a file usually produces several events
+        bool readChanges(std::set<std::string>& changed, bool& overflow)
+        {
+            alignas(struct inotify_event) char buffer[16384];
+            int timeout = -1;
+            while (true)
+            {
+                pollfd descriptor = { m_fd, POLLIN, 0 };
+                int ready = poll(&descriptor, 1, timeout);
+                if (ready < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (ready < 0)
+                {
+                    perror("poll");
+                    return false;
+                }
+                if (ready == 0)
+                {
+                    return true;
+                }
+
+                ssize_t length = read(m_fd, buffer, sizeof(buffer));
+                if (length < 0 && errno != EINTR && errno != EAGAIN)
+                {
+                    perror("read");
+                    return false;
+                }
+                for (ssize_t offset = 0; offset < length; )
+                {
+                    const inotify_event* event = (const inotify_event*)(buffer + offset);
+                    offset += sizeof(inotify_event) + event->len;
+                    if (event->mask & IN_Q_OVERFLOW)
+                    {
+                        overflow = true;
+                        continue;
+                    }
+                    auto directory = m_directories.find(event->wd);
+                    if (directory != m_directories.end() && event->len > 0)
+                    {
+                        changed.insert(directory->second + event->name);
+                    }
+                }
+                timeout = s_settleMilliseconds;
+            }
+        }
+
+        static const int s_settleMilliseconds = 30;
+
+        const Manifest& m_manifest;
+        const std::vector<Job>& m_jobs;
+        unsigned m_jobCount;
+        int m_fd;
+        std::string m_manifestPath;
+        std::map<std::string, int> m_watches;
+        std::map<int, std::string> m_directories;
+        std::map<std::string, std::set<size_t>> m_dependents;
+        std::vector<std::vector<std::string>> m_dependencies;
+    };
+#endif
+
+    void PrintUsage()
+    {
+        fprintf(stderr,
+                "usage: shadercross [-j N] [-o output] [--processes] [--watch] manifest\n"
+                "  -j N         compile N shaders at a time (default: number of cores)\n"
+                "  -o output    write outputs and depfiles below this directory instead of the manifest's output\n"
+                "  --processes  compile in worker processes, so a compiler crash only fails the shader it happened in\n"
+                "  --watch      after building, recompile shaders whenever their sources or headers change\n");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    unsigned jobCount = std::max(1u, std::thread::hardware_concurrency());
+    std::string outputPath;
+    std::string manifestPath;
+    bool watch = false;
+    bool processes = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc)
+        {
+            jobCount = (unsigned)std::max(1, atoi(argv[++i]));
+        }
+        else if (arg.compare(0, 2, "-j") == 0 && arg.size() > 2)
+        {
+            jobCount = (unsigned)std::max(1, atoi(arg.c_str() + 2));
+        }
+        else if (arg == "-o" && i + 1 < argc)
+        {
+            outputPath = argv[++i];
+        }
+        else if (arg == "--processes")
+        {
+            processes = true;
+        }
+        else if (arg == "--watch")
+        {
+            watch = true;
+        }
+        else if (arg[0] != '-' && manifestPath.empty())
+        {
+            manifestPath = arg;
+        }
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    if (manifestPath.empty())
+    {
+        PrintUsage();
+        return 1;
+    }
+
+#ifdef _WIN32
+    if (processes)
+    {
+        fprintf(stderr, "--processes is not supported on Windows\n");
+        return 1;
+    }
+#endif
+
+#ifndef __linux__
+    if (watch)
+    {
+        fprintf(stderr, "--watch is only supported on Linux\n");
+        return 1;
+    }
+#endif
+
+    // before any compile thread starts, see CompileProcessPool
+    std::unique_ptr<CompileProcessPool> processPool;
+    if (processes)
+    {
+        processPool.reset(new CompileProcessPool(jobCount));
+        s_processPool = processPool.get();
+    }
+
+    Manifest manifest;
+    std::vector<Job> jobs;
+    if (!LoadManifest(manifestPath, outputPath, manifest, jobs))
+    {
+        return 1;
+    }
+
+    std::vector<DependencyScan> scans;
+    bool build = true;
+    while (true)
+    {
+        if (build)
+        {
+            std::vector<size_t> all(jobs.size());
+            for (size_t i = 0; i < jobs.size(); i++) all[i] = i;
+            scans.assign(jobs.size(), DependencyScan());
+            size_t failed = RunJobs(manifest, jobs, all, jobCount, false, scans);
+            if (failed > 0)
+            {
+                fprintf(stderr, "%zu of %zu shaders failed\n", failed, jobs.size());
+            }
+
+            if (!watch)
+            {
+                return failed > 0 ? 1 : 0;
+            }
+        }
+
+#ifdef __linux__
+        Watcher watcher(manifest, jobs, jobCount);
+        if (!watcher.run(scans))
+        {
+            return 1;
+        }
+
+        // The manifest changed. Keep watching with the previous one if the new one
+        // doesn't parse, until the next change.
+        build = LoadManifest(manifestPath, outputPath, manifest, jobs);
+#endif
+    }
+}
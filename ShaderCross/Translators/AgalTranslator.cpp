@@ -40,9 +40,11 @@ namespace {
 		Type() : name("unknown"), length(1), isarray(false) {}
 	};
 
-	std::map<unsigned, Variable> variables;
-	std::map<unsigned, Type> types;
-	std::vector<ConstantVariable> constants;
+	// Per thread, so translations running concurrently don't share them.
+	// outputCode clears them before use.
+	thread_local std::map<unsigned, Variable> variables;
+	thread_local std::map<unsigned, Type> types;
+	thread_local std::vector<ConstantVariable> constants;
 
 	enum Opcode {
 		con, // pseudo instruction for constants
@@ -45,6 +45,10 @@ void GlslTranslator2::outputCode(const Target& target, const char* sourcefilenam
 	}
 	compiler->set_common_options(opts);
 
+	if (stage == StageVertex && !attributes.empty()) {
+		pinAttributeLocations(*compiler, attributes);
+	}
+
 	std::string glsl = compiler->compile();
 	if (output) {
 		strcpy(output, glsl.c_str());
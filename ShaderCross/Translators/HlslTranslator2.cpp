@@ -39,6 +39,12 @@ void HlslTranslator2::outputCode(const Target& target, const char* sourcefilenam
 	}
 	compiler->set_hlsl_options(opts);
 
+	// with a registry the TEXCOORD semantics follow the pinned locations
+	bool pinned = stage == StageVertex && !attributes.empty();
+	if (pinned) {
+		pinAttributeLocations(*compiler, attributes);
+	}
+
 	std::string hlsl = compiler->compile();
 	if (output) {
 		strcpy(output, hlsl.c_str());
@@ -50,7 +56,23 @@ void HlslTranslator2::outputCode(const Target& target, const char* sourcefilenam
 		out.close();
 	}
 
-	if (stage == StageVertex) {
+	if (pinned) {
+		// matrices are passed as one attribute per column
+		auto variables = compiler->get_active_interface_variables();
+		for (auto var : variables) {
+			auto attribute = attributes.find(compiler->get_name(var));
+			if (compiler->get_storage_class(var) == spv::StorageClassInput && attribute != attributes.end() &&
+				compiler->get_type_from_variable(var).vecsize == 4 && compiler->get_type_from_variable(var).columns == 4) {
+				std::string name = attribute->first;
+				int location = attribute->second;
+				attributes.erase(attribute);
+				for (int column = 0; column < 4; ++column) {
+					attributes[name + "_" + std::to_string(column)] = location + column;
+				}
+			}
+		}
+	}
+	else if (stage == StageVertex) {
 		std::vector<std::string> inputs;
 		auto variables = compiler->get_active_interface_variables();
 		for (auto var : variables) {
@@ -65,6 +65,10 @@ void MetalTranslator2::outputCode(const Target& target, const char* sourcefilena
 	mslBinding.msl_buffer = stage == StageVertex ? 1 : 0;
 	compiler->add_msl_resource_binding(mslBinding);
     
+	if (stage == StageVertex && !attributes.empty()) {
+		pinAttributeLocations(*compiler, attributes);
+	}
+
 	std::string metal = compiler->compile();
     
 	if (output) {
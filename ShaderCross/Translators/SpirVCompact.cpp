@@ -0,0 +1,206 @@
+#include "SpirVCompact.h"
+
+#include <string.h>
+
+using namespace ShaderCross;
+
+namespace {
+	const uint8_t magic[4] = { 'S', 'P', 'V', 'C' };
+	const unsigned spirvMagic = 0x07230203;
+
+	// Opcodes whose first operand is a result type and second a result id. The tables
+	// only decide how operands are packed, the encoding stays lossless for any opcode
+	// that is missing.
+	bool hasResultType(unsigned op) {
+		if (op == 99 /* OpImageWrite */ || op == 228 /* OpAtomicStore */) return false;
+		return op == 1 /* OpUndef */
+			|| op == 12 /* OpExtInst */
+			|| (op >= 41 && op <= 52) /* constants and spec constants */
+			|| op == 54 /* OpFunction */ || op == 55 /* OpFunctionParameter */ || op == 57 /* OpFunctionCall */
+			|| (op >= 59 && op <= 61) /* OpVariable, OpImageTexelPointer, OpLoad */
+			|| (op >= 65 && op <= 70) /* access chains */
+			|| (op >= 77 && op <= 84) /* vector and composite operations */
+			|| (op >= 86 && op <= 107) /* images */
+			|| (op >= 109 && op <= 126) /* conversions */
+			|| (op >= 126 && op <= 152) /* arithmetic */
+			|| (op >= 154 && op <= 205) /* relational, logical and bit operations */
+			|| (op >= 207 && op <= 215) /* derivatives */
+			|| (op >= 227 && op <= 242) /* atomics */
+			|| op == 245 /* OpPhi */;
+	}
+
+	bool hasResultId(unsigned op) {
+		return hasResultType(op)
+			|| op == 7 /* OpString */ || op == 11 /* OpExtInstImport */
+			|| (op >= 19 && op <= 38) /* types */
+			|| op == 73 /* OpDecorationGroup */ || op == 248 /* OpLabel */;
+	}
+
+	// Index of the operand a literal string starts at, or -1
+	int stringOperand(unsigned op) {
+		switch (op) {
+		case 2: /* OpSourceContinued */
+		case 4: /* OpSourceExtension */
+		case 10: /* OpExtension */
+		case 330: /* OpModuleProcessed */
+			return 0;
+		case 5: /* OpName */
+		case 7: /* OpString */
+		case 11: /* OpExtInstImport */
+			return 1;
+		case 6: /* OpMemberName */
+		case 15: /* OpEntryPoint */
+			return 2;
+		default:
+			return -1;
+		}
+	}
+
+	void writeVarint(std::vector<uint8_t>& out, unsigned value) {
+		while (value >= 0x80) {
+			out.push_back((uint8_t)(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back((uint8_t)value);
+	}
+
+	unsigned zigzag(int value) {
+		return ((unsigned)value << 1) ^ (unsigned)(value >> 31);
+	}
+
+	int unzigzag(unsigned value) {
+		return (int)(value >> 1) ^ -(int)(value & 1);
+	}
+
+	class Reader {
+	public:
+		Reader(const uint8_t* data, size_t length) : p(data), end(data + length) {}
+
+		bool varint(unsigned& value) {
+			if (p < end && *p < 0x80) {
+				value = *p++;
+				return true;
+			}
+			value = 0;
+			for (unsigned shift = 0; shift < 35; shift += 7) {
+				if (p >= end) return false;
+				uint8_t byte = *p++;
+				value |= (unsigned)(byte & 0x7f) << shift;
+				if (byte < 0x80) return true;
+			}
+			return false;
+		}
+
+		bool word(unsigned& value) {
+			if (end - p < 4) return false;
+			value = (unsigned)p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16) | ((unsigned)p[3] << 24);
+			p += 4;
+			return true;
+		}
+
+		bool done() const { return p == end; }
+
+	private:
+		const uint8_t* p;
+		const uint8_t* end;
+	};
+}
+
+bool ShaderCross::IsCompactSpirV(const uint8_t* data, size_t length) {
+	return length >= sizeof(magic) && memcmp(data, magic, sizeof(magic)) == 0;
+}
+
+bool ShaderCross::EncodeCompactSpirV(const std::vector<unsigned>& spirv, std::vector<uint8_t>& encoded) {
+	encoded.clear();
+	if (spirv.size() < 5 || spirv[0] != spirvMagic) return false;
+
+	encoded.reserve(spirv.size() * 2);
+	encoded.insert(encoded.end(), magic, magic + sizeof(magic));
+	for (unsigned i = 1; i < 5; ++i) writeVarint(encoded, spirv[i]);
+
+	unsigned lastResult = 0;
+	size_t index = 5;
+	while (index < spirv.size()) {
+		unsigned opcode = spirv[index] & 0xffff;
+		unsigned wordCount = spirv[index] >> 16;
+		if (wordCount == 0 || index + wordCount > spirv.size()) return false;
+
+		writeVarint(encoded, opcode);
+		writeVarint(encoded, wordCount);
+
+		const unsigned* operands = &spirv[index + 1];
+		unsigned operandCount = wordCount - 1;
+		unsigned resultIndex = hasResultId(opcode) ? (hasResultType(opcode) ? 1 : 0) : operandCount;
+		unsigned stringIndex = (unsigned)stringOperand(opcode);
+
+		for (unsigned i = 0; i < operandCount; ++i) {
+			unsigned operand = operands[i];
+			if (i == stringIndex) {
+				// four bytes per word up to the word holding the terminator
+				for (; i < operandCount; ++i) {
+					unsigned word = operands[i];
+					encoded.push_back((uint8_t)word);
+					encoded.push_back((uint8_t)(word >> 8));
+					encoded.push_back((uint8_t)(word >> 16));
+					encoded.push_back((uint8_t)(word >> 24));
+					if ((word >> 24) == 0) break;
+				}
+			}
+			else if (i == resultIndex) {
+				writeVarint(encoded, zigzag((int)(operand - lastResult - 1)));
+				lastResult = operand;
+			}
+			else {
+				writeVarint(encoded, operand);
+			}
+		}
+
+		index += wordCount;
+	}
+	return true;
+}
+
+bool ShaderCross::DecodeCompactSpirV(const uint8_t* data, size_t length, std::vector<unsigned>& spirv) {
+	spirv.clear();
+	if (!IsCompactSpirV(data, length)) return false;
+
+	Reader reader(data + sizeof(magic), length - sizeof(magic));
+	// no word takes less than a byte to encode
+	spirv.reserve(length);
+	spirv.push_back(spirvMagic);
+	for (unsigned i = 1; i < 5; ++i) {
+		unsigned value;
+		if (!reader.varint(value)) return false;
+		spirv.push_back(value);
+	}
+
+	unsigned lastResult = 0;
+	while (!reader.done()) {
+		unsigned opcode, wordCount;
+		if (!reader.varint(opcode) || !reader.varint(wordCount) || wordCount == 0 || opcode > 0xffff || wordCount > 0xffff) return false;
+		spirv.push_back((wordCount << 16) | opcode);
+
+		unsigned operandCount = wordCount - 1;
+		unsigned resultIndex = hasResultId(opcode) ? (hasResultType(opcode) ? 1 : 0) : operandCount;
+		unsigned stringIndex = (unsigned)stringOperand(opcode);
+
+		for (unsigned i = 0; i < operandCount; ++i) {
+			unsigned operand;
+			if (i == stringIndex) {
+				for (; i < operandCount; ++i) {
+					if (!reader.word(operand)) return false;
+					spirv.push_back(operand);
+					if ((operand >> 24) == 0) break;
+				}
+				continue;
+			}
+			if (!reader.varint(operand)) return false;
+			if (i == resultIndex) {
+				operand = lastResult + 1 + (unsigned)unzigzag(operand);
+				lastResult = operand;
+			}
+			spirv.push_back(operand);
+		}
+	}
+	return true;
+}
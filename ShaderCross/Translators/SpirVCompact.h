@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ShaderCross
+{
+	// Lossless compact encoding of SPIR-V for storage, along the lines of SMOL-V:
+	// opcodes, word counts and operands are varints, result ids are stored as the
+	// difference to the previous result id and literal strings are stored as bytes.
+	// Typically less than half the size of the raw words, before any general-purpose
+	// compression.
+
+	// Returns false if spirv isn't a SPIR-V module
+	bool EncodeCompactSpirV(const std::vector<unsigned>& spirv, std::vector<uint8_t>& encoded);
+
+	// Returns false if data isn't a complete compact encoding
+	bool DecodeCompactSpirV(const uint8_t* data, size_t length, std::vector<unsigned>& spirv);
+
+	// Whether data starts like a compact encoding rather than raw SPIR-V
+	bool IsCompactSpirV(const uint8_t* data, size_t length);
+}
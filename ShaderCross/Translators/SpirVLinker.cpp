@@ -0,0 +1,819 @@
+#include "SpirVLinker.h"
+#include "Translator.h"
+#include <algorithm>
+#include <map>
+#include <set>
+
+using namespace ShaderCross;
+
+namespace {
+	struct LinkInstruction {
+		unsigned opcode;
+		std::vector<unsigned> operands;
+	};
+
+	// Sections of a module in the order the specification requires them
+	enum Section {
+		SectionCapabilities,
+		SectionExtensions,
+		SectionImports,
+		SectionMemoryModel,
+		SectionEntryPoints,
+		SectionExecutionModes,
+		SectionDebugSources,
+		SectionDebugNames,
+		SectionDebugProcessed,
+		SectionAnnotations,
+		SectionGlobals,
+		SectionCount
+	};
+
+	const unsigned OpModuleProcessed = 330;
+	const unsigned OpExecutionModeId = 331;
+	const unsigned OpDecorateId = 332;
+	const unsigned OpDecorateString = 5632;
+	const unsigned OpMemberDecorateString = 5633;
+
+	Section sectionOf(unsigned opcode) {
+		using namespace spv;
+		switch (opcode) {
+		case OpCapability:
+			return SectionCapabilities;
+		case OpExtension:
+			return SectionExtensions;
+		case OpExtInstImport:
+			return SectionImports;
+		case OpMemoryModel:
+			return SectionMemoryModel;
+		case OpEntryPoint:
+			return SectionEntryPoints;
+		case OpExecutionMode:
+		case OpExecutionModeId:
+			return SectionExecutionModes;
+		case OpString:
+		case OpSource:
+		case OpSourceExtension:
+		case OpSourceContinued:
+			return SectionDebugSources;
+		case OpName:
+		case OpMemberName:
+			return SectionDebugNames;
+		case OpModuleProcessed:
+			return SectionDebugProcessed;
+		case OpDecorate:
+		case OpMemberDecorate:
+		case OpDecorationGroup:
+		case OpGroupDecorate:
+		case OpGroupMemberDecorate:
+		case OpDecorateId:
+		case OpDecorateString:
+		case OpMemberDecorateString:
+			return SectionAnnotations;
+		default:
+			return SectionGlobals;
+		}
+	}
+
+	bool isType(unsigned opcode) {
+		return (opcode >= spv::OpTypeVoid && opcode <= spv::OpTypeForwardPointer) || opcode == 322 /* OpTypePipeStorage */ || opcode == 327 /* OpTypeNamedBarrier */;
+	}
+
+	bool isAnnotationOfId(unsigned opcode) {
+		return opcode == spv::OpDecorate || opcode == spv::OpMemberDecorate || opcode == OpDecorateId || opcode == OpDecorateString || opcode == OpMemberDecorateString;
+	}
+
+	enum OperandKind {
+		OperandId,
+		OperandLiteral,
+		OperandUnknown
+	};
+
+	OperandKind idIf(bool id) {
+		return id ? OperandId : OperandLiteral;
+	}
+
+	// Whether an operand is an id rather than a literal, result ids count as ids. Opcodes
+	// missing here are unknown rather than assumed to take ids, as renumbering a literal
+	// would silently change what the module does.
+	OperandKind operandKind(unsigned opcode, unsigned index) {
+		using namespace spv;
+		switch (opcode) {
+		case OpCapability:
+		case OpExtension:
+		case OpMemoryModel:
+		case OpSource:
+		case OpSourceExtension:
+		case OpSourceContinued:
+		case OpModuleProcessed:
+			return OperandLiteral;
+		case OpTypeInt:
+		case OpTypeFloat:
+		case OpTypeOpaque:
+		case OpTypePipe:
+		case OpExtInstImport:
+		case OpString:
+		case OpName:
+		case OpMemberName:
+		case OpDecorate:
+		case OpMemberDecorate:
+		case OpDecorateString:
+		case OpMemberDecorateString:
+		case OpExecutionMode:
+		case OpLine:
+		case OpLifetimeStart:
+		case OpLifetimeStop:
+			return idIf(index == 0);
+		case OpEntryPoint:
+			return idIf(index == 1);
+		case OpTypeVector:
+		case OpTypeMatrix:
+		case OpTypeImage:
+		case OpConstant:
+		case OpSpecConstant:
+		case OpConstantSampler:
+			return idIf(index <= 1);
+		case OpTypePointer:
+		case OpTypeForwardPointer:
+			return idIf(index != 1);
+		case OpVariable:
+		case OpFunction:
+		case OpSpecConstantOp:
+			return idIf(index != 2);
+		case OpExtInst:
+		case OpGenericCastToPtrExplicit:
+			return idIf(index != 3);
+		case OpSelectionMerge:
+			return idIf(index < 1);
+		case OpStore:
+		case OpCopyMemory:
+		case OpLoopMerge:
+			return idIf(index < 2);
+		case OpLoad:
+		case OpCompositeExtract:
+		case OpCopyMemorySized:
+		case OpBranchConditional:
+		case OpArrayLength:
+			return idIf(index < 3);
+		case OpCompositeInsert:
+		case OpVectorShuffle:
+			return idIf(index < 4);
+		case OpSwitch:
+			return idIf(index < 2 || index % 2 == 1);
+		case OpGroupMemberDecorate:
+			return idIf(index % 2 == 0);
+		case OpImageWrite:
+			return idIf(index != 3);
+		case OpImageSampleImplicitLod:
+		case OpImageSampleExplicitLod:
+		case OpImageSampleProjImplicitLod:
+		case OpImageSampleProjExplicitLod:
+		case OpImageFetch:
+		case OpImageRead:
+		case OpImageSparseSampleImplicitLod:
+		case OpImageSparseSampleExplicitLod:
+		case OpImageSparseSampleProjImplicitLod:
+		case OpImageSparseSampleProjExplicitLod:
+		case OpImageSparseFetch:
+		case OpImageSparseRead:
+			return idIf(index != 4);
+		case OpImageSampleDrefImplicitLod:
+		case OpImageSampleDrefExplicitLod:
+		case OpImageSampleProjDrefImplicitLod:
+		case OpImageSampleProjDrefExplicitLod:
+		case OpImageGather:
+		case OpImageDrefGather:
+		case OpImageSparseSampleDrefImplicitLod:
+		case OpImageSparseSampleDrefExplicitLod:
+		case OpImageSparseSampleProjDrefImplicitLod:
+		case OpImageSparseSampleProjDrefExplicitLod:
+		case OpImageSparseGather:
+		case OpImageSparseDrefGather:
+			return idIf(index != 5);
+		case OpNop:
+		case OpUndef:
+		case OpExecutionModeId:
+		case OpDecorateId:
+		case OpDecorationGroup:
+		case OpGroupDecorate:
+		case OpTypeVoid:
+		case OpTypeBool:
+		case OpTypeSampler:
+		case OpTypeSampledImage:
+		case OpTypeArray:
+		case OpTypeRuntimeArray:
+		case OpTypeStruct:
+		case OpTypeFunction:
+		case OpTypeEvent:
+		case OpTypeDeviceEvent:
+		case OpTypeReserveId:
+		case OpTypeQueue:
+		case 322: // OpTypePipeStorage
+		case 327: // OpTypeNamedBarrier
+		case OpConstantTrue:
+		case OpConstantFalse:
+		case OpConstantComposite:
+		case OpConstantNull:
+		case OpSpecConstantTrue:
+		case OpSpecConstantFalse:
+		case OpSpecConstantComposite:
+		case OpFunctionParameter:
+		case OpFunctionEnd:
+		case OpFunctionCall:
+		case OpImageTexelPointer:
+		case OpAccessChain:
+		case OpInBoundsAccessChain:
+		case OpPtrAccessChain:
+		case OpGenericPtrMemSemantics:
+		case OpInBoundsPtrAccessChain:
+		case OpVectorExtractDynamic:
+		case OpVectorInsertDynamic:
+		case OpCompositeConstruct:
+		case OpCopyObject:
+		case OpTranspose:
+		case OpSampledImage:
+		case OpImage:
+		case OpImageQueryFormat:
+		case OpImageQueryOrder:
+		case OpImageQuerySizeLod:
+		case OpImageQuerySize:
+		case OpImageQueryLod:
+		case OpImageQueryLevels:
+		case OpImageQuerySamples:
+		case OpImageSparseTexelsResident:
+		case OpBitcast:
+		case OpPhi:
+		case OpLabel:
+		case OpBranch:
+		case OpKill:
+		case OpReturn:
+		case OpReturnValue:
+		case OpUnreachable:
+		case OpNoLine:
+		case OpEmitVertex:
+		case OpEndPrimitive:
+		case OpEmitStreamVertex:
+		case OpEndStreamPrimitive:
+		case OpControlBarrier:
+		case OpMemoryBarrier:
+			return OperandId;
+		default:
+			// conversions, arithmetic, relational and logical, bit, derivative and atomic
+			// instructions, whose scopes and memory semantics are ids too
+			if ((opcode >= OpConvertFToU && opcode <= OpGenericCastToPtr) || (opcode >= OpSNegate && opcode <= OpSMulExtended) ||
+				(opcode >= OpAny && opcode <= OpFUnordGreaterThanEqual) || (opcode >= OpShiftRightLogical && opcode <= OpBitCount) ||
+				(opcode >= OpDPdx && opcode <= OpFwidthCoarse) || (opcode >= OpAtomicLoad && opcode <= OpAtomicXor)) {
+				return OperandId;
+			}
+			// group operations take their operation as a literal
+			if ((opcode >= OpGroupIAdd && opcode <= OpGroupSMax) || opcode == 342 /* OpGroupNonUniformBallotBitCount */ || (opcode >= 349 && opcode <= 364) /* OpGroupNonUniformIAdd to OpGroupNonUniformLogicalXor */) {
+				return idIf(index != 3);
+			}
+			if ((opcode >= 333 && opcode <= 348) /* OpGroupNonUniformElect to OpGroupNonUniformShuffleDown */ || opcode == 365 || opcode == 366 /* OpGroupNonUniformQuadBroadcast and QuadSwap */ ||
+				opcode == 4416 /* OpTerminateInvocation */ || opcode == 5380 /* OpDemoteToHelperInvocation */ || opcode == 5381 /* OpIsHelperInvocationEXT */) {
+				return OperandId;
+			}
+			return OperandUnknown;
+		}
+	}
+
+	std::string literalString(const std::vector<unsigned>& operands, size_t index) {
+		std::string string;
+		for (; index < operands.size(); ++index) {
+			for (unsigned byte = 0; byte < 4; ++byte) {
+				char c = (char)((operands[index] >> (byte * 8)) & 0xff);
+				if (c == 0) return string;
+				string += c;
+			}
+		}
+		return string;
+	}
+
+	bool parse(const std::vector<unsigned>& spirv, std::vector<LinkInstruction>& instructions) {
+		if (spirv.size() < 5 || spirv[0] != spv::MagicNumber) return false;
+
+		std::vector<unsigned> words = spirv;
+		unsigned index = 5;
+		while (index < words.size()) {
+			unsigned wordCount = words[index] >> 16;
+			if (wordCount == 0 || index + wordCount > words.size()) return false;
+			Instruction instruction(words, index);
+			LinkInstruction copy;
+			copy.opcode = (unsigned)instruction.opcode;
+			copy.operands.assign(instruction.operands, instruction.operands + instruction.length);
+			instructions.push_back(copy);
+		}
+		return true;
+	}
+
+	typedef std::map<unsigned, std::vector<std::vector<unsigned>>> Decorations;
+
+	// The decorations of each id without their target, sorted so they compare equal
+	// regardless of the order they were emitted in
+	Decorations collectDecorations(const std::vector<LinkInstruction>& instructions) {
+		Decorations decorations;
+		for (const LinkInstruction& instruction : instructions) {
+			if (isAnnotationOfId(instruction.opcode) && !instruction.operands.empty()) {
+				std::vector<unsigned> decoration(1, instruction.opcode);
+				decoration.insert(decoration.end(), instruction.operands.begin() + 1, instruction.operands.end());
+				decorations[instruction.operands[0]].push_back(decoration);
+			}
+		}
+		for (auto& entry : decorations) {
+			std::sort(entry.second.begin(), entry.second.end());
+		}
+		return decorations;
+	}
+
+	unsigned resultIndex(unsigned opcode) {
+		return isType(opcode) || opcode == spv::OpExtInstImport || opcode == spv::OpString ? 0 : 1;
+	}
+
+	// Identifies a type or constant by its operands, which have to be ids of the stage
+	// already, its decorations and for structs its name
+	std::vector<unsigned> typeKey(const LinkInstruction& instruction, const std::vector<std::vector<unsigned>>* decorations, const std::string& name) {
+		std::vector<unsigned> key(1, instruction.opcode);
+		unsigned result = resultIndex(instruction.opcode);
+		for (unsigned i = 0; i < instruction.operands.size(); ++i) {
+			if (i != result) key.push_back(instruction.operands[i]);
+		}
+		key.push_back(0xffffffff);
+		if (decorations) {
+			for (const auto& decoration : *decorations) {
+				key.push_back((unsigned)decoration.size());
+				key.insert(key.end(), decoration.begin(), decoration.end());
+			}
+		}
+		if (instruction.opcode == spv::OpTypeStruct) {
+			key.insert(key.end(), name.begin(), name.end());
+		}
+		return key;
+	}
+
+	class Linker {
+	public:
+		Linker(std::vector<LinkInstruction>& stage, unsigned& bound, const std::vector<LinkInstruction>& module, std::string& errors)
+			: module(module), bound(bound), errors(errors) {
+			indexStage(stage);
+			indexModule();
+		}
+
+		bool link();
+		void write(std::vector<unsigned>& spirv);
+
+	private:
+		void indexStage(std::vector<LinkInstruction>& stage);
+		void indexModule();
+		std::string variableKey(unsigned variable, unsigned pointerType, const std::map<unsigned, const LinkInstruction*>& definitions, const std::map<unsigned, std::string>& names);
+		unsigned importGlobal(unsigned id);
+		unsigned importVariable(unsigned id, const LinkInstruction& instruction);
+		unsigned importFunction(unsigned id);
+		unsigned importBodyId(unsigned id, std::map<unsigned, unsigned>& locals);
+		bool emitFunction(unsigned id);
+		void copyAnnotations(unsigned id, unsigned target);
+		void copyNames(unsigned id, unsigned target);
+		void removeLocals(const std::vector<LinkInstruction>& body);
+		unsigned fail(const std::string& message);
+
+		std::vector<LinkInstruction> sections[SectionCount];
+		std::vector<std::vector<LinkInstruction>> functions;
+
+		std::map<unsigned, size_t> stageFunctionIndices;
+		std::map<std::string, unsigned> stageFunctions;
+		std::set<unsigned> stageGlobals;
+		std::map<std::string, unsigned> stageImports;
+		std::map<std::vector<unsigned>, unsigned> stageTypes;
+		std::map<std::string, unsigned> stageVariables;
+		std::set<unsigned> stageEntryPoints;
+
+		const std::vector<LinkInstruction>& module;
+		std::map<unsigned, const LinkInstruction*> moduleDefinitions;
+		std::map<unsigned, std::pair<size_t, size_t>> moduleFunctions;
+		std::map<unsigned, std::string> moduleNames;
+		std::map<unsigned, std::vector<const LinkInstruction*>> moduleNameInstructions;
+		std::map<unsigned, std::vector<const LinkInstruction*>> moduleAnnotations;
+		Decorations moduleDecorations;
+		std::set<unsigned> moduleEntryPoints;
+
+		std::map<unsigned, unsigned> imported;
+		std::vector<unsigned> pending;
+		std::set<unsigned> replaced;
+		unsigned& bound;
+		std::string& errors;
+		bool failed = false;
+	};
+
+	unsigned Linker::fail(const std::string& message) {
+		errors += "Linking module: " + message + "\n";
+		failed = true;
+		return 0;
+	}
+
+	// Variables are matched by name, by the name of the block they hold and by their
+	// storage class, as both modules were compiled from the same declarations
+	std::string Linker::variableKey(unsigned variable, unsigned pointerType, const std::map<unsigned, const LinkInstruction*>& definitions, const std::map<unsigned, std::string>& names) {
+		std::string key;
+		auto name = names.find(variable);
+		if (name != names.end()) key += name->second;
+		key += '/';
+		auto pointer = definitions.find(pointerType);
+		if (pointer != definitions.end() && pointer->second->opcode == spv::OpTypePointer && pointer->second->operands.size() > 2) {
+			key += std::to_string(pointer->second->operands[1]) + '/';
+			auto pointee = names.find(pointer->second->operands[2]);
+			if (pointee != names.end()) key += pointee->second;
+		}
+		return key;
+	}
+
+	void Linker::indexStage(std::vector<LinkInstruction>& stage) {
+		std::map<unsigned, std::string> names;
+		for (LinkInstruction& instruction : stage) {
+			if (instruction.opcode == spv::OpFunction) {
+				functions.push_back(std::vector<LinkInstruction>());
+			}
+			if (!functions.empty()) {
+				functions.back().push_back(instruction);
+				continue;
+			}
+
+			Section section = sectionOf(instruction.opcode);
+			sections[section].push_back(instruction);
+			if (instruction.opcode == spv::OpName && !instruction.operands.empty()) {
+				names[instruction.operands[0]] = literalString(instruction.operands, 1);
+			}
+			else if (instruction.opcode == spv::OpEntryPoint && instruction.operands.size() > 1) {
+				stageEntryPoints.insert(instruction.operands[1]);
+			}
+		}
+
+		for (size_t i = 0; i < functions.size(); ++i) {
+			const LinkInstruction& function = functions[i].front();
+			if (function.operands.size() < 2) continue;
+			unsigned id = function.operands[1];
+			stageFunctionIndices[id] = i;
+			stageGlobals.insert(id);
+			auto name = names.find(id);
+			if (name != names.end() && !stageEntryPoints.count(id)) {
+				stageFunctions[name->second] = id;
+			}
+		}
+
+		for (const LinkInstruction& instruction : sections[SectionImports]) {
+			if (!instruction.operands.empty()) {
+				stageImports[literalString(instruction.operands, 1)] = instruction.operands[0];
+				stageGlobals.insert(instruction.operands[0]);
+			}
+		}
+
+		std::map<unsigned, const LinkInstruction*> definitions;
+		for (const LinkInstruction& instruction : sections[SectionGlobals]) {
+			unsigned result = resultIndex(instruction.opcode);
+			if (instruction.opcode != spv::OpLine && instruction.opcode != spv::OpNoLine && result < instruction.operands.size()) {
+				definitions[instruction.operands[result]] = &instruction;
+				stageGlobals.insert(instruction.operands[result]);
+			}
+		}
+
+		Decorations decorations = collectDecorations(sections[SectionAnnotations]);
+		for (const auto& definition : definitions) {
+			const LinkInstruction& instruction = *definition.second;
+			if (instruction.opcode == spv::OpVariable) {
+				stageVariables[variableKey(definition.first, instruction.operands[0], definitions, names)] = definition.first;
+				continue;
+			}
+			auto decoration = decorations.find(definition.first);
+			auto name = names.find(definition.first);
+			stageTypes[typeKey(instruction, decoration != decorations.end() ? &decoration->second : nullptr, name != names.end() ? name->second : "")] = definition.first;
+		}
+	}
+
+	void Linker::indexModule() {
+		bool inFunctions = false;
+		unsigned function = 0;
+		for (size_t i = 0; i < module.size(); ++i) {
+			const LinkInstruction& instruction = module[i];
+			if (instruction.opcode == spv::OpFunction && instruction.operands.size() > 1) {
+				function = instruction.operands[1];
+				moduleFunctions[function] = std::make_pair(i, module.size());
+				inFunctions = true;
+			}
+			else if (instruction.opcode == spv::OpFunctionEnd && inFunctions) {
+				moduleFunctions[function].second = i + 1;
+			}
+			if (inFunctions) continue;
+
+			switch (sectionOf(instruction.opcode)) {
+			case SectionDebugNames:
+				if (!instruction.operands.empty()) {
+					moduleNameInstructions[instruction.operands[0]].push_back(&instruction);
+					if (instruction.opcode == spv::OpName) moduleNames[instruction.operands[0]] = literalString(instruction.operands, 1);
+				}
+				break;
+			case SectionAnnotations:
+				if (isAnnotationOfId(instruction.opcode) && !instruction.operands.empty()) {
+					moduleAnnotations[instruction.operands[0]].push_back(&instruction);
+				}
+				break;
+			case SectionEntryPoints:
+				if (instruction.operands.size() > 1) moduleEntryPoints.insert(instruction.operands[1]);
+				break;
+			case SectionImports:
+			case SectionGlobals: {
+				unsigned result = resultIndex(instruction.opcode);
+				if (instruction.opcode != spv::OpLine && instruction.opcode != spv::OpNoLine && result < instruction.operands.size()) {
+					moduleDefinitions[instruction.operands[result]] = &instruction;
+				}
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+		std::vector<LinkInstruction> annotations;
+		for (const auto& entry : moduleAnnotations) {
+			for (const LinkInstruction* instruction : entry.second) annotations.push_back(*instruction);
+		}
+		moduleDecorations = collectDecorations(annotations);
+	}
+
+	void Linker::copyAnnotations(unsigned id, unsigned target) {
+		auto annotations = moduleAnnotations.find(id);
+		if (annotations == moduleAnnotations.end()) return;
+		for (const LinkInstruction* instruction : annotations->second) {
+			LinkInstruction copy = *instruction;
+			copy.operands[0] = target;
+			if (copy.opcode == OpDecorateId) {
+				for (size_t i = 2; i < copy.operands.size(); ++i) copy.operands[i] = importGlobal(copy.operands[i]);
+			}
+			sections[SectionAnnotations].push_back(copy);
+		}
+	}
+
+	void Linker::copyNames(unsigned id, unsigned target) {
+		auto names = moduleNameInstructions.find(id);
+		if (names == moduleNameInstructions.end()) return;
+		for (const LinkInstruction* instruction : names->second) {
+			LinkInstruction copy = *instruction;
+			copy.operands[0] = target;
+			sections[SectionDebugNames].push_back(copy);
+		}
+	}
+
+	unsigned Linker::importGlobal(unsigned id) {
+		auto found = imported.find(id);
+		if (found != imported.end()) return found->second;
+		if (moduleFunctions.count(id)) return importFunction(id);
+
+		auto definition = moduleDefinitions.find(id);
+		if (definition == moduleDefinitions.end()) {
+			return fail("id " + std::to_string(id) + " is not defined");
+		}
+		const LinkInstruction& instruction = *definition->second;
+
+		if (instruction.opcode == spv::OpExtInstImport) {
+			std::string name = literalString(instruction.operands, 1);
+			auto stageImport = stageImports.find(name);
+			unsigned result;
+			if (stageImport != stageImports.end()) {
+				result = stageImport->second;
+			}
+			else {
+				LinkInstruction copy = instruction;
+				copy.operands[0] = result = bound++;
+				sections[SectionImports].push_back(copy);
+				stageImports[name] = result;
+			}
+			imported[id] = result;
+			return result;
+		}
+		if (instruction.opcode == spv::OpVariable) {
+			return importVariable(id, instruction);
+		}
+		if (instruction.opcode == spv::OpTypeForwardPointer || instruction.opcode == spv::OpString) {
+			return fail("unsupported global instruction " + std::to_string(instruction.opcode));
+		}
+
+		unsigned result = resultIndex(instruction.opcode);
+		LinkInstruction copy = instruction;
+		for (unsigned i = 0; i < copy.operands.size(); ++i) {
+			OperandKind kind = operandKind(copy.opcode, i);
+			if (kind == OperandUnknown) {
+				return fail("unsupported instruction " + std::to_string(copy.opcode));
+			}
+			if (i != result && kind == OperandId) {
+				copy.operands[i] = importGlobal(instruction.operands[i]);
+				if (failed) return 0;
+			}
+		}
+
+		auto decoration = moduleDecorations.find(id);
+		auto name = moduleNames.find(id);
+		std::vector<unsigned> key = typeKey(copy, decoration != moduleDecorations.end() ? &decoration->second : nullptr, name != moduleNames.end() ? name->second : "");
+		auto existing = stageTypes.find(key);
+		if (existing != stageTypes.end()) {
+			imported[id] = existing->second;
+			return existing->second;
+		}
+
+		copy.operands[result] = bound++;
+		imported[id] = copy.operands[result];
+		stageTypes[key] = copy.operands[result];
+		stageGlobals.insert(copy.operands[result]);
+		sections[SectionGlobals].push_back(copy);
+		copyAnnotations(id, copy.operands[result]);
+		copyNames(id, copy.operands[result]);
+		return copy.operands[result];
+	}
+
+	unsigned Linker::importVariable(unsigned id, const LinkInstruction& instruction) {
+		if (instruction.operands.size() < 3) return fail("invalid variable");
+
+		std::string key = variableKey(id, instruction.operands[0], moduleDefinitions, moduleNames);
+		auto existing = stageVariables.find(key);
+		if (existing != stageVariables.end()) {
+			imported[id] = existing->second;
+			return existing->second;
+		}
+
+		// the stage was compiled against the same declarations, but glslang only
+		// emits the variables a stage uses
+		LinkInstruction copy = instruction;
+		copy.operands[0] = importGlobal(instruction.operands[0]);
+		if (copy.operands.size() > 3) copy.operands[3] = importGlobal(instruction.operands[3]);
+		if (failed) return 0;
+
+		unsigned result = copy.operands[1] = bound++;
+		imported[id] = result;
+		stageVariables[key] = result;
+		stageGlobals.insert(result);
+		sections[SectionGlobals].push_back(copy);
+		copyAnnotations(id, result);
+		copyNames(id, result);
+
+		unsigned storage = instruction.operands[2];
+		if (storage == spv::StorageClassInput || storage == spv::StorageClassOutput) {
+			for (LinkInstruction& entryPoint : sections[SectionEntryPoints]) {
+				entryPoint.operands.push_back(result);
+			}
+		}
+		return result;
+	}
+
+	unsigned Linker::importFunction(unsigned id) {
+		auto found = imported.find(id);
+		if (found != imported.end()) return found->second;
+
+		unsigned result;
+		auto name = moduleNames.find(id);
+		auto stageFunction = name != moduleNames.end() ? stageFunctions.find(name->second) : stageFunctions.end();
+		if (stageFunction != stageFunctions.end()) {
+			result = stageFunction->second;
+			replaced.insert(result);
+		}
+		else {
+			// a helper the stage never called, so its stub got dropped
+			result = bound++;
+			copyNames(id, result);
+		}
+		imported[id] = result;
+		stageGlobals.insert(result);
+		pending.push_back(id);
+		return result;
+	}
+
+	unsigned Linker::importBodyId(unsigned id, std::map<unsigned, unsigned>& locals) {
+		if (moduleFunctions.count(id) || moduleDefinitions.count(id)) {
+			return importGlobal(id);
+		}
+		auto local = locals.find(id);
+		if (local != locals.end()) return local->second;
+		return locals[id] = bound++;
+	}
+
+	// Drops the names and decorations of the ids a replaced body defined
+	void Linker::removeLocals(const std::vector<LinkInstruction>& body) {
+		std::set<unsigned> locals;
+		for (const LinkInstruction& instruction : body) {
+			for (unsigned i = 0; i < instruction.operands.size(); ++i) {
+				OperandKind kind = operandKind(instruction.opcode, i);
+				if (kind == OperandUnknown) {
+					fail("unsupported instruction " + std::to_string(instruction.opcode));
+					return;
+				}
+				if (kind == OperandId && !stageGlobals.count(instruction.operands[i])) {
+					locals.insert(instruction.operands[i]);
+				}
+			}
+		}
+
+		for (Section section : { SectionDebugNames, SectionAnnotations }) {
+			std::vector<LinkInstruction>& instructions = sections[section];
+			instructions.erase(std::remove_if(instructions.begin(), instructions.end(), [&](const LinkInstruction& instruction) {
+				return (section == SectionDebugNames || isAnnotationOfId(instruction.opcode)) && !instruction.operands.empty() && locals.count(instruction.operands[0]);
+			}), instructions.end());
+		}
+	}
+
+	bool Linker::emitFunction(unsigned id) {
+		std::pair<size_t, size_t> range = moduleFunctions[id];
+		std::vector<LinkInstruction> body;
+		std::map<unsigned, unsigned> locals;
+		for (size_t i = range.first; i < range.second; ++i) {
+			const LinkInstruction& instruction = module[i];
+			if (instruction.opcode == spv::OpLine || instruction.opcode == spv::OpNoLine) continue;
+
+			LinkInstruction copy = instruction;
+			for (unsigned operand = 0; operand < copy.operands.size(); ++operand) {
+				OperandKind kind = operandKind(copy.opcode, operand);
+				if (kind == OperandUnknown) {
+					fail("unsupported instruction " + std::to_string(copy.opcode));
+					return false;
+				}
+				if (kind == OperandId) {
+					copy.operands[operand] = importBodyId(instruction.operands[operand], locals);
+				}
+			}
+			if (failed) return false;
+			body.push_back(copy);
+		}
+
+		for (const auto& local : locals) {
+			copyAnnotations(local.first, local.second);
+		}
+
+		unsigned result = imported[id];
+		auto existing = stageFunctionIndices.find(result);
+		if (existing != stageFunctionIndices.end()) {
+			removeLocals(functions[existing->second]);
+			functions[existing->second] = body;
+		}
+		else {
+			stageFunctionIndices[result] = functions.size();
+			functions.push_back(body);
+		}
+		return !failed;
+	}
+
+	bool Linker::link() {
+		for (const auto& function : moduleFunctions) {
+			auto name = moduleNames.find(function.first);
+			if (!moduleEntryPoints.count(function.first) && name != moduleNames.end() && stageFunctions.count(name->second)) {
+				importFunction(function.first);
+			}
+		}
+		if (pending.empty()) return true;
+
+		while (!pending.empty() && !failed) {
+			unsigned id = pending.back();
+			pending.pop_back();
+			emitFunction(id);
+		}
+		if (failed) return false;
+
+		std::set<unsigned> capabilities;
+		for (const LinkInstruction& instruction : sections[SectionCapabilities]) capabilities.insert(instruction.operands[0]);
+		std::set<std::string> extensions;
+		for (const LinkInstruction& instruction : sections[SectionExtensions]) extensions.insert(literalString(instruction.operands, 0));
+		for (const LinkInstruction& instruction : module) {
+			if (instruction.opcode == spv::OpCapability && capabilities.insert(instruction.operands[0]).second) {
+				sections[SectionCapabilities].push_back(instruction);
+			}
+			else if (instruction.opcode == spv::OpExtension && extensions.insert(literalString(instruction.operands, 0)).second) {
+				sections[SectionExtensions].push_back(instruction);
+			}
+		}
+		return true;
+	}
+
+	void Linker::write(std::vector<unsigned>& spirv) {
+		std::vector<unsigned> header(spirv.begin(), spirv.begin() + 5);
+		header[3] = bound;
+		spirv = header;
+
+		auto append = [&](const LinkInstruction& instruction) {
+			spirv.push_back(((unsigned)(instruction.operands.size() + 1) << 16) | instruction.opcode);
+			spirv.insert(spirv.end(), instruction.operands.begin(), instruction.operands.end());
+		};
+		for (int section = 0; section < SectionCount; ++section) {
+			for (const LinkInstruction& instruction : sections[section]) append(instruction);
+		}
+		for (const auto& function : functions) {
+			for (const LinkInstruction& instruction : function) append(instruction);
+		}
+	}
+}
+
+bool ShaderCross::LinkSpirV(std::vector<unsigned>& spirv, const std::vector<unsigned>& module, std::string& errors) {
+	std::vector<LinkInstruction> stageInstructions;
+	std::vector<LinkInstruction> moduleInstructions;
+	if (!parse(spirv, stageInstructions) || !parse(module, moduleInstructions)) {
+		errors += "Linking module: invalid SPIR-V\n";
+		return false;
+	}
+
+	unsigned bound = spirv[3];
+	Linker linker(stageInstructions, bound, moduleInstructions, errors);
+	if (!linker.link()) return false;
+	linker.write(spirv);
+	return true;
+}
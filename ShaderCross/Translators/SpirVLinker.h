@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace ShaderCross
+{
+	// Links a module compiled from a shared header into the SPIR-V of a stage that was
+	// compiled against the header's stub. Every function of the stage that the module
+	// defines under the same name gets the module's body, and the types, constants,
+	// global variables and helper functions those bodies use are merged into the stage,
+	// reusing what the stage already declares and renumbering the rest.
+	// Returns false and appends to errors if the module doesn't fit the stage.
+	bool LinkSpirV(std::vector<unsigned>& spirv, const std::vector<unsigned>& module, std::string& errors);
+}
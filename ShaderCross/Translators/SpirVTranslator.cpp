@@ -1,9 +1,11 @@
 #include "SpirVTranslator.h"
+#include "SpirVCompact.h"
 #include <glslang/SPIRV/spirv.hpp>
 #include <glslang/glslang/Public/ShaderLang.h>
 #include <algorithm>
 #include <fstream>
 #include <map>
+#include <set>
 #include <string.h>
 #include <sstream>
 #include <strstream>
@@ -47,6 +49,18 @@ namespace {
 		unsigned pointertype;
 	};
 
+	// A uniform buffer loose uniforms are packed into, the shader's own
+	// _k_global_uniform_buffer or one of the shared Config::uniformBlocks
+	struct UniformBuffer {
+		std::string name;
+		unsigned binding;
+		std::vector<Var> members;
+		std::vector<unsigned> offsets;
+		std::vector<unsigned> structtypeindices; // operands to set to the struct type once it has an id
+		unsigned structvarindex;
+		unsigned structid;
+	};
+
 	bool varcompare(const Var& a, const Var& b) {
 		return strcmp(a.name.c_str(), b.name.c_str()) < 0;
 	}
@@ -74,6 +88,28 @@ namespace {
 	}
 }
 
+unsigned ShaderCross::uniformTypeSize(const std::string& type) {
+	if (type == "bool" || type == "int" || type == "float") return 4;
+	if (type == "vec2") return 8;
+	if (type == "vec3") return 12;
+	if (type == "vec4" || type == "mat2") return 16;
+	if (type == "mat3") return 36;
+	if (type == "mat4") return 64;
+	return 0;
+}
+
+unsigned ShaderCross::uniformBlockLayout(const UniformBlock& block, std::vector<unsigned>& offsets) {
+	unsigned offset = 0;
+	for (auto& member : block.members) {
+		unsigned alignment = member.type == "vec2" ? 8 : uniformTypeSize(member.type) <= 4 ? 4 : 16;
+		unsigned size = member.type == "mat2" ? 32 : member.type == "mat3" ? 48 : uniformTypeSize(member.type);
+		offset = (offset + alignment - 1) / alignment * alignment;
+		offsets.push_back(offset);
+		offset += size;
+	}
+	return (offset + 15) / 16 * 16;
+}
+
 void SpirVTranslator::writeInstructions(const char* filename, char* output, std::vector<Instruction>& instructions) {
 	std::ofstream fileout;
 	std::ostrstream arrayout(output, 1024 * 1024);
@@ -87,21 +123,34 @@ void SpirVTranslator::writeInstructions(const char* filename, char* output, std:
 		out = &fileout;
 	}
 
-	writeInstruction(out, magicNumber);
-	writeInstruction(out, version);
-	writeInstruction(out, generator);
-	writeInstruction(out, bound);
-	writeInstruction(out, schema);
+	std::vector<unsigned> words;
+	words.push_back(magicNumber);
+	words.push_back(version);
+	words.push_back(generator);
+	words.push_back(bound);
+	words.push_back(schema);
 
 	for (unsigned i = 0; i < instructions.size(); ++i) {
 		Instruction& inst = instructions[i];
-		writeInstruction(out, ((inst.length + 1) << 16) | (unsigned)inst.opcode);
-		for (unsigned i2 = 0; i2 < inst.length; ++i2) {
-			writeInstruction(out, inst.operands[i2]);
+		words.push_back(((inst.length + 1) << 16) | (unsigned)inst.opcode);
+		words.insert(words.end(), inst.operands, inst.operands + inst.length);
+	}
+
+	if (compact) {
+		std::vector<uint8_t> encoded;
+		EncodeCompactSpirV(words, encoded);
+		out->write((const char*)encoded.data(), encoded.size());
+	}
+	else {
+		for (unsigned word : words) {
+			writeInstruction(out, word);
 		}
 	}
 
-	if (!output) {
+	if (output) {
+		written = (size_t)arrayout.pcount();
+	}
+	else {
 		fileout.close();
 	}
 }
@@ -109,50 +158,82 @@ void SpirVTranslator::writeInstructions(const char* filename, char* output, std:
 namespace {
 	using namespace spv;
 
-	void outputNames(unsigned* instructionsData, unsigned& instructionsDataIndex, std::vector<unsigned>& structtypeindices, unsigned& structvarindex, std::vector<Instruction>& newinstructions, std::vector<Var>& uniforms) {
-		if (uniforms.size() > 0) {
+	void outputNames(unsigned* instructionsData, unsigned& instructionsDataIndex, std::vector<Instruction>& newinstructions, std::vector<UniformBuffer>& buffers) {
+		for (auto& buffer : buffers) {
 			Instruction structtypename(OpName, &instructionsData[instructionsDataIndex], 0);
-			structtypeindices.push_back(instructionsDataIndex);
+			buffer.structtypeindices.push_back(instructionsDataIndex);
 			instructionsData[instructionsDataIndex++] = 0;
-			structtypename.length = 1 + copyname("_k_global_uniform_buffer_type", instructionsData, instructionsDataIndex);
+			structtypename.length = 1 + copyname(buffer.name + "_type", instructionsData, instructionsDataIndex);
 			newinstructions.push_back(structtypename);
 
 			Instruction structname(OpName, &instructionsData[instructionsDataIndex], 0);
-			structvarindex = instructionsDataIndex;
+			buffer.structvarindex = instructionsDataIndex;
 			instructionsData[instructionsDataIndex++] = 0;
-			structname.length = 1 + copyname("_k_global_uniform_buffer", instructionsData, instructionsDataIndex);
+			structname.length = 1 + copyname(buffer.name, instructionsData, instructionsDataIndex);
 			newinstructions.push_back(structname);
 
-			for (unsigned i = 0; i < uniforms.size(); ++i) {
+			for (unsigned i = 0; i < buffer.members.size(); ++i) {
 				Instruction name(OpMemberName, &instructionsData[instructionsDataIndex], 0);
-				structtypeindices.push_back(instructionsDataIndex);
+				buffer.structtypeindices.push_back(instructionsDataIndex);
 				instructionsData[instructionsDataIndex++] = 0;
 				instructionsData[instructionsDataIndex++] = i;
-				name.length = 2 + copyname(uniforms[i].name, instructionsData, instructionsDataIndex);
+				name.length = 2 + copyname(buffer.members[i].name, instructionsData, instructionsDataIndex);
 				newinstructions.push_back(name);
 			}
 		}
 	}
 
-	unsigned booltype = 0;
-	unsigned inttype = 0;
-	unsigned floattype = 0;
-	unsigned vec4type = 0;
-	unsigned vec3type = 0;
-	unsigned vec2type = 0;
-	unsigned mat4type = 0;
-	unsigned mat3type = 0;
-	unsigned mat2type = 0;
+	// Ids of the basic types found in (or added to) the module being translated
+	struct BasicTypes {
+		unsigned booltype = 0;
+		unsigned inttype = 0;
+		unsigned floattype = 0;
+		unsigned vec4type = 0;
+		unsigned vec3type = 0;
+		unsigned vec2type = 0;
+		unsigned mat4type = 0;
+		unsigned mat3type = 0;
+		unsigned mat2type = 0;
+	};
 
-	void outputDecorations(unsigned* instructionsData, unsigned& instructionsDataIndex, std::vector<unsigned>& structtypeindices, std::vector<Instruction>& newinstructions, std::vector<Var>& uniforms,
-		std::map<unsigned, unsigned>& pointers, std::vector<Var>& invars, std::vector<Var>& outvars, std::vector<Var>& images, ShaderStage stage) {
+	// Name of a uniform's type in Config::uniformBlocks, empty if it can't be in a block
+	std::string typeName(unsigned type, BasicTypes& types) {
+		if (type == 0) return "";
+		if (type == types.booltype) return "bool";
+		if (type == types.inttype) return "int";
+		if (type == types.floattype) return "float";
+		if (type == types.vec2type) return "vec2";
+		if (type == types.vec3type) return "vec3";
+		if (type == types.vec4type) return "vec4";
+		if (type == types.mat2type) return "mat2";
+		if (type == types.mat3type) return "mat3";
+		if (type == types.mat4type) return "mat4";
+		return "";
+	}
+
+	void outputDecorations(unsigned* instructionsData, unsigned& instructionsDataIndex, std::vector<Instruction>& newinstructions, std::vector<UniformBuffer>& buffers,
+		std::map<unsigned, unsigned>& pointers, std::vector<Var>& invars, std::vector<Var>& outvars, std::vector<Var>& images, BasicTypes& types, ShaderStage stage,
+		std::map<std::string, int>& attributes, const std::map<std::string, unsigned>& attributeSizes, const std::set<unsigned>& blockbindings,
+		std::map<unsigned, unsigned>& locationcounts) {
+
+		// vertex attributes named in the registry go to their pinned locations,
+		// matrices, arrays and wide doubles taking several
+		std::vector<int> locations;
+		if (stage == StageVertex && !attributes.empty()) {
+			std::vector<std::pair<std::string, unsigned>> inputs;
+			for (auto var : invars) {
+				unsigned type = pointers[var.type];
+				inputs.push_back(std::make_pair(var.name, locationcounts.count(type) ? locationcounts[type] : 1));
+			}
+			locations = assignAttributeLocations(inputs, attributes, attributeSizes);
+		}
 
 		unsigned location = 0;
-		for (auto var : invars) {
+		for (unsigned i = 0; i < invars.size(); ++i) {
 			Instruction newinst(OpDecorate, &instructionsData[instructionsDataIndex], 3);
-			instructionsData[instructionsDataIndex++] = var.id;
+			instructionsData[instructionsDataIndex++] = invars[i].id;
 			instructionsData[instructionsDataIndex++] = DecorationLocation;
-			instructionsData[instructionsDataIndex++] = location;
+			instructionsData[instructionsDataIndex++] = locations.empty() ? location : (unsigned)locations[i];
 			newinstructions.push_back(newinst);
 			++location;
 		}
@@ -165,8 +246,12 @@ namespace {
 			newinstructions.push_back(newinst);
 			++location;
 		}
+		// textures are numbered from 2 on, past the shared blocks' bindings
 		unsigned binding = 2;
 		for (auto var : images) {
+			while (blockbindings.count(binding)) {
+				++binding;
+			}
 			Instruction newinst(OpDecorate, &instructionsData[instructionsDataIndex], 3);
 			instructionsData[instructionsDataIndex++] = var.id;
 			instructionsData[instructionsDataIndex++] = DecorationBinding;
@@ -174,70 +259,61 @@ namespace {
 			newinstructions.push_back(newinst);
 			++binding;
 		}
-		unsigned offset = 0;
-		for (unsigned i = 0; i < uniforms.size(); ++i) {
-			Instruction newinst(OpMemberDecorate, &instructionsData[instructionsDataIndex], 4);
-			structtypeindices.push_back(instructionsDataIndex);
-			instructionsData[instructionsDataIndex++] = 0;
-			instructionsData[instructionsDataIndex++] = i;
-			instructionsData[instructionsDataIndex++] = DecorationOffset;
-			instructionsData[instructionsDataIndex++] = offset;
-			newinstructions.push_back(newinst);
-
-			int utype = pointers[uniforms[i].type];
-
-			if (utype == mat2type || utype == mat3type || utype == mat4type) {
-				Instruction dec2(OpMemberDecorate, &instructionsData[instructionsDataIndex], 3);
-				structtypeindices.push_back(instructionsDataIndex);
+		for (auto& buffer : buffers) {
+			for (unsigned i = 0; i < buffer.members.size(); ++i) {
+				Instruction newinst(OpMemberDecorate, &instructionsData[instructionsDataIndex], 4);
+				buffer.structtypeindices.push_back(instructionsDataIndex);
 				instructionsData[instructionsDataIndex++] = 0;
 				instructionsData[instructionsDataIndex++] = i;
-				instructionsData[instructionsDataIndex++] = DecorationColMajor;
-				newinstructions.push_back(dec2);
+				instructionsData[instructionsDataIndex++] = DecorationOffset;
+				instructionsData[instructionsDataIndex++] = buffer.offsets[i];
+				newinstructions.push_back(newinst);
+
+				int utype = pointers[buffer.members[i].type];
+
+				if (utype == types.mat2type || utype == types.mat3type || utype == types.mat4type) {
+					Instruction dec2(OpMemberDecorate, &instructionsData[instructionsDataIndex], 3);
+					buffer.structtypeindices.push_back(instructionsDataIndex);
+					instructionsData[instructionsDataIndex++] = 0;
+					instructionsData[instructionsDataIndex++] = i;
+					instructionsData[instructionsDataIndex++] = DecorationColMajor;
+					newinstructions.push_back(dec2);
+
+					Instruction dec3(OpMemberDecorate, &instructionsData[instructionsDataIndex], 4);
+					buffer.structtypeindices.push_back(instructionsDataIndex);
+					instructionsData[instructionsDataIndex++] = 0;
+					instructionsData[instructionsDataIndex++] = i;
+					instructionsData[instructionsDataIndex++] = DecorationMatrixStride;
+					instructionsData[instructionsDataIndex++] = 16;
+					newinstructions.push_back(dec3);
+				}
+			}
 
-				Instruction dec3(OpMemberDecorate, &instructionsData[instructionsDataIndex], 4);
-				structtypeindices.push_back(instructionsDataIndex);
-				instructionsData[instructionsDataIndex++] = 0;
-				instructionsData[instructionsDataIndex++] = i;
-				instructionsData[instructionsDataIndex++] = DecorationMatrixStride;
-				instructionsData[instructionsDataIndex++] = 16;
-				newinstructions.push_back(dec3);
-			}
-			
-			if (utype == booltype || utype == inttype || utype == floattype) offset += 4;
-			else if (utype == vec2type) offset += 8;
-			else if (utype == vec3type) offset += 12;
-			else if (utype == vec4type) offset += 16;
-			else if (utype == mat2type) offset += 16;
-			else if (utype == mat3type) offset += 36;
-			else if (utype == mat4type) offset += 64;
-			else offset += 1; // Type not handled
-		}
-		if (uniforms.size() > 0) {
 			Instruction dec1(OpDecorate, &instructionsData[instructionsDataIndex], 2);
-			structtypeindices.push_back(instructionsDataIndex);
+			buffer.structtypeindices.push_back(instructionsDataIndex);
 			instructionsData[instructionsDataIndex++] = 0;
 			instructionsData[instructionsDataIndex++] = DecorationBlock;
 			newinstructions.push_back(dec1);
 
 			Instruction decbind(OpDecorate, &instructionsData[instructionsDataIndex], 3);
-			structtypeindices.push_back(instructionsDataIndex);
+			buffer.structtypeindices.push_back(instructionsDataIndex);
 			instructionsData[instructionsDataIndex++] = 0;
 			instructionsData[instructionsDataIndex++] = DecorationBinding;
-			instructionsData[instructionsDataIndex++] = stage == StageVertex ? 0 : 1;
+			instructionsData[instructionsDataIndex++] = buffer.binding;
 			newinstructions.push_back(decbind);
 		}
 	}
 
-	void outputTypes(unsigned* instructionsData, unsigned& instructionsDataIndex, std::vector<unsigned>& structtypeindices, unsigned& structvarindex, std::vector<Instruction>& newinstructions, std::vector<Var>& uniforms,
-		std::map<unsigned, unsigned>& pointers, std::map<unsigned, unsigned>& constants, unsigned& currentId, unsigned& structid, unsigned& floatpointertype,
-		unsigned& dotfive, unsigned& two, unsigned& three, unsigned& tempposition, ShaderStage stage) {
-		if (uniforms.size() > 0) {
-			Instruction typestruct(OpTypeStruct, &instructionsData[instructionsDataIndex], 1 + uniforms.size());
+	void outputTypes(unsigned* instructionsData, unsigned& instructionsDataIndex, std::vector<Instruction>& newinstructions, std::vector<UniformBuffer>& buffers,
+		std::map<unsigned, unsigned>& pointers, std::map<unsigned, unsigned>& constants, unsigned& currentId, unsigned& floatpointertype,
+		unsigned& dotfive, unsigned& two, unsigned& three, unsigned& tempposition, BasicTypes& types, ShaderStage stage) {
+		for (auto& buffer : buffers) {
+			Instruction typestruct(OpTypeStruct, &instructionsData[instructionsDataIndex], 1 + buffer.members.size());
 			unsigned structtype = instructionsData[instructionsDataIndex++] = currentId++;
-			for (unsigned i = 0; i < uniforms.size(); ++i) {
-				instructionsData[instructionsDataIndex++] = pointers[uniforms[i].type];
+			for (unsigned i = 0; i < buffer.members.size(); ++i) {
+				instructionsData[instructionsDataIndex++] = pointers[buffer.members[i].type];
 			}
-			for (auto index : structtypeindices) instructionsData[index] = structtype;
+			for (auto index : buffer.structtypeindices) instructionsData[index] = structtype;
 			newinstructions.push_back(typestruct);
 			Instruction typepointer(OpTypePointer, &instructionsData[instructionsDataIndex], 3);
 			unsigned pointertype = instructionsData[instructionsDataIndex++] = currentId++;
@@ -246,38 +322,45 @@ namespace {
 			newinstructions.push_back(typepointer);
 			Instruction variable(OpVariable, &instructionsData[instructionsDataIndex], 3);
 			instructionsData[instructionsDataIndex++] = pointertype;
-			structid = instructionsData[instructionsDataIndex++] = currentId++;
-			instructionsData[structvarindex] = structid;
+			buffer.structid = instructionsData[instructionsDataIndex++] = currentId++;
+			instructionsData[buffer.structvarindex] = buffer.structid;
 			instructionsData[instructionsDataIndex++] = StorageClassUniform;
 			newinstructions.push_back(variable);
+		}
 
-			if (inttype == 0) {
+		if (buffers.size() > 0) {
+			if (types.inttype == 0) {
 				Instruction typeint(OpTypeInt, &instructionsData[instructionsDataIndex], 3);
-				inttype = instructionsData[instructionsDataIndex++] = currentId++;
+				types.inttype = instructionsData[instructionsDataIndex++] = currentId++;
 				instructionsData[instructionsDataIndex++] = 32;
 				instructionsData[instructionsDataIndex++] = 0;
 				newinstructions.push_back(typeint);
 			}
-			for (unsigned i = 0; i < uniforms.size(); ++i) {
-				Instruction constant(OpConstant, &instructionsData[instructionsDataIndex], 3);
-				instructionsData[instructionsDataIndex++] = inttype;
-				unsigned constantid = currentId++;
-				instructionsData[instructionsDataIndex++] = constantid;
-				constants[i] = constantid;
-				instructionsData[instructionsDataIndex++] = i;
-				newinstructions.push_back(constant);
+		}
+		for (auto& buffer : buffers) {
+			for (unsigned i = 0; i < buffer.members.size(); ++i) {
+				// member indices are shared by the buffers
+				if (constants.count(i) == 0) {
+					Instruction constant(OpConstant, &instructionsData[instructionsDataIndex], 3);
+					instructionsData[instructionsDataIndex++] = types.inttype;
+					unsigned constantid = currentId++;
+					instructionsData[instructionsDataIndex++] = constantid;
+					constants[i] = constantid;
+					instructionsData[instructionsDataIndex++] = i;
+					newinstructions.push_back(constant);
+				}
 				Instruction typepointer(OpTypePointer, &instructionsData[instructionsDataIndex], 3);
-				uniforms[i].pointertype = instructionsData[instructionsDataIndex++] = currentId++;
+				buffer.members[i].pointertype = instructionsData[instructionsDataIndex++] = currentId++;
 				instructionsData[instructionsDataIndex++] = StorageClassUniform;
-				instructionsData[instructionsDataIndex++] = pointers[uniforms[i].type];
+				instructionsData[instructionsDataIndex++] = pointers[buffer.members[i].type];
 				newinstructions.push_back(typepointer);
 			}
 		}
 
 		if (stage == StageVertex) {
-			if (floattype == 0) {
+			if (types.floattype == 0) {
 				Instruction floaty(OpTypeFloat, &instructionsData[instructionsDataIndex], 2);
-				floattype = instructionsData[instructionsDataIndex++] = currentId++;
+				types.floattype = instructionsData[instructionsDataIndex++] = currentId++;
 				instructionsData[instructionsDataIndex++] = 32;
 				newinstructions.push_back(floaty);
 			}
@@ -285,39 +368,39 @@ namespace {
 			Instruction floatpointer(OpTypePointer, &instructionsData[instructionsDataIndex], 3);
 			floatpointertype = instructionsData[instructionsDataIndex++] = currentId++;
 			instructionsData[instructionsDataIndex++] = StorageClassPrivate;
-			instructionsData[instructionsDataIndex++] = floattype;
+			instructionsData[instructionsDataIndex++] = types.floattype;
 			newinstructions.push_back(floatpointer);
 
 			Instruction dotfiveconstant(OpConstant, &instructionsData[instructionsDataIndex], 3);
-			instructionsData[instructionsDataIndex++] = floattype;
+			instructionsData[instructionsDataIndex++] = types.floattype;
 			dotfive = instructionsData[instructionsDataIndex++] = currentId++;
 			*(float*)&instructionsData[instructionsDataIndex++] = 0.5f;
 			newinstructions.push_back(dotfiveconstant);
 
-			if (inttype == 0) {
+			if (types.inttype == 0) {
 				Instruction inty(OpTypeInt, &instructionsData[instructionsDataIndex], 3);
-				inttype = instructionsData[instructionsDataIndex++] = currentId++;
+				types.inttype = instructionsData[instructionsDataIndex++] = currentId++;
 				instructionsData[instructionsDataIndex++] = 32;
 				instructionsData[instructionsDataIndex++] = 0;
 				newinstructions.push_back(inty);
 			}
 
 			Instruction twoconstant(OpConstant, &instructionsData[instructionsDataIndex], 3);
-			instructionsData[instructionsDataIndex++] = inttype;
+			instructionsData[instructionsDataIndex++] = types.inttype;
 			two = instructionsData[instructionsDataIndex++] = currentId++;
 			instructionsData[instructionsDataIndex++] = 2;
 			newinstructions.push_back(twoconstant);
 
 			Instruction threeconstant(OpConstant, &instructionsData[instructionsDataIndex], 3);
-			instructionsData[instructionsDataIndex++] = inttype;
+			instructionsData[instructionsDataIndex++] = types.inttype;
 			three = instructionsData[instructionsDataIndex++] = currentId++;
 			instructionsData[instructionsDataIndex++] = 3;
 			newinstructions.push_back(threeconstant);
 
-			if (vec4type == 0) {
+			if (types.vec4type == 0) {
 				Instruction vec4(OpTypeVector, &instructionsData[instructionsDataIndex], 3);
-				vec4type = instructionsData[instructionsDataIndex++] = currentId++;
-				instructionsData[instructionsDataIndex++] = floattype;
+				types.vec4type = instructionsData[instructionsDataIndex++] = currentId++;
+				instructionsData[instructionsDataIndex++] = types.floattype;
 				instructionsData[instructionsDataIndex++] = 4;
 				newinstructions.push_back(vec4);
 			}
@@ -325,7 +408,7 @@ namespace {
 			Instruction vec4pointer(OpTypePointer, &instructionsData[instructionsDataIndex], 3);
 			unsigned vec4pointertype = instructionsData[instructionsDataIndex++] = currentId++;
 			instructionsData[instructionsDataIndex++] = StorageClassPrivate;
-			instructionsData[instructionsDataIndex++] = vec4type;
+			instructionsData[instructionsDataIndex++] = types.vec4type;
 			newinstructions.push_back(vec4pointer);
 
 			Instruction varinst(OpVariable, &instructionsData[instructionsDataIndex], 3);
@@ -348,7 +431,14 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 	std::map<unsigned, bool> imageTypes;
 	std::map<unsigned, unsigned> pointers;
 	std::map<unsigned, unsigned> constants;
-	unsigned position;
+	BasicTypes types;
+	unsigned position = 0;
+	// locations a vertex input of each vector, matrix or array type takes, with the
+	// widths and vector sizes and the integer constants that go into them
+	std::map<unsigned, unsigned> locationcounts;
+	std::map<unsigned, unsigned> widths;
+	std::map<unsigned, std::pair<unsigned, unsigned>> vectors;
+	std::map<unsigned, unsigned> literals;
 
 	for (unsigned i = 0; i < instructions.size(); ++i) {
 		Instruction& inst = instructions[i];
@@ -393,23 +483,25 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 		}
 		case OpTypeBool: {
 			unsigned id = inst.operands[0];
-			booltype = id;
+			types.booltype = id;
 			break;
 		}
 		case OpTypeInt: {
 			unsigned id = inst.operands[0];
 			unsigned width = inst.operands[1];
 			unsigned signedness = inst.operands[2];
+			widths[id] = width;
 			if (width == 32 && signedness == 0) {
-				inttype = id;
+				types.inttype = id;
 			}
 			break;
 		}
 		case OpTypeFloat: {
 			unsigned id = inst.operands[0];
 			unsigned width = inst.operands[1];
+			widths[id] = width;
 			if (width == 32) {
-				floattype = id;
+				types.floattype = id;
 			}
 			break;
 		}
@@ -417,35 +509,50 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 			unsigned id = inst.operands[0];
 			unsigned componentType = inst.operands[1];
 			unsigned componentCount = inst.operands[2];
-			if (componentType == floattype) {
+			vectors[id] = std::make_pair(componentCount, widths[componentType]);
+			locationcounts[id] = attributeLocationCount(1, componentCount, widths[componentType], 1);
+			if (componentType == types.floattype) {
 				if (componentCount == 4) {
-					vec4type = id;
+					types.vec4type = id;
 				}
 				else if (componentCount == 3) {
-					vec3type = id;
+					types.vec3type = id;
 				}
 				else if (componentCount == 2) {
-					vec2type = id;
+					types.vec2type = id;
 				}
 			}
 			break;
 		}
 		case OpTypeMatrix: {
 			unsigned id = inst.operands[0];
-			// unsigned columnType = inst.operands[1];
+			unsigned columnType = inst.operands[1];
 			unsigned columnCount = inst.operands[2];
+			locationcounts[id] = attributeLocationCount(columnCount, vectors[columnType].first, vectors[columnType].second, 1);
 			if (columnCount == 4) {
-				mat4type = id;
+				types.mat4type = id;
 			}
 			else if (columnCount == 3) {
-				mat3type = id;
+				types.mat3type = id;
 			}
 			else if (columnCount == 2) {
-				mat2type = id;
+				types.mat2type = id;
 			}
 
 			break;
 		}
+		case OpConstant: {
+			unsigned id = inst.operands[1];
+			literals[id] = inst.operands[2];
+			break;
+		}
+		case OpTypeArray: {
+			unsigned id = inst.operands[0];
+			unsigned elementType = inst.operands[1];
+			unsigned length = inst.operands[2];
+			locationcounts[id] = (locationcounts.count(elementType) ? locationcounts[elementType] : 1) * std::max(1u, literals[length]);
+			break;
+		}
 		case OpVariable: {
 			unsigned type = inst.operands[0];
 			unsigned id = inst.operands[1];
@@ -475,14 +582,48 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 	std::sort(outvars.begin(), outvars.end(), varcompare);
 	std::sort(images.begin(), images.end(), varcompare);
 
+	// uniforms named in a shared block with the type it declares go there, the
+	// rest into the shader's own buffer
+	std::vector<UniformBuffer> buffers(1);
+	buffers[0].name = "_k_global_uniform_buffer";
+	buffers[0].binding = stage == StageVertex ? 0 : 1;
+	routed.clear();
+	std::set<unsigned> blockbindings;
+	for (auto& block : blocks) {
+		blockbindings.insert(block.binding);
+		UniformBuffer buffer;
+		buffer.name = block.name;
+		buffer.binding = block.binding;
+		std::vector<unsigned> offsets;
+		uniformBlockLayout(block, offsets);
+		for (unsigned i = 0; i < block.members.size(); ++i) {
+			auto& member = block.members[i];
+			for (auto& uniform : uniforms) {
+				if (uniform.name == member.name && typeName(pointers[uniform.type], types) == member.type && routed.count(uniform.name) == 0) {
+					buffer.members.push_back(uniform);
+					buffer.offsets.push_back(offsets[i]);
+					routed[uniform.name] = block.name;
+				}
+			}
+		}
+		buffers.push_back(buffer);
+	}
+	unsigned offset = 0;
+	for (auto& uniform : uniforms) {
+		if (routed.count(uniform.name) == 0) {
+			unsigned size = uniformTypeSize(typeName(pointers[uniform.type], types));
+			buffers[0].members.push_back(uniform);
+			buffers[0].offsets.push_back(offset);
+			offset += size > 0 ? size : 1; // Type not handled
+		}
+	}
+	buffers.erase(std::remove_if(buffers.begin(), buffers.end(), [](const UniformBuffer& buffer) { return buffer.members.empty(); }), buffers.end());
+
 	SpirVState state = SpirVStart;
 	std::vector<Instruction> newinstructions;
 	unsigned instructionsData[4096];
 	unsigned instructionsDataIndex = 0;
 	unsigned currentId = bound;
-	unsigned structid;
-	std::vector<unsigned> structtypeindices;
-	unsigned structvarindex;
 	unsigned tempposition;
 	unsigned floatpointertype;
 	unsigned dotfive;
@@ -499,7 +640,7 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 				state = SpirVDebugInformation;
 
 				if (!namesInserted) {
-					outputNames(instructionsData, instructionsDataIndex, structtypeindices, structvarindex, newinstructions, uniforms);
+					outputNames(instructionsData, instructionsDataIndex, newinstructions, buffers);
 					namesInserted = true;
 				}
 			}
@@ -509,11 +650,11 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 				state = SpirVAnnotations;
 
 				if (!namesInserted) {
-					outputNames(instructionsData, instructionsDataIndex, structtypeindices, structvarindex, newinstructions, uniforms);
+					outputNames(instructionsData, instructionsDataIndex, newinstructions, buffers);
 					namesInserted = true;
 				}
 				if (!decorationsInserted) {
-					outputDecorations(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, uniforms, pointers, invars, outvars, images, stage);
+					outputDecorations(instructionsData, instructionsDataIndex, newinstructions, buffers, pointers, invars, outvars, images, types, stage, attributes, attributeSizes, blockbindings, locationcounts);
 					decorationsInserted = true;
 				}
 			}
@@ -521,11 +662,11 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 				state = SpirVTypes;
 
 				if (!namesInserted) {
-					outputNames(instructionsData, instructionsDataIndex, structtypeindices, structvarindex, newinstructions, uniforms);
+					outputNames(instructionsData, instructionsDataIndex, newinstructions, buffers);
 					namesInserted = true;
 				}
 				if (!decorationsInserted) {
-					outputDecorations(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, uniforms, pointers, invars, outvars, images, stage);
+					outputDecorations(instructionsData, instructionsDataIndex, newinstructions, buffers, pointers, invars, outvars, images, types, stage, attributes, attributeSizes, blockbindings, locationcounts);
 					decorationsInserted = true;
 				}
 			}
@@ -535,19 +676,19 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 				state = SpirVTypes;
 
 				if (!namesInserted) {
-					outputNames(instructionsData, instructionsDataIndex, structtypeindices, structvarindex, newinstructions, uniforms);
+					outputNames(instructionsData, instructionsDataIndex, newinstructions, buffers);
 					namesInserted = true;
 				}
 				if (!decorationsInserted) {
-					outputDecorations(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, uniforms, pointers, invars, outvars, images, stage);
+					outputDecorations(instructionsData, instructionsDataIndex, newinstructions, buffers, pointers, invars, outvars, images, types, stage, attributes, attributeSizes, blockbindings, locationcounts);
 					decorationsInserted = true;
 				}
 			}
 			break;
 		case SpirVTypes:
 			if (inst.opcode == OpFunction) {
-				outputTypes(instructionsData, instructionsDataIndex, structtypeindices, structvarindex, newinstructions, uniforms, pointers, constants, currentId,
-					structid, floatpointertype, dotfive, two, three, tempposition, stage);
+				outputTypes(instructionsData, instructionsDataIndex, newinstructions, buffers, pointers, constants, currentId,
+					floatpointertype, dotfive, two, three, tempposition, types, stage);
 				state = SpirVFunctions;
 			}
 			break;
@@ -582,6 +723,11 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 				newinstructions.push_back(inst);
 			}
 		}
+		else if (inst.opcode == OpDecorate && inst.operands[1] == DecorationBinding
+			&& std::any_of(images.begin(), images.end(), [&](const Var& image) { return image.id == inst.operands[0]; })) {
+			// textures were given their binding with the other decorations, a second
+			// one from glslang would take precedence
+		}
 		else if (inst.opcode == OpVariable) {
 			unsigned type = inst.operands[0];
 			unsigned id = inst.operands[1];
@@ -596,13 +742,16 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 			unsigned pointer = inst.operands[2];
 			Var uniform;
 			unsigned index;
+			unsigned structid;
 			bool found = false;
-			for (unsigned i = 0; i < uniforms.size(); ++i) {
-				if (uniforms[i].id == pointer) {
-					uniform = uniforms[i];
-					index = i;
-					found = true;
-					break;
+			for (auto& buffer : buffers) {
+				for (unsigned i = 0; i < buffer.members.size() && !found; ++i) {
+					if (buffer.members[i].id == pointer) {
+						uniform = buffer.members[i];
+						index = i;
+						structid = buffer.structid;
+						found = true;
+					}
 				}
 			}
 			if (found) {
@@ -644,7 +793,7 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 
 					//%28 = OpLoad float %27
 					Instruction load1(OpLoad, &instructionsData[instructionsDataIndex], 3);
-					instructionsData[instructionsDataIndex++] = floattype;
+					instructionsData[instructionsDataIndex++] = types.floattype;
 					unsigned _28 = instructionsData[instructionsDataIndex++] = currentId++;
 					instructionsData[instructionsDataIndex++] = _27;
 					newinstructions.push_back(load1);
@@ -659,14 +808,14 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 
 					//%31 = OpLoad float %30
 					Instruction load2(OpLoad, &instructionsData[instructionsDataIndex], 3);
-					instructionsData[instructionsDataIndex++] = floattype;
+					instructionsData[instructionsDataIndex++] = types.floattype;
 					unsigned _31 = instructionsData[instructionsDataIndex++] = currentId++;
 					instructionsData[instructionsDataIndex++] = _30;
 					newinstructions.push_back(load2);
 
 					//%32 = OpFAdd float %28 %31
 					Instruction add(OpFAdd, &instructionsData[instructionsDataIndex], 4);
-					instructionsData[instructionsDataIndex++] = floattype;
+					instructionsData[instructionsDataIndex++] = types.floattype;
 					unsigned _32 = instructionsData[instructionsDataIndex++] = currentId++;
 					instructionsData[instructionsDataIndex++] = _28;
 					instructionsData[instructionsDataIndex++] = _31;
@@ -674,7 +823,7 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 
 					//%34 = OpFMul float %32 dotfive
 					Instruction mult(OpFMul, &instructionsData[instructionsDataIndex], 4);
-					instructionsData[instructionsDataIndex++] = floattype;
+					instructionsData[instructionsDataIndex++] = types.floattype;
 					unsigned _34 = instructionsData[instructionsDataIndex++] = currentId++;
 					instructionsData[instructionsDataIndex++] = _32;
 					instructionsData[instructionsDataIndex++] = dotfive;
@@ -696,7 +845,7 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 
 					//%38 = OpLoad vec4 tempposition
 					Instruction load3(OpLoad, &instructionsData[instructionsDataIndex], 3);
-					instructionsData[instructionsDataIndex++] = vec4type;
+					instructionsData[instructionsDataIndex++] = types.vec4type;
 					unsigned _38 = instructionsData[instructionsDataIndex++] = currentId++;
 					instructionsData[instructionsDataIndex++] = tempposition;
 					newinstructions.push_back(load3);
@@ -4,11 +4,30 @@
 
 namespace ShaderCross
 {
+	// Bytes a uniform of type takes in a uniform buffer, 0 for types that can't be in
+	// a Config::uniformBlocks block
+	unsigned uniformTypeSize(const std::string& type);
+
+	// Offsets of the members of a Config::uniformBlocks block in std140 layout, with
+	// every matrix column taking 16 bytes, and the size of the whole block
+	unsigned uniformBlockLayout(const UniformBlock& block, std::vector<unsigned>& offsets);
+
 	class SpirVTranslator : public Translator {
 	public:
-		SpirVTranslator(std::vector<unsigned>& spirv, ShaderStage stage) : Translator(spirv, stage) {}
+		// compact writes the encoding of SpirVCompact.h instead of raw words. Loose
+		// uniforms matching a member of blocks are packed into that block instead of
+		// the shader's own uniform buffer.
+		SpirVTranslator(std::vector<unsigned>& spirv, ShaderStage stage, bool compact = false, const std::vector<UniformBlock>& blocks = std::vector<UniformBlock>())
+			: Translator(spirv, stage), compact(compact), blocks(blocks) {}
 		void outputCode(const Target& target, const char* sourcefilename, const char* filename, char* output, std::map<std::string, int>& attributes) override;
+		size_t outputLength(const char* output) override { return written; }
+		// The block each uniform routed into one of blocks went to, by uniform name
+		const std::map<std::string, std::string>& uniformBlocks() const { return routed; }
 	private:
 		void writeInstructions(const char* filename, char* output, std::vector<Instruction>& instructions);
+		bool compact;
+		std::vector<UniformBlock> blocks;
+		std::map<std::string, std::string> routed;
+		size_t written = 0;
 	};
 }
@@ -1,6 +1,9 @@
 #include "Translator.h"
 #include <glslang/SPIRV/spirv.hpp>
 #include <glslang/glslang/Public/ShaderLang.h>
+#include <SPIRV-Cross/spirv_cross.hpp>
+#include <algorithm>
+#include <set>
 
 namespace ShaderCross
 {
@@ -58,6 +61,83 @@ namespace ShaderCross
         //printf("Read %i instructions.\n", instructions.size());
     }
 
+    unsigned attributeLocationCount(unsigned columns, unsigned components, unsigned width, unsigned elements) {
+        return std::max(1u, columns) * (width == 64 && components > 2 ? 2 : 1) * std::max(1u, elements);
+    }
+
+    std::vector<int> assignAttributeLocations(const std::vector<std::pair<std::string, unsigned>>& inputs, std::map<std::string, int>& attributes,
+        const std::map<std::string, unsigned>& sizes) {
+        // every pinned location stays free, so that a layout built for the pinned
+        // attributes works with any shader
+        std::set<int> used;
+        for (auto attribute : attributes) {
+            auto size = sizes.find(attribute.first);
+            unsigned count = size == sizes.end() ? 1 : std::max(1u, size->second);
+            for (unsigned i = 0; i < count; ++i) {
+                used.insert(attribute.second + (int)i);
+            }
+        }
+        for (auto input : inputs) {
+            auto pinned = attributes.find(input.first);
+            for (unsigned i = 0; pinned != attributes.end() && i < input.second; ++i) {
+                used.insert(pinned->second + (int)i);
+            }
+        }
+
+        std::map<std::string, int> assigned;
+        std::vector<int> locations;
+        for (auto input : inputs) {
+            auto pinned = attributes.find(input.first);
+            int location = 0;
+            if (pinned != attributes.end()) {
+                location = pinned->second;
+            }
+            else {
+                auto available = [&](int location) {
+                    for (unsigned i = 0; i < input.second; ++i) {
+                        if (used.count(location + (int)i)) return false;
+                    }
+                    return true;
+                };
+                while (!available(location)) {
+                    ++location;
+                }
+                for (unsigned i = 0; i < input.second; ++i) {
+                    used.insert(location + (int)i);
+                }
+            }
+            assigned[input.first] = location;
+            locations.push_back(location);
+        }
+        attributes = assigned;
+        return locations;
+    }
+
+    void Translator::pinAttributeLocations(spirv_cross::Compiler& compiler, std::map<std::string, int>& attributes) {
+        std::vector<std::pair<std::string, uint32_t>> variables;
+        for (auto var : compiler.get_active_interface_variables()) {
+            std::string name = compiler.get_name(var);
+            if (compiler.get_storage_class(var) == spv::StorageClassInput && name.substr(0, 3) != "gl_") {
+                variables.push_back(std::make_pair(name, (uint32_t)var));
+            }
+        }
+        std::sort(variables.begin(), variables.end());
+
+        std::vector<std::pair<std::string, unsigned>> inputs;
+        for (auto variable : variables) {
+            const spirv_cross::SPIRType& type = compiler.get_type_from_variable(variable.second);
+            unsigned elements = 1;
+            for (size_t i = 0; i < type.array.size(); ++i) {
+                elements *= type.array_size_literal[i] ? std::max(1u, (unsigned)type.array[i]) : 1;
+            }
+            inputs.push_back(std::make_pair(variable.first, attributeLocationCount(type.columns, type.vecsize, type.width, elements)));
+        }
+        std::vector<int> locations = assignAttributeLocations(inputs, attributes, attributeSizes);
+        for (size_t i = 0; i < variables.size(); ++i) {
+            compiler.set_decoration(variables[i].second, spv::DecorationLocation, (uint32_t)locations[i]);
+        }
+    }
+
     spv::ExecutionModel Translator::executionModel() {
         switch (stage) {
         case StageVertex:
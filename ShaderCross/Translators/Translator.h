@@ -3,6 +3,11 @@
 #include "ShaderCross.hpp"
 
 #include <SPIRV-Cross/spirv.hpp>
+#include <string.h>
+
+namespace spirv_cross {
+	class Compiler;
+}
 
 namespace ShaderCross {
 
@@ -17,17 +22,39 @@ namespace ShaderCross {
 		const char* string;
 	};
 
+	// Locations a vertex input takes: one per column of every array element, two for a
+	// column of more than two 64-bit components
+	unsigned attributeLocationCount(unsigned columns, unsigned components, unsigned width, unsigned elements);
+
+	// Locations for vertex inputs, given by name and the number of locations each takes.
+	// Inputs named in attributes keep the location it pins them to, the others take
+	// the lowest ones no pinned attribute covers, in order, a pinned attribute covering
+	// as many locations as sizes gives it or one. attributes is replaced by the location
+	// of every input.
+	std::vector<int> assignAttributeLocations(const std::vector<std::pair<std::string, unsigned>>& inputs, std::map<std::string, int>& attributes,
+		const std::map<std::string, unsigned>& sizes);
+
 	class Translator {
 	public:
 		Translator(std::vector<unsigned>& spirv, ShaderStage stage);
 		virtual ~Translator() {}
+		// attributes holds Config::attributeLocations when it is called and the location
+		// of each vertex input when the translator assigns them
 		virtual void outputCode(const Target& target, const char* sourcefilename, const char* filename, char* output, std::map<std::string, int>& attributes) = 0;
+		// Number of bytes outputCode wrote to output
+		virtual size_t outputLength(const char* output) { return strlen(output); }
+		// Config::attributeSizes, for the pinned attributes a shader doesn't have
+		void setAttributeSizes(const std::map<std::string, unsigned>& sizes) { attributeSizes = sizes; }
 
 	protected:
 		std::vector<unsigned>& spirv;
 		std::vector<Instruction> instructions;
 		ShaderStage stage;
 		spv::ExecutionModel executionModel();
+		std::map<std::string, unsigned> attributeSizes;
+		// Decorates the vertex inputs with the locations of assignAttributeLocations,
+		// in name order, for translators going through SPIRV-Cross
+		void pinAttributeLocations(spirv_cross::Compiler& compiler, std::map<std::string, int>& attributes);
 
 		unsigned magicNumber;
 		unsigned version;
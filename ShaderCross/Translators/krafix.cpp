@@ -54,8 +54,11 @@
 #include <cstdlib>
 #include <cctype>
 #include <cmath>
+#include <algorithm>
 #include <array>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 #include "../glslang/OSDependent/osinclude.h"
 
@@ -71,6 +74,13 @@
 
 #include "../SPIRV-Cross/spirv_common.hpp"
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#endif
+#include <sys/stat.h>
+
 extern "C" {
 	SH_IMPORT_EXPORT void ShOutputHtml();
 }
@@ -123,25 +133,31 @@ enum TFailCode {
 // Forward declarations.
 //
 EShLanguage FindLanguage(const std::string& name, bool parseSuffix = true);
-void CompileFile(const char* fileName, ShHandle);
 void usage();
 void FreeFileData(char** data);
 char** ReadFileData(const char* fileName);
 void InfoLogMsg(const char* msg, const char* name, const int num);
 
-// Globally track if any compile or link failure.
-bool CompileFailed = false;
-bool LinkFailed = false;
-std::string CompileErrors = "";
-std::string ReflectJSON = "";
+// Everything a compile changes, so that several files can compile at once.
+// The globals below are only written while parsing the command line.
+struct CompileJob {
+	int options = 0;
+	bool quiet = false;
+	bool compileFailed = false;
+	bool linkFailed = false;
+	bool printedVarList = false;
+	std::string errors;      // compiler, linker and translator errors
+	std::string log;         // info logs and messages, for stdout
+	std::string files;       // #file: lines of the written outputs, for stderr
+	std::string reflectJSON;
+};
 
 static bool quiet = false;
 static bool debugMode = false;
 static bool outputSpirv = false;
 
-// Use to test breaking up a single shader file into multiple strings.
-// Set in ReadFileData().
-int NumShaderStrings;
+// Keeps the output of jobs running on different threads apart
+std::mutex OutputMutex;
 
 TBuiltInResource Resources;
 std::string ConfigFile;
@@ -506,68 +522,47 @@ void ProcessArguments(int argc, char* argv[])
 //
 // Translate the meaningful subset of command-line options to parser-behavior options.
 //
-void SetMessageOptions(EShMessages& messages)
+void SetMessageOptions(int options, EShMessages& messages)
 {
-	if (Options & EOptionRelaxedErrors)
+	if (options & EOptionRelaxedErrors)
 		messages = (EShMessages)(messages | EShMsgRelaxedErrors);
-	if (Options & EOptionIntermediate)
+	if (options & EOptionIntermediate)
 		messages = (EShMessages)(messages | EShMsgAST);
-	if (Options & EOptionSuppressWarnings)
+	if (options & EOptionSuppressWarnings)
 		messages = (EShMessages)(messages | EShMsgSuppressWarnings);
-	if (Options & EOptionSpv)
+	if (options & EOptionSpv)
 		messages = (EShMessages)(messages | EShMsgSpvRules);
-	if (Options & EOptionVulkanRules)
+	if (options & EOptionVulkanRules)
 		messages = (EShMessages)(messages | EShMsgVulkanRules);
-	if (Options & EOptionOutputPreprocessed)
+	if (options & EOptionOutputPreprocessed)
 		messages = (EShMessages)(messages | EShMsgOnlyPreprocessor);
-	if (Options & EOptionReadHlsl)
+	if (options & EOptionReadHlsl)
 		messages = (EShMessages)(messages | EShMsgReadHlsl);
-	if (Options & EOptionCascadingErrors)
+	if (options & EOptionCascadingErrors)
 		messages = (EShMessages)(messages | EShMsgCascadingErrors);
-	if (Options & EOptionKeepUncalled)
+	if (options & EOptionKeepUncalled)
 		messages = (EShMessages)(messages | EShMsgKeepUncalled);
 }
 
-//
-// Thread entry point, for non-linking asynchronous mode.
-//
-// Return 0 for failure, 1 for success.
-//
-unsigned int CompileShaders(void*)
-{
-	glslang::TWorkItem* workItem;
-	while (Worklist.remove(workItem)) {
-		ShHandle compiler = ShConstructCompiler(FindLanguage(workItem->name), Options);
-		if (compiler == 0)
-			return 0;
-
-		CompileFile(workItem->name.c_str(), compiler);
-
-		if (!(Options & EOptionSuppressInfolog))
-			workItem->results = ShGetInfoLog(compiler);
-
-		ShDestruct(compiler);
-	}
-
-	return 0;
-}
-
-// Outputs the given string, but only if it is non-null and non-empty.
+// Appends the given string and a newline to log, but only if it is non-null and non-empty.
 // This prevents erroneous newlines from appearing.
-void PutsIfNonEmpty(const char* str)
+void AppendIfNonEmpty(std::string& log, const char* str)
 {
 	if (str && str[0]) {
-		puts(str);
+		log += str;
+		log += '\n';
 	}
 }
 
-// Outputs the given string to stderr, but only if it is non-null and non-empty.
-// This prevents erroneous newlines from appearing.
-void StderrIfNonEmpty(const char* str)
+// Prints what a job collected, in one piece even when other jobs finish at the same time.
+void FlushJobOutput(CompileJob& job)
 {
-	if (str && str[0]) {
-		fprintf(stderr, "%s\n", str);
-	}
+	std::lock_guard<std::mutex> lock(OutputMutex);
+	fputs(job.log.c_str(), stdout);
+	fputs(job.files.c_str(), stderr);
+	fflush(stdout);
+	job.log.clear();
+	job.files.clear();
 }
 
 // Simple bundling of what makes a compilation unit for ease in passing around,
@@ -733,14 +728,14 @@ static void preprocessSpirv(std::vector<unsigned int>& spirv) {
 // Uses the new C++ interface instead of the old handle-based interface.
 //
 
-void CompileAndLinkShaderUnits(std::vector<ShaderCompUnit> compUnits, krafix::Target target, const char* sourcefilename, const char* filename, const char* tempdir, char* output, int* length,
+void CompileAndLinkShaderUnits(CompileJob& job, std::vector<ShaderCompUnit> compUnits, krafix::Target target, const char* sourcefilename, const char* filename, const char* tempdir, char* output, int* length,
 	glslang::TShader::Includer& includer, const char* defines, bool relax)
 {
 	// keep track of what to free
 	std::list<glslang::TShader*> shaders;
 
 	EShMessages messages = EShMsgDefault;
-	SetMessageOptions(messages);
+	SetMessageOptions(job.options, messages);
 
 	//
 	// Per-shader processing...
@@ -761,44 +756,44 @@ void CompileAndLinkShaderUnits(std::vector<ShaderCompUnit> compUnits, krafix::Ta
 		shader->setShiftImageBinding(baseImageBinding[compUnit.stage]);
 		shader->setShiftUboBinding(baseUboBinding[compUnit.stage]);
 		shader->setShiftSsboBinding(baseSsboBinding[compUnit.stage]);
-		shader->setFlattenUniformArrays((Options & EOptionFlattenUniformArrays) != 0);
-		shader->setNoStorageFormat((Options & EOptionNoStorageFormat) != 0);
+		shader->setFlattenUniformArrays((job.options & EOptionFlattenUniformArrays) != 0);
+		shader->setNoStorageFormat((job.options & EOptionNoStorageFormat) != 0);
 		shader->setPreamble(defines);
 
-		if (Options & EOptionAutoMapBindings)
+		if (job.options & EOptionAutoMapBindings)
 			shader->setAutoMapBindings(true);
 
 		shaders.push_back(shader);
 
-		const int defaultVersion = Options & EOptionDefaultDesktop ? 110 : 100;
+		const int defaultVersion = job.options & EOptionDefaultDesktop ? 110 : 100;
 
-		if (Options & EOptionOutputPreprocessed) {
+		if (job.options & EOptionOutputPreprocessed) {
 			std::string str;
 			//glslang::TShader::ForbidIncluder includer;
 			if (shader->preprocess(&Resources, defaultVersion, ENoProfile, false, false,
 				messages, &str, includer)) {
-				PutsIfNonEmpty(str.c_str());
+				AppendIfNonEmpty(job.log, str.c_str());
 			}
 			else {
-				CompileFailed = true;
+				job.compileFailed = true;
 			}
-			StderrIfNonEmpty(shader->getInfoLog());
-			StderrIfNonEmpty(shader->getInfoDebugLog());
+			AppendIfNonEmpty(job.log, shader->getInfoLog());
+			AppendIfNonEmpty(job.log, shader->getInfoDebugLog());
 			continue;
 		}
 		if (!shader->parse(&Resources, defaultVersion, ENoProfile, false, false, messages, includer))
         {
-			CompileFailed = true;
-            CompileErrors += shader->getInfoLog();
+			job.compileFailed = true;
+            job.errors += shader->getInfoLog();
         }
 
 		program.addShader(shader);
 
-		if (!(Options & EOptionSuppressInfolog) &&
-			!(Options & EOptionMemoryLeakMode)) {
+		if (!(job.options & EOptionSuppressInfolog) &&
+			!(job.options & EOptionMemoryLeakMode)) {
 			//PutsIfNonEmpty(compUnit.fileName.c_str());
-			PutsIfNonEmpty(shader->getInfoLog());
-			PutsIfNonEmpty(shader->getInfoDebugLog());
+			AppendIfNonEmpty(job.log, shader->getInfoLog());
+			AppendIfNonEmpty(job.log, shader->getInfoDebugLog());
 		}
 	}
 
@@ -807,37 +802,38 @@ void CompileAndLinkShaderUnits(std::vector<ShaderCompUnit> compUnits, krafix::Ta
 	//
 
 	// Link
-	if (!(Options & EOptionOutputPreprocessed) && !program.link(messages))
-		LinkFailed = true;
+	if (!(job.options & EOptionOutputPreprocessed) && !program.link(messages))
+		job.linkFailed = true;
 
 	// Map IO
-	if (Options & EOptionSpv) {
+	if (job.options & EOptionSpv) {
 		if (!program.mapIO())
-			LinkFailed = true;
+			job.linkFailed = true;
 	}
     
-    if (LinkFailed)
+    if (job.linkFailed)
     {
-        CompileErrors += program.getInfoLog();
+        job.errors += program.getInfoLog();
     } 
 
 	// Report
-	if (!(Options & EOptionSuppressInfolog) &&
-		!(Options & EOptionMemoryLeakMode)) {
-		PutsIfNonEmpty(program.getInfoLog());
-		PutsIfNonEmpty(program.getInfoDebugLog());
+	if (!(job.options & EOptionSuppressInfolog) &&
+		!(job.options & EOptionMemoryLeakMode)) {
+		AppendIfNonEmpty(job.log, program.getInfoLog());
+		AppendIfNonEmpty(job.log, program.getInfoDebugLog());
 	}
 
 	// Reflect
-	if (Options & EOptionDumpReflection) {
+	if (job.options & EOptionDumpReflection) {
 		program.buildReflection();
+		std::lock_guard<std::mutex> lock(OutputMutex);
 		program.dumpReflection();
 	}
 
 	// Dump SPIR-V
-	if (Options & EOptionSpv) {
-		if (CompileFailed || LinkFailed)
-			printf("SPIR-V is not generated for failed compile or link\n");
+	if (job.options & EOptionSpv) {
+		if (job.compileFailed || job.linkFailed)
+			job.log += "SPIR-V is not generated for failed compile or link\n";
 		else {
 			for (int stage = 0; stage < EShLangCount; ++stage) {
 				if (program.getIntermediate((EShLanguage)stage)) {
@@ -853,11 +849,11 @@ void CompileAndLinkShaderUnits(std::vector<ShaderCompUnit> compUnits, krafix::Ta
 
 					preprocessSpirv(spirv);
 
-					static bool firstRun = true;
-					if (!quiet && firstRun) {
-						krafix::VarListTranslator* varPrinter = new krafix::VarListTranslator(spirv, shLanguageToShaderStage((EShLanguage)stage));
-						varPrinter->print();
-						firstRun = false;
+					if (!job.quiet && !job.printedVarList) {
+						krafix::VarListTranslator varPrinter(spirv, shLanguageToShaderStage((EShLanguage)stage));
+						std::lock_guard<std::mutex> lock(OutputMutex);
+						varPrinter.print();
+						job.printedVarList = true;
 					}
 
 					krafix::Translator* translator = NULL;
@@ -898,7 +894,7 @@ void CompileAndLinkShaderUnits(std::vector<ShaderCompUnit> compUnits, krafix::Ta
 							else {
 								returnCode = compileHLSLToD3D11(temp.c_str(), filename, tempoutput, output, length, attributes, (EShLanguage)stage, debugMode);
 							}
-							if (returnCode != 0) CompileFailed = true;
+							if (returnCode != 0) job.compileFailed = true;
 							delete[] tempoutput;
 						}
 						else {
@@ -909,9 +905,9 @@ void CompileAndLinkShaderUnits(std::vector<ShaderCompUnit> compUnits, krafix::Ta
 						}
 					}
 					catch (spirv_cross::CompilerError& error) {
-						printf("Error compiling to %s: %s\n", target.string().c_str(), error.what());
-						CompileFailed = true;
-                        CompileErrors = error.what();
+						job.log += "Error compiling to " + target.string() + ": " + error.what() + "\n";
+						job.compileFailed = true;
+                        job.errors += error.what();
 					}
                     
                     {
@@ -921,14 +917,16 @@ void CompileAndLinkShaderUnits(std::vector<ShaderCompUnit> compUnits, krafix::Ta
                         spirv_cross::CompilerReflection compiler(std::move(spirv_parser.get_parsed_ir()));
                         compiler.set_format("json");
                         
-                        ReflectJSON = compiler.compile();
+                        job.reflectJSON = compiler.compile();
                     }
 
 					delete translator;
 
 					//glslang::OutputSpv(spirv, GetBinaryName((EShLanguage)stage));
-					if (Options & EOptionHumanReadableSpv) {
-						spv::Disassemble(std::cout, spirv);
+					if (job.options & EOptionHumanReadableSpv) {
+						std::stringstream disassembly;
+						spv::Disassemble(disassembly, spirv);
+						job.log += disassembly.str();
 					}
 				}
 			}
@@ -969,47 +967,37 @@ krafix::TargetSystem getSystem(const char* system) {
 // This is just for linking mode: meaning all the shaders will be put into the
 // the same program linked together.
 //
-// This means there are a limited number of work items (not multi-threading mode)
-// and that the point is testing at the linking level. Hence, to enable
-// performance and memory testing, the actual compile/link can be put in
-// a loop, independent of processing the work items and file IO.
+// The point is testing at the linking level. Hence, to enable performance and
+// memory testing, the actual compile/link can be put in a loop, independent of
+// the file IO.
 //
-void CompileAndLinkShaderFiles(krafix::Target target, const char* sourcefilename, const char* filename, const char* tempdir, const char* source, char* output, int* length, glslang::TShader::Includer& includer, const char* defines, bool relax)
+void CompileAndLinkShaderFiles(CompileJob& job, std::string name, krafix::Target target, const char* sourcefilename, const char* filename, const char* tempdir, const char* source, char* output, int* length, glslang::TShader::Includer& includer, const char* defines, bool relax)
 {
 	std::vector<ShaderCompUnit> compUnits;
 
-	// Transfer all the work items from to a simple list of
-	// of compilation units.  (We don't care about the thread
-	// work-item distribution properties in this path, which
-	// is okay due to the limited number of shaders, know since
-	// they are all getting linked together.)
-
 	char* sources[] = { (char*)source, nullptr, nullptr, nullptr, nullptr };
 
-	glslang::TWorkItem* workItem;
-	while (Worklist.remove(workItem)) {
-		ShaderCompUnit compUnit(
-			FindLanguage(workItem->name),
-			workItem->name,
-			source != nullptr ? sources : ReadFileData(workItem->name.c_str())
-		);
+	ShaderCompUnit compUnit(
+		FindLanguage(name),
+		name,
+		source != nullptr ? sources : ReadFileData(name.c_str())
+	);
 
-		if (!compUnit.text) {
-			usage();
-			return;
-		}
-
-		compUnits.push_back(compUnit);
+	if (!compUnit.text) {
+		usage();
+		return;
 	}
 
+	compUnits.push_back(compUnit);
+
 	// Actual call to programmatic processing of compile and link,
 	// in a loop for testing memory and performance.  This part contains
 	// all the perf/memory that a programmatic consumer will care about.
-	for (int i = 0; i < ((Options & EOptionMemoryLeakMode) ? 100 : 1); ++i) {
-		for (int j = 0; j < ((Options & EOptionMemoryLeakMode) ? 100 : 1); ++j)
-			CompileAndLinkShaderUnits(compUnits, target, sourcefilename, filename, tempdir, output, length, includer, defines, relax);
+	for (int i = 0; i < ((job.options & EOptionMemoryLeakMode) ? 100 : 1); ++i) {
+		for (int j = 0; j < ((job.options & EOptionMemoryLeakMode) ? 100 : 1); ++j)
+			CompileAndLinkShaderUnits(job, compUnits, target, sourcefilename, filename, tempdir, output, length, includer, defines, relax);
 
-		if (Options & EOptionMemoryLeakMode)
+		if (job.options & EOptionMemoryLeakMode)
 			glslang::OS_DumpMemoryCounters();
 	}
 
@@ -1019,33 +1007,32 @@ void CompileAndLinkShaderFiles(krafix::Target target, const char* sourcefilename
 	}
 }
 
-int compile(const char* targetlang, const char* from, std::string to, const char* tempdir, const char* source, char* output, int* length, const char* system,
-	glslang::TShader::Includer& includer, std::string defines, int version, bool relax) {
-	CompileFailed = false;
+//
+// Initializes glslang and the resource limits the first time it is called. Both are
+// kept until the process exits, so that the built-in symbol tables glslang creates
+// for each version and stage are reused by every compile after the first.
+//
+void InitializeOnce()
+{
+	static std::once_flag initialized;
+	std::call_once(initialized, []() {
+		glslang::InitializeProcess();
+		ProcessConfigFile();
+	});
+}
 
-	//Options |= EOptionHumanReadableSpv;
-	Options |= EOptionSpv;
-	Options |= EOptionLinkProgram;
-	//Options |= EOptionSuppressInfolog;
+int compile(CompileJob& job, const char* targetlang, const char* from, std::string to, const char* tempdir, const char* source, char* output, int* length, const char* system,
+	glslang::TShader::Includer& includer, std::string defines, int version, bool relax) {
+	job.compileFailed = false;
+	job.linkFailed = false;
 
-	NumWorkItems = 1;
-	Work = new glslang::TWorkItem * [NumWorkItems];
-	Work[0] = 0;
+	//job.options |= EOptionHumanReadableSpv;
+	job.options = Options | EOptionSpv | EOptionLinkProgram;
+	//job.options |= EOptionSuppressInfolog;
 
-	if (from) {
-		std::string name(from);
-		if (!SetConfigFile(name)) {
-			Work[0] = new glslang::TWorkItem(name);
-			Worklist.add(Work[0]);
-		}
-	}
-	else {
-		std::string name = std::string("nothing.") + to;
-		Work[0] = new glslang::TWorkItem(name);
-		Worklist.add(Work[0]);
-	}
+	std::string name = from ? std::string(from) : std::string("nothing.") + to;
 
-	glslang::InitializeProcess();
+	InitializeOnce();
 
 	krafix::Target target;
 	target.system = getSystem(system);
@@ -1054,80 +1041,78 @@ int compile(const char* targetlang, const char* from, std::string to, const char
 		target.lang = krafix::SpirV;
 		target.version = version > 0 ? version : 1;
 		defines += "#define SPIRV " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
+		CompileAndLinkShaderFiles(job, name, target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "d3d9") == 0) {
 		target.lang = krafix::HLSL;
 		target.version = version > 0 ? version : 9;
 		defines += "#define HLSL " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
+		CompileAndLinkShaderFiles(job, name, target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "d3d11") == 0) {
 		target.lang = krafix::HLSL;
 		target.version = version > 0 ? version : 11;
 		defines += "#define HLSL " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
+		CompileAndLinkShaderFiles(job, name, target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "glsl") == 0) {
 		target.lang = krafix::GLSL;
 		if (target.system == krafix::Linux && (FindLanguage(from) == EShLangVertex || FindLanguage(from) == EShLangFragment)) target.version = version > 0 ? version : 110;
 		else target.version = version > 0 ? version : 330;
 		defines += "#define GLSL " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
+		CompileAndLinkShaderFiles(job, name, target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "essl") == 0) {
 		target.lang = krafix::GLSL;
 		target.version = version > 0 ? version : 100;
 		target.es = true;
 		defines += "#define GLSL " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
+		CompileAndLinkShaderFiles(job, name, target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "agal") == 0) {
 		target.lang = krafix::AGAL;
 		target.version = version > 0 ? version : 100;
 		target.es = true;
 		defines += "#define AGAL " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
+		CompileAndLinkShaderFiles(job, name, target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "metal") == 0) {
 		target.lang = krafix::Metal;
 		target.version = version > 0 ? version : 1;
 		defines += "#define METAL " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
+		CompileAndLinkShaderFiles(job, name, target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "varlist") == 0) {
 		target.lang = krafix::VarList;
 		target.version = version > 0 ? version : 1;
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
+		CompileAndLinkShaderFiles(job, name, target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else {
-		std::cout << "Unknown profile " << targetlang << std::endl;
-		CompileFailed = true;
+		job.log += std::string("Unknown profile ") + targetlang + "\n";
+		job.compileFailed = true;
 	}
-	if (!CompileFailed && !quiet) {
-		std::cerr << "#file:" << to << std::endl;
+	if (!job.compileFailed && !job.quiet) {
+		job.files += "#file:" + to + "\n";
 	}
 
-	glslang::FinalizeProcess();
-
-	if (CompileFailed || LinkFailed) return 1;
+	if (job.compileFailed || job.linkFailed) return 1;
 	else return 0;
 }
 
-int compileOptionallyRelaxed(const char* targetlang, const char* from, std::string to, std::string ext, const char* tempdir, const char* source, char* output, int* length, const char* system,
+int compileOptionallyRelaxed(CompileJob& job, const char* targetlang, const char* from, std::string to, std::string ext, const char* tempdir, const char* source, char* output, int* length, const char* system,
 	glslang::TShader::Includer& includer, std::string defines, int version, bool relax) {
 	int regularErrors = 0, relaxErrors = 0, es3Errors = 0;
 
 	if (strcmp(system, "html5") == 0 || strcmp(system, "debug-html5") == 0 || strcmp(system, "html5worker") == 0) {
 		if (version == 300) { // -webgl2 only
-			es3Errors = compile(targetlang, from, to + "-webgl2" + ext, tempdir, source, output, length, system, includer, defines, 300, false);
+			es3Errors = compile(job, targetlang, from, to + "-webgl2" + ext, tempdir, source, output, length, system, includer, defines, 300, false);
 			return es3Errors;
 		}
 		else {
-			regularErrors = compile(targetlang, from, to + ext, tempdir, source, output, length, system, includer, defines, version, false);
-			es3Errors = compile(targetlang, from, to + "-webgl2" + ext, tempdir, source, output, length, system, includer, defines, 300, false);
+			regularErrors = compile(job, targetlang, from, to + ext, tempdir, source, output, length, system, includer, defines, version, false);
+			es3Errors = compile(job, targetlang, from, to + "-webgl2" + ext, tempdir, source, output, length, system, includer, defines, 300, false);
 			if (relax) {
-				relaxErrors = compile(targetlang, from, to + "-relaxed" + ext, tempdir, source, output, length, system, includer, defines, version, true);
+				relaxErrors = compile(job, targetlang, from, to + "-relaxed" + ext, tempdir, source, output, length, system, includer, defines, version, true);
 				return std::min(regularErrors, std::min(relaxErrors, es3Errors));
 			}
 			else {
@@ -1136,9 +1121,9 @@ int compileOptionallyRelaxed(const char* targetlang, const char* from, std::stri
 		}
 	}
 	else {
-		regularErrors = compile(targetlang, from, to + ext, tempdir, source, output, length, system, includer, defines, version, false);
+		regularErrors = compile(job, targetlang, from, to + ext, tempdir, source, output, length, system, includer, defines, version, false);
 		if (relax) {
-			relaxErrors = compile(targetlang, from, to + "-relaxed" + ext, tempdir, source, output, length, system, includer, defines, version, true);
+			relaxErrors = compile(job, targetlang, from, to + "-relaxed" + ext, tempdir, source, output, length, system, includer, defines, version, true);
 			return std::min(regularErrors, relaxErrors);
 		}
 		else {
@@ -1147,20 +1132,21 @@ int compileOptionallyRelaxed(const char* targetlang, const char* from, std::stri
 	}
 }
 
-int compileOptionallyInstanced(const char* targetlang, const char* from, std::string to, std::string ext, const char* tempdir, const char* source, char* output, int* length, const char* system,
+int compileOptionallyInstanced(CompileJob& job, const char* targetlang, const char* from, std::string to, std::string ext, const char* tempdir, const char* source, char* output, int* length, const char* system,
 	glslang::TShader::Includer& includer, std::string defines, int version, bool instanced, bool relax) {
 	int errors = 0;
 	if (instanced) {
-		errors += compileOptionallyRelaxed(targetlang, from, to + "-noinst", ext, tempdir, source, output, length, system, includer, defines, version, relax);
-		errors += compileOptionallyRelaxed(targetlang, from, to + "-inst", ext, tempdir, source, output, length, system, includer, defines + "#define INSTANCED_RENDERING\n", version, relax);
+		errors += compileOptionallyRelaxed(job, targetlang, from, to + "-noinst", ext, tempdir, source, output, length, system, includer, defines, version, relax);
+		errors += compileOptionallyRelaxed(job, targetlang, from, to + "-inst", ext, tempdir, source, output, length, system, includer, defines + "#define INSTANCED_RENDERING\n", version, relax);
 	}
 	else {
-		errors += compileOptionallyRelaxed(targetlang, from, to, ext, tempdir, source, output, length, system, includer, defines, version, relax);
+		errors += compileOptionallyRelaxed(job, targetlang, from, to, ext, tempdir, source, output, length, system, includer, defines, version, relax);
 	}
 	return errors;
 }
 
-int compileWithTextureUnits(const char* targetlang,
+int compileWithTextureUnits(CompileJob& job,
+                            const char* targetlang,
                             const char* from, std::string to,
                             std::string ext,
                             const char* tempdir,
@@ -1183,11 +1169,11 @@ int compileWithTextureUnits(const char* targetlang,
 			toto << to << "-tex" << texcount << ext;
 			std::stringstream definesplustex;
 			definesplustex << defines << "#define MAX_TEXTURE_UNITS=" << texcount << "\n";
-			errors += compileOptionallyInstanced(targetlang, from, toto.str(), ext, tempdir, source, output, length, system, includer, definesplustex.str(), version, instanced, relax);
+			errors += compileOptionallyInstanced(job, targetlang, from, toto.str(), ext, tempdir, source, output, length, system, includer, definesplustex.str(), version, instanced, relax);
 		}
 	}
 	else {
-		errors += compileOptionallyInstanced(targetlang, from, to, ext, tempdir, source, output, length, system, includer, defines, version, instanced, relax);
+		errors += compileOptionallyInstanced(job, targetlang, from, to, ext, tempdir, source, output, length, system, includer, defines, version, instanced, relax);
 	}
 	return errors;
 }
@@ -1214,11 +1200,11 @@ bool cross_compile(const char* source,
 	int version = -1;
 	bool relax = false;
 
-	quiet = true;
+	CompileJob job;
+	job.quiet = true;
 
-	ProcessConfigFile();
+	InitializeOnce();
 
-	//glslang::InitializeProcess();
     glslang::TShader::Includer* includer = nullptr;
     
     if (includePath)
@@ -1233,19 +1219,179 @@ bool cross_compile(const char* source,
 	bool usesTextureUnitsCount = false;
 	bool usesInstancedoptional = false;
 
-    compileWithTextureUnits(targetlang, nullptr, "", shadertype, nullptr, source, output, length, system, *includer, defines, version, textureUnitCounts, usesTextureUnitsCount, instancedoptional && usesInstancedoptional, relax);
+    compileWithTextureUnits(job, targetlang, nullptr, "", shadertype, nullptr, source, output, length, system, *includer, defines, version, textureUnitCounts, usesTextureUnitsCount, instancedoptional && usesInstancedoptional, relax);
     
     delete includer;
+    FlushJobOutput(job);
     
-    if (errors && (CompileFailed || LinkFailed))
+    if (errors && (job.compileFailed || job.linkFailed))
     {
-        *errors = CompileErrors;
+        *errors = job.errors;
     }
     
-    return CompileFailed || LinkFailed;
+    return job.compileFailed || job.linkFailed;
+}
+
+// Settings shared by the files of a directory compiled with several threads
+struct CompileBatch {
+	const char* targetlang;
+	std::string to;
+	const char* tempdir;
+	const char* system;
+	std::string defines;
+	int version;
+	std::vector<int> textureUnitCounts;
+	bool instancedoptional;
+	bool relax;
+
+	std::mutex mutex;
+	int errors = 0;
+	std::vector<std::string> failedFiles;
+};
+
+//
+// Compiles one input file to one or more outputs named after to, depending on the
+// texture unit counts, instancing and relaxed variants the file asks for.
+// Returns the number of failed variants.
+//
+int compileFile(CompileJob& job, const char* targetlang, const char* from, std::string to, const char* tempdir, const char* system,
+	const std::string& defines, int version, const std::vector<int>& textureUnitCounts, bool instancedoptional, bool relax) {
+	KrafixIncluder includer(from);
+
+	bool usesTextureUnitsCount = false;
+	bool usesInstancedoptional = false;
+
+	if (textureUnitCounts.size() > 0 || instancedoptional) {
+		std::stringstream filecontentstream;
+		std::string line;
+		std::ifstream file(from);
+		if (file.is_open()) {
+			while (getline(file, line)) {
+				filecontentstream << line << '\n';
+			}
+			file.close();
+		}
+		std::string filecontent = filecontentstream.str();
+
+		if (filecontent.find("MAX_TEXTURE_UNITS") != std::string::npos) {
+			usesTextureUnitsCount = true;
+		}
+		if (filecontent.find("INSTANCED_RENDERING") != std::string::npos) {
+			usesInstancedoptional = true;
+		}
+	}
+
+	size_t split1 = to.find_last_of('/');
+	size_t split2 = to.find_last_of('\\');
+	size_t split;
+	if (split1 == std::string::npos && split2 == std::string::npos) {
+		split = 0;
+	}
+	else if (split1 == std::string::npos || split2 == std::string::npos) {
+		split = std::min(split1, split2);
+	}
+	else {
+		split = std::max(split1, split2);
+	}
+	std::string towithoutext = to.substr(0, to.find_first_of('.', split));
+	std::string ext = to.substr(to.find_first_of('.', split));
+
+	int errors = 0;
+	if (strcmp(targetlang, "varlist") == 0) {
+		int length = 0;
+		compile(job, targetlang, from, to, tempdir, nullptr, nullptr, &length, system, includer, defines, version, false);
+		if (job.compileFailed || job.linkFailed) ++errors;
+	}
+	else {
+		int length = 0;
+		errors = compileWithTextureUnits(job, targetlang, from, towithoutext, ext, tempdir, nullptr, nullptr, &length, system, includer, defines, version, textureUnitCounts, usesTextureUnitsCount, instancedoptional && usesInstancedoptional, relax);
+	}
+	return errors;
+}
+
+//
+// Thread entry point for compiling a directory. Takes files from the worklist until
+// it is empty, each with a job of its own so that errors are reported for the file
+// they happened in.
+//
+unsigned int CompileShaders(void* data)
+{
+	CompileBatch& batch = *(CompileBatch*)data;
+	glslang::TWorkItem* workItem;
+	while (Worklist.remove(workItem)) {
+		std::string name = extractFilename(workItem->name);
+		if (name.size() > 5 && name.compare(name.size() - 5, 5, ".glsl") == 0) {
+			name = name.substr(0, name.size() - 5);
+		}
+		std::string to = batch.to + "/" + name + "." + batch.targetlang;
+
+		CompileJob job;
+		job.quiet = quiet;
+		int errors = compileFile(job, batch.targetlang, workItem->name.c_str(), to, batch.tempdir, batch.system, batch.defines, batch.version, batch.textureUnitCounts, batch.instancedoptional, batch.relax);
+		if (errors > 0) {
+			// the info logs in job.log above say why
+			job.log += workItem->name + ": failed\n";
+		}
+		FlushJobOutput(job);
+
+		std::lock_guard<std::mutex> lock(batch.mutex);
+		batch.errors += errors;
+		if (errors > 0) batch.failedFiles.push_back(workItem->name);
+		delete workItem;
+	}
+
+	return 0;
+}
+
+bool isDirectory(const char* path) {
+	struct stat info;
+	return stat(path, &info) == 0 && (info.st_mode & S_IFMT) == S_IFDIR;
+}
+
+//
+// Shader files in a directory, those with a stage extension and an optional .glsl
+//
+std::vector<std::string> listShaderFiles(const std::string& directory) {
+	std::vector<std::string> names;
+#ifdef _WIN32
+	_finddata_t entry;
+	intptr_t handle = _findfirst((directory + "/*").c_str(), &entry);
+	if (handle != -1) {
+		do {
+			if (!(entry.attrib & _A_SUBDIR)) names.push_back(entry.name);
+		} while (_findnext(handle, &entry) == 0);
+		_findclose(handle);
+	}
+#else
+	DIR* dir = opendir(directory.c_str());
+	if (dir) {
+		while (dirent* entry = readdir(dir)) {
+			if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+		}
+		closedir(dir);
+	}
+#endif
+
+	static const char* stages[] = { ".vert", ".tesc", ".tese", ".geom", ".frag", ".comp" };
+	std::vector<std::string> files;
+	for (std::string name : names) {
+		std::string stem = name;
+		if (stem.size() > 5 && stem.compare(stem.size() - 5, 5, ".glsl") == 0) {
+			stem = stem.substr(0, stem.size() - 5);
+		}
+		for (const char* stage : stages) {
+			if (stem.size() > 5 && stem.compare(stem.size() - 5, 5, stage) == 0) {
+				files.push_back(directory + "/" + name);
+				break;
+			}
+		}
+	}
+	std::sort(files.begin(), files.end());
+	return files;
 }
 
 // d3d11 in/basic.vert.glsl test.d3d11 temp windows
+// d3d11 in out temp windows --threads 8
 #ifndef KRAFIX_LIBRARY
 int C_DECL main(int argc, char* argv[]) {
 	if (argc < 6) {
@@ -1261,6 +1407,8 @@ int C_DECL main(int argc, char* argv[]) {
 	int version = -1;
 	bool getversion = false;
 	bool relax = false;
+	int threads = (int)std::thread::hardware_concurrency();
+	bool getthreads = false;
 
 	for (int i = 6; i < argc; ++i) {
 		std::string arg = argv[i];
@@ -1268,6 +1416,10 @@ int C_DECL main(int argc, char* argv[]) {
 			version = atoi(argv[i]);
 			getversion = false;
 		}
+		else if (getthreads) {
+			threads = atoi(argv[i]);
+			getthreads = false;
+		}
 		else if (arg.substr(0, 2) == "-D") {
 			defines += "#define " + arg.substr(2) + "\n";
 		}
@@ -1283,6 +1435,9 @@ int C_DECL main(int argc, char* argv[]) {
 		else if (arg == "--version") {
 			getversion = true;
 		}
+		else if (arg == "--threads") {
+			getthreads = true;
+		}
 		else if (arg == "--quiet") {
 			quiet = true;
 		}
@@ -1299,61 +1454,46 @@ int C_DECL main(int argc, char* argv[]) {
 	std::string to = argv[3];
 	const char* system = argv[5];
 
-	ProcessConfigFile();
-
-	//glslang::InitializeProcess();
-
-	KrafixIncluder includer(from);
-
-	bool usesTextureUnitsCount = false;
-	bool usesInstancedoptional = false;
+	InitializeOnce();
 
-	if (textureUnitCounts.size() > 0 || instancedoptional) {
-		std::stringstream filecontentstream;
-		std::string line;
-		std::ifstream file(from);
-		if (file.is_open()) {
-			while (getline(file, line)) {
-				filecontentstream << line << '\n';
-			}
-			file.close();
-		}
-		std::string filecontent = filecontentstream.str();
-
-		if (filecontent.find("MAX_TEXTURE_UNITS") != std::string::npos) {
-			usesTextureUnitsCount = true;
-		}
-		if (filecontent.find("INSTANCED_RENDERING") != std::string::npos) {
-			usesInstancedoptional = true;
-		}
+	if (!isDirectory(from)) {
+		CompileJob job;
+		job.quiet = quiet;
+		int errors = compileFile(job, targetlang, from, to, tempdir, system, defines, version, textureUnitCounts, instancedoptional, relax);
+		FlushJobOutput(job);
+		return errors;
 	}
 
-	size_t split1 = to.find_last_of('/');
-	size_t split2 = to.find_last_of('\\');
-	size_t split;
-	if (split1 == std::string::npos && split2 == std::string::npos) {
-		split = 0;
+	// Every shader in the directory, to <to>/<name>.<profile>
+	std::vector<std::string> files = listShaderFiles(from);
+	for (const std::string& file : files) {
+		Worklist.add(new glslang::TWorkItem(file));
 	}
-	else if (split1 == std::string::npos || split2 == std::string::npos) {
-		split = std::min(split1, split2);
+
+	CompileBatch batch;
+	batch.targetlang = targetlang;
+	batch.to = to;
+	batch.tempdir = tempdir;
+	batch.system = system;
+	batch.defines = defines;
+	batch.version = version;
+	batch.textureUnitCounts = textureUnitCounts;
+	batch.instancedoptional = instancedoptional;
+	batch.relax = relax;
+
+	std::vector<std::thread> workers;
+	for (int i = 1; i < std::min(std::max(threads, 1), (int)files.size()); ++i) {
+		workers.emplace_back(CompileShaders, &batch);
 	}
-	else {
-		split = std::max(split1, split2);
+	CompileShaders(&batch);
+	for (auto& worker : workers) {
+		worker.join();
 	}
-	std::string towithoutext = to.substr(0, to.find_first_of('.', split));
-	std::string ext = to.substr(to.find_first_of('.', split));
 
-	int errors = 0;
-	if (strcmp(targetlang, "varlist") == 0) {
-		int length = 0;
-		compile(targetlang, from, to, tempdir, nullptr, nullptr, &length, system, includer, defines, version, false);
-		if (CompileFailed || LinkFailed) ++errors;
+	if (!batch.failedFiles.empty()) {
+		fprintf(stderr, "%d of %d files failed\n", (int)batch.failedFiles.size(), (int)files.size());
 	}
-	else {
-		int length = 0;
-		errors = compileWithTextureUnits(targetlang, from, towithoutext, ext, tempdir, nullptr, nullptr, &length, system, includer, defines, version, textureUnitCounts, usesTextureUnitsCount, instancedoptional && usesInstancedoptional, relax);
-	}
-	return errors;
+	return batch.errors;
 }
 #endif
 
@@ -1411,60 +1551,13 @@ EShLanguage FindLanguage(const std::string& name, bool parseSuffix)
 	return EShLangVertex;
 }
 
-//
-// Read a file's data into a string, and compile it using the old interface ShCompile,
-// for non-linkable results.
-//
-void CompileFile(const char* fileName, ShHandle compiler)
-{
-	int ret = 0;
-	char** shaderStrings = ReadFileData(fileName);
-	if (!shaderStrings) {
-		usage();
-	}
-
-	int* lengths = new int[NumShaderStrings];
-
-	// move to length-based strings, rather than null-terminated strings
-	for (int s = 0; s < NumShaderStrings; ++s)
-		lengths[s] = (int)strlen(shaderStrings[s]);
-
-	if (!shaderStrings) {
-		CompileFailed = true;
-		return;
-	}
-
-	EShMessages messages = EShMsgDefault;
-	SetMessageOptions(messages);
-
-	for (int i = 0; i < ((Options & EOptionMemoryLeakMode) ? 100 : 1); ++i) {
-		for (int j = 0; j < ((Options & EOptionMemoryLeakMode) ? 100 : 1); ++j) {
-			// ret = ShCompile(compiler, shaderStrings, NumShaderStrings, lengths, EShOptNone, &Resources, Options, (Options & EOptionDefaultDesktop) ? 110 : 100, false, messages);
-			ret = ShCompile(compiler, shaderStrings, NumShaderStrings, nullptr, EShOptNone, &Resources, Options, (Options & EOptionDefaultDesktop) ? 110 : 100, false, messages);
-			// const char* multi[12] = { "# ve", "rsion", " 300 e", "s", "\n#err",
-			//                         "or should be l", "ine 1", "string 5\n", "float glo", "bal",
-			//                         ";\n#error should be line 2\n void main() {", "global = 2.3;}" };
-			// const char* multi[7] = { "/", "/", "\\", "\n", "\n", "#", "version 300 es" };
-			// ret = ShCompile(compiler, multi, 7, nullptr, EShOptNone, &Resources, Options, (Options & EOptionDefaultDesktop) ? 110 : 100, false, messages);
-		}
-
-		if (Options & EOptionMemoryLeakMode)
-			glslang::OS_DumpMemoryCounters();
-	}
-
-	delete[] lengths;
-	FreeFileData(shaderStrings);
-
-	if (ret == 0)
-		CompileFailed = true;
-}
-
 //
 //   print usage to stdout
 //
 void usage()
 {
-	printf("Usage: krafix profile in out tempdir system\n");
+	printf("Usage: krafix profile in out tempdir system\n"
+		   "       krafix profile indir outdir tempdir system [--threads N]\n");
 
 	/*printf("Usage: glslangValidator [option]... [file]...\n"
 		   "\n"
@@ -1588,7 +1681,8 @@ char** ReadFileData(const char* fileName)
 
 	int count = 0;
 	const int maxSourceStrings = 5;  // for testing splitting shader/tokens across multiple strings
-	char** return_data = (char**)malloc(sizeof(char*) * (maxSourceStrings + 1)); // freed in FreeFileData()
+	char** return_data = (char**)calloc(maxSourceStrings + 1, sizeof(char*)); // freed in FreeFileData(), which stops at the first null
+	int numShaderStrings;
 
 	if (errorCode || in == nullptr)
 		Error("unable to open input file");
@@ -1614,16 +1708,15 @@ char** ReadFileData(const char* fileName)
 		// recover from empty file
 		return_data[0] = (char*)malloc(count + 2);  // freed in FreeFileData()
 		return_data[0][0] = '\0';
-		NumShaderStrings = 0;
 		free(fdata);
 
 		return return_data;
 	}
 	else
-		NumShaderStrings = 1;  // Set to larger than 1 for testing multiple strings
+		numShaderStrings = 1;  // Set to larger than 1 for testing multiple strings
 
 	// compute how to split up the file into multiple strings, for testing multiple strings
-	int len = (int)(ceil)((float)count / (float)NumShaderStrings);
+	int len = (int)(ceil)((float)count / (float)numShaderStrings);
 	int ptr_len = 0;
 	int i = 0;
 	while (count > 0) {
@@ -1634,7 +1727,6 @@ char** ReadFileData(const char* fileName)
 		ptr_len += len;
 		if (count < len) {
 			if (count == 0) {
-				NumShaderStrings = i + 1;
 				break;
 			}
 			len = count;
@@ -1649,7 +1741,7 @@ char** ReadFileData(const char* fileName)
 
 void FreeFileData(char** data)
 {
-	for (int i = 0; i < NumShaderStrings; i++)
+	for (int i = 0; data[i]; i++)
 		free(data[i]);
 
 	free(data);